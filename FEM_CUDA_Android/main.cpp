@@ -16,7 +16,7 @@ int MeshLoad(Simulation& simulation)
 {
 
 	std::cout << "Load meshes" << std::endl;
-	if (!simulation.simulation_load_fem_mesh(RAPTOR_NETGEN_MESH_HIGH))
+	if (!simulation.simulation_load_fem_mesh(RAPTOR_NETGEN_MESH_FULL))
 	{
 		//return 1;
 	}
@@ -2,17 +2,30 @@
 #define BoundingBox_h__
 
 #include <glm/glm.hpp>
+#include <vector>
+#include "ConvexHull.h"
 #include "EndPoint.h"
 
 namespace Physics
-{ 
-
+{
+	/*
+	* World space AABB of a body, from its model space AABB.
+	* The box of the points is computed once, then each frame the world box
+	* comes from its center and half extents and the model matrix M (Arvo):
+	* the center is transformed, and the half extent along the world axis i
+	* is the sum over j of |M[j][i]| times the model space half extent j.
+	* That is O(1) whatever the number of vertices, but the box of a rotated
+	* box is larger than the box of the rotated vertices. The hull version
+	* gives that tighter box: the support vertex of the hull along each world
+	* axis, climbed from the one of the last frame, which moves little.
+	* m_min_coordinate and m_max_coordinate are relative to m_center.
+	*/
 	struct BoundingBox
 	{
 		float			m_width;
 		float			m_depth;
 		float			m_height;
-		 
+
 		glm::vec3		m_min_coordinate;
 		glm::vec3		m_max_coordinate;
 		glm::vec3		m_center;
@@ -20,126 +33,121 @@ namespace Physics
 
 		glm::vec3		m_scale_factor;
 
-		vector<Vertex>	m_vertices;
-		vector<Vertex>	m_model_space_vertices;
+		explicit BoundingBox(const vector<glm::vec3>& points);
 
-		BoundingBox(const BoundingBox& bounding_box);
-		BoundingBox(vector<Vertex> vertices);
-		
-		void operator+=(BoundingBox& const other_bbox){
+		void operator+=(BoundingBox& other_bbox){
 			*this = Calculate(*this,  other_bbox);
-		} 
+		}
 		glm::vec4 Color() const;
 
 		bool Overlaps(const BoundingBox& second);
 
 		bool Is_Colliding() const;
 
-		void Recalculate_Bounding_Box(glm::vec3* translation,glm::quat* rotation);
-		void Recalculate_Vertices(glm::mat4* model_matrix);
+		// O(1) box of the model space box
+		void Recalculate_Bounding_Box(glm::mat4 const& model_matrix);
+		// Exact box of the hull of the points, close to O(1) from one frame to the next
+		void Recalculate_Bounding_Box(glm::mat4 const& model_matrix, const ConvexHull& hull);
 
 		EndPoint Get_EndPoint_X();
 		EndPoint Get_EndPoint_Y();
 		EndPoint Get_EndPoint_Z();
 
- 
+
 		glm::vec3		d_initial_wdh;
 
 		glm::vec3 Get_Min_Coordinate_World_Space();
 		glm::vec3 Get_Max_Coordinate_World_Space();
 
 		static BoundingBox Calculate(BoundingBox& b1, BoundingBox& b2);
-		void calculate(glm::vec3* translation ,glm::quat* rotation  );
+
+	private:
+		glm::vec3		d_local_center;
+		glm::vec3		d_local_half_size;
+		int				d_support[6];		// hull vertices of the last frame, on the min then max side of each axis
+
+		void set(glm::vec3 const& min_coordinate, glm::vec3 const& max_coordinate);
 	};
 
-	BoundingBox::BoundingBox(vector<Vertex> vertices) 
-		: m_vertices(vertices),
-		m_model_space_vertices(vertices),
-		m_is_colliding(glm::vec3(false,false,false)),
-		m_width(0.0f),
+	inline BoundingBox::BoundingBox(const vector<glm::vec3>& points)
+		: m_width(0.0f),
 		m_depth(0.0f),
-		m_height(0.0f)
+		m_height(0.0f),
+		m_is_colliding(glm::vec3(false,false,false)),
+		d_initial_wdh(1.0f)
 	{
+		glm::vec3 min_coordinate(points.empty() ? glm::vec3(0.0f) : points[0]);
+		glm::vec3 max_coordinate(min_coordinate);
+		for (auto& point : points)
+		{
+			min_coordinate = glm::min(min_coordinate, point);
+			max_coordinate = glm::max(max_coordinate, point);
+		}
+		d_local_center = (min_coordinate + max_coordinate) * 0.5f;
+		d_local_half_size = (max_coordinate - min_coordinate) * 0.5f;
+		for (int i = 0; i < 6; i++)
+			d_support[i] = 0;
 
-		calculate(&glm::vec3(0.0f),&glm::quat());
-		d_initial_wdh.x = m_width;
-		d_initial_wdh.y = m_height;
-		d_initial_wdh.z = m_depth;
-	}
-
-	BoundingBox::BoundingBox(const BoundingBox& bounding_box)
-		: 
-		m_vertices(bounding_box.m_vertices),
-		m_model_space_vertices(bounding_box.m_model_space_vertices)
-
-	{
-		calculate(&glm::vec3(0.0f),&glm::quat());
+		set(min_coordinate, max_coordinate);
 		d_initial_wdh.x = m_width;
 		d_initial_wdh.y = m_height;
 		d_initial_wdh.z = m_depth;
+		m_scale_factor = glm::vec3(1.0f);
 	}
 
-	void BoundingBox::calculate(glm::vec3* translation,glm::quat* rotation)
+	inline void BoundingBox::set(glm::vec3 const& min_coordinate, glm::vec3 const& max_coordinate)
 	{
-		glm::vec3	min_coordinate;
-		glm::vec3   max_coordinate;
-		size_t		vert_size = m_vertices.size(); 
-		for (int i = 0; i < vert_size; i++)
-		{
-			glm::vec3 newPos  = glm::vec3(*rotation * glm::vec4(m_vertices[i].Position,1.0f));
-
-			if(newPos.x < min_coordinate.x) min_coordinate.x = newPos.x;
-			if(newPos.x > max_coordinate.x) max_coordinate.x = newPos.x;
-
-			if(newPos.y < min_coordinate.y) min_coordinate.y = newPos.y;
-			if(newPos.y > max_coordinate.y) max_coordinate.y = newPos.y;
-
-			if(newPos.z < min_coordinate.z) min_coordinate.z = newPos.z;
-			if(newPos.z > max_coordinate.z) max_coordinate.z = newPos.z;
-		}								
-
-
-
-		float depth  = glm::distance( min_coordinate.z,max_coordinate.z)
-			,width   = glm::distance( min_coordinate.x,max_coordinate.x)
-			,height  = glm::distance( min_coordinate.y,max_coordinate.y);
-
-
-		m_depth		= depth;
-		m_width		= width;
-		m_height	= height;
-
+		m_width		= max_coordinate.x - min_coordinate.x;
+		m_height	= max_coordinate.y - min_coordinate.y;
+		m_depth		= max_coordinate.z - min_coordinate.z;
 
 		m_scale_factor = glm::vec3(m_width,m_height,m_depth) / d_initial_wdh;
 
-		m_center =  (min_coordinate + max_coordinate) * 0.5f + *translation;
-
-
-		m_min_coordinate = min_coordinate;
-		m_max_coordinate = max_coordinate;
+		m_center = (min_coordinate + max_coordinate) * 0.5f;
+		m_max_coordinate = max_coordinate - m_center;
+		m_min_coordinate = -m_max_coordinate;
 	}
 
-	Physics::BoundingBox BoundingBox::Calculate(BoundingBox& b1, BoundingBox& b2)
+	inline void BoundingBox::Recalculate_Bounding_Box(glm::mat4 const& model_matrix)
 	{
-		BoundingBox temp(b1.m_vertices);
-		temp.m_min_coordinate.x = glm::min(b1.m_min_coordinate.x,b2.m_min_coordinate.x);
-		temp.m_max_coordinate.x = glm::max(b1.m_max_coordinate.x,b2.m_max_coordinate.x);
-
-		temp.m_min_coordinate.y = glm::min(b1.m_min_coordinate.y,b2.m_min_coordinate.y);
-		temp.m_max_coordinate.y = glm::max(b1.m_max_coordinate.y,b2.m_max_coordinate.y);
-
-		temp.m_min_coordinate.z = glm::min(b1.m_min_coordinate.z,b2.m_min_coordinate.z);
-		temp.m_max_coordinate.z = glm::max(b1.m_max_coordinate.z,b2.m_max_coordinate.z);
-
+		glm::vec3 center = glm::vec3(model_matrix * glm::vec4(d_local_center, 1.0f));
+		glm::vec3 half_size;
+		for (int i = 0; i < 3; i++)
+			half_size[i] = fabs(model_matrix[0][i]) * d_local_half_size.x
+				+ fabs(model_matrix[1][i]) * d_local_half_size.y
+				+ fabs(model_matrix[2][i]) * d_local_half_size.z;
+		set(center - half_size, center + half_size);
+	}
 
-		temp.m_depth  =  glm::distance( temp.m_min_coordinate.z,temp.m_max_coordinate.z);
-		temp.m_width  =  glm::distance( temp.m_min_coordinate.x,temp.m_max_coordinate.x);
-		temp.m_height =  glm::distance( temp.m_min_coordinate.y,temp.m_max_coordinate.y);
+	inline void BoundingBox::Recalculate_Bounding_Box(glm::mat4 const& model_matrix, const ConvexHull& hull)
+	{
+		if (hull.Empty())
+		{
+			Recalculate_Bounding_Box(model_matrix);
+			return;
+		}
+		glm::vec3 min_coordinate, max_coordinate;
+		for (int i = 0; i < 3; i++)
+		{
+			// world axis i seen from model space, the row i of M
+			const glm::vec3 direction(model_matrix[0][i], model_matrix[1][i], model_matrix[2][i]);
+			d_support[2*i]		= hull.Support(-direction, d_support[2*i]);
+			d_support[2*i + 1]	= hull.Support(direction, d_support[2*i + 1]);
+			min_coordinate[i] = model_matrix[3][i] + glm::dot(direction, hull.Vertex_At(d_support[2*i]));
+			max_coordinate[i] = model_matrix[3][i] + glm::dot(direction, hull.Vertex_At(d_support[2*i + 1]));
+		}
+		set(min_coordinate, max_coordinate);
+	}
 
+	inline Physics::BoundingBox BoundingBox::Calculate(BoundingBox& b1, BoundingBox& b2)
+	{
+		BoundingBox temp(b1);
+		temp.set(glm::min(b1.Get_Min_Coordinate_World_Space(), b2.Get_Min_Coordinate_World_Space()),
+			glm::max(b1.Get_Max_Coordinate_World_Space(), b2.Get_Max_Coordinate_World_Space()));
 		return temp;
 	}
 
-	EndPoint BoundingBox::Get_EndPoint_X()
+	inline EndPoint BoundingBox::Get_EndPoint_X()
 	{
 		EndPoint ep;
 		ep.m_min_point = m_min_coordinate.x + m_center.x;
@@ -148,7 +156,7 @@ namespace Physics
 		return ep;
 	}
 
-	EndPoint BoundingBox::Get_EndPoint_Y()
+	inline EndPoint BoundingBox::Get_EndPoint_Y()
 	{
 		EndPoint ep;
 		ep.m_min_point = m_min_coordinate.y + m_center.y;
@@ -158,7 +166,7 @@ namespace Physics
 		return ep;
 	}
 
-	EndPoint BoundingBox::Get_EndPoint_Z()
+	inline EndPoint BoundingBox::Get_EndPoint_Z()
 	{
 		EndPoint ep;
 		ep.m_min_point = m_min_coordinate.z + m_center.z;
@@ -167,33 +175,18 @@ namespace Physics
 		return ep;
 	}
 
-	glm::vec4 BoundingBox::Color()  const
+	inline glm::vec4 BoundingBox::Color()  const
 	{
 		bool is_colliding = Is_Colliding();
 		return  is_colliding ? glm::vec4(1.0f,0.0f,0.0f,0.3f) : glm::vec4(0.0f,1.0f,0.0f,1.0f);
 	}
 
-	void BoundingBox::Recalculate_Bounding_Box(glm::vec3* translation,glm::quat* rotation)
-	{
-		calculate(translation, rotation);
-	}
-
-	void BoundingBox::Recalculate_Vertices(glm::mat4* model_matrix)
-	{
-		size_t vertices_count = m_vertices.size();
-		for (int i = 0; i < vertices_count; i++)
-		{
-			m_model_space_vertices[i].Position = glm::vec3(*model_matrix * glm::vec4(m_vertices[i].Position,1.0f));
-		}
-
-	}
-
-	bool BoundingBox::Is_Colliding()  const
+	inline bool BoundingBox::Is_Colliding()  const
 	{
 		return 	m_is_colliding.x &&  m_is_colliding.y && m_is_colliding.z;
 	}
 
-	bool BoundingBox::Overlaps(const BoundingBox& second)
+	inline bool BoundingBox::Overlaps(const BoundingBox& second)
 	{
 		if ( std::fabs(m_center.x -  second.m_center.x) > (m_width  * 0.5f + second.m_width  * 0.5f ) ) return false;
 		if ( std::fabs(m_center.y -  second.m_center.y) > (m_height * 0.5f + second.m_height * 0.5f ) ) return false;
@@ -203,15 +196,14 @@ namespace Physics
 		return true;
 	}
 
-	glm::vec3 BoundingBox::Get_Min_Coordinate_World_Space()
+	inline glm::vec3 BoundingBox::Get_Min_Coordinate_World_Space()
 	{
 		return this->m_min_coordinate + m_center;
 	}
-	glm::vec3 BoundingBox::Get_Max_Coordinate_World_Space()
+	inline glm::vec3 BoundingBox::Get_Max_Coordinate_World_Space()
 	{
 		return this->m_max_coordinate + m_center;
 	}
-
 }
 
 #endif // BoundingBox_h__
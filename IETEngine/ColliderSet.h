@@ -0,0 +1,295 @@
+#ifndef ColliderSet_h__
+#define ColliderSet_h__
+
+#include "common.h"
+#include "GPU.h"
+#include <algorithm>
+
+// Set of static or moving colliders (planes, spheres, capsules and boxes)
+// used as penalty contacts for the FEM mesh.
+// Bounded colliders are binned into a uniform grid so that each particle is
+// only tested against the colliders overlapping its cell; planes are unbounded
+// and tested against every particle. So is a collider once it was moved by
+// setCenter: the grid is rebuilt when it starts moving, not at each move.
+struct ColliderSet
+{
+	MyVector(GPUCollider<TReal>) colliders;
+	GPUColliderGrid<TReal> grid;
+	MyVector(int) cellStart;     // nx*ny*nz+1 offsets in cellColliders
+	MyVector(int) cellColliders; // unbounded and moving colliders first, then the colliders overlapping each cell
+
+	ColliderSet()
+		: d_dirty(true)
+	{
+		clear();
+	}
+
+	void clear();
+	bool empty() const { return colliders.empty(); }
+
+	int addPlane(const TDeriv& normal, TReal d, TReal stiffness, TReal damping = 0);
+	int addSphere(const TCoord& center, TReal radius, TReal stiffness, TReal damping = 0);
+	int addCapsule(const TCoord& a, const TCoord& b, TReal radius, TReal stiffness, TReal damping = 0);
+	int addBox(const TCoord& center, const TDeriv& halfExtents, const TDeriv& axisX, const TDeriv& axisY, TReal stiffness, TReal damping = 0);
+
+	// Move a collider so that its center is at the given position
+	void setCenter(int index, const TCoord& center);
+
+	// Rebuild the grid if colliders were added or started moving since the last call
+	void update();
+
+private:
+	bool d_dirty;
+	MyVector(char) d_moving; // colliders moved by setCenter, kept out of the grid
+	// work vectors of update, kept so that moving colliders do not allocate at each rebuild,
+	// and allocated as the other vectors so that the steady state allocation audit sees them
+	MyVector(TCoord) d_bmin, d_bmax;
+	MyVector(char) d_bounded;
+	MyVector(int) d_cellMin, d_cellMax, d_fill;
+
+	int add(const GPUCollider<TReal>& c);
+	bool bounds(const GPUCollider<TReal>& c, TCoord& bmin, TCoord& bmax) const;
+};
+
+void ColliderSet::clear()
+{
+	colliders.clear();
+	d_moving.clear();
+	cellStart.clear();
+	cellColliders.clear();
+	grid.origin_x = grid.origin_y = grid.origin_z = 0;
+	grid.invCellSize = 1;
+	grid.nx = grid.ny = grid.nz = 0;
+	grid.nbGlobal = 0;
+	d_dirty = true;
+}
+
+int ColliderSet::add(const GPUCollider<TReal>& c)
+{
+	colliders.push_back(c);
+	d_moving.push_back(0);
+	d_dirty = true;
+	return colliders.size()-1;
+}
+
+int ColliderSet::addPlane(const TDeriv& normal, TReal d, TReal stiffness, TReal damping)
+{
+	GPUCollider<TReal> c;
+	memset(&c, 0, sizeof(c));
+	c.type = COLLIDER_PLANE;
+	TDeriv n = normal;
+	n.normalize();
+	for (int k=0;k<3;++k) c.p0[k] = n[k];
+	c.radius = d;
+	c.stiffness = stiffness;
+	c.damping = damping;
+	return add(c);
+}
+
+int ColliderSet::addSphere(const TCoord& center, TReal radius, TReal stiffness, TReal damping)
+{
+	GPUCollider<TReal> c;
+	memset(&c, 0, sizeof(c));
+	c.type = COLLIDER_SPHERE;
+	for (int k=0;k<3;++k) c.p0[k] = center[k];
+	c.radius = radius;
+	c.stiffness = stiffness;
+	c.damping = damping;
+	return add(c);
+}
+
+int ColliderSet::addCapsule(const TCoord& a, const TCoord& b, TReal radius, TReal stiffness, TReal damping)
+{
+	GPUCollider<TReal> c;
+	memset(&c, 0, sizeof(c));
+	c.type = COLLIDER_CAPSULE;
+	for (int k=0;k<3;++k) { c.p0[k] = a[k]; c.p1[k] = b[k]; }
+	c.radius = radius;
+	c.stiffness = stiffness;
+	c.damping = damping;
+	return add(c);
+}
+
+int ColliderSet::addBox(const TCoord& center, const TDeriv& halfExtents, const TDeriv& axisX, const TDeriv& axisY, TReal stiffness, TReal damping)
+{
+	GPUCollider<TReal> c;
+	memset(&c, 0, sizeof(c));
+	c.type = COLLIDER_BOX;
+	// orthonormalize the frame
+	TDeriv ax = axisX;
+	ax.normalize();
+	TDeriv ay = axisY - ax * dot(axisY, ax);
+	ay.normalize();
+	for (int k=0;k<3;++k)
+	{
+		c.p0[k] = center[k];
+		c.p1[k] = halfExtents[k];
+		c.axis[0][k] = ax[k];
+		c.axis[1][k] = ay[k];
+	}
+	c.stiffness = stiffness;
+	c.damping = damping;
+	return add(c);
+}
+
+void ColliderSet::setCenter(int index, const TCoord& center)
+{
+	if (index < 0 || index >= (int)colliders.size()) return;
+	GPUCollider<TReal>& c = colliders[index];
+	const TCoord oldP0(c.p0[0], c.p0[1], c.p0[2]), oldP1(c.p1[0], c.p1[1], c.p1[2]);
+	switch (c.type)
+	{
+	case COLLIDER_PLANE:
+		c.radius = c.p0[0]*center[0] + c.p0[1]*center[1] + c.p0[2]*center[2];
+		break;
+	case COLLIDER_CAPSULE:
+		for (int k=0;k<3;++k)
+		{
+			TReal t = center[k] - (c.p0[k] + c.p1[k])*0.5f;
+			c.p0[k] += t;
+			c.p1[k] += t;
+		}
+		break;
+	default:
+		for (int k=0;k<3;++k) c.p0[k] = center[k];
+		break;
+	}
+	// planes are not in the grid, and the other colliders only leave it once
+	if (c.type != COLLIDER_PLANE && !d_moving[index]
+		&& (oldP0 != TCoord(c.p0[0], c.p0[1], c.p0[2]) || oldP1 != TCoord(c.p1[0], c.p1[1], c.p1[2])))
+	{
+		d_moving[index] = 1;
+		d_dirty = true;
+	}
+}
+
+bool ColliderSet::bounds(const GPUCollider<TReal>& c, TCoord& bmin, TCoord& bmax) const
+{
+	switch (c.type)
+	{
+	case COLLIDER_SPHERE:
+		for (int k=0;k<3;++k) { bmin[k] = c.p0[k] - c.radius; bmax[k] = c.p0[k] + c.radius; }
+		return true;
+	case COLLIDER_CAPSULE:
+		for (int k=0;k<3;++k)
+		{
+			bmin[k] = std::min(c.p0[k], c.p1[k]) - c.radius;
+			bmax[k] = std::max(c.p0[k], c.p1[k]) + c.radius;
+		}
+		return true;
+	case COLLIDER_BOX:
+	{
+		TDeriv ax(c.axis[0][0], c.axis[0][1], c.axis[0][2]);
+		TDeriv ay(c.axis[1][0], c.axis[1][1], c.axis[1][2]);
+		TDeriv az = cross(ax, ay);
+		for (int k=0;k<3;++k)
+		{
+			TReal e = fabs(ax[k])*c.p1[0] + fabs(ay[k])*c.p1[1] + fabs(az[k])*c.p1[2];
+			bmin[k] = c.p0[k] - e;
+			bmax[k] = c.p0[k] + e;
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+void ColliderSet::update()
+{
+	if (!d_dirty) return;
+	d_dirty = false;
+
+	const int nbc = colliders.size();
+	MyVector(TCoord)& bmin = d_bmin;
+	MyVector(TCoord)& bmax = d_bmax;
+	MyVector(char)& bounded = d_bounded;
+	bmin.resize(nbc);
+	bmax.resize(nbc);
+	bounded.resize(nbc);
+	cellStart.clear();
+	cellColliders.clear();
+	TCoord gmin, gmax;
+	TReal cellSize = 0;
+	int nbBounded = 0;
+	for (int i=0;i<nbc;++i)
+	{
+		bounded[i] = !d_moving[i] && bounds(colliders[i], bmin[i], bmax[i]);
+		if (!bounded[i])
+		{
+			cellColliders.push_back(i);
+			continue;
+		}
+		if (nbBounded == 0) { gmin = bmin[i]; gmax = bmax[i]; }
+		for (int k=0;k<3;++k)
+		{
+			gmin[k] = std::min(gmin[k], bmin[i][k]);
+			gmax[k] = std::max(gmax[k], bmax[i][k]);
+		}
+		TDeriv e = bmax[i] - bmin[i];
+		cellSize += std::max(e[0], std::max(e[1], e[2]));
+		++nbBounded;
+	}
+
+	grid.nbGlobal = cellColliders.size();
+	grid.nx = grid.ny = grid.nz = 0;
+
+	if (nbBounded > 0)
+	{
+		// cells as large as the average collider, with at most 64 cells along each axis
+		const int maxCells = 64;
+		TDeriv extent = gmax - gmin;
+		cellSize /= nbBounded;
+		cellSize = std::max(cellSize, std::max(extent[0], std::max(extent[1], extent[2])) / maxCells);
+		if (cellSize <= 0) cellSize = 1;
+		grid.origin_x = gmin[0];
+		grid.origin_y = gmin[1];
+		grid.origin_z = gmin[2];
+		grid.invCellSize = 1 / cellSize;
+		grid.nx = std::min(maxCells, (int)(extent[0] * grid.invCellSize) + 1);
+		grid.ny = std::min(maxCells, (int)(extent[1] * grid.invCellSize) + 1);
+		grid.nz = std::min(maxCells, (int)(extent[2] * grid.invCellSize) + 1);
+	}
+
+	// count then fill the colliders overlapping each cell
+	const int nbCells = grid.nx * grid.ny * grid.nz;
+	cellStart.resize(nbCells+1);
+	std::fill(cellStart.begin(), cellStart.end(), 0);
+	MyVector(int)& cmin = d_cellMin;
+	MyVector(int)& cmax = d_cellMax;
+	cmin.resize(3*nbc);
+	cmax.resize(3*nbc);
+	const TCoord origin(grid.origin_x, grid.origin_y, grid.origin_z);
+	const int dims[3] = { grid.nx, grid.ny, grid.nz };
+	for (int i=0;i<nbc;++i)
+	{
+		if (!bounded[i]) continue;
+		for (int k=0;k<3;++k)
+		{
+			cmin[3*i+k] = std::max(0, std::min(dims[k]-1, (int)floor((bmin[i][k] - origin[k]) * grid.invCellSize)));
+			cmax[3*i+k] = std::max(0, std::min(dims[k]-1, (int)floor((bmax[i][k] - origin[k]) * grid.invCellSize)));
+		}
+		for (int z=cmin[3*i+2];z<=cmax[3*i+2];++z)
+			for (int y=cmin[3*i+1];y<=cmax[3*i+1];++y)
+				for (int x=cmin[3*i+0];x<=cmax[3*i+0];++x)
+					++cellStart[(z * grid.ny + y) * grid.nx + x + 1];
+	}
+	for (int c=0;c<nbCells;++c)
+		cellStart[c+1] += cellStart[c];
+	for (int c=0;c<=nbCells;++c)
+		cellStart[c] += grid.nbGlobal;
+	cellColliders.resize(cellStart[nbCells]);
+	MyVector(int)& fill = d_fill;
+	fill.resize(nbCells);
+	std::copy(cellStart.begin(), cellStart.end()-1, fill.begin());
+	for (int i=0;i<nbc;++i)
+	{
+		if (!bounded[i]) continue;
+		for (int z=cmin[3*i+2];z<=cmax[3*i+2];++z)
+			for (int y=cmin[3*i+1];y<=cmax[3*i+1];++y)
+				for (int x=cmin[3*i+0];x<=cmax[3*i+0];++x)
+					cellColliders[fill[(z * grid.ny + y) * grid.nx + x]++] = i;
+	}
+}
+
+#endif // ColliderSet_h__
@@ -0,0 +1,646 @@
+#ifndef CollisionBenchmark_h__
+#define CollisionBenchmark_h__
+
+#include <glm/glm.hpp>
+#include <glm/gtx/norm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <iostream>
+
+#include "SpatialHash.h"
+#include "SweepAndPrune.h"
+#include "DynamicAABBTree.h"
+#include "ParallelNarrowPhase.h"
+#include "ConvexHull.h"
+#include "ContactSolver.h"
+#include "BoundingBox.h"
+
+namespace Physics
+{
+	using namespace std;
+
+	// Time SpatialHash::Find_Pairs and the brute force for 1k, 10k and 100k random
+	// spheres, written as CSV
+	inline void Benchmark_Spatial_Hash(const string& filename)
+	{
+		typedef std::chrono::duration<double, std::milli> ms;
+		ofstream out(filename.c_str());
+		out << "bodies,cell size,pairs,spatial hash ms,brute force ms,same pairs" << endl;
+		SpatialHash hash;
+		const int sizes[3] = { 1000, 10000, 100000 };
+		for (int s = 0; s < 3; ++s)
+		{
+			const int n = sizes[s];
+			// constant density: the side of the box grows with the cube root of the count
+			std::mt19937 random(1234);
+			std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+			const float side = 8.0f * pow((float)n, 1.0f/3.0f);
+			vector<glm::vec3> centers(n);
+			vector<float> radii(n);
+			for (int i = 0; i < n; ++i)
+			{
+				centers[i] = glm::vec3(unit(random), unit(random), unit(random)) * side;
+				// mostly small bodies and a few larger ones
+				radii[i] = (unit(random) < 0.9f) ? 0.5f + 0.5f * unit(random) : 1.0f + 3.0f * unit(random);
+			}
+
+			vector<pair<int,int>> pairs;
+			const int nbRuns = 5;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			for (int r = 0; r < nbRuns; ++r)
+				hash.Find_Pairs(centers, radii, pairs);
+			const double hashTime = std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count() / nbRuns;
+
+			// the brute force takes minutes for 100k bodies
+			double bruteTime = -1;
+			int same = -1;
+			if (n <= 10000)
+			{
+				vector<pair<int,int>> brute;
+				start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < n; ++i)
+					for (int j = i+1; j < n; ++j)
+						// same expression as BoundingSphere::Overlaps
+						if (glm::distance2(centers[i], centers[j]) < (radii[i] + radii[j]) * (radii[i] + radii[j]))
+							brute.push_back(make_pair(i,j));
+				bruteTime = std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+				same = (brute == pairs) ? 1 : 0;
+			}
+
+			out << n << "," << hash.Cell_size() << "," << pairs.size() << "," << hashTime << "," << bruteTime << "," << same << endl;
+			cout << n << " spheres: " << pairs.size() << " pairs, spatial hash " << hashTime << " ms";
+			if (bruteTime >= 0) cout << ", brute force " << bruteTime << " ms" << (same ? "" : " (DIFFERENT PAIRS)");
+			cout << endl;
+		}
+	}
+
+	// Time SweepAndPrune::Update against a Rebuild each frame, for 5000 moving boxes,
+	// written as CSV
+	inline void Benchmark_Sweep_And_Prune(const string& filename)
+	{
+		typedef std::chrono::duration<double, std::milli> ms;
+		const int n = 5000;
+		const int nbFrames = 100;
+		std::mt19937 random(1234);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const float side = 4.0f * pow((float)n, 1.0f/3.0f);
+		vector<glm::vec3> centers(n), velocities(n), half_sizes(n), mins(n), maxs(n);
+		for (int i = 0; i < n; ++i)
+		{
+			centers[i] = glm::vec3(unit(random), unit(random), unit(random)) * side;
+			velocities[i] = (glm::vec3(unit(random), unit(random), unit(random)) - 0.5f) * 0.05f;
+			half_sizes[i] = glm::vec3(0.25f) + glm::vec3(unit(random), unit(random), unit(random)) * 0.5f;
+		}
+
+		SweepAndPrune incremental, rebuilt;
+		double incrementalTime = 0, rebuildTime = 0;
+		size_t events = 0;
+		bool same = true;
+		for (int frame = 0; frame <= nbFrames; ++frame)
+		{
+			for (int i = 0; i < n; ++i)
+			{
+				centers[i] += velocities[i];
+				mins[i] = centers[i] - half_sizes[i];
+				maxs[i] = centers[i] + half_sizes[i];
+			}
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			incremental.Update(mins, maxs);
+			const double t = std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+			start = std::chrono::high_resolution_clock::now();
+			rebuilt.Rebuild(mins, maxs);
+			const double r = std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+			// the first frame sorts from scratch in both
+			if (frame == 0) continue;
+			incrementalTime += t;
+			rebuildTime += r;
+			events += incremental.Added().size() + incremental.Removed().size();
+			same = same && incremental.Pairs() == rebuilt.Pairs();
+		}
+
+		ofstream out(filename.c_str());
+		out << "bodies,frames,pairs,events per frame,rebuild ms,incremental ms,same pairs" << endl;
+		out << n << "," << nbFrames << "," << incremental.Pairs().size() << "," << (double)events / nbFrames << ","
+			<< rebuildTime / nbFrames << "," << incrementalTime / nbFrames << "," << (same ? 1 : 0) << endl;
+		cout << n << " boxes: rebuild " << rebuildTime / nbFrames << " ms, incremental " << incrementalTime / nbFrames
+			<< " ms per frame" << (same ? "" : " (DIFFERENT PAIRS)") << endl;
+	}
+
+	// Time the tree against the sweep and prune for 5000 boxes, a tenth moving fast
+	// and a few large ones, written as CSV
+	inline void Benchmark_AABB_Tree(const string& filename)
+	{
+		typedef std::chrono::duration<double, std::milli> ms;
+		const int n = 5000;
+		const int nbFrames = 100;
+		std::mt19937 random(1234);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const float side = 4.0f * pow((float)n, 1.0f/3.0f);
+		vector<glm::vec3> centers(n), velocities(n), half_sizes(n), mins(n), maxs(n), displacements(n);
+		for (int i = 0; i < n; ++i)
+		{
+			centers[i] = glm::vec3(unit(random), unit(random), unit(random)) * side;
+			// a few large bodies, and a tenth moving fast
+			const float size = (i % 100 == 0) ? 10.0f : 0.25f + unit(random) * 0.5f;
+			half_sizes[i] = glm::vec3(size);
+			const float speed = (i % 10 == 0) ? 2.0f : 0.05f;
+			velocities[i] = (glm::vec3(unit(random), unit(random), unit(random)) - 0.5f) * speed;
+		}
+
+		SweepAndPrune sweep_and_prune;
+		DynamicAABBTree tree;
+		vector<pair<int,int>> tree_pairs, sap_pairs;
+		double sapTime = 0, treeTime = 0;
+		size_t reinsertions = 0;
+		bool same = true;
+		for (int frame = 0; frame <= nbFrames; ++frame)
+		{
+			for (int i = 0; i < n; ++i)
+			{
+				centers[i] += velocities[i];
+				// bounce in the box
+				for (int a = 0; a < 3; ++a)
+					if ((centers[i][a] < 0.0f && velocities[i][a] < 0.0f) || (centers[i][a] > side && velocities[i][a] > 0.0f))
+						velocities[i][a] = -velocities[i][a];
+				mins[i] = centers[i] - half_sizes[i];
+				maxs[i] = centers[i] + half_sizes[i];
+				displacements[i] = velocities[i];
+			}
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			sweep_and_prune.Update(mins, maxs);
+			const double s = std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+			start = std::chrono::high_resolution_clock::now();
+			tree.Update(mins, maxs, &displacements);
+			tree.Find_Pairs(tree_pairs);
+			const double t = std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+			// the first frame builds both from scratch
+			if (frame == 0) continue;
+			sapTime += s;
+			treeTime += t;
+			reinsertions += tree.Reinsertions();
+			sap_pairs.clear();
+			for (auto key : sweep_and_prune.Pairs())
+				sap_pairs.push_back(SweepAndPrune::Pair_From_Key(key));
+			sort(sap_pairs.begin(), sap_pairs.end());
+			same = same && sap_pairs == tree_pairs;
+		}
+
+		ofstream out(filename.c_str());
+		out << "bodies,frames,pairs,reinsertions per frame,tree height,sweep and prune ms,tree ms,same pairs" << endl;
+		out << n << "," << nbFrames << "," << tree_pairs.size() << "," << (double)reinsertions / nbFrames << "," << tree.Height() << ","
+			<< sapTime / nbFrames << "," << treeTime / nbFrames << "," << (same ? 1 : 0) << endl;
+		cout << n << " boxes: sweep and prune " << sapTime / nbFrames << " ms, tree " << treeTime / nbFrames
+			<< " ms per frame, " << (double)reinsertions / nbFrames << " reinsertions, height " << tree.Height() << (same ? "" : " (DIFFERENT PAIRS)") << endl;
+	}
+
+	// Pair tests per second for random cubes, without and with the caches, and the
+	// cost of EPA for deep penetrations of round hulls, written as CSV
+	inline void Benchmark_Narrow_Phase(const string& filename)
+	{
+		typedef std::chrono::duration<double, std::milli> ms;
+		typedef ParallelNarrowPhase::Shape Shape;
+		typedef ParallelNarrowPhase::Contact Contact;
+		const int nbShapes = 1000;
+		const int nbPairs = 200000;
+		std::mt19937 random(1234);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+		// rotated unit cubes in a small box, so that about half of the pairs collide
+		vector<Vertex> vertices(8 * nbShapes);
+		vector<Shape> shapes(nbShapes);
+		for (int s = 0; s < nbShapes; s++)
+		{
+			const glm::vec3 center = glm::vec3(unit(random), unit(random), unit(random)) * 2.0f;
+			const glm::vec3 axis = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + 0.1f);
+			const float angle = unit(random) * 3.14159f;
+			// Rodrigues rotation of the corners
+			for (int c = 0; c < 8; c++)
+			{
+				const glm::vec3 corner((c & 1) ? 0.5f : -0.5f, (c & 2) ? 0.5f : -0.5f, (c & 4) ? 0.5f : -0.5f);
+				const glm::vec3 rotated = corner * cos(angle) + glm::cross(axis, corner) * sin(angle) + axis * glm::dot(axis, corner) * (1.0f - cos(angle));
+				vertices[8*s + c].Position = rotated;
+			}
+			shapes[s].vertices = &vertices[8*s];
+			shapes[s].count = 8;
+			shapes[s].center = center;
+			shapes[s].transform = glm::mat4(1.0f);
+			shapes[s].transform[3] = glm::vec4(center, 1.0f);
+			shapes[s].hull = NULL;
+			shapes[s].start = 0;
+		}
+		vector<pair<int,int>> pairs(nbPairs);
+		std::uniform_int_distribution<int> pick(0, nbShapes - 1);
+		for (int k = 0; k < nbPairs; k++)
+		{
+			pairs[k].first = pick(random);
+			do pairs[k].second = pick(random); while (pairs[k].second == pairs[k].first);
+		}
+
+		ParallelNarrowPhase narrow_phase;
+		vector<Contact> contacts;
+		narrow_phase.Run(shapes, pairs, contacts);
+		const int nbRuns = 5;
+		// without the cache, each run starts from the centers
+		double cold = 0.0;
+		float coldIterations = 0.0f;
+		for (int r = 0; r < nbRuns; r++)
+		{
+			narrow_phase.Clear_Cache();
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			narrow_phase.Run(shapes, pairs, contacts);
+			cold += std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count() / nbRuns;
+			coldIterations += narrow_phase.Gjk_Iterations() / nbRuns;
+		}
+
+		// with the cache, the cubes moving a little between the runs
+		double warm = 0.0;
+		float warmIterations = 0.0f;
+		for (int r = 0; r < nbRuns; r++)
+		{
+			for (int s = 0; s < nbShapes; s++)
+			{
+				const glm::vec3 move = (glm::vec3(unit(random), unit(random), unit(random)) - 0.5f) * 0.002f;
+				shapes[s].transform[3] += glm::vec4(move, 0.0f);
+				shapes[s].center += move;
+			}
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			narrow_phase.Run(shapes, pairs, contacts);
+			warm += std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count() / nbRuns;
+			warmIterations += narrow_phase.Gjk_Iterations() / nbRuns;
+		}
+
+		int nbColliding = 0;
+		for (int k = 0; k < nbPairs; k++)
+			if (contacts[k].colliding) nbColliding++;
+		int nbThreads = 1;
+#ifdef _OPENMP
+		nbThreads = omp_get_max_threads();
+#endif
+		const double perSecond = nbPairs / (cold * 0.001);
+		const double warmPerSecond = nbPairs / (warm * 0.001);
+		ofstream out(filename.c_str());
+		out << "pairs,colliding,threads,ms,pairs per second per thread,gjk iterations,cached ms,cached pairs per second per thread,cached gjk iterations" << endl;
+		out << nbPairs << "," << nbColliding << "," << nbThreads << "," << cold << "," << perSecond / nbThreads << "," << coldIterations << ","
+			<< warm << "," << warmPerSecond / nbThreads << "," << warmIterations << endl;
+		cout << nbPairs << " pairs (" << nbColliding << " colliding) on " << nbThreads << " threads: " << cold << " ms, "
+			<< coldIterations << " GJK iterations per pair; from the cache " << warm << " ms, " << warmIterations << " iterations" << endl;
+
+		// deep penetrations of round hulls, where EPA grows the polytope to its largest
+		std::normal_distribution<float> normal(0.0f, 1.0f);
+		out << endl << "hull vertices,deep pairs,us per pair,mean epa faces,mean depth error" << endl;
+		const int hullSizes[3] = { 100, 1000, 10000 };
+		for (int h = 0; h < 3; h++)
+		{
+			vector<glm::vec3> points(hullSizes[h]);
+			for (auto& p : points)
+				p = glm::normalize(glm::vec3(normal(random), normal(random), normal(random))) * 0.5f;
+			ConvexHull hull;
+			hull.Build(points);
+			const int nbDeep = 2000;
+			vector<ParallelNarrowPhase::Workspace> workspace(1);
+			ParallelNarrowPhase::Workspace& w = workspace[0];
+			double time = 0.0, error = 0.0, faces = 0.0;
+			for (int k = 0; k < nbDeep; k++)
+			{
+				Shape deep[2];
+				for (int s = 0; s < 2; s++)
+				{
+					const glm::vec3 center = s ? glm::vec3(unit(random), unit(random), unit(random)) * 0.4f : glm::vec3(0.0f);
+					deep[s].vertices = NULL;
+					deep[s].count = 0;
+					deep[s].center = center;
+					deep[s].hull = &hull;
+					deep[s].transform = glm::mat4(1.0f);
+					deep[s].transform[3] = glm::vec4(center, 1.0f);
+					deep[s].start = 0;
+				}
+				Contact contact;
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				ParallelNarrowPhase::Collide(deep[0], deep[1], w, contact);
+				time += std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count() * 1000.0 / nbDeep;
+				// two spheres of radius 0.5
+				error += fabs(contact.depth - (1.0f - glm::length(deep[1].center))) / nbDeep;
+				int alive = 0;
+				for (int f = 0; f < w.nb_faces; f++)
+					if (w.faces[f].alive) alive++;
+				faces += (double)alive / nbDeep;
+			}
+			out << hull.Size() << "," << nbDeep << "," << time << "," << faces << "," << error << endl;
+			cout << hull.Size() << " hull vertices, deep penetrations: " << time << " us per pair, " << faces << " faces, depth error " << error << endl;
+		}
+	}
+
+	// Build time, and the support queries by scan and by climbing on points of
+	// spheres of increasing sizes, written as CSV
+	inline void Benchmark_Convex_Hull(const string& filename)
+	{
+		typedef std::chrono::duration<double, std::micro> us;
+		std::mt19937 random(1234);
+		std::normal_distribution<float> normal(0.0f, 1.0f);
+		ofstream out(filename.c_str());
+		out << "vertices,hull vertices,build ms,scan us,cold climb us,cold steps,warm climb us,warm steps" << endl;
+		const int sizes[4] = { 100, 1000, 10000, 50000 };
+		for (int s = 0; s < 4; s++)
+		{
+			// points on a sphere, all on the hull
+			vector<glm::vec3> points(sizes[s]);
+			for (auto& p : points)
+				p = glm::normalize(glm::vec3(normal(random), normal(random), normal(random)));
+
+			ConvexHull hull;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			hull.Build(points);
+			const double build = std::chrono::duration_cast<us>(std::chrono::high_resolution_clock::now() - start).count() * 0.001;
+
+			// directions turning a little at each query, as in successive GJK iterations or frames
+			const int nbQueries = 20000;
+			vector<glm::vec3> directions(nbQueries);
+			glm::vec3 d = glm::vec3(1.0f, 0.0f, 0.0f);
+			for (auto& direction : directions)
+			{
+				d = glm::normalize(d + 0.05f * glm::vec3(normal(random), normal(random), normal(random)));
+				direction = d;
+			}
+			vector<int> scanned(nbQueries), climbed(nbQueries);
+			start = std::chrono::high_resolution_clock::now();
+			for (int q = 0; q < nbQueries; q++)
+				scanned[q] = hull.Support_Scan(directions[q]);
+			const double scan = std::chrono::duration_cast<us>(std::chrono::high_resolution_clock::now() - start).count() / nbQueries;
+
+			long long cold_steps = 0, warm_steps = 0;
+			int steps = 0;
+			start = std::chrono::high_resolution_clock::now();
+			for (int q = 0; q < nbQueries; q++)
+			{
+				climbed[q] = hull.Support_Climb(directions[q], 0, &steps);
+				cold_steps += steps;
+			}
+			const double cold = std::chrono::duration_cast<us>(std::chrono::high_resolution_clock::now() - start).count() / nbQueries;
+
+			int v = 0;
+			start = std::chrono::high_resolution_clock::now();
+			for (auto& direction : directions)
+			{
+				v = hull.Support_Climb(direction, v, &steps);
+				warm_steps += steps;
+			}
+			const double warm = std::chrono::duration_cast<us>(std::chrono::high_resolution_clock::now() - start).count() / nbQueries;
+
+			// ties may give another vertex, at the same distance
+			bool same = true;
+			for (int q = 0; q < nbQueries; q++)
+				same = same && glm::dot(hull.Vertex_At(climbed[q]), directions[q]) >= glm::dot(hull.Vertex_At(scanned[q]), directions[q]);
+
+			out << sizes[s] << "," << hull.Size() << "," << build << "," << scan << "," << cold << "," << (double)cold_steps / nbQueries
+				<< "," << warm << "," << (double)warm_steps / nbQueries << endl;
+			cout << sizes[s] << " vertices: scan " << scan << " us, climb " << cold << " us (" << (double)cold_steps / nbQueries
+				<< " steps), from the previous support " << warm << " us (" << (double)warm_steps / nbQueries << " steps)"
+				<< (same ? "" : " (DIFFERENT VERTICES)") << endl;
+		}
+	}
+
+	// Stacks of boxes on the ground with and without warm starting, with fewer
+	// iterations, and with sleeping: time to rest, drift and time, written as CSV
+	inline void Benchmark_Contact_Solver(const string& filename)
+	{
+		typedef std::chrono::duration<double, std::milli> ms;
+		const int nb_stacks = 10;
+		const int height = 10;
+		const int nb_frames = 600;
+		const float delta_time = 1.0f / 60.0f;
+		const glm::vec3 gravity(0.0f, -9.81f, 0.0f);
+
+		// unit boxes of mass 1
+		vector<glm::vec3> corners;
+		for (int i = 0; i < 8; i++)
+			corners.push_back(glm::vec3(i & 1 ? 0.5f : -0.5f, i & 2 ? 0.5f : -0.5f, i & 4 ? 0.5f : -0.5f));
+		ConvexHull box;
+		box.Build(corners);
+		const glm::mat3 local_inverse_inertia(6.0f);
+
+		struct Run { bool warm_start; int iterations; bool sleeping; };
+		const Run runs[] = { { true, 20, false }, { false, 20, false }, { true, 10, false }, { false, 10, false }, { true, 20, true } };
+		const int nb_settled_frames = 100;
+
+		ofstream out(filename.c_str());
+		out << "boxes,warm start,iterations,sleeping,frames,frames to rest,max speed at the end,max drift,fallen boxes,"
+			<< "sleeping boxes at the end,ms per frame,ms per frame at the end" << endl;
+		for (auto& run : runs)
+		{
+			// each box a little off the one below
+			std::mt19937 random(1234);
+			std::uniform_real_distribution<float> offset(-0.05f, 0.05f);
+			const int n = nb_stacks * height;
+			vector<ContactSolver::Body> bodies(n);
+			vector<glm::vec3> start(n);
+			vector<glm::quat> orientations(n, glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+			vector<ParallelNarrowPhase::Shape> shapes(n);
+			for (int s = 0; s < nb_stacks; s++)
+				for (int l = 0; l < height; l++)
+				{
+					const int i = s * height + l;
+					start[i] = glm::vec3(s * 2.0f + offset(random), 0.5f + l, offset(random));
+					bodies[i].center = start[i];
+					bodies[i].velocity = bodies[i].angular_velocity = glm::vec3(0.0f);
+					bodies[i].inverse_mass = 1.0f;
+					shapes[i].vertices = nullptr;
+					shapes[i].count = 0;
+					shapes[i].hull = &box;
+					shapes[i].start = 0;
+				}
+
+			ContactSolver solver;
+			solver.m_warm_start = run.warm_start;
+			solver.m_iterations = run.iterations;
+			ParallelNarrowPhase narrow_phase;
+			Islands islands;
+			islands.Resize(n);
+			vector<pair<int,int>> pairs, manifold_pairs;
+			vector<ParallelNarrowPhase::Contact> contacts;
+			vector<float> linear_speeds(n), angular_speeds(n);
+			double solve_time = 0, settled_time = 0;
+			int rest_frame = -1;
+			float max_speed = 0.0f;
+			for (int frame = 0; frame < nb_frames; frame++)
+			{
+				std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+				// a sleeping box is fixed, as the ground
+				for (int i = 0; i < n; i++)
+				{
+					if (islands.Is_Sleeping(i))
+					{
+						bodies[i].inverse_mass = 0.0f;
+						bodies[i].inverse_inertia = glm::mat3(0.0f);
+						bodies[i].velocity = bodies[i].angular_velocity = glm::vec3(0.0f);
+						continue;
+					}
+					const glm::mat3 rotation = glm::mat3_cast(orientations[i]);
+					bodies[i].transform = glm::translate(glm::mat4(1.0f), bodies[i].center) * glm::mat4(rotation);
+					bodies[i].inverse_mass = 1.0f;
+					bodies[i].inverse_inertia = rotation * local_inverse_inertia * glm::transpose(rotation);
+					bodies[i].velocity += gravity * delta_time;
+					shapes[i].transform = bodies[i].transform;
+					shapes[i].center = bodies[i].center;
+				}
+				pairs.clear();
+				for (int i = 0; i < n; i++)
+					for (int j = i + 1; j < n; j++)
+						if ((!islands.Is_Sleeping(i) || !islands.Is_Sleeping(j)) && glm::distance(bodies[i].center, bodies[j].center) < 1.8f)
+							pairs.push_back(make_pair(i, j));
+
+				narrow_phase.Run(shapes, pairs, contacts);
+				solver.Begin_Frame();
+				for (int k = 0; k < (int)pairs.size(); k++)
+					solver.Add_Contact(bodies, pairs[k].first, pairs[k].second, shapes[pairs[k].first], shapes[pairs[k].second], contacts[k]);
+				for (int i = 0; i < n; i++)
+					if (!islands.Is_Sleeping(i))
+						solver.Add_Plane_Contact(bodies, i, 0, shapes[i], glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+				solver.Solve(bodies, delta_time);
+				if (run.sleeping)
+				{
+					for (int i = 0; i < n; i++)
+					{
+						linear_speeds[i] = glm::length(bodies[i].velocity);
+						angular_speeds[i] = glm::length(bodies[i].angular_velocity);
+					}
+					solver.Body_Pairs(manifold_pairs);
+					islands.Update(manifold_pairs, linear_speeds, angular_speeds, delta_time);
+				}
+				const double time = std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - begin).count();
+				solve_time += time;
+				if (frame >= nb_frames - nb_settled_frames) settled_time += time;
+
+				max_speed = 0.0f;
+				for (int i = 0; i < n; i++)
+				{
+					if (islands.Is_Sleeping(i)) continue;
+					bodies[i].center += bodies[i].velocity * delta_time;
+					const glm::vec3 w = bodies[i].angular_velocity;
+					orientations[i] = glm::normalize(orientations[i] + glm::quat(0.0f, w.x, w.y, w.z) * orientations[i] * (0.5f * delta_time));
+					max_speed = max(max_speed, glm::length(bodies[i].velocity) + glm::length(w) * 0.87f);
+				}
+				if (max_speed > 0.1f) rest_frame = -1;
+				else if (rest_frame < 0) rest_frame = frame;
+			}
+
+			float max_drift = 0.0f;
+			int fallen = 0;
+			for (int i = 0; i < n; i++)
+			{
+				const float drift = glm::distance(bodies[i].center, start[i]);
+				max_drift = max(max_drift, drift);
+				if (drift > 0.25f) fallen++;
+			}
+			out << n << "," << (run.warm_start ? 1 : 0) << "," << run.iterations << "," << (run.sleeping ? 1 : 0) << ","
+				<< nb_frames << "," << rest_frame << "," << max_speed << "," << max_drift << "," << fallen << ","
+				<< islands.Nb_Sleeping() << "," << solve_time / nb_frames << "," << settled_time / nb_settled_frames << endl;
+			cout << n << " boxes, " << run.iterations << " iterations" << (run.warm_start ? " warm started" : "")
+				<< (run.sleeping ? " with sleeping" : "") << ": at rest after " << rest_frame << " frames, drift "
+				<< max_drift << ", " << fallen << " fallen, " << islands.Nb_Sleeping() << " sleeping, "
+				<< solve_time / nb_frames << " ms per frame, " << settled_time / nb_settled_frames << " at the end" << endl;
+		}
+	}
+
+	// Time the O(1) box and the box from the hull against the box of all the
+	// vertices, and their volumes, for stretched balls turning, written as CSV
+	inline void Benchmark_Bounding_Box(const string& filename)
+	{
+		typedef std::chrono::duration<double, std::milli> ms;
+		const int nbFrames = 1000;
+		std::mt19937 random(1234);
+		std::normal_distribution<float> normal(0.0f, 1.0f);
+
+		ofstream out(filename.c_str());
+		out << "vertices,hull vertices,all vertices us,arvo us,hull us,arvo volume ratio,hull volume ratio" << endl;
+		const int sizes[3] = { 1000, 10000, 100000 };
+		for (int s = 0; s < 3; s++)
+		{
+			// points of a stretched ball, turning a little each frame
+			vector<glm::vec3> points(sizes[s]);
+			for (auto& p : points)
+				p = glm::normalize(glm::vec3(normal(random), normal(random), normal(random))) * glm::vec3(2.0f, 1.0f, 0.5f);
+			ConvexHull hull;
+			hull.Build(points);
+			BoundingBox arvo(points), tight(points);
+			const glm::vec3 axis = glm::normalize(glm::vec3(1.0f, 2.0f, 3.0f));
+
+			double all_time = 0, arvo_time = 0, hull_time = 0;
+			double arvo_ratio = 0, hull_ratio = 0;
+			for (int f = 0; f < nbFrames; f++)
+			{
+				const float angle = f * 0.01f;
+				// Rodrigues rotation and a translation, as a model matrix
+				glm::mat4 model(1.0f);
+				for (int c = 0; c < 3; c++)
+				{
+					const glm::vec3 e(c == 0, c == 1, c == 2);
+					model[c] = glm::vec4(e * cos(angle) + glm::cross(axis, e) * sin(angle) + axis * glm::dot(axis, e) * (1.0f - cos(angle)), 0.0f);
+				}
+				model[3] = glm::vec4(f * 0.001f, 0.0f, 0.0f, 1.0f);
+
+				// what the boxes were before: every vertex transformed
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				glm::vec3 min_coordinate(FLT_MAX), max_coordinate(-FLT_MAX);
+				for (auto& p : points)
+				{
+					const glm::vec3 world = glm::vec3(model * glm::vec4(p, 1.0f));
+					min_coordinate = glm::min(min_coordinate, world);
+					max_coordinate = glm::max(max_coordinate, world);
+				}
+				all_time += std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+
+				start = std::chrono::high_resolution_clock::now();
+				arvo.Recalculate_Bounding_Box(model);
+				arvo_time += std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+
+				start = std::chrono::high_resolution_clock::now();
+				tight.Recalculate_Bounding_Box(model, hull);
+				hull_time += std::chrono::duration_cast<ms>(std::chrono::high_resolution_clock::now() - start).count();
+
+				const glm::vec3 size = max_coordinate - min_coordinate;
+				const float volume = size.x * size.y * size.z;
+				arvo_ratio += arvo.m_width * arvo.m_height * arvo.m_depth / volume / nbFrames;
+				hull_ratio += tight.m_width * tight.m_height * tight.m_depth / volume / nbFrames;
+			}
+			const double to_us = 1000.0 / nbFrames;
+			out << sizes[s] << "," << hull.Size() << "," << all_time * to_us << "," << arvo_time * to_us << "," << hull_time * to_us << ","
+				<< arvo_ratio << "," << hull_ratio << endl;
+			cout << sizes[s] << " vertices (" << hull.Size() << " on the hull): all vertices " << all_time * to_us << " us, Arvo "
+				<< arvo_time * to_us << " us (volume x" << arvo_ratio << "), hull " << hull_time * to_us << " us (volume x" << hull_ratio << ")" << endl;
+		}
+	}
+
+	// Run the benchmark named by the first argument, which writes its CSV file
+	// in the working directory; returns false if the argument names none
+	inline bool Run_Collision_Benchmark(int argc, char* argv[])
+	{
+		if (argc < 2) return false;
+		if (strcmp(argv[1], "--benchmark-spatial-hash") == 0)
+			Benchmark_Spatial_Hash("./SpatialHash.csv");
+		else if (strcmp(argv[1], "--benchmark-sweep-and-prune") == 0)
+			Benchmark_Sweep_And_Prune("./SweepAndPrune.csv");
+		else if (strcmp(argv[1], "--benchmark-aabb-tree") == 0)
+			Benchmark_AABB_Tree("./DynamicAABBTree.csv");
+		else if (strcmp(argv[1], "--benchmark-narrow-phase") == 0)
+			Benchmark_Narrow_Phase("./ParallelNarrowPhase.csv");
+		else if (strcmp(argv[1], "--benchmark-convex-hull") == 0)
+			Benchmark_Convex_Hull("./ConvexHull.csv");
+		else if (strcmp(argv[1], "--benchmark-contact-solver") == 0)
+			Benchmark_Contact_Solver("./ContactSolver.csv");
+		else if (strcmp(argv[1], "--benchmark-bounding-box") == 0)
+			Benchmark_Bounding_Box("./BoundingBox.csv");
+		else
+			return false;
+		return true;
+	}
+}
+
+#endif // CollisionBenchmark_h__
@@ -0,0 +1,704 @@
+#ifndef ContactSolver_h__
+#define ContactSolver_h__
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cfloat>
+
+#include "ConvexHull.h"
+#include "ParallelNarrowPhase.h"
+#include "Islands.h"
+
+namespace Physics
+{
+	using namespace std;
+
+	/*
+	* Persistent contact manifolds and a sequential impulse solver.
+	* Each pair of touching bodies, or body and plane, keeps up to MAX_POINTS
+	* contact points from one frame to the next. The points of a frame come
+	* from the faces of the two shapes facing each other along the normal found
+	* by EPA, clipped against each other, so that a box resting on a face gets
+	* its four corners at once. An edge or a vertex only gives one or two
+	* points, which are added to those kept from the last frames. The points
+	* are stored on the bodies in model space: a new point close to a kept one
+	* takes over its impulses, and a manifold which is not updated in a frame
+	* keeps its points while they stay within m_breaking_distance.
+	* The solver first applies the impulses of the last frame (warm starting),
+	* then m_iterations passes of projected Gauss-Seidel over all the points:
+	* the normal impulses never pull, and push apart the bodies penetrating
+	* more than m_slop, the friction impulses on two tangent directions are
+	* bounded by m_friction times the normal impulse. The passes go through the
+	* contacts forward and backward in turn. With warm starting, the iterations
+	* of a resting stack start from the answer of the last frame, so that a
+	* fixed number of them per frame lets tall stacks come to rest.
+	* A body of inverse_mass 0 does not move: the manifolds between such
+	* bodies, as sleeping ones, are kept as they are until one of them moves.
+	*/
+	class ContactSolver
+	{
+	public:
+		enum { MAX_POINTS = 4 };
+		// vertices taken from the faces facing each other, the others are ignored
+		enum { MAX_FEATURE = 16 };
+		enum { MAX_CLIPPED = 2 * MAX_FEATURE };
+
+		struct Body
+		{
+			glm::mat4	transform;			// model matrix, for the points stored in model space
+			glm::vec3	center;				// center of mass
+			glm::vec3	velocity;
+			glm::vec3	angular_velocity;
+			float		inverse_mass;		// 0 for a fixed body
+			glm::mat3	inverse_inertia;	// world space
+		};
+
+		struct Point
+		{
+			glm::vec3	local_a, local_b;	// in model space, world space for a plane
+			glm::vec3	world_a, world_b;
+			float		depth;				// along the normal, negative when apart
+			float		normal_impulse;
+			float		tangent_impulse[2];
+			// set for the iterations
+			glm::vec3	ra, rb;
+			float		normal_mass;
+			float		tangent_mass[2];
+			float		bias;
+		};
+
+		struct Manifold
+		{
+			int			body_a, body_b;		// body_b is -1 for a plane
+			glm::vec3	normal;				// from a to b
+			glm::vec3	tangent[2];
+			Point		points[MAX_POINTS];
+			int			nb_points;
+			int			frame;
+		};
+
+		int			m_iterations;
+		float		m_friction;
+		float		m_slop;					// penetration left, so that resting contacts stay touching
+		float		m_baumgarte;			// fraction of the penetration beyond m_slop removed per frame
+		float		m_breaking_distance;
+		bool		m_warm_start;
+
+		ContactSolver();
+
+		// Start a frame, the contacts added before Solve update the manifolds
+		void		Begin_Frame() { ++d_frame; d_next = 0; }
+		// Colliding pair of bodies a and b, contact.normal going from a to b
+		void		Add_Contact(const vector<Body>& bodies, int a, int b,
+						const ParallelNarrowPhase::Shape& shape_a, const ParallelNarrowPhase::Shape& shape_b,
+						const ParallelNarrowPhase::Contact& contact);
+		// Body a against a plane given by a point and its normal, pointing to the side of the bodies
+		void		Add_Plane_Contact(const vector<Body>& bodies, int a, int plane,
+						const ParallelNarrowPhase::Shape& shape, glm::vec3 const& point, glm::vec3 const& normal);
+		// Change the velocities of the bodies so that the contacts do not penetrate more.
+		// The manifolds between bodies of inverse_mass 0 are neither moved nor solved.
+		void		Solve(vector<Body>& bodies, float delta_time);
+		void		Clear() { d_manifolds.clear(); d_keys.clear(); d_sorted_keys.clear(); d_nb_sorted = d_next = 0; }
+
+		int			Nb_Manifolds() const { return d_manifolds.size(); }
+		int			Nb_Points() const;
+		// Pairs of bodies with a manifold, the contacts of the last frames
+		void		Body_Pairs(vector<pair<int,int>>& pairs) const;
+
+	private:
+		// The manifolds and their pair keys side by side, in the order the pairs were first added.
+		// The contacts of a frame mostly come in the order of the last one, so that the manifold
+		// after the last one found is tried first, then the keys sorted at the last Solve, then the
+		// manifolds added since. Nothing is allocated for a new pair once the vectors have grown.
+		vector<Manifold>	d_manifolds;
+		vector<unsigned long long>
+							d_keys;
+		vector<pair<unsigned long long, int>>
+							d_sorted_keys;		// keys of the manifolds kept at the last Solve and their index
+		int					d_nb_sorted;		// manifolds in d_sorted_keys, the others were added since
+		int					d_next;				// index tried first for the next contact
+		vector<Manifold*>	d_active;
+		int					d_frame;
+
+		static unsigned long long key(int a, int b) { return ((unsigned long long)a << 32) | (unsigned int)b; }
+		// World space vertices of the shape within tolerance of its support plane along direction
+		static int	feature(const ParallelNarrowPhase::Shape& shape, glm::vec3 const& direction, float tolerance, glm::vec3* points);
+		// Convex polygon of the points, counter clockwise, in place
+		static int	convexPolygon(glm::vec2* points, int count);
+		// Part of the subject (a polygon, a segment or a point) inside the convex clipper
+		static int	clip(const glm::vec2* subject, int count, const glm::vec2* clipper, int nb_edges, glm::vec2* out);
+		// Normal of the largest triangle of a flat feature, not normalized, and its vertex farthest from the first one
+		static glm::vec3 faceNormal(const glm::vec3* points, int count, int* farthest);
+		// Height along the normal of the flat feature above a point of the tangent plane
+		static float height(const glm::vec3* points, int count, glm::vec3 const& at, glm::vec3 const& normal);
+		// Keep MAX_POINTS of the points: the deepest one, the farthest from it, then those adding the largest areas
+		static int	reduce(Point* points, int count, glm::vec3 const& normal);
+		static void	tangents(glm::vec3 const& normal, glm::vec3* tangent);
+
+		Manifold&	manifold(int a, int b, glm::vec3 const& normal);
+		// Move the points of the manifold with the bodies, and drop those which went too far
+		void		refresh(Manifold& m, const vector<Body>& bodies);
+		// New points of a frame, replacing the old ones if they span a face
+		void		merge(Manifold& m, const vector<Body>& bodies, Point* points, int count);
+		void		applyImpulse(vector<Body>& bodies, const Manifold& m, const Point& p, glm::vec3 const& impulse);
+		glm::vec3	relativeVelocity(const vector<Body>& bodies, const Manifold& m, const Point& p) const;
+	};
+
+	inline ContactSolver::ContactSolver()
+		: m_iterations(20),
+		m_friction(0.5f),
+		m_slop(0.005f),
+		m_baumgarte(0.2f),
+		m_breaking_distance(0.02f),
+		m_warm_start(true),
+		d_nb_sorted(0),
+		d_next(0),
+		d_frame(0)
+	{
+	}
+
+	inline int ContactSolver::Nb_Points() const
+	{
+		int count = 0;
+		for (auto& m : d_manifolds)
+			count += m.nb_points;
+		return count;
+	}
+
+	inline void ContactSolver::Body_Pairs(vector<pair<int,int>>& pairs) const
+	{
+		pairs.clear();
+		for (auto& m : d_manifolds)
+			if (m.body_b >= 0)
+				pairs.push_back(make_pair(m.body_a, m.body_b));
+	}
+
+	inline void ContactSolver::tangents(glm::vec3 const& normal, glm::vec3* tangent)
+	{
+		if (fabs(normal.x) > 0.57f)
+			tangent[0] = glm::normalize(glm::vec3(normal.y, -normal.x, 0.0f));
+		else
+			tangent[0] = glm::normalize(glm::vec3(0.0f, normal.z, -normal.y));
+		tangent[1] = glm::cross(normal, tangent[0]);
+	}
+
+	inline int ContactSolver::feature(const ParallelNarrowPhase::Shape& shape, glm::vec3 const& direction, float tolerance, glm::vec3* points)
+	{
+		int count = 0;
+		if (!shape.hull || shape.hull->Empty())
+		{
+			// dot(M x, d) is dot(x, transpose(M) d) plus the same translation term for all the vertices
+			const glm::vec3 local_direction = glm::transpose(glm::mat3(shape.transform)) * direction;
+			float top = -FLT_MAX;
+			for (int i = 0; i < shape.count; i++)
+				top = max(top, glm::dot(shape.vertices[i].Position, local_direction));
+			for (int i = 0; i < shape.count && count < MAX_FEATURE; i++)
+				if (glm::dot(shape.vertices[i].Position, local_direction) >= top - tolerance)
+					points[count++] = glm::vec3(shape.transform * glm::vec4(shape.vertices[i].Position, 1.0f));
+			return count;
+		}
+
+		const ConvexHull& hull = *shape.hull;
+		const glm::vec3 local_direction = glm::transpose(glm::mat3(shape.transform)) * direction;
+		const int top_vertex = hull.Support(local_direction, shape.start);
+		auto world = [&](int i) { return glm::vec3(shape.transform * glm::vec4(hull.Vertex_At(i), 1.0f)); };
+		points[count++] = world(top_vertex);
+		const float top = glm::dot(points[0], direction);
+
+		if (hull.Neighbor_Count(top_vertex) == 0)
+		{
+			for (int i = 0; i < hull.Size() && count < MAX_FEATURE; i++)
+			{
+				if (i == top_vertex) continue;
+				glm::vec3 p = world(i);
+				if (glm::dot(p, direction) >= top - tolerance) points[count++] = p;
+			}
+			return count;
+		}
+
+		// the vertices of a face are connected by its edges, so they are found from the support vertex
+		int queue[MAX_FEATURE];
+		int visited[4 * MAX_FEATURE];
+		int nb_visited = 0;
+		queue[0] = top_vertex;
+		visited[nb_visited++] = top_vertex;
+		for (int q = 0; q < count; q++)
+		{
+			for (int k = 0; k < hull.Neighbor_Count(queue[q]); k++)
+			{
+				const int n = hull.Neighbor(queue[q], k);
+				if (find(visited, visited + nb_visited, n) != visited + nb_visited) continue;
+				if (nb_visited == 4 * MAX_FEATURE || count == MAX_FEATURE) return count;
+				visited[nb_visited++] = n;
+				glm::vec3 p = world(n);
+				if (glm::dot(p, direction) < top - tolerance) continue;
+				queue[count] = n;
+				points[count++] = p;
+			}
+		}
+		return count;
+	}
+
+	inline int ContactSolver::convexPolygon(glm::vec2* points, int count)
+	{
+		sort(points, points + count, [](glm::vec2 const& a, glm::vec2 const& b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+		count = unique(points, points + count, [](glm::vec2 const& a, glm::vec2 const& b) { return glm::distance(a, b) < 1e-5f; }) - points;
+		if (count < 3) return count;
+
+		// monotone chain, collinear points are dropped
+		auto cross = [](glm::vec2 const& o, glm::vec2 const& a, glm::vec2 const& b) { return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x); };
+		glm::vec2 polygon[2 * MAX_FEATURE];
+		int k = 0;
+		for (int i = 0; i < count; i++)
+		{
+			while (k >= 2 && cross(polygon[k-2], polygon[k-1], points[i]) <= 0.0f) k--;
+			polygon[k++] = points[i];
+		}
+		for (int i = count - 2, lower = k + 1; i >= 0; i--)
+		{
+			while (k >= lower && cross(polygon[k-2], polygon[k-1], points[i]) <= 0.0f) k--;
+			polygon[k++] = points[i];
+		}
+		k--;
+		copy(polygon, polygon + k, points);
+		return k;
+	}
+
+	inline int ContactSolver::clip(const glm::vec2* subject, int count, const glm::vec2* clipper, int nb_edges, glm::vec2* out)
+	{
+		glm::vec2 buffers[2][MAX_CLIPPED];
+		copy(subject, subject + count, buffers[0]);
+		int current = 0;
+		for (int e = 0; e < nb_edges && count > 0; e++)
+		{
+			const glm::vec2 a = clipper[e], edge = clipper[(e + 1) % nb_edges] - a;
+			auto side = [&](glm::vec2 const& p) { return edge.x * (p.y - a.y) - edge.y * (p.x - a.x); };
+			const glm::vec2* input = buffers[current];
+			glm::vec2* output = buffers[1 - current];
+			int nb_output = 0;
+			if (count == 1)
+			{
+				if (side(input[0]) >= 0.0f) output[nb_output++] = input[0];
+			}
+			else
+			{
+				// a segment is not closed, its last point does not go back to the first one
+				const int nb_sides = count == 2 ? 1 : count;
+				if (count == 2 && side(input[0]) >= 0.0f) output[nb_output++] = input[0];
+				for (int i = 0; i < nb_sides && nb_output < MAX_CLIPPED - 1; i++)
+				{
+					const glm::vec2 p = input[i], q = input[(i + 1) % count];
+					const float sp = side(p), sq = side(q);
+					if ((sp >= 0.0f) != (sq >= 0.0f))
+						output[nb_output++] = p + (q - p) * (sp / (sp - sq));
+					if (sq >= 0.0f) output[nb_output++] = q;
+				}
+			}
+			count = nb_output;
+			current = 1 - current;
+		}
+		copy(buffers[current], buffers[current] + count, out);
+		return count;
+	}
+
+	inline glm::vec3 ContactSolver::faceNormal(const glm::vec3* points, int count, int* farthest)
+	{
+		*farthest = 0;
+		for (int i = 1; i < count; i++)
+			if (glm::distance(points[i], points[0]) > glm::distance(points[*farthest], points[0])) *farthest = i;
+		const glm::vec3 edge = points[*farthest] - points[0];
+		glm::vec3 plane_normal(0.0f);
+		for (int i = 1; i < count; i++)
+		{
+			const glm::vec3 n = glm::cross(edge, points[i] - points[0]);
+			if (glm::dot(n, n) > glm::dot(plane_normal, plane_normal)) plane_normal = n;
+		}
+		return plane_normal;
+	}
+
+	inline float ContactSolver::height(const glm::vec3* points, int count, glm::vec3 const& at, glm::vec3 const& normal)
+	{
+		if (count == 1) return glm::dot(points[0], normal);
+		int farthest;
+		const glm::vec3 plane_normal = faceNormal(points, count, &farthest);
+		const glm::vec3 edge = points[farthest] - points[0];
+		const float slope = glm::dot(plane_normal, normal);
+		if (fabs(slope) > 1e-3f * glm::length(plane_normal))
+			return glm::dot(at, normal) + glm::dot(plane_normal, points[0] - at) / slope;
+
+		// along the edge seen from the normal
+		const glm::vec3 flat_edge = edge - normal * glm::dot(edge, normal);
+		const float length2 = glm::dot(flat_edge, flat_edge);
+		const float t = length2 > 1e-12f ? glm::clamp(glm::dot(at - points[0], flat_edge) / length2, 0.0f, 1.0f) : 0.0f;
+		return glm::mix(glm::dot(points[0], normal), glm::dot(points[farthest], normal), t);
+	}
+
+	inline int ContactSolver::reduce(Point* points, int count, glm::vec3 const& normal)
+	{
+		if (count <= MAX_POINTS) return count;
+
+		int chosen[MAX_POINTS];
+		chosen[0] = 0;
+		for (int i = 1; i < count; i++)
+			if (points[i].depth > points[chosen[0]].depth) chosen[0] = i;
+
+		float best = -1.0f;
+		chosen[1] = chosen[0];
+		for (int i = 0; i < count; i++)
+		{
+			const float d = glm::distance(points[i].world_a, points[chosen[0]].world_a);
+			if (d > best) { best = d; chosen[1] = i; }
+		}
+
+		best = -1.0f;
+		chosen[2] = chosen[0];
+		for (int i = 0; i < count; i++)
+		{
+			const glm::vec3 ab = points[chosen[1]].world_a - points[chosen[0]].world_a;
+			const float area = fabs(glm::dot(glm::cross(ab, points[i].world_a - points[chosen[0]].world_a), normal));
+			if (area > best) { best = area; chosen[2] = i; }
+		}
+
+		// the point outside the triangle adding the largest area across one of its edges
+		glm::vec3 triangle[3] = { points[chosen[0]].world_a, points[chosen[1]].world_a, points[chosen[2]].world_a };
+		const float orientation = glm::dot(glm::cross(triangle[1] - triangle[0], triangle[2] - triangle[0]), normal) < 0.0f ? -1.0f : 1.0f;
+		best = 0.0f;
+		chosen[3] = -1;
+		for (int i = 0; i < count; i++)
+		{
+			for (int e = 0; e < 3; e++)
+			{
+				const glm::vec3& p = triangle[e];
+				const glm::vec3& q = triangle[(e + 1) % 3];
+				const float area = -orientation * glm::dot(glm::cross(q - p, points[i].world_a - p), normal);
+				if (area > best) { best = area; chosen[3] = i; }
+			}
+		}
+
+		Point kept[MAX_POINTS];
+		int nb_kept = 0;
+		for (int k = 0; k < MAX_POINTS; k++)
+			if (chosen[k] >= 0 && find(chosen, chosen + k, chosen[k]) == chosen + k)
+				kept[nb_kept++] = points[chosen[k]];
+		copy(kept, kept + nb_kept, points);
+		return nb_kept;
+	}
+
+	inline ContactSolver::Manifold& ContactSolver::manifold(int a, int b, glm::vec3 const& normal)
+	{
+		const unsigned long long k = key(a, b);
+		const int count = d_manifolds.size();
+		int index = -1;
+		if (d_next < count && d_keys[d_next] == k)
+			index = d_next;
+		else
+		{
+			auto it = lower_bound(d_sorted_keys.begin(), d_sorted_keys.end(), make_pair(k, -1));
+			if (it != d_sorted_keys.end() && it->first == k)
+				index = it->second;
+			else
+				for (int i = d_nb_sorted; i < count && index < 0; i++)
+					if (d_keys[i] == k) index = i;
+		}
+		const bool inserted = index < 0;
+		if (inserted)
+		{
+			index = count;
+			d_manifolds.push_back(Manifold());
+			d_keys.push_back(k);
+		}
+		d_next = index + 1;
+		Manifold& m = d_manifolds[index];
+		// the impulses along another normal do not help
+		if (inserted || glm::dot(m.normal, normal) < 0.9f)
+			m.nb_points = 0;
+		m.body_a = a;
+		m.body_b = b < 0 ? -1 : b;
+		m.normal = normal;
+		tangents(normal, m.tangent);
+		m.frame = d_frame;
+		return m;
+	}
+
+	inline void ContactSolver::refresh(Manifold& m, const vector<Body>& bodies)
+	{
+		const float breaking2 = m_breaking_distance * m_breaking_distance;
+		int kept = 0;
+		for (int i = 0; i < m.nb_points; i++)
+		{
+			Point& p = m.points[i];
+			p.world_a = glm::vec3(bodies[m.body_a].transform * glm::vec4(p.local_a, 1.0f));
+			p.world_b = m.body_b < 0 ? p.local_b : glm::vec3(bodies[m.body_b].transform * glm::vec4(p.local_b, 1.0f));
+			const glm::vec3 d = p.world_a - p.world_b;
+			p.depth = glm::dot(d, m.normal);
+			const glm::vec3 drift = d - m.normal * p.depth;
+			if (p.depth < -m_breaking_distance || glm::dot(drift, drift) > breaking2) continue;
+			m.points[kept++] = p;
+		}
+		m.nb_points = kept;
+	}
+
+	inline void ContactSolver::merge(Manifold& m, const vector<Body>& bodies, Point* points, int count)
+	{
+		const glm::mat4 inverse_a = glm::inverse(bodies[m.body_a].transform);
+		const glm::mat4 inverse_b = m.body_b < 0 ? glm::mat4(1.0f) : glm::inverse(bodies[m.body_b].transform);
+		for (int i = 0; i < count; i++)
+		{
+			points[i].local_a = glm::vec3(inverse_a * glm::vec4(points[i].world_a, 1.0f));
+			points[i].local_b = glm::vec3(inverse_b * glm::vec4(points[i].world_b, 1.0f));
+			points[i].normal_impulse = points[i].tangent_impulse[0] = points[i].tangent_impulse[1] = 0.0f;
+		}
+		refresh(m, bodies);
+
+		// a new point close to an old one takes its impulses, and its place if the old points are kept
+		const float breaking2 = m_breaking_distance * m_breaking_distance;
+		const bool replace = count >= 3;
+		Point all[MAX_POINTS + 2 * MAX_FEATURE];
+		int nb_all = 0;
+		bool matched[MAX_POINTS] = { false, false, false, false };
+		for (int i = 0; i < count; i++)
+		{
+			for (int j = 0; j < m.nb_points; j++)
+			{
+				const glm::vec3 d = m.points[j].world_a - points[i].world_a;
+				if (matched[j] || glm::dot(d, d) > breaking2) continue;
+				matched[j] = true;
+				points[i].normal_impulse = m.points[j].normal_impulse;
+				points[i].tangent_impulse[0] = m.points[j].tangent_impulse[0];
+				points[i].tangent_impulse[1] = m.points[j].tangent_impulse[1];
+				break;
+			}
+			all[nb_all++] = points[i];
+		}
+		if (!replace)
+			for (int j = 0; j < m.nb_points; j++)
+				if (!matched[j]) all[nb_all++] = m.points[j];
+
+		nb_all = reduce(all, nb_all, m.normal);
+		copy(all, all + nb_all, m.points);
+		m.nb_points = nb_all;
+	}
+
+	inline void ContactSolver::Add_Contact(const vector<Body>& bodies, int a, int b,
+		const ParallelNarrowPhase::Shape& shape_a, const ParallelNarrowPhase::Shape& shape_b,
+		const ParallelNarrowPhase::Contact& contact)
+	{
+		if (!contact.colliding) return;
+		glm::vec3 normal = glm::normalize(contact.normal);
+		glm::vec3 feature_a[MAX_FEATURE], feature_b[MAX_FEATURE];
+		const int nb_a = feature(shape_a, normal, m_breaking_distance, feature_a);
+		const int nb_b = feature(shape_b, -normal, m_breaking_distance, feature_b);
+
+		// EPA only finds the normal up to its tolerance, the normal of a face is exact,
+		// and does not make the bodies slide or turn
+		int farthest;
+		if (nb_a >= 3 || nb_b >= 3)
+		{
+			glm::vec3 face = nb_a >= 3 ? faceNormal(feature_a, nb_a, &farthest) : faceNormal(feature_b, nb_b, &farthest);
+			if (glm::dot(face, face) > 0.0f)
+			{
+				face = glm::normalize(face);
+				if (glm::dot(face, normal) < 0.0f) face = -face;
+				if (glm::dot(face, normal) > 0.99f) normal = face;
+			}
+		}
+		Manifold& m = manifold(a, b, normal);
+
+		// both features in the tangent plane, one of them clipped by the other
+		glm::vec2 polygon_a[MAX_FEATURE], polygon_b[MAX_FEATURE], clipped[MAX_CLIPPED];
+		for (int i = 0; i < nb_a; i++) polygon_a[i] = glm::vec2(glm::dot(feature_a[i], m.tangent[0]), glm::dot(feature_a[i], m.tangent[1]));
+		for (int i = 0; i < nb_b; i++) polygon_b[i] = glm::vec2(glm::dot(feature_b[i], m.tangent[0]), glm::dot(feature_b[i], m.tangent[1]));
+		const int sides_a = convexPolygon(polygon_a, nb_a);
+		const int sides_b = convexPolygon(polygon_b, nb_b);
+		int nb_clipped = 0;
+		if (sides_a >= 3)
+			nb_clipped = clip(polygon_b, sides_b, polygon_a, sides_a, clipped);
+		else if (sides_b >= 3)
+			nb_clipped = clip(polygon_a, sides_a, polygon_b, sides_b, clipped);
+
+		Point points[MAX_CLIPPED];
+		int count = 0;
+		for (int i = 0; i < nb_clipped; i++)
+		{
+			const glm::vec3 on_plane = m.tangent[0] * clipped[i].x + m.tangent[1] * clipped[i].y;
+			const float height_a = height(feature_a, nb_a, on_plane, normal);
+			const float height_b = height(feature_b, nb_b, on_plane, normal);
+			if (height_a - height_b < -m_breaking_distance) continue;
+			points[count].world_a = on_plane + normal * height_a;
+			points[count].world_b = on_plane + normal * height_b;
+			points[count].depth = height_a - height_b;
+			count++;
+		}
+		// edges crossing, or a vertex: the deepest points found by EPA
+		if (count == 0)
+		{
+			points[0].world_a = contact.point_a;
+			points[0].world_b = contact.point_b;
+			points[0].depth = contact.depth;
+			count = 1;
+		}
+		merge(m, bodies, points, count);
+	}
+
+	inline void ContactSolver::Add_Plane_Contact(const vector<Body>& bodies, int a, int plane,
+		const ParallelNarrowPhase::Shape& shape, glm::vec3 const& point, glm::vec3 const& normal)
+	{
+		glm::vec3 vertices[MAX_FEATURE];
+		const int nb_vertices = feature(shape, -normal, m_breaking_distance, vertices);
+
+		Point points[MAX_FEATURE];
+		int count = 0;
+		for (int i = 0; i < nb_vertices; i++)
+		{
+			const float depth = glm::dot(point - vertices[i], normal);
+			if (depth < -m_breaking_distance) continue;
+			points[count].world_a = vertices[i];
+			points[count].world_b = vertices[i] + normal * depth;
+			points[count].depth = depth;
+			count++;
+		}
+		if (count == 0) return;
+		// planes are keyed after the bodies
+		merge(manifold(a, -1 - plane, -normal), bodies, points, count);
+	}
+
+	inline glm::vec3 ContactSolver::relativeVelocity(const vector<Body>& bodies, const Manifold& m, const Point& p) const
+	{
+		const Body& a = bodies[m.body_a];
+		glm::vec3 v = -(a.velocity + glm::cross(a.angular_velocity, p.ra));
+		if (m.body_b >= 0)
+		{
+			const Body& b = bodies[m.body_b];
+			v += b.velocity + glm::cross(b.angular_velocity, p.rb);
+		}
+		return v;
+	}
+
+	inline void ContactSolver::applyImpulse(vector<Body>& bodies, const Manifold& m, const Point& p, glm::vec3 const& impulse)
+	{
+		Body& a = bodies[m.body_a];
+		a.velocity -= impulse * a.inverse_mass;
+		a.angular_velocity -= a.inverse_inertia * glm::cross(p.ra, impulse);
+		if (m.body_b < 0) return;
+		Body& b = bodies[m.body_b];
+		b.velocity += impulse * b.inverse_mass;
+		b.angular_velocity += b.inverse_inertia * glm::cross(p.rb, impulse);
+	}
+
+	inline void ContactSolver::Solve(vector<Body>& bodies, float delta_time)
+	{
+		// the manifolds kept are moved to the front, in their order
+		const int count = d_manifolds.size();
+		int kept = 0;
+		for (int i = 0; i < count; i++)
+		{
+			Manifold& m = d_manifolds[i];
+			if (m.body_a >= (int)bodies.size() || m.body_b >= (int)bodies.size())
+				continue;
+			// between fixed or sleeping bodies, kept with its impulses for when they move again
+			const bool fixed = bodies[m.body_a].inverse_mass == 0.0f && (m.body_b < 0 || bodies[m.body_b].inverse_mass == 0.0f);
+			if (!fixed && m.frame != d_frame) refresh(m, bodies);
+			if (!fixed && m.nb_points == 0)
+				continue;
+			if (kept != i)
+			{
+				d_manifolds[kept] = m;
+				d_keys[kept] = d_keys[i];
+			}
+			kept++;
+		}
+		d_manifolds.resize(kept);
+		d_keys.resize(kept);
+		if (kept != count || d_nb_sorted != count)
+		{
+			d_sorted_keys.resize(kept);
+			for (int i = 0; i < kept; i++)
+				d_sorted_keys[i] = make_pair(d_keys[i], i);
+			sort(d_sorted_keys.begin(), d_sorted_keys.end());
+		}
+		d_nb_sorted = kept;
+
+		// the contacts with the planes first, so that the forward sweeps go up the stacks from the ground
+		d_active.clear();
+		for (int planes = 1; planes >= 0; planes--)
+			for (auto& m : d_manifolds)
+				if ((m.body_b < 0) == (planes == 1)
+					&& (bodies[m.body_a].inverse_mass != 0.0f || (m.body_b >= 0 && bodies[m.body_b].inverse_mass != 0.0f)))
+					d_active.push_back(&m);
+
+		// effective masses, and the impulses of the last frame
+		for (auto m : d_active)
+		{
+			const Body& a = bodies[m->body_a];
+			for (int i = 0; i < m->nb_points; i++)
+			{
+				Point& p = m->points[i];
+				p.ra = p.world_a - a.center;
+				p.rb = m->body_b < 0 ? glm::vec3(0.0f) : p.world_b - bodies[m->body_b].center;
+				auto effective_mass = [&](glm::vec3 const& direction)
+				{
+					float k = a.inverse_mass + glm::dot(direction, glm::cross(a.inverse_inertia * glm::cross(p.ra, direction), p.ra));
+					if (m->body_b >= 0)
+					{
+						const Body& b = bodies[m->body_b];
+						k += b.inverse_mass + glm::dot(direction, glm::cross(b.inverse_inertia * glm::cross(p.rb, direction), p.rb));
+					}
+					return k > 0.0f ? 1.0f / k : 0.0f;
+				};
+				p.normal_mass = effective_mass(m->normal);
+				p.tangent_mass[0] = effective_mass(m->tangent[0]);
+				p.tangent_mass[1] = effective_mass(m->tangent[1]);
+
+				// separating points may close the gap in this frame, but not more
+				if (p.depth > m_slop)
+					p.bias = m_baumgarte / delta_time * (p.depth - m_slop);
+				else if (p.depth < 0.0f)
+					p.bias = p.depth / delta_time;
+				else
+					p.bias = 0.0f;
+
+				if (!m_warm_start)
+				{
+					p.normal_impulse = p.tangent_impulse[0] = p.tangent_impulse[1] = 0.0f;
+					continue;
+				}
+				applyImpulse(bodies, *m, p, m->normal * p.normal_impulse
+					+ m->tangent[0] * p.tangent_impulse[0] + m->tangent[1] * p.tangent_impulse[1]);
+			}
+		}
+
+		// the sweeps go forward and backward in turn, so that the first contacts solved do not always get the largest share
+		const int nb_active = d_active.size();
+		for (int iteration = 0; iteration < m_iterations; iteration++)
+		{
+			for (int k = 0; k < nb_active; k++)
+			{
+				Manifold* m = d_active[iteration & 1 ? nb_active - 1 - k : k];
+				for (int i = 0; i < m->nb_points; i++)
+				{
+					Point& p = m->points[i];
+					// friction first, bounded by the normal impulse of the last iteration
+					const float max_friction = m_friction * p.normal_impulse;
+					for (int k = 0; k < 2; k++)
+					{
+						const float speed = glm::dot(relativeVelocity(bodies, *m, p), m->tangent[k]);
+						const float old_impulse = p.tangent_impulse[k];
+						p.tangent_impulse[k] = glm::clamp(old_impulse - speed * p.tangent_mass[k], -max_friction, max_friction);
+						applyImpulse(bodies, *m, p, m->tangent[k] * (p.tangent_impulse[k] - old_impulse));
+					}
+
+					const float speed = glm::dot(relativeVelocity(bodies, *m, p), m->normal);
+					const float old_impulse = p.normal_impulse;
+					p.normal_impulse = max(0.0f, old_impulse + (p.bias - speed) * p.normal_mass);
+					applyImpulse(bodies, *m, p, m->normal * (p.normal_impulse - old_impulse));
+				}
+			}
+		}
+	}
+}
+
+#endif // ContactSolver_h__
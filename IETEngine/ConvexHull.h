@@ -0,0 +1,364 @@
+#ifndef ConvexHull_h__
+#define ConvexHull_h__
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cfloat>
+#include "Vertex.h"
+
+namespace Physics
+{
+	using namespace std;
+
+	/*
+	* Convex hull of the vertices of a model, computed once at load by
+	* quickhull, with the neighbors of each hull vertex.
+	* The support vertex in a direction is found by hill climbing: from a start
+	* vertex, move to the neighbor farthest along the direction until none is
+	* farther. On a convex polyhedron a vertex without a farther neighbor is a
+	* support vertex, and starting from the support vertex of a close direction
+	* (the previous GJK iteration, or the previous frame) takes a few steps.
+	* Small hulls are scanned instead, from positions stored by coordinate.
+	*/
+	class ConvexHull
+	{
+	public:
+		// Hulls up to this size are scanned rather than climbed
+		enum { SCAN_SIZE = 32 };
+
+		ConvexHull() {}
+
+		void		Build(const vector<glm::vec3>& points);
+		void		Build(const vector<Vertex>& vertices);
+
+		int			Size() const { return d_vertices.size(); }
+		bool		Empty() const { return d_vertices.empty(); }
+		glm::vec3	const& Vertex_At(int i) const { return d_vertices[i]; }
+		// Triangles of the hull, 3 vertex indices each, counter clockwise seen from outside
+		vector<int>	const& Triangles() const { return d_triangles; }
+		// Vertices sharing an edge with vertex i, none for a flat hull
+		int			Neighbor_Count(int i) const { return d_neighbors.empty() ? 0 : d_neighbor_offsets[i + 1] - d_neighbor_offsets[i]; }
+		int			Neighbor(int i, int k) const { return d_neighbors[d_neighbor_offsets[i] + k]; }
+
+		// Vertex farthest along direction, climbing from start when the hull has more than SCAN_SIZE vertices
+		int			Support(glm::vec3 const& direction, int start = 0) const;
+		int			Support_Scan(glm::vec3 const& direction) const;
+		int			Support_Climb(glm::vec3 const& direction, int start, int* steps = NULL) const;
+
+	private:
+		struct Face
+		{
+			int			v[3];
+			int			adjacent[3];	// face across the edge v[k] v[k+1]
+			glm::vec3	normal;
+			float		offset;
+			bool		alive;
+			vector<int>	outside;		// points in front of the face, not yet in the hull
+		};
+
+		vector<glm::vec3>	d_vertices;
+		vector<float>		d_x, d_y, d_z;
+		vector<int>			d_neighbor_offsets;	// neighbors of vertex i: d_neighbors[offsets[i] .. offsets[i+1]]
+		vector<int>			d_neighbors;
+		vector<int>			d_triangles;
+
+		void		setPoints(const vector<glm::vec3>& points, const vector<int>& used);
+		static int	addFace(vector<Face>& faces, const vector<glm::vec3>& points, int a, int b, int c);
+	};
+
+	inline void ConvexHull::Build(const vector<Vertex>& vertices)
+	{
+		vector<glm::vec3> points(vertices.size());
+		for (int i = 0; i < (int)vertices.size(); i++)
+			points[i] = vertices[i].Position;
+		Build(points);
+	}
+
+	inline int ConvexHull::addFace(vector<Face>& faces, const vector<glm::vec3>& points, int a, int b, int c)
+	{
+		faces.push_back(Face());
+		Face& face = faces.back();
+		face.v[0] = a; face.v[1] = b; face.v[2] = c;
+		face.adjacent[0] = face.adjacent[1] = face.adjacent[2] = -1;
+		const glm::vec3 n = glm::cross(points[b] - points[a], points[c] - points[a]);
+		const float length = glm::length(n);
+		face.normal = (length > 0.0f) ? n / length : glm::vec3(0.0f);
+		face.offset = glm::dot(face.normal, points[a]);
+		face.alive = true;
+		return faces.size() - 1;
+	}
+
+	// Keep the points used by the hull, with the neighbors given by the triangles
+	inline void ConvexHull::setPoints(const vector<glm::vec3>& points, const vector<int>& used)
+	{
+		vector<int> index(points.size(), -1);
+		for (int i = 0; i < (int)used.size(); i++)
+		{
+			index[used[i]] = i;
+			d_vertices.push_back(points[used[i]]);
+			d_x.push_back(points[used[i]].x);
+			d_y.push_back(points[used[i]].y);
+			d_z.push_back(points[used[i]].z);
+		}
+		for (auto& t : d_triangles)
+			t = index[t];
+		if (d_triangles.empty()) return;
+
+		// each edge is in two triangles, once in each direction
+		const int n = d_vertices.size();
+		d_neighbor_offsets.assign(n + 1, 0);
+		for (auto t : d_triangles)
+			++d_neighbor_offsets[t + 1];
+		for (int i = 0; i < n; i++)
+			d_neighbor_offsets[i + 1] += d_neighbor_offsets[i];
+		d_neighbors.resize(d_triangles.size());
+		vector<int> fill(d_neighbor_offsets.begin(), d_neighbor_offsets.end() - 1);
+		for (int t = 0; t < (int)d_triangles.size(); t += 3)
+			for (int k = 0; k < 3; k++)
+				d_neighbors[fill[d_triangles[t + k]]++] = d_triangles[t + (k + 1) % 3];
+	}
+
+	inline void ConvexHull::Build(const vector<glm::vec3>& points)
+	{
+		d_vertices.clear();
+		d_x.clear(); d_y.clear(); d_z.clear();
+		d_neighbor_offsets.clear();
+		d_neighbors.clear();
+		d_triangles.clear();
+		const int n = points.size();
+		if (n == 0) return;
+
+		glm::vec3 min_point = points[0], max_point = points[0];
+		int extremes[6] = { 0, 0, 0, 0, 0, 0 };
+		for (int i = 1; i < n; i++)
+			for (int a = 0; a < 3; a++)
+			{
+				if (points[i][a] < points[extremes[2*a]][a]) extremes[2*a] = i;
+				if (points[i][a] > points[extremes[2*a+1]][a]) extremes[2*a+1] = i;
+				min_point[a] = glm::min(min_point[a], points[i][a]);
+				max_point[a] = glm::max(max_point[a], points[i][a]);
+			}
+		const glm::vec3 extent = max_point - min_point;
+		const float epsilon = 1e-5f * glm::max(glm::max(extent.x, extent.y), glm::max(extent.z, FLT_MIN));
+
+		// initial tetrahedron: the farthest extremes, the farthest point from their line, and from their plane
+		int i0 = extremes[0], i1 = extremes[1];
+		for (int e = 0; e < 6; e++)
+			for (int f = e + 1; f < 6; f++)
+				if (glm::distance(points[extremes[e]], points[extremes[f]]) > glm::distance(points[i0], points[i1]))
+				{
+					i0 = extremes[e];
+					i1 = extremes[f];
+				}
+		int i2 = -1, i3 = -1;
+		float best = epsilon;
+		const glm::vec3 line = glm::normalize(points[i1] - points[i0]);
+		for (int i = 0; i < n && glm::distance(points[i0], points[i1]) > epsilon; i++)
+		{
+			const glm::vec3 d = points[i] - points[i0];
+			const float distance = glm::length(d - line * glm::dot(d, line));
+			if (distance > best) { best = distance; i2 = i; }
+		}
+		if (i2 >= 0)
+		{
+			const glm::vec3 normal = glm::normalize(glm::cross(points[i1] - points[i0], points[i2] - points[i0]));
+			best = epsilon;
+			for (int i = 0; i < n; i++)
+			{
+				const float distance = fabs(glm::dot(points[i] - points[i0], normal));
+				if (distance > best) { best = distance; i3 = i; }
+			}
+		}
+		if (i3 < 0)
+		{
+			// flat or smaller: all the points, scanned
+			vector<int> all(n);
+			for (int i = 0; i < n; i++) all[i] = i;
+			setPoints(points, all);
+			return;
+		}
+
+		vector<Face> faces;
+		if (glm::dot(glm::cross(points[i1] - points[i0], points[i2] - points[i0]), points[i3] - points[i0]) > 0.0f)
+			swap(i1, i2);
+		// faces of the tetrahedron, and the face across each of their edges
+		addFace(faces, points, i0, i1, i2);
+		addFace(faces, points, i0, i3, i1);
+		addFace(faces, points, i1, i3, i2);
+		addFace(faces, points, i2, i3, i0);
+		const int adjacent[4][3] = { {1,2,3}, {3,2,0}, {1,3,0}, {2,1,0} };
+		for (int f = 0; f < 4; f++)
+			for (int k = 0; k < 3; k++)
+				faces[f].adjacent[k] = adjacent[f][k];
+
+		for (int i = 0; i < n; i++)
+		{
+			if (i == i0 || i == i1 || i == i2 || i == i3) continue;
+			for (int f = 0; f < 4; f++)
+				if (glm::dot(faces[f].normal, points[i]) - faces[f].offset > epsilon)
+				{
+					faces[f].outside.push_back(i);
+					break;
+				}
+		}
+
+		vector<int> visible, stack, horizon_face, horizon_edge, new_faces, orphans;
+		vector<int> starting(n, -1), ending(n, -1);
+		for (int f = 0; f < (int)faces.size(); f++)
+		{
+			if (!faces[f].alive || faces[f].outside.empty()) continue;
+
+			// farthest point in front of the face
+			int eye = faces[f].outside[0];
+			float eye_distance = -FLT_MAX;
+			for (auto p : faces[f].outside)
+			{
+				const float distance = glm::dot(faces[f].normal, points[p]) - faces[f].offset;
+				if (distance > eye_distance) { eye_distance = distance; eye = p; }
+			}
+
+			// faces seen from the eye, connected to f, and the edges to the faces not seen
+			visible.clear();
+			horizon_face.clear();
+			horizon_edge.clear();
+			stack.assign(1, f);
+			faces[f].alive = false;
+			while (!stack.empty())
+			{
+				const int g = stack.back();
+				stack.pop_back();
+				visible.push_back(g);
+				for (int k = 0; k < 3; k++)
+				{
+					const int h = faces[g].adjacent[k];
+					if (!faces[h].alive)
+					{
+						// already seen, unless it is a face of this step
+						continue;
+					}
+					// without tolerance here, so that the cone leaves no concave edge to stop the climb
+					if (glm::dot(faces[h].normal, points[eye]) - faces[h].offset > 0.0f)
+					{
+						faces[h].alive = false;
+						stack.push_back(h);
+					}
+					else
+					{
+						horizon_face.push_back(g);
+						horizon_edge.push_back(k);
+					}
+				}
+			}
+
+			// a cone of faces from the horizon to the eye
+			new_faces.clear();
+			for (int e = 0; e < (int)horizon_face.size(); e++)
+			{
+				const Face& g = faces[horizon_face[e]];
+				const int k = horizon_edge[e];
+				const int a = g.v[k], b = g.v[(k + 1) % 3];
+				const int outer = g.adjacent[k];
+				const int face = addFace(faces, points, a, b, eye);
+				faces[face].adjacent[0] = outer;
+				for (int j = 0; j < 3; j++)
+					if (faces[outer].v[j] == b && faces[outer].v[(j + 1) % 3] == a)
+						faces[outer].adjacent[j] = face;
+				starting[a] = face;
+				ending[b] = face;
+				new_faces.push_back(face);
+			}
+			for (auto face : new_faces)
+			{
+				faces[face].adjacent[1] = starting[faces[face].v[1]];	// across b eye
+				faces[face].adjacent[2] = ending[faces[face].v[0]];		// across eye a
+			}
+
+			// the points in front of the removed faces go to the new ones, or are inside
+			for (auto g : visible)
+			{
+				orphans.swap(faces[g].outside);
+				for (auto p : orphans)
+				{
+					if (p == eye) continue;
+					for (auto face : new_faces)
+						if (glm::dot(faces[face].normal, points[p]) - faces[face].offset > epsilon)
+						{
+							faces[face].outside.push_back(p);
+							break;
+						}
+				}
+				orphans.clear();
+				vector<int>().swap(faces[g].outside);
+			}
+			// faces are added at the end, so they are reached by this loop
+		}
+
+		vector<int> used;
+		vector<char> is_used(n, 0);
+		for (auto& face : faces)
+		{
+			if (!face.alive) continue;
+			for (int k = 0; k < 3; k++)
+			{
+				d_triangles.push_back(face.v[k]);
+				if (!is_used[face.v[k]])
+				{
+					is_used[face.v[k]] = 1;
+					used.push_back(face.v[k]);
+				}
+			}
+		}
+		setPoints(points, used);
+	}
+
+	inline int ConvexHull::Support_Scan(glm::vec3 const& direction) const
+	{
+		const int n = d_vertices.size();
+		const float* x = d_x.data();
+		const float* y = d_y.data();
+		const float* z = d_z.data();
+		int best = 0;
+		float best_dot = -FLT_MAX;
+		for (int i = 0; i < n; i++)
+		{
+			const float d = x[i] * direction.x + y[i] * direction.y + z[i] * direction.z;
+			if (d > best_dot) { best_dot = d; best = i; }
+		}
+		return best;
+	}
+
+	inline int ConvexHull::Support_Climb(glm::vec3 const& direction, int start, int* steps) const
+	{
+		if (steps) *steps = 0;
+		// flat hulls have no neighbors
+		if (d_neighbors.empty()) return Support_Scan(direction);
+		int v = (start >= 0 && start < (int)d_vertices.size()) ? start : 0;
+		float best_dot = glm::dot(d_vertices[v], direction);
+		int nb_steps = 0;
+		for (;;)
+		{
+			int next = v;
+			for (int k = d_neighbor_offsets[v]; k < d_neighbor_offsets[v + 1]; k++)
+			{
+				const float d = glm::dot(d_vertices[d_neighbors[k]], direction);
+				if (d > best_dot) { best_dot = d; next = d_neighbors[k]; }
+			}
+			if (next == v) break;
+			v = next;
+			nb_steps++;
+		}
+		if (steps) *steps = nb_steps;
+		return v;
+	}
+
+	inline int ConvexHull::Support(glm::vec3 const& direction, int start) const
+	{
+		if ((int)d_vertices.size() <= SCAN_SIZE || d_neighbors.empty())
+			return Support_Scan(direction);
+		return Support_Climb(direction, start);
+	}
+}
+
+#endif // ConvexHull_h__
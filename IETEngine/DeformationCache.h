@@ -0,0 +1,331 @@
+#ifndef DeformationCache_h__
+#define DeformationCache_h__
+
+#include "common.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Recorded positions of a set of meshes, played back without simulating.
+//
+// Coordinates are quantized on a grid of the given precision. Every
+// keyInterval frames a keyframe stores the quantized coordinates, the other
+// frames only store the difference with a linear extrapolation of the two
+// previous frames. Values are written as zigzag varints, so a smooth motion
+// takes about one byte per coordinate instead of four. Decoding is exact, the
+// only error is the quantization (at most precision/2 per coordinate).
+//
+// File layout: header, frames, table of frame offsets, trailer (offset of the
+// table, number of frames, magic).
+
+static const char DeformationCache_magic[4] = { 'I', 'E', 'T', 'C' };
+static const int DeformationCache_version = 1;
+
+static inline void DeformationCache_putVarint(std::vector<unsigned char>& out, int v)
+{
+	unsigned int u = ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+	while (u >= 0x80)
+	{
+		out.push_back((unsigned char)(u | 0x80));
+		u >>= 7;
+	}
+	out.push_back((unsigned char)u);
+}
+
+static inline int DeformationCache_getVarint(const unsigned char*& in)
+{
+	unsigned int u = 0;
+	int shift = 0;
+	unsigned char c;
+	do
+	{
+		c = *in++;
+		u |= (unsigned int)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+// Quantized coordinates of the two previous frames, and the prediction of the next one
+struct DeformationCacheState
+{
+	std::vector<int> q1, q2;
+
+	void resize(int size) { q1.resize(size); q2.resize(size); }
+
+	// k is the index of the frame since the last keyframe
+	int predict(int i, int k) const
+	{
+		if (k == 0) return 0;
+		if (k == 1) return q1[i];
+		return 2*q1[i] - q2[i];
+	}
+};
+
+class DeformationCacheWriter
+{
+public:
+	DeformationCacheWriter() : d_nbFrames(0), d_fileSize(0) {}
+	~DeformationCacheWriter() { close(); }
+
+	// precision is the quantization step, keyInterval the number of frames between keyframes
+	bool open(const std::string& filename, const std::vector<int>& nbVertices, double timeStep, TReal precision, int keyInterval = 30);
+	bool isOpen() const { return d_out.is_open(); }
+	// One array of positions per mesh
+	void addFrame(const TCoord* const* positions);
+	void close();
+
+	int nbFrames() const { return d_nbFrames; }
+	unsigned long long fileSize() { return isOpen() ? (unsigned long long)d_out.tellp() : d_fileSize; }
+
+private:
+	std::ofstream d_out;
+	std::vector<int> d_nbVertices;
+	std::vector<DeformationCacheState> d_states;
+	std::vector<unsigned long long> d_offsets;
+	std::vector<unsigned char> d_buffer;
+	TReal d_invPrecision;
+	int d_keyInterval;
+	int d_nbFrames;
+	unsigned long long d_fileSize;
+};
+
+bool DeformationCacheWriter::open(const std::string& filename, const std::vector<int>& nbVertices, double timeStep, TReal precision, int keyInterval)
+{
+	close();
+	d_out.open(filename.c_str(), std::ios::binary);
+	if (!d_out)
+	{
+		std::cerr << "Cannot write to file " << filename << std::endl;
+		return false;
+	}
+	d_nbVertices = nbVertices;
+	d_states.resize(nbVertices.size());
+	for (unsigned int m = 0; m < nbVertices.size(); ++m)
+		d_states[m].resize(3*nbVertices[m]);
+	d_offsets.clear();
+	d_invPrecision = 1 / precision;
+	d_keyInterval = (keyInterval > 0) ? keyInterval : 1;
+	d_nbFrames = 0;
+
+	const int nbMeshes = nbVertices.size();
+	d_out.write(DeformationCache_magic, 4);
+	d_out.write((const char*)&DeformationCache_version, sizeof(int));
+	d_out.write((const char*)&nbMeshes, sizeof(int));
+	d_out.write((const char*)&d_keyInterval, sizeof(int));
+	d_out.write((const char*)&precision, sizeof(TReal));
+	d_out.write((const char*)&timeStep, sizeof(double));
+	if (nbMeshes) d_out.write((const char*)&nbVertices[0], nbMeshes*sizeof(int));
+	return true;
+}
+
+void DeformationCacheWriter::addFrame(const TCoord* const* positions)
+{
+	if (!isOpen()) return;
+	const int k = d_nbFrames % d_keyInterval;
+	d_buffer.clear();
+	for (unsigned int m = 0; m < d_nbVertices.size(); ++m)
+	{
+		DeformationCacheState& state = d_states[m];
+		const TReal* x = positions[m][0].ptr();
+		const int size = 3*d_nbVertices[m];
+		for (int i = 0; i < size; ++i)
+		{
+			const int q = (int)floor(x[i] * d_invPrecision + 0.5f);
+			DeformationCache_putVarint(d_buffer, q - state.predict(i, k));
+			state.q2[i] = state.q1[i];
+			state.q1[i] = q;
+		}
+	}
+	d_offsets.push_back((unsigned long long)d_out.tellp());
+	if (!d_buffer.empty())
+		d_out.write((const char*)&d_buffer[0], d_buffer.size());
+	++d_nbFrames;
+}
+
+void DeformationCacheWriter::close()
+{
+	if (!isOpen()) return;
+	const unsigned long long tableOffset = (unsigned long long)d_out.tellp();
+	if (d_nbFrames) d_out.write((const char*)&d_offsets[0], d_nbFrames*sizeof(unsigned long long));
+	d_out.write((const char*)&tableOffset, sizeof(tableOffset));
+	d_out.write((const char*)&d_nbFrames, sizeof(int));
+	d_out.write(DeformationCache_magic, 4);
+	d_fileSize = (unsigned long long)d_out.tellp();
+	d_out.close();
+}
+
+// Loads a whole cache in memory and decodes frames on request.
+// Reading the frames in order decodes each one from the previous, other
+// frames are decoded from the preceding keyframe.
+class DeformationCacheReader
+{
+public:
+	DeformationCacheReader() : d_nbFrames(0), d_frame(-1) {}
+
+	bool open(const std::string& filename);
+
+	int nbFrames() const { return d_nbFrames; }
+	int nbMeshes() const { return d_nbVertices.size(); }
+	int nbVertices(int mesh) const { return d_nbVertices[mesh]; }
+	double timeStep() const { return d_timeStep; }
+	// Frame to show at the given time, clamped to the recorded frames
+	int frameAt(double time) const;
+
+	// Decode a frame, then its positions are given by positions()
+	bool readFrame(int frame);
+	const TCoord* positions(int mesh) const { return &d_positions[mesh][0]; }
+
+private:
+	void decode(int frame);
+
+	std::vector<unsigned char> d_data;
+	std::vector<unsigned long long> d_offsets;
+	std::vector<int> d_nbVertices;
+	std::vector<DeformationCacheState> d_states;
+	std::vector<std::vector<TCoord> > d_positions;
+	TReal d_precision;
+	double d_timeStep;
+	int d_keyInterval;
+	int d_nbFrames;
+	int d_frame; // last decoded frame
+};
+
+bool DeformationCacheReader::open(const std::string& filename)
+{
+	d_nbFrames = 0;
+	d_frame = -1;
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "Cannot open file " << filename << std::endl;
+		return false;
+	}
+	in.seekg(0, std::ios::end);
+	const unsigned long long size = (unsigned long long)in.tellg();
+	in.seekg(0, std::ios::beg);
+	d_data.resize(size);
+	if (size) in.read((char*)&d_data[0], size);
+
+	const int headerSize = 4 + 3*sizeof(int) + sizeof(TReal) + sizeof(double);
+	const int trailerSize = sizeof(unsigned long long) + sizeof(int) + 4;
+	if (!in || size < (unsigned long long)(headerSize + trailerSize)
+		|| memcmp(&d_data[0], DeformationCache_magic, 4) || memcmp(&d_data[size-4], DeformationCache_magic, 4))
+	{
+		std::cerr << "ERROR: file " << filename << " is not a deformation cache" << std::endl;
+		return false;
+	}
+	const unsigned char* p = &d_data[4];
+	int version, nbMeshes;
+	memcpy(&version, p, sizeof(int)); p += sizeof(int);
+	memcpy(&nbMeshes, p, sizeof(int)); p += sizeof(int);
+	memcpy(&d_keyInterval, p, sizeof(int)); p += sizeof(int);
+	memcpy(&d_precision, p, sizeof(TReal)); p += sizeof(TReal);
+	memcpy(&d_timeStep, p, sizeof(double)); p += sizeof(double);
+	if (version != DeformationCache_version)
+	{
+		std::cerr << "ERROR: file " << filename << " has version " << version << " instead of " << DeformationCache_version << std::endl;
+		return false;
+	}
+	// the sizes read from the file are checked against its size before they are used
+	const unsigned long long dataEnd = size - trailerSize;
+	if (nbMeshes < 0 || d_keyInterval <= 0 || headerSize + (unsigned long long)nbMeshes*sizeof(int) > dataEnd)
+	{
+		std::cerr << "ERROR: file " << filename << " has a corrupted header" << std::endl;
+		return false;
+	}
+	d_nbVertices.resize(nbMeshes);
+	if (nbMeshes) memcpy(&d_nbVertices[0], p, nbMeshes*sizeof(int));
+	const unsigned long long framesBegin = headerSize + (unsigned long long)nbMeshes*sizeof(int);
+	unsigned long long nbCoords = 0;
+	for (int m = 0; m < nbMeshes; ++m)
+	{
+		if (d_nbVertices[m] < 0)
+		{
+			std::cerr << "ERROR: file " << filename << " has a corrupted header" << std::endl;
+			return false;
+		}
+		nbCoords += 3ULL*d_nbVertices[m];
+	}
+
+	unsigned long long tableOffset;
+	int nbFrames;
+	memcpy(&tableOffset, &d_data[dataEnd], sizeof(tableOffset));
+	memcpy(&nbFrames, &d_data[dataEnd+sizeof(tableOffset)], sizeof(int));
+	// the table lies between the frames and the trailer, and each coordinate takes at least one byte in a frame
+	if (nbFrames < 0 || tableOffset < framesBegin || tableOffset > dataEnd
+		|| (unsigned long long)nbFrames*sizeof(unsigned long long) > dataEnd - tableOffset
+		|| (nbFrames && nbCoords > (tableOffset - framesBegin) / nbFrames))
+	{
+		std::cerr << "ERROR: file " << filename << " has a corrupted frame table" << std::endl;
+		return false;
+	}
+	d_offsets.resize(nbFrames);
+	if (nbFrames) memcpy(&d_offsets[0], &d_data[tableOffset], nbFrames*sizeof(unsigned long long));
+	for (int f = 0; f < nbFrames; ++f)
+		if (d_offsets[f] < framesBegin || d_offsets[f] > tableOffset || tableOffset - d_offsets[f] < nbCoords)
+		{
+			std::cerr << "ERROR: file " << filename << " has a corrupted offset for frame " << f << std::endl;
+			return false;
+		}
+
+	d_states.resize(nbMeshes);
+	d_positions.resize(nbMeshes);
+	for (int m = 0; m < nbMeshes; ++m)
+	{
+		d_states[m].resize(3*d_nbVertices[m]);
+		d_positions[m].resize(d_nbVertices[m]);
+	}
+	d_nbFrames = nbFrames;
+	return true;
+}
+
+int DeformationCacheReader::frameAt(double time) const
+{
+	int frame = (int)floor(time / d_timeStep + 0.5);
+	if (frame >= d_nbFrames) frame = d_nbFrames-1;
+	if (frame < 0) frame = 0;
+	return frame;
+}
+
+bool DeformationCacheReader::readFrame(int frame)
+{
+	if (frame < 0 || frame >= d_nbFrames) return false;
+	if (frame == d_frame) return true;
+	int start = frame - frame % d_keyInterval;
+	if (d_frame >= start && d_frame < frame)
+		start = d_frame + 1;
+	for (int f = start; f <= frame; ++f)
+		decode(f);
+	d_frame = frame;
+
+	for (unsigned int m = 0; m < d_states.size(); ++m)
+	{
+		const int* q = &d_states[m].q1[0];
+		TReal* x = d_positions[m][0].ptr();
+		const int size = 3*d_nbVertices[m];
+		for (int i = 0; i < size; ++i)
+			x[i] = q[i] * d_precision;
+	}
+	return true;
+}
+
+void DeformationCacheReader::decode(int frame)
+{
+	const int k = frame % d_keyInterval;
+	const unsigned char* p = &d_data[d_offsets[frame]];
+	for (unsigned int m = 0; m < d_states.size(); ++m)
+	{
+		DeformationCacheState& state = d_states[m];
+		const int size = 3*d_nbVertices[m];
+		for (int i = 0; i < size; ++i)
+		{
+			const int q = state.predict(i, k) + DeformationCache_getVarint(p);
+			state.q2[i] = state.q1[i];
+			state.q1[i] = q;
+		}
+	}
+}
+
+#endif // DeformationCache_h__
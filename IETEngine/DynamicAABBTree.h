@@ -0,0 +1,502 @@
+#ifndef DynamicAABBTree_h__
+#define DynamicAABBTree_h__
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <limits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "SweepAndPrune.h"
+
+namespace Physics
+{
+	using namespace std;
+
+	/*
+	* Bounding volume hierarchy of the boxes of bodies 0..n-1, kept up to date
+	* between the frames.
+	* The leaves hold fattened boxes: the box of the body grown by a margin
+	* relative to its size, and extended along its predicted displacement. A
+	* body is only reinserted when its box leaves its fat box, or when the fat
+	* box became much larger than needed. Insertions choose the sibling with
+	* the surface area heuristic, and the ancestors are rotated to keep the
+	* heights of the children within 1 of each other.
+	* The pairs of overlapping fat boxes are kept between the updates, and only
+	* the reinserted bodies query the tree again, so a frame without
+	* reinsertion only tests the exact boxes of these pairs.
+	* Unlike the sweep and prune, the cost does not depend on the differences of
+	* sizes between the bodies, nor on how far they move.
+	*/
+	class DynamicAABBTree
+	{
+	public:
+		// margin: fraction of the size of each box, velocity_factor: number of predicted displacements in the fat box
+		DynamicAABBTree(float margin = 0.2f, float velocity_factor = 4.0f);
+
+		// Boxes of the bodies 0..n-1 and their predicted displacement until the next update (may be NULL)
+		void		Update(const vector<glm::vec3>& mins, const vector<glm::vec3>& maxs, const vector<glm::vec3>* displacements);
+
+		// Pairs (i < j) of bodies whose boxes overlap (closed intervals), sorted.
+		// The candidates are the pairs of overlapping fat boxes, tested in an OpenMP loop.
+		void		Find_Pairs(vector<pair<int,int>>& pairs);
+		// Bodies whose box overlaps the given one
+		void		Query_Box(glm::vec3 const& min, glm::vec3 const& max, vector<int>& bodies) const;
+		// Bodies whose box is hit by origin + t * direction for t in [0, max_t], sorted by entry t
+		void		Ray_Cast(glm::vec3 const& origin, glm::vec3 const& direction, float max_t, vector<pair<float,int>>& hits) const;
+
+		int			Size() const { return d_leaf.size(); }
+		int			Height() const { return d_root < 0 ? 0 : d_nodes[d_root].height; }
+		// Bodies reinserted by the last update
+		int			Reinsertions() const { return d_reinsertions; }
+
+	private:
+		struct Node
+		{
+			glm::vec3	min;
+			glm::vec3	max;
+			int			parent; // next free node when not used
+			int			child1;
+			int			child2;
+			int			height; // 0 for a leaf, -1 when not used
+			int			body;
+
+			bool		Is_Leaf() const { return child1 < 0; }
+		};
+
+		float					d_margin;
+		float					d_velocity_factor;
+		vector<Node>			d_nodes;
+		int						d_root;
+		int						d_free;
+		vector<int>				d_leaf;	// leaf of each body
+		vector<glm::vec3>		d_min;	// exact boxes of the bodies
+		vector<glm::vec3>		d_max;
+		int						d_reinsertions;
+		vector<vector<int>>		d_neighbors;	// bodies whose fat box overlaps the one of each body
+		vector<int>				d_moved;		// bodies reinserted by the last update
+		vector<char>			d_is_moved;
+		vector<vector<pair<int,int>>>	d_thread_pairs;
+		vector<vector<int>>		d_thread_stacks;
+
+		int			allocateNode();
+		void		freeNode(int node);
+		void		insertLeaf(int leaf);
+		void		removeLeaf(int leaf);
+		int			balance(int a);
+		void		refit(int node);
+		void		fatBox(int body, const glm::vec3* displacement, glm::vec3& min, glm::vec3& max) const;
+		void		unlink(int body);
+		void		updateNeighbors();
+
+		static float area(glm::vec3 const& min, glm::vec3 const& max);
+		static bool	overlaps(glm::vec3 const& min1, glm::vec3 const& max1, glm::vec3 const& min2, glm::vec3 const& max2);
+		static bool	contains(glm::vec3 const& outer_min, glm::vec3 const& outer_max, glm::vec3 const& min, glm::vec3 const& max);
+		// Entry t of the ray in the box, or a negative value if it misses it within [0, max_t]
+		static float rayBox(glm::vec3 const& origin, glm::vec3 const& inv_direction, float max_t, glm::vec3 const& min, glm::vec3 const& max);
+	};
+
+	inline DynamicAABBTree::DynamicAABBTree(float margin, float velocity_factor)
+		: d_margin(margin),
+		d_velocity_factor(velocity_factor),
+		d_root(-1),
+		d_free(-1),
+		d_reinsertions(0)
+	{
+	}
+
+	inline float DynamicAABBTree::area(glm::vec3 const& min, glm::vec3 const& max)
+	{
+		glm::vec3 d = max - min;
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	inline bool DynamicAABBTree::overlaps(glm::vec3 const& min1, glm::vec3 const& max1, glm::vec3 const& min2, glm::vec3 const& max2)
+	{
+		return min1.x <= max2.x && min2.x <= max1.x
+			&& min1.y <= max2.y && min2.y <= max1.y
+			&& min1.z <= max2.z && min2.z <= max1.z;
+	}
+
+	inline bool DynamicAABBTree::contains(glm::vec3 const& outer_min, glm::vec3 const& outer_max, glm::vec3 const& min, glm::vec3 const& max)
+	{
+		return outer_min.x <= min.x && outer_min.y <= min.y && outer_min.z <= min.z
+			&& max.x <= outer_max.x && max.y <= outer_max.y && max.z <= outer_max.z;
+	}
+
+	inline float DynamicAABBTree::rayBox(glm::vec3 const& origin, glm::vec3 const& inv_direction, float max_t, glm::vec3 const& min, glm::vec3 const& max)
+	{
+		float t_min = 0.0f, t_max = max_t;
+		for (int a = 0; a < 3; ++a)
+		{
+			float t1 = (min[a] - origin[a]) * inv_direction[a];
+			float t2 = (max[a] - origin[a]) * inv_direction[a];
+			// a ray parallel to the slab gives nan when starting on its border, and +-inf otherwise
+			if (t1 != t1 || t2 != t2) continue;
+			if (t1 > t2) swap(t1,t2);
+			t_min = glm::max(t_min, t1);
+			t_max = glm::min(t_max, t2);
+			if (t_min > t_max) return -1.0f;
+		}
+		return t_min;
+	}
+
+	inline int DynamicAABBTree::allocateNode()
+	{
+		if (d_free < 0)
+		{
+			d_nodes.push_back(Node());
+			d_nodes.back().parent = -1;
+			d_free = d_nodes.size() - 1;
+		}
+		const int node = d_free;
+		d_free = d_nodes[node].parent;
+		Node& n = d_nodes[node];
+		n.parent = n.child1 = n.child2 = -1;
+		n.height = 0;
+		n.body = -1;
+		return node;
+	}
+
+	inline void DynamicAABBTree::freeNode(int node)
+	{
+		d_nodes[node].parent = d_free;
+		d_nodes[node].height = -1;
+		d_free = node;
+	}
+
+	inline void DynamicAABBTree::refit(int node)
+	{
+		Node& n = d_nodes[node];
+		const Node& c1 = d_nodes[n.child1];
+		const Node& c2 = d_nodes[n.child2];
+		n.min = glm::min(c1.min, c2.min);
+		n.max = glm::max(c1.max, c2.max);
+		n.height = 1 + max(c1.height, c2.height);
+	}
+
+	// Rotate the higher child of a up if the heights of the children differ by more than 1, returns the new root of the subtree
+	inline int DynamicAABBTree::balance(int a)
+	{
+		if (d_nodes[a].Is_Leaf() || d_nodes[a].height < 2) return a;
+		const int b = d_nodes[a].child1;
+		const int c = d_nodes[a].child2;
+		const int difference = d_nodes[c].height - d_nodes[b].height;
+		if (difference >= -1 && difference <= 1) return a;
+
+		// the higher child replaces a
+		const int up = (difference > 1) ? c : b;
+		const int f = d_nodes[up].child1;
+		const int g = d_nodes[up].child2;
+
+		d_nodes[up].child1 = a;
+		d_nodes[up].parent = d_nodes[a].parent;
+		d_nodes[a].parent = up;
+		const int parent = d_nodes[up].parent;
+		if (parent < 0)
+			d_root = up;
+		else if (d_nodes[parent].child1 == a)
+			d_nodes[parent].child1 = up;
+		else
+			d_nodes[parent].child2 = up;
+
+		// the higher child of up stays, the other one goes under a in place of up
+		const int stays = (d_nodes[f].height > d_nodes[g].height) ? f : g;
+		const int moves = (stays == f) ? g : f;
+		d_nodes[up].child2 = stays;
+		if (difference > 1)
+			d_nodes[a].child2 = moves;
+		else
+			d_nodes[a].child1 = moves;
+		d_nodes[moves].parent = a;
+
+		refit(a);
+		refit(up);
+		return up;
+	}
+
+	inline void DynamicAABBTree::insertLeaf(int leaf)
+	{
+		if (d_root < 0)
+		{
+			d_root = leaf;
+			d_nodes[leaf].parent = -1;
+			return;
+		}
+
+		// find the sibling which increases the total area of the tree the least
+		const glm::vec3 leaf_min = d_nodes[leaf].min, leaf_max = d_nodes[leaf].max;
+		int index = d_root;
+		while (!d_nodes[index].Is_Leaf())
+		{
+			const Node& node = d_nodes[index];
+			const float node_area = area(node.min, node.max);
+			const float combined_area = area(glm::min(node.min, leaf_min), glm::max(node.max, leaf_max));
+			// a new parent of node and leaf
+			const float cost = 2.0f * combined_area;
+			// growing node, paid by every level below
+			const float inheritance_cost = 2.0f * (combined_area - node_area);
+
+			float child_cost[2];
+			const int children[2] = { node.child1, node.child2 };
+			for (int k = 0; k < 2; ++k)
+			{
+				const Node& child = d_nodes[children[k]];
+				const float grown = area(glm::min(child.min, leaf_min), glm::max(child.max, leaf_max));
+				child_cost[k] = (child.Is_Leaf() ? grown : grown - area(child.min, child.max)) + inheritance_cost;
+			}
+			if (cost < child_cost[0] && cost < child_cost[1]) break;
+			index = (child_cost[0] < child_cost[1]) ? children[0] : children[1];
+		}
+		const int sibling = index;
+
+		const int old_parent = d_nodes[sibling].parent;
+		const int new_parent = allocateNode();
+		d_nodes[new_parent].parent = old_parent;
+		d_nodes[new_parent].child1 = sibling;
+		d_nodes[new_parent].child2 = leaf;
+		d_nodes[sibling].parent = new_parent;
+		d_nodes[leaf].parent = new_parent;
+		if (old_parent < 0)
+			d_root = new_parent;
+		else if (d_nodes[old_parent].child1 == sibling)
+			d_nodes[old_parent].child1 = new_parent;
+		else
+			d_nodes[old_parent].child2 = new_parent;
+
+		for (index = new_parent; index >= 0; index = d_nodes[index].parent)
+		{
+			refit(index);
+			index = balance(index);
+		}
+	}
+
+	inline void DynamicAABBTree::removeLeaf(int leaf)
+	{
+		if (leaf == d_root)
+		{
+			d_root = -1;
+			return;
+		}
+		const int parent = d_nodes[leaf].parent;
+		const int grand_parent = d_nodes[parent].parent;
+		const int sibling = (d_nodes[parent].child1 == leaf) ? d_nodes[parent].child2 : d_nodes[parent].child1;
+		freeNode(parent);
+		d_nodes[sibling].parent = grand_parent;
+		if (grand_parent < 0)
+		{
+			d_root = sibling;
+			return;
+		}
+		if (d_nodes[grand_parent].child1 == parent)
+			d_nodes[grand_parent].child1 = sibling;
+		else
+			d_nodes[grand_parent].child2 = sibling;
+		for (int index = grand_parent; index >= 0; index = d_nodes[index].parent)
+		{
+			refit(index);
+			index = balance(index);
+		}
+	}
+
+	inline void DynamicAABBTree::fatBox(int body, const glm::vec3* displacement, glm::vec3& min, glm::vec3& max) const
+	{
+		const glm::vec3 margin = (d_max[body] - d_min[body]) * d_margin;
+		min = d_min[body] - margin;
+		max = d_max[body] + margin;
+		if (!displacement) return;
+		const glm::vec3 d = *displacement * d_velocity_factor;
+		min += glm::min(d, glm::vec3(0.0f));
+		max += glm::max(d, glm::vec3(0.0f));
+	}
+
+	inline void DynamicAABBTree::Update(const vector<glm::vec3>& mins, const vector<glm::vec3>& maxs, const vector<glm::vec3>* displacements)
+	{
+		const int n = mins.size();
+		d_reinsertions = 0;
+		d_moved.clear();
+		while ((int)d_leaf.size() > n)
+		{
+			unlink(d_leaf.size() - 1);
+			removeLeaf(d_leaf.back());
+			freeNode(d_leaf.back());
+			d_leaf.pop_back();
+		}
+		d_neighbors.resize(n);
+		d_is_moved.assign(n, 0);
+		d_min.assign(mins.begin(), mins.end());
+		d_max.assign(maxs.begin(), maxs.end());
+
+		glm::vec3 fat_min, fat_max;
+		for (int i = 0; i < n; ++i)
+		{
+			fatBox(i, displacements ? &(*displacements)[i] : NULL, fat_min, fat_max);
+			if (i >= (int)d_leaf.size())
+			{
+				const int leaf = allocateNode();
+				d_nodes[leaf].body = i;
+				d_nodes[leaf].min = fat_min;
+				d_nodes[leaf].max = fat_max;
+				d_leaf.push_back(leaf);
+				insertLeaf(leaf);
+				d_moved.push_back(i);
+				continue;
+			}
+			const int leaf = d_leaf[i];
+			if (contains(d_nodes[leaf].min, d_nodes[leaf].max, d_min[i], d_max[i]))
+			{
+				// still inside, unless the fat box is much larger than needed (a fast body stopped)
+				const glm::vec3 slack = (d_max[i] - d_min[i]) * (4.0f * d_margin);
+				if (contains(fat_min - slack, fat_max + slack, d_nodes[leaf].min, d_nodes[leaf].max)) continue;
+			}
+			removeLeaf(leaf);
+			d_nodes[leaf].min = fat_min;
+			d_nodes[leaf].max = fat_max;
+			insertLeaf(leaf);
+			unlink(i);
+			d_moved.push_back(i);
+			++d_reinsertions;
+		}
+		updateNeighbors();
+	}
+
+	inline void DynamicAABBTree::unlink(int body)
+	{
+		for (auto other : d_neighbors[body])
+		{
+			vector<int>& others = d_neighbors[other];
+			others.erase(find(others.begin(), others.end(), body));
+		}
+		d_neighbors[body].clear();
+	}
+
+	// The moved bodies query the tree with their fat box
+	inline void DynamicAABBTree::updateNeighbors()
+	{
+		const int nbMoved = d_moved.size();
+		for (int m = 0; m < nbMoved; ++m)
+			d_is_moved[d_moved[m]] = 1;
+		int nbThreads = 1;
+#ifdef _OPENMP
+		nbThreads = omp_get_max_threads();
+#endif
+		d_thread_pairs.resize(nbThreads);
+		d_thread_stacks.resize(nbThreads);
+		#pragma omp parallel
+		{
+			int thread = 0;
+#ifdef _OPENMP
+			thread = omp_get_thread_num();
+#endif
+			vector<pair<int,int>>& local = d_thread_pairs[thread];
+			vector<int>& stack = d_thread_stacks[thread];
+			local.clear();
+			#pragma omp for schedule(dynamic,16)
+			for (int m = 0; m < nbMoved; ++m)
+			{
+				const int i = d_moved[m];
+				const Node& leaf = d_nodes[d_leaf[i]];
+				stack.assign(1, d_root);
+				while (!stack.empty())
+				{
+					const Node& node = d_nodes[stack.back()];
+					stack.pop_back();
+					if (!overlaps(node.min, node.max, leaf.min, leaf.max)) continue;
+					if (node.Is_Leaf())
+					{
+						// two moved bodies find each other, the pair is kept by the lower one
+						if (node.body != i && !(d_is_moved[node.body] && node.body < i))
+							local.push_back(make_pair(i, node.body));
+						continue;
+					}
+					stack.push_back(node.child1);
+					stack.push_back(node.child2);
+				}
+			}
+		}
+		for (int t = 0; t < nbThreads; ++t)
+			for (auto p : d_thread_pairs[t])
+			{
+				d_neighbors[p.first].push_back(p.second);
+				d_neighbors[p.second].push_back(p.first);
+			}
+	}
+
+	inline void DynamicAABBTree::Query_Box(glm::vec3 const& min, glm::vec3 const& max, vector<int>& bodies) const
+	{
+		bodies.clear();
+		if (d_root < 0) return;
+		vector<int> stack(1, d_root);
+		while (!stack.empty())
+		{
+			const Node& node = d_nodes[stack.back()];
+			stack.pop_back();
+			if (!overlaps(node.min, node.max, min, max)) continue;
+			if (node.Is_Leaf())
+			{
+				if (overlaps(d_min[node.body], d_max[node.body], min, max))
+					bodies.push_back(node.body);
+				continue;
+			}
+			stack.push_back(node.child1);
+			stack.push_back(node.child2);
+		}
+	}
+
+	inline void DynamicAABBTree::Ray_Cast(glm::vec3 const& origin, glm::vec3 const& direction, float max_t, vector<pair<float,int>>& hits) const
+	{
+		hits.clear();
+		if (d_root < 0) return;
+		const glm::vec3 inv_direction = 1.0f / direction;
+		vector<int> stack(1, d_root);
+		while (!stack.empty())
+		{
+			const Node& node = d_nodes[stack.back()];
+			stack.pop_back();
+			if (rayBox(origin, inv_direction, max_t, node.min, node.max) < 0.0f) continue;
+			if (node.Is_Leaf())
+			{
+				const float t = rayBox(origin, inv_direction, max_t, d_min[node.body], d_max[node.body]);
+				if (t >= 0.0f) hits.push_back(make_pair(t, node.body));
+				continue;
+			}
+			stack.push_back(node.child1);
+			stack.push_back(node.child2);
+		}
+		sort(hits.begin(), hits.end());
+	}
+
+	inline void DynamicAABBTree::Find_Pairs(vector<pair<int,int>>& pairs)
+	{
+		pairs.clear();
+		const int n = d_leaf.size();
+		int nbThreads = 1;
+#ifdef _OPENMP
+		nbThreads = omp_get_max_threads();
+#endif
+		d_thread_pairs.resize(nbThreads);
+		#pragma omp parallel
+		{
+			int thread = 0;
+#ifdef _OPENMP
+			thread = omp_get_thread_num();
+#endif
+			vector<pair<int,int>>& local = d_thread_pairs[thread];
+			local.clear();
+			#pragma omp for schedule(dynamic,64)
+			for (int i = 0; i < n; ++i)
+				for (auto j : d_neighbors[i])
+					if (j > i && overlaps(d_min[i], d_max[i], d_min[j], d_max[j]))
+						local.push_back(make_pair(i, j));
+		}
+		for (int t = 0; t < nbThreads; ++t)
+			pairs.insert(pairs.end(), d_thread_pairs[t].begin(), d_thread_pairs[t].end());
+		sort(pairs.begin(), pairs.end());
+	}
+}
+
+#endif // DynamicAABBTree_h__
@@ -3,7 +3,11 @@
 
 #include "common.h"
 #include "GPU.h"
+#include "ColliderSet.h"
+#include "SurfaceCollision.h"
+#include "FEMSnapshot.h"
 #include <iostream>
+#include <map>
 #include "SimulationParameters.h"
 #include <mesh/write_mesh_obj.h>
  
@@ -20,67 +24,99 @@ struct FEMMesh
 	TVecDeriv velocity;
 	TVecCoord positions0; // rest positions
 
-	// Description of external forces
-	// In a real application, this could be extended to a different force for each particle
-	struct ExternalForce
-	{
-		int index;
-		TDeriv value;
-	};
-	ExternalForce externalForce;
+	// Description of external forces, applied as one batch at each step
+	MyVector(GPUExternalForce<TReal>) externalForces;
 
 	// Description of constraints
+	// Fixed particles are stored as a bitmask, tested by the integration and
+	// merged CG kernels, and as a list of indices for the indexed projection.
+	// Each fixed particle follows its target position (its rest or current
+	// position unless moved with setFixedTargets).
 	int nbFixedParticles;
 	MyVector(int) fixedParticles;
 	MyVector(unsigned int) fixedMask;
-	
-
-	// Internal data and methods for simulation
-	TVecDeriv f; // force vector when using Euler explicit
-	TVecDeriv a,b; // solution and right-hand term when calling CG solver
-	TVecDeriv r,d,q; // temporary vectors used by CG solver
-#ifdef PARALLEL_REDUCTION
-	TVecReal dottmp; // temporary buffer for dot product reductions
-#endif
+	MyVector(TCoord) fixedTargets;
 
-	// PlaneForceField
-	GPUPlane<TReal> plane;
-	TVecReal planePenetration;
+	// Internal data and methods for simulation (the temporaries of a step are in SolverWorkspace)
+	TVecDeriv a; // solution of the CG solver, or acceleration when using Euler explicit
 
-	// SphereForceField
-	GPUSphere<TReal> sphere;
-	TVecReal spherePenetration;
+	// ColliderForceField
+	ColliderSet colliders;
+	int planeCollider, sphereCollider; // colliders driven by the simulation parameters, -1 if disabled
+	MyVector(int) surfacePoints; // particles on the boundary of the mesh, the only ones tested against colliders
+	MyVector(GPUContact<TReal>) contacts; // deepest contact of each surface particle
+
+	// Self-collision and triangle mesh colliders
+	SurfaceCollision surfaceCollision;
+	MyVector(GPUContact<TReal>) surfaceContacts; // deepest surface contact of each surface particle
 
 	// TetrahedronFEMForceField
 	MyVector(GPUElement<TReal>) femElem;
 	MyVector(GPUElementRotation<TReal>) femElemRotation;
 #ifdef PARALLEL_GATHER
 	// data for parallel gather operation
-	MyVector(GPUElementForce<TReal>) femElemForce;
 	int nbElemPerVertex;
 	MyVector(int) femVElems;
 #endif
 
-#ifdef USE_VEC4
-	MyVector(TCoord4) x4,dx4;
-#endif
+	// Largest time step for which explicit integration stays stable (CFL bound
+	// over all elements, computed in init)
+	TReal stableTimeStep;
 
 	bool isFixedParticle(int index) const;
 	void addFixedParticle(int index);
 	void removeFixedParticle(int index);
+	// Bulk versions, each particle costs O(1)
+	void addFixedParticles(const int* indices, int nbIndices);
+	void removeFixedParticles(const int* indices, int nbIndices);
+	void addFixedRange(int begin, int end);
+	void removeFixedRange(int begin, int end);
+	void clearFixedParticles();
+	// Kinematic targets, the particles are fixed if they were not
+	void setFixedTargets(const int* indices, const TCoord* targets, int nbIndices);
 
 	void reorder();
+	void initSurface();
+#ifdef PARALLEL_GATHER
+	void initGather();
+#endif
 
 	void init(SimulationParameters* params);
 	void update(SimulationParameters* params);
 
+	// Replace the external forces by a batch of forces on particles, or on
+	// surface triangles at the given barycentric coordinates (2 per force)
+	void setExternalForces(int nbForces, const int* indices, const TDeriv* forces);
+	void setSurfaceForces(int nbForces, const int* triangleIndices, const TReal* bary, const TDeriv* forces);
+	void addExternalForce(int index, const TDeriv& force);
+	void clearExternalForces() { externalForces.clear(); }
+
 	void setPushRandomForce(TDeriv pushForce);
 	void reset();
 	void setPushForce(SimulationParameters* params);
 
+	// Topology changes (cutting and tearing)
+	// The FEM elements, gather table, surface triangles and surface points are
+	// patched in place instead of calling init again. Tetrahedra are removed by
+	// moving the last one in their slot: tetrahedronRenumber gives the new index
+	// of each tetrahedron from before the last change (-1 if it was removed).
+	std::vector<int> tetrahedronRenumber;
+	// Remove the given tetrahedra, returns the number removed
+	int removeTetrahedra(const std::vector<int>& indices);
+	// Separate the tetrahedra on each side of the plane, within radius of center,
+	// by duplicating their shared particles; returns the number of new particles
+	int cut(const TCoord& center, const TDeriv& normal, TReal radius);
+	// Remove the tetrahedra with an edge stretched more than maxStretch times its rest length
+	int tear(TReal maxStretch);
+
 	bool save(const std::string& filename);
 	bool load(const std::string& filename);
 
+	// Binary state, see FEMSnapshot
+	void captureSnapshot(FEMSnapshot& s, double time);
+	// Fails if the snapshot was captured before a topology change
+	bool restoreSnapshot(const FEMSnapshot& s);
+
 	TReal tetraYoungModulus(int index, SimulationParameters* params)
 	{
 		const TReal youngModulusTop = (TReal)params->youngModulusTop;
@@ -101,29 +137,48 @@ struct FEMMesh
 	FEMMesh()
 	{
 		nbFixedParticles = 0;
-		externalForce.index = -1;
-		plane.normal_x = 0;
-		plane.normal_y = 1;
-		plane.normal_z = 0;
-		plane.d = 0;
-		plane.stiffness = 0;
-		plane.damping = 0;
-		sphere.center_x = 0;
-		sphere.center_y = 0;
-		sphere.center_z = 0;
-		sphere.velocity_x = 0;
-		sphere.velocity_y = 0;
-		sphere.velocity_z = 0;
-		sphere.radius = 0;
-		sphere.stiffness = 0;
-		sphere.damping = 0;
+		stableTimeStep = 0;
+		planeCollider = -1;
+		sphereCollider = -1;
 #ifdef PARALLEL_GATHER
 		nbElemPerVertex = 0;
+		d_gatherFull = false;
 #endif
 	}
 
 	private:
 		double d_simulationSize;
+		std::vector<int> d_fixedIndex; // position of each particle in fixedParticles, -1 if free
+
+		// a face as its three sorted particle indices
+		typedef std::pair<std::pair<unsigned int, unsigned int>, unsigned int> TFace;
+		// tetrahedron faces (4*tetra+j, j the opposite corner) on each side of each face, -1 if none
+		std::map<TFace, std::pair<int,int> > d_faceTetras;
+		// index in triangles of each surface triangle
+		std::map<TFace, int> d_surfaceTriangles;
+		std::vector<int> d_vertexNbElems;
+		std::vector<bool> d_onSurface;
+
+		static TFace faceKey(unsigned int a, unsigned int b, unsigned int c);
+		TFace tetraFace(int e, int j) const;
+		TTriangle boundaryTriangle(int e, int j) const;
+		void addSurfaceTriangle(int e, int j);
+		void removeSurfaceTriangle(const TFace& face);
+		void attachFace(int e, int j);
+		void detachFace(int e, int j);
+		void removeTetrahedron(int e);
+		void setTetrahedronVertex(int e, int j, int p);
+		void copyElement(int from, int to);
+		int addParticle(int from);
+		void endTopologyChange(const std::vector<int>& origin, int nbOld);
+#ifdef PARALLEL_GATHER
+		bool d_gatherFull; // a particle outgrew its list, the table must be rebuilt
+		int gatherSize(int nbp) const;
+		int gatherSlot(int p, int num) const;
+		void addGather(int p, int value);
+		void removeGather(int p, int value);
+		void replaceGather(int p, int oldValue, int newValue);
+#endif
 };
 
 
@@ -178,28 +233,32 @@ bool FEMMesh::isFixedParticle(int index) const
 {
 	if (nbFixedParticles == 0) return false;
 	// we use a bitmask instead of a indices vector to more easily search for the particle
-	if (fixedMask.empty()) return false;
 	int mi = index / 32;
 	int mb = index % 32;
-	if (fixedMask[mi] & (1 << mb)) return true;
+	if (mi >= (int)fixedMask.size()) return false;
+	if (fixedMask[mi] & (1u << mb)) return true;
 	return false;
-
-	//for (unsigned int i=0;i<fixedParticles.size();++i)
-	//    if (fixedParticles[i] == index) return true;
-	//return false;
 }
 
 void FEMMesh::addFixedParticle(int index)
 {
 	// for merged kernels we use a bitmask instead of a indices vector
-	if (fixedMask.empty())
-		fixedMask.resize((positions.size()+31) / 32);
+	const int nbp = positions.size();
+	if ((int)fixedMask.size() < (nbp+31) / 32)
+		fixedMask.resize((nbp+31) / 32);
+	if ((int)d_fixedIndex.size() < nbp)
+	{
+		d_fixedIndex.resize(nbp, -1);
+		fixedTargets.resize(nbp);
+	}
 	int mi = index / 32;
 	int mb = index % 32;
-	if (fixedMask[mi] & (1 << mb)) return; // already fixed
-	fixedMask[mi] |= (1 << mb);
+	if (fixedMask[mi] & (1u << mb)) return; // already fixed
+	fixedMask[mi] |= (1u << mb);
+	fixedTargets[index] = positions[index];
 
 	// for standard kernels we use an indices vector
+	d_fixedIndex[index] = fixedParticles.size();
 	fixedParticles.push_back(index);
 
 	++nbFixedParticles;
@@ -207,28 +266,69 @@ void FEMMesh::addFixedParticle(int index)
 
 void FEMMesh::removeFixedParticle(int index)
 {
+	if (!isFixedParticle(index)) return;
 	// for merged kernels we use a bitmask instead of a indices vector
-	if (fixedMask.empty()) return;
 	int mi = index / 32;
 	int mb = index % 32;
-	if (!(fixedMask[mi] & (1 << mb))) return; // not fixed
-	fixedMask[mi] &= ~(1 << mb);
+	fixedMask[mi] &= ~(1u << mb);
 
-	// for standard kernels we use an indices vector
-	unsigned int i;
-	for (i=0;i<fixedParticles.size();++i)
-		if (fixedParticles[i] == index) break;
-	if (i < fixedParticles.size())
+	// for standard kernels we use an indices vector, the last index is moved in the freed slot
+	const int i = d_fixedIndex[index];
+	const int last = fixedParticles.size()-1;
+	if (i < last)
 	{
-		if (i < fixedParticles.size()-1) // move to last
-			fixedParticles[i] = fixedParticles[fixedParticles.size()-1];
-		// and remove last
-		fixedParticles.resize(fixedParticles.size()-1);
+		const int moved = fixedParticles[last];
+		fixedParticles[i] = moved;
+		d_fixedIndex[moved] = i;
 	}
+	fixedParticles.resize(last);
+	d_fixedIndex[index] = -1;
 
 	--nbFixedParticles;
 }
 
+void FEMMesh::addFixedParticles(const int* indices, int nbIndices)
+{
+	for (int i = 0; i < nbIndices; ++i)
+		addFixedParticle(indices[i]);
+}
+
+void FEMMesh::removeFixedParticles(const int* indices, int nbIndices)
+{
+	for (int i = 0; i < nbIndices; ++i)
+		removeFixedParticle(indices[i]);
+}
+
+void FEMMesh::addFixedRange(int begin, int end)
+{
+	for (int i = begin; i < end; ++i)
+		addFixedParticle(i);
+}
+
+void FEMMesh::removeFixedRange(int begin, int end)
+{
+	for (int i = begin; i < end; ++i)
+		removeFixedParticle(i);
+}
+
+void FEMMesh::clearFixedParticles()
+{
+	fixedParticles.clear();
+	fixedMask.clear();
+	fixedTargets.clear();
+	d_fixedIndex.clear();
+	nbFixedParticles = 0;
+}
+
+void FEMMesh::setFixedTargets(const int* indices, const TCoord* targets, int nbIndices)
+{
+	for (int i = 0; i < nbIndices; ++i)
+	{
+		addFixedParticle(indices[i]);
+		fixedTargets[indices[i]] = targets[i];
+	}
+}
+
 void FEMMesh::init(SimulationParameters* params)
 {
 	if (positions0.size() != positions.size())
@@ -239,20 +339,24 @@ void FEMMesh::init(SimulationParameters* params)
 
 	const TVecCoord& x0 = positions0;
 	d_simulationSize = params->simulation_size;
-	// Plane
-	plane.normal_x = 0;
-	plane.normal_y = 1;
-	plane.normal_z = 0;
-	plane.d = params->plane_position[1];
-	plane.stiffness = (TReal)params->planeRepulsion;
-	plane.damping = 0;
-	std::cout << "Plane d = " << plane.d << " stiffness = " << plane.stiffness << " damping = " << plane.damping << std::endl;
+	// Colliders
+	colliders.clear();
+	planeCollider = -1;
+	sphereCollider = -1;
+	if (params->planeRepulsion != 0)
+	{
+		planeCollider = colliders.addPlane(TDeriv(0,1,0), (TReal)params->plane_position[1], (TReal)params->planeRepulsion);
+		std::cout << "Plane d = " << params->plane_position[1] << " stiffness = " << params->planeRepulsion << " damping = " << 0 << std::endl;
+	}
+	initSurface();
+	surfaceCollision.selfCollision = params->selfCollision;
+	surfaceCollision.thickness = (TReal)params->collisionThickness;
+	surfaceCollision.stiffness = (TReal)params->collisionStiffness;
+	surfaceCollision.init(positions0.hostRead(), positions0.size(), triangles.hostRead(), triangles.size());
 
 	// Fixed
 
-	fixedParticles.clear();
-	fixedMask.clear();
-	nbFixedParticles = 0;
+	clearFixedParticles();
 	if (params->fixedHeight > 0)
 	{
 		TReal maxY = (TReal)(bbox[0][1] + (bbox[1][1]-bbox[0][1]) * params->fixedHeight);
@@ -261,9 +365,8 @@ void FEMMesh::init(SimulationParameters* params)
 		for (unsigned int i=0;i<positions.size();++i)
 			if (x0[i][1] <= maxY && x0[i][2] <= maxZ)
 			{
-				//fixedParticles.push_back(i);
-				addFixedParticle(i);
 				positions[i] = x0[i];
+				addFixedParticle(i);
 				if (!velocity.empty())
 					velocity[i].clear();
 			}
@@ -279,9 +382,15 @@ void FEMMesh::init(SimulationParameters* params)
 	const int nbBe = (nbe + BSIZE-1)/BSIZE;
 	femElem.resize(nbBe);
 	femElemRotation.resize(nbBe);
-#ifdef PARALLEL_GATHER
-	femElemForce.resize(nbe);
-#endif
+	// number of elements around each particle, used to share the lumped
+	// particle mass between elements when computing the stable time step
+	std::vector<int>& p_nbe = d_vertexNbElems;
+	p_nbe.assign(nbp, 0);
+	for (int eindex = 0; eindex < nbe; ++eindex)
+		for (int j = 0; j < 4; ++j)
+			++p_nbe[tetrahedra[eindex][j]];
+	const TReal mass = (TReal)params->massDensity;
+	stableTimeStep = 0;
 	// FEM matrices
 	for (int eindex = 0; eindex < nbe; ++eindex)
 	{
@@ -315,6 +424,7 @@ void FEMMesh::init(SimulationParameters* params)
 		TReal poissonRatio = tetraPoissonRatio(eindex, params);
 		TReal gamma = (youngModulus*poissonRatio) / ((1+poissonRatio)*(1-2*poissonRatio));
 		TReal mu2 = youngModulus / (1+poissonRatio);
+		TReal pWaveModulus = gamma + mu2; // lambda + 2 mu
 		// divide by 36 times vol of the element
 		gamma /= vol36;
 		mu2 /= vol36;
@@ -336,80 +446,563 @@ void FEMMesh::init(SimulationParameters* params)
 		e.Jbx_bx[thread] = (c[1] * d[2]) / b[0];
 		e.Jby_bx[thread] = (-c[0] * d[2]) / b[0];
 		e.Jbz_bx[thread] = (c[0]*d[1] - c[1]*d[0]) / b[0];
+
+		// CFL bound: dt < h / c, with h the smallest altitude of the tetrahedron
+		// and c = sqrt((lambda + 2 mu) / rho) the dilatational wave speed
+		TReal maxArea2 = std::max(std::max(cross(B,C).norm(), cross(C,D).norm()),
+			std::max(cross(D,B).norm(), cross(C-B,D-B).norm()));
+		TReal altitude = (vol36/6) / maxArea2; // 3 V / A, with 6 V = vol36/6 and 2 A = maxArea2
+		TReal elemMass = 0;
+		for (int j = 0; j < 4; ++j)
+			elemMass += mass / p_nbe[tetra[j]];
+		TReal density = elemMass / (vol36/36);
+		TReal waveSpeed = sqrt(pWaveModulus / density);
+		TReal dt = altitude / waveSpeed;
+		if (stableTimeStep == 0 || dt < stableTimeStep)
+			stableTimeStep = dt;
 	}
 #ifdef PARALLEL_GATHER
-	// elements <-> particles table
-	// first find number of elements per particle
-	std::vector<int> p_nbe;
-	p_nbe.resize(nbp);
-	for (int eindex = 0; eindex < nbe; ++eindex)
+	initGather();
+#endif
+		std::cout << "FEM init done: " << positions.size() << " particles, " << tetrahedra.size() << " elements";
+#ifdef PARALLEL_GATHER
+		std::cout << ", up to " << nbElemPerVertex << " elements on each particle";
+#endif
+		std::cout << ", stable explicit time step " << stableTimeStep;
+		std::cout << "." << std::endl;
+		update(params);
+}
+
+
+// Find the particles lying on a boundary face (faces used by a single tetrahedron),
+// and use these faces as surface triangles if the mesh file did not provide any
+void FEMMesh::initSurface()
+{
+	const int nbe = tetrahedra.size();
+	std::vector< std::pair<TFace, int> > faces; // sorted face and index of the face in the tetrahedra
+	faces.reserve(4*nbe);
+	for (int i = 0; i < nbe; ++i)
 		for (int j = 0; j < 4; ++j)
-			++p_nbe[tetrahedra[eindex][j]];
-	// then compute max value
+			faces.push_back(std::make_pair(tetraFace(i, j), 4*i+j));
+	std::sort(faces.begin(), faces.end());
+	const bool addTriangles = triangles.empty();
+	d_onSurface.assign(positions.size(), false);
+	d_faceTetras.clear();
+	for (unsigned int i = 0; i < faces.size(); )
+	{
+		unsigned int j = i+1;
+		while (j < faces.size() && faces[j].first == faces[i].first) ++j;
+		// faces are sorted, insert at the end of the map
+		d_faceTetras.insert(d_faceTetras.end(), std::make_pair(faces[i].first, std::make_pair(faces[i].second, (j > i+1) ? faces[i+1].second : -1)));
+		if (j == i+1)
+		{
+			const TFace& f = faces[i].first;
+			d_onSurface[f.first.first] = true;
+			d_onSurface[f.first.second] = true;
+			d_onSurface[f.second] = true;
+			if (addTriangles)
+				triangles.push_back(boundaryTriangle(faces[i].second / 4, faces[i].second % 4));
+		}
+		i = j;
+	}
+	d_surfaceTriangles.clear();
+	for (unsigned int i = 0; i < triangles.size(); ++i)
+	{
+		const TTriangle& t = triangles[i];
+		d_surfaceTriangles[faceKey(t[0], t[1], t[2])] = i;
+	}
+	surfacePoints.clear();
+	for (unsigned int i = 0; i < d_onSurface.size(); ++i)
+		if (d_onSurface[i])
+			surfacePoints.push_back(i);
+}
+
+#ifdef PARALLEL_GATHER
+// Build the elements <-> particles table from the number of elements per particle
+void FEMMesh::initGather()
+{
+	const int nbp = positions.size();
+	const int nbe = tetrahedra.size();
 	nbElemPerVertex = 0;
 	for (int i=0;i<nbp;++i)
-		if (p_nbe[i] > nbElemPerVertex) nbElemPerVertex = p_nbe[i];
-#if GATHER_PT > 1
-	// we will create group of GATHER_PT elements
-	int nbElemPerThread = (nbElemPerVertex+GATHER_PT-1)/GATHER_PT;
-	const int nbBpt = (nbp*GATHER_PT + GATHER_BSIZE-1)/GATHER_BSIZE;
-	cout << "Element per Thread: " << nbElemPerThread << " Points: " << nbBpt << endl;
-	// finally fill velems array
-	femVElems.resize(nbBpt*nbElemPerThread*GATHER_BSIZE);
-#else
-	const int nbBp = (nbp + GATHER_BSIZE-1)/GATHER_BSIZE;
-	// finally fill velems array
-	femVElems.resize(nbBp*nbElemPerVertex*GATHER_BSIZE);
-#endif
-	p_nbe.clear();
+		if (d_vertexNbElems[i] > nbElemPerVertex) nbElemPerVertex = d_vertexNbElems[i];
+	d_gatherFull = false;
+	femVElems.clear();
+	femVElems.resize(gatherSize(nbp));
+	std::vector<int> p_nbe;
 	p_nbe.resize(nbp);
 	for (int eindex = 0; eindex < nbe; ++eindex)
 		for (int j = 0; j < 4; ++j)
 		{
 			int p = tetrahedra[eindex][j];
-			int num = p_nbe[p]++;
-#if GATHER_PT > 1
-			const int block  = (p*GATHER_PT) / GATHER_BSIZE;
-			const int thread = (p*GATHER_PT+(num%GATHER_PT)) % GATHER_BSIZE;
-			num = num/GATHER_PT;
-			femVElems[ block * (nbElemPerThread * GATHER_BSIZE) +
-				num * GATHER_BSIZE + thread ] = 1 + eindex * 4 + j;
+			femVElems[gatherSlot(p, p_nbe[p]++)] = 1 + eindex * 4 + j;
+		}
+}
+
+int FEMMesh::gatherSize(int nbp) const
+{
+	const int gatherPT = kernel_variants.gatherPT;
+	const int gatherBSize = kernel_variants.gatherBSize;
+	if (gatherPT > 1)
+	{
+		// we will create group of gatherPT elements
+		const int nbElemPerThread = (nbElemPerVertex+gatherPT-1)/gatherPT;
+		const int nbBpt = (nbp*gatherPT + gatherBSize-1)/gatherBSize;
+		return nbBpt*nbElemPerThread*gatherBSize;
+	}
+	const int nbBp = (nbp + gatherBSize-1)/gatherBSize;
+	return nbBp*nbElemPerVertex*gatherBSize;
+}
+
+// Position in femVElems of the num-th element around particle p
+int FEMMesh::gatherSlot(int p, int num) const
+{
+	const int gatherPT = kernel_variants.gatherPT;
+	const int gatherBSize = kernel_variants.gatherBSize;
+	if (gatherPT > 1)
+	{
+		const int nbElemPerThread = (nbElemPerVertex+gatherPT-1)/gatherPT;
+		const int block  = (p*gatherPT) / gatherBSize;
+		const int thread = (p*gatherPT+(num%gatherPT)) % gatherBSize;
+		return block * (nbElemPerThread * gatherBSize) + (num/gatherPT) * gatherBSize + thread;
+	}
+	const int block  = p / gatherBSize;
+	const int thread = p % gatherBSize;
+	return block * (nbElemPerVertex * gatherBSize) + num * gatherBSize + thread;
+}
+
+// The following keep the entries of each particle packed at the start of
+// its list, and must be called before updating d_vertexNbElems
+void FEMMesh::addGather(int p, int value)
+{
+	const int num = d_vertexNbElems[p];
+	if (num >= nbElemPerVertex)
+		d_gatherFull = true;
+	if (d_gatherFull) return;
+	femVElems[gatherSlot(p, num)] = value;
+}
+
+void FEMMesh::removeGather(int p, int value)
+{
+	if (d_gatherFull) return;
+	const int last = d_vertexNbElems[p]-1;
+	for (int num = 0; num <= last; ++num)
+	{
+		const int slot = gatherSlot(p, num);
+		if (femVElems[slot] != value) continue;
+		const int lastSlot = gatherSlot(p, last);
+		femVElems[slot] = femVElems[lastSlot];
+		femVElems[lastSlot] = 0;
+		return;
+	}
+}
+
+void FEMMesh::replaceGather(int p, int oldValue, int newValue)
+{
+	if (d_gatherFull) return;
+	for (int num = 0; num < d_vertexNbElems[p]; ++num)
+	{
+		const int slot = gatherSlot(p, num);
+		if (femVElems[slot] == oldValue)
+		{
+			femVElems[slot] = newValue;
+			return;
+		}
+	}
+}
+#endif
+
+FEMMesh::TFace FEMMesh::faceKey(unsigned int a, unsigned int b, unsigned int c)
+{
+	unsigned int f[3] = { a, b, c };
+	std::sort(f, f+3);
+	return TFace(std::make_pair(f[0], f[1]), f[2]);
+}
+
+// Face of tetrahedron e opposite to its corner j
+FEMMesh::TFace FEMMesh::tetraFace(int e, int j) const
+{
+	const TTetra& t = tetrahedra[e];
+	return faceKey(t[(j+1)%4], t[(j+2)%4], t[(j+3)%4]);
+}
+
+// Face of tetrahedron e opposite to its corner j, oriented away from that corner
+TTriangle FEMMesh::boundaryTriangle(int e, int j) const
+{
+	const TTetra& t = tetrahedra[e];
+	TTriangle tri(t[(j+1)%4], t[(j+2)%4], t[(j+3)%4]);
+	const TCoord& a = positions0[tri[0]];
+	if (dot(cross(positions0[tri[1]] - a, positions0[tri[2]] - a), a - positions0[t[j]]) < 0)
+		std::swap(tri[1], tri[2]);
+	return tri;
+}
+
+void FEMMesh::addSurfaceTriangle(int e, int j)
+{
+	const TTriangle tri = boundaryTriangle(e, j);
+	d_surfaceTriangles[tetraFace(e, j)] = triangles.size();
+	triangles.push_back(tri);
+	for (int k = 0; k < 3; ++k)
+		if (!d_onSurface[tri[k]])
+		{
+			d_onSurface[tri[k]] = true;
+			surfacePoints.push_back(tri[k]);
+		}
+}
+
+void FEMMesh::removeSurfaceTriangle(const TFace& face)
+{
+	std::map<TFace, int>::iterator it = d_surfaceTriangles.find(face);
+	if (it == d_surfaceTriangles.end()) return;
+	const int index = it->second;
+	const int last = triangles.size()-1;
+	d_surfaceTriangles.erase(it);
+	if (index != last)
+	{
+		const TTriangle t = triangles[last];
+		triangles[index] = t;
+		d_surfaceTriangles[faceKey(t[0], t[1], t[2])] = index;
+	}
+	triangles.resize(last);
+}
+
+// Add face j of tetrahedron e to the face table, the face becomes a surface
+// triangle if it has no other tetrahedron, or stops being one otherwise
+void FEMMesh::attachFace(int e, int j)
+{
+	const TFace face = tetraFace(e, j);
+	std::pair<int,int>& sides = d_faceTetras.insert(std::make_pair(face, std::make_pair(-1, -1))).first->second;
+	if (sides.first < 0)
+	{
+		sides.first = 4*e+j;
+		addSurfaceTriangle(e, j);
+	}
+	else
+	{
+		sides.second = 4*e+j;
+		removeSurfaceTriangle(face);
+	}
+}
+
+// Remove face j of tetrahedron e from the face table, exposing the tetrahedron
+// on the other side if any
+void FEMMesh::detachFace(int e, int j)
+{
+	const TFace face = tetraFace(e, j);
+	std::map<TFace, std::pair<int,int> >::iterator it = d_faceTetras.find(face);
+	if (it == d_faceTetras.end()) return;
+	std::pair<int,int>& sides = it->second;
+	if (sides.first == 4*e+j)
+		sides.first = sides.second;
+	sides.second = -1;
+	if (sides.first < 0)
+	{
+		d_faceTetras.erase(it);
+		removeSurfaceTriangle(face);
+	}
+	else
+		addSurfaceTriangle(sides.first / 4, sides.first % 4);
+}
+
+void FEMMesh::copyElement(int from, int to)
+{
+	const int fb = from / BSIZE, ft = from % BSIZE;
+	const int tb = to / BSIZE, tt = to % BSIZE;
+	GPUElement<TReal>* elems = femElem.hostWrite();
+	const GPUElement<TReal>& a = elems[fb];
+	GPUElement<TReal>& b = elems[tb];
+	b.ia[tt] = a.ia[ft]; b.ib[tt] = a.ib[ft]; b.ic[tt] = a.ic[ft]; b.id[tt] = a.id[ft];
+	b.gamma_bx2[tt] = a.gamma_bx2[ft]; b.mu2_bx2[tt] = a.mu2_bx2[ft];
+	b.bx[tt] = a.bx[ft]; b.cx[tt] = a.cx[ft];
+	b.cy[tt] = a.cy[ft]; b.dx[tt] = a.dx[ft]; b.dy[tt] = a.dy[ft]; b.dz[tt] = a.dz[ft];
+	b.Jbx_bx[tt] = a.Jbx_bx[ft]; b.Jby_bx[tt] = a.Jby_bx[ft]; b.Jbz_bx[tt] = a.Jbz_bx[ft];
+	GPUElementRotation<TReal>* rots = femElemRotation.hostWrite();
+	for (int k = 0; k < 3; ++k)
+	{
+#ifdef USE_ROT6
+		rots[tb].rx[k][tt] = rots[fb].rx[k][ft];
+		rots[tb].ry[k][tt] = rots[fb].ry[k][ft];
 #else
-			const int block  = p / GATHER_BSIZE;
-			const int thread = p % GATHER_BSIZE;
-			femVElems[ block * (nbElemPerVertex * BSIZE) +
-				num * BSIZE + thread ] = 1 + eindex * 4 + j;
+		rots[tb].r[k][tt] = rots[fb].r[k][ft];
+		rots[tb].r[k+3][tt] = rots[fb].r[k+3][ft];
+		rots[tb].r[k+6][tt] = rots[fb].r[k+6][ft];
+#endif
+	}
+}
+
+// Remove tetrahedron e, moving the last tetrahedron in its slot
+void FEMMesh::removeTetrahedron(int e)
+{
+	for (int j = 0; j < 4; ++j)
+		detachFace(e, j);
+	const TTetra t = tetrahedra[e];
+	for (int j = 0; j < 4; ++j)
+	{
+#ifdef PARALLEL_GATHER
+		removeGather(t[j], 1 + e * 4 + j);
+#endif
+		--d_vertexNbElems[t[j]];
+	}
+	const int last = tetrahedra.size()-1;
+	if (e != last)
+	{
+		const TTetra moved = tetrahedra[last];
+		tetrahedra[e] = moved;
+		copyElement(last, e);
+		for (int j = 0; j < 4; ++j)
+		{
+			std::pair<int,int>& sides = d_faceTetras[tetraFace(e, j)];
+			if (sides.first == 4*last+j) sides.first = 4*e+j;
+			else if (sides.second == 4*last+j) sides.second = 4*e+j;
+#ifdef PARALLEL_GATHER
+			replaceGather(moved[j], 1 + last * 4 + j, 1 + e * 4 + j);
 #endif
 		}
+	}
+	tetrahedra.resize(last);
+}
+
+// Replace corner j of tetrahedron e by particle p (with the same rest position)
+void FEMMesh::setTetrahedronVertex(int e, int j, int p)
+{
+	const int old = tetrahedra[e][j];
+	for (int k = 0; k < 4; ++k)
+		if (k != j) detachFace(e, k);
+	tetrahedra[e][j] = p;
+	for (int k = 0; k < 4; ++k)
+		if (k != j) attachFace(e, k);
+
+	GPUElement<TReal>& elem = femElem.hostWrite()[e / BSIZE];
+	int* indices[4] = { elem.ia, elem.ib, elem.ic, elem.id };
+	indices[j][e % BSIZE] = p;
+#ifdef PARALLEL_GATHER
+	removeGather(old, 1 + e * 4 + j);
+	addGather(p, 1 + e * 4 + j);
 #endif
-		std::cout << "FEM init done: " << positions.size() << " particles, " << tetrahedra.size() << " elements";
+	--d_vertexNbElems[old];
+	++d_vertexNbElems[p];
+}
+
+// Add a copy of particle from, with no element
+int FEMMesh::addParticle(int from)
+{
+	const TCoord x = positions[from];
+	const TCoord x0 = positions0[from];
+	const TDeriv v = velocity[from];
+	const int index = positions.size();
+	positions.push_back(x);
+	positions0.push_back(x0);
+	velocity.push_back(v);
+	d_vertexNbElems.push_back(0);
+	d_onSurface.push_back(false);
+	// the mask must cover every particle tested by the kernels
+	if (!fixedMask.empty())
+		fixedMask.resize((index+1+31) / 32);
+	if (isFixedParticle(from))
+		addFixedParticle(index);
 #ifdef PARALLEL_GATHER
-		std::cout << ", up to " << nbElemPerVertex << " elements on each particle";
+	if (!d_gatherFull)
+		femVElems.resize(gatherSize(index+1));
 #endif
-		std::cout << "." << std::endl;
-		update(params);
+	return index;
 }
 
+// origin gives the index before the change of each tetrahedron
+void FEMMesh::endTopologyChange(const std::vector<int>& origin, int nbOld)
+{
+	tetrahedronRenumber.assign(nbOld, -1);
+	for (unsigned int i = 0; i < tetrahedra.size(); ++i)
+		tetrahedronRenumber[origin[i]] = i;
+#ifdef PARALLEL_GATHER
+	if (d_gatherFull)
+		initGather();
+#endif
+	if (surfaceCollision.enabled())
+		surfaceCollision.init(positions0.hostRead(), positions0.size(), triangles.hostRead(), triangles.size());
+}
+
+int FEMMesh::removeTetrahedra(const std::vector<int>& indices)
+{
+	const int nbe = tetrahedra.size();
+	std::vector<int> origin(nbe);
+	for (int i = 0; i < nbe; ++i)
+		origin[i] = i;
+	// remove from the last one so that the tetrahedra moved in the freed
+	// slots are never in the list
+	std::vector<int> sorted(indices);
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+	int nbRemoved = 0;
+	for (int i = (int)sorted.size()-1; i >= 0; --i)
+	{
+		const int e = sorted[i];
+		if (e < 0 || e >= (int)tetrahedra.size()) continue;
+		origin[e] = origin[tetrahedra.size()-1];
+		removeTetrahedron(e);
+		++nbRemoved;
+	}
+	origin.resize(tetrahedra.size());
+	endTopologyChange(origin, nbe);
+	return nbRemoved;
+}
+
+int FEMMesh::cut(const TCoord& center, const TDeriv& normal, TReal radius)
+{
+	const int nbe = tetrahedra.size();
+	const int nbp = positions.size();
+	TDeriv n = normal;
+	n.normalize();
+	const TCoord* x = positions.hostRead();
+	const TTetra* tetras = tetrahedra.hostRead();
+	enum { CANDIDATE = 1, FRONT = 2, BACK = 4 };
+	std::vector<unsigned char> flags(nbp, 0);
+	std::vector<bool> front(nbe);
+	// particles of the tetrahedra crossed by the cutting disk
+	for (int e = 0; e < nbe; ++e)
+	{
+		const TTetra& t = tetras[e];
+		TReal dmin = 0, dmax = 0;
+		TCoord c;
+		for (int j = 0; j < 4; ++j)
+		{
+			const TReal d = dot(x[t[j]] - center, n);
+			if (j == 0 || d < dmin) dmin = d;
+			if (j == 0 || d > dmax) dmax = d;
+			c += x[t[j]];
+		}
+		c *= 0.25f;
+		front[e] = (dmin + dmax >= 0);
+		const TDeriv r = (c - center) - n * dot(c - center, n);
+		if (dmin < 0 && dmax > 0 && r.norm2() <= radius*radius)
+			for (int j = 0; j < 4; ++j)
+				flags[t[j]] |= CANDIDATE;
+	}
+	// the candidates with tetrahedra on both sides are split
+	for (int e = 0; e < nbe; ++e)
+		for (int j = 0; j < 4; ++j)
+			if (flags[tetras[e][j]] & CANDIDATE)
+				flags[tetras[e][j]] |= (front[e] ? FRONT : BACK);
+	std::vector<int> split(nbp, -1);
+	std::vector<int> origin(nbe);
+	for (int e = 0; e < nbe; ++e)
+		origin[e] = e;
+	int nbNew = 0;
+	for (int i = 0; i < nbp; ++i)
+		if (flags[i] == (CANDIDATE | FRONT | BACK))
+		{
+			split[i] = addParticle(i);
+			++nbNew;
+		}
+	// the tetrahedra in front use the new particles
+	if (nbNew > 0)
+		for (int e = 0; e < nbe; ++e)
+		{
+			if (!front[e]) continue;
+			for (int j = 0; j < 4; ++j)
+			{
+				const int p = split[tetrahedra[e][j]];
+				if (p >= 0) setTetrahedronVertex(e, j, p);
+			}
+		}
+	endTopologyChange(origin, nbe);
+	return nbNew;
+}
+
+int FEMMesh::tear(TReal maxStretch)
+{
+	const int nbe = tetrahedra.size();
+	const TCoord* x = positions.hostRead();
+	const TCoord* x0 = positions0.hostRead();
+	const TTetra* tetras = tetrahedra.hostRead();
+	const TReal maxStretch2 = maxStretch*maxStretch;
+	std::vector<int> torn;
+	for (int e = 0; e < nbe; ++e)
+	{
+		const TTetra& t = tetras[e];
+		for (int j = 0; j < 3; ++j)
+			for (int k = j+1; k < 4; ++k)
+				if ((x[t[j]] - x[t[k]]).norm2() > maxStretch2 * (x0[t[j]] - x0[t[k]]).norm2())
+				{
+					torn.push_back(e);
+					j = k = 4;
+				}
+	}
+	if (torn.empty()) return 0;
+	return removeTetrahedra(torn);
+}
 
 void FEMMesh::update(SimulationParameters* params)
 {
 
 	// Sphere
-	sphere.center_x = params->sphere_position[0];
-	sphere.center_y = params->sphere_position[1];
-	sphere.center_z = params->sphere_position[2];
-	sphere.velocity_x = params->sphere_velocity[0];
-	sphere.velocity_y = params->sphere_velocity[1];
-	sphere.velocity_z = params->sphere_velocity[2];
-	sphere.radius = params->sphere_radius;
-	sphere.stiffness = (TReal)params->sphereRepulsion;
-	sphere.damping = 0;
-	//std::cout << "sphere r = " << sphere.radius << " stiffness = " << sphere.stiffness << " damping = " << sphere.damping << std::endl;
+	if (params->sphereRepulsion != 0)
+	{
+		if (sphereCollider < 0)
+			sphereCollider = colliders.addSphere(params->sphere_position, (TReal)params->sphere_radius, (TReal)params->sphereRepulsion);
+		else
+		{
+			GPUCollider<TReal>& sphere = colliders.colliders[sphereCollider];
+			sphere.radius = (TReal)params->sphere_radius;
+			sphere.stiffness = (TReal)params->sphereRepulsion;
+			colliders.setCenter(sphereCollider, params->sphere_position);
+		}
+	}
+	else if (sphereCollider >= 0)
+		colliders.colliders[sphereCollider].stiffness = 0;
+	//std::cout << "sphere r = " << params->sphere_radius << " stiffness = " << params->sphereRepulsion << std::endl;
+}
+void FEMMesh::setExternalForces(int nbForces, const int* indices, const TDeriv* forces)
+{
+	externalForces.fastResize(nbForces);
+	GPUExternalForce<TReal>* e = externalForces.hostWrite();
+	for (int i=0;i<nbForces;++i)
+	{
+		for (int j=0;j<3;++j)
+		{
+			e[i].index[j] = indices[i];
+			e[i].bary[j] = (j == 0) ? 1.0f : 0.0f;
+			e[i].value[j] = forces[i][j];
+		}
+	}
+}
+
+void FEMMesh::setSurfaceForces(int nbForces, const int* triangleIndices, const TReal* bary, const TDeriv* forces)
+{
+	externalForces.fastResize(nbForces);
+	GPUExternalForce<TReal>* e = externalForces.hostWrite();
+	const TTriangle* tris = triangles.hostRead();
+	for (int i=0;i<nbForces;++i)
+	{
+		const TTriangle& t = tris[triangleIndices[i]];
+		const TReal u = bary[2*i], v = bary[2*i+1];
+		for (int j=0;j<3;++j)
+		{
+			e[i].index[j] = t[j];
+			e[i].value[j] = forces[i][j];
+		}
+		e[i].bary[0] = 1 - u - v;
+		e[i].bary[1] = u;
+		e[i].bary[2] = v;
+	}
+}
+
+void FEMMesh::addExternalForce(int index, const TDeriv& force)
+{
+	GPUExternalForce<TReal> e;
+	for (int j=0;j<3;++j)
+	{
+		e.index[j] = index;
+		e.bary[j] = (j == 0) ? 1.0f : 0.0f;
+		e.value[j] = force[j];
+	}
+	externalForces.push_back(e);
 }
+
 void FEMMesh::setPushRandomForce(TDeriv pushForce)
 {
-	externalForce.index = rand() % positions0.size();
-	externalForce.value = pushForce * d_simulationSize;
+	const int index = rand() % positions0.size();
+	const TDeriv force = pushForce * d_simulationSize;
+	setExternalForces(1, &index, &force);
 }
 void FEMMesh::setPushForce(SimulationParameters* params)
 {
@@ -428,8 +1021,9 @@ void FEMMesh::setPushForce(SimulationParameters* params)
 				bestz = x[2];
 			}
 		}
-		externalForce.index = best;
-		externalForce.value = params->pushForce * d_simulationSize;
+		clearExternalForces();
+		if (best >= 0)
+			addExternalForce(best, params->pushForce * d_simulationSize);
 	}
 }
 
@@ -438,6 +1032,8 @@ void FEMMesh::reset()
 	positions = positions0;
 	velocity.clear();
 	velocity.resize(positions.size());
+	for (int i = 0; i < nbFixedParticles; ++i)
+		fixedTargets[fixedParticles[i]] = positions0[fixedParticles[i]];
 }
 
 bool FEMMesh::save(const std::string& filename)
@@ -486,6 +1082,39 @@ bool FEMMesh::load(const std::string& filename)
 	return true;
 }
 
+void FEMMesh::captureSnapshot(FEMSnapshot& s, double time)
+{
+	s.time = time;
+	FEMSnapshot_copy(s.positions, positions.hostRead(), positions.size());
+	FEMSnapshot_copy(s.velocity, velocity.hostRead(), velocity.size());
+	FEMSnapshot_copy(s.rotations, femElemRotation.hostRead(), femElemRotation.size());
+	FEMSnapshot_copy(s.fixedTargets, fixedTargets.hostRead(), fixedTargets.size());
+	FEMSnapshot_copy(s.solution, a.hostRead(), a.size());
+}
+
+bool FEMMesh::restoreSnapshot(const FEMSnapshot& s)
+{
+	if (s.positions.size() != positions.size() || s.velocity.size() != positions.size()
+		|| s.rotations.size() != femElemRotation.size())
+	{
+		std::cerr << "ERROR: snapshot of " << s.positions.size() << " vertices while the mesh contains " << positions.size() << std::endl;
+		return false;
+	}
+	memcpy(positions.hostWrite(), &s.positions[0], s.positions.size()*sizeof(TCoord));
+	memcpy(velocity.hostWrite(), &s.velocity[0], s.velocity.size()*sizeof(TDeriv));
+	if (!s.rotations.empty())
+		memcpy(femElemRotation.hostWrite(), &s.rotations[0], s.rotations.size()*sizeof(GPUElementRotation<TReal>));
+	// targets are only kept for the particles fixed at capture time
+	if (s.fixedTargets.size() <= fixedTargets.size() && !s.fixedTargets.empty())
+		memcpy(fixedTargets.hostWrite(), &s.fixedTargets[0], s.fixedTargets.size()*sizeof(TCoord));
+	if (s.solution.size() == positions.size())
+	{
+		a.fastResize(s.solution.size());
+		memcpy(a.hostWrite(), &s.solution[0], s.solution.size()*sizeof(TDeriv));
+	}
+	return true;
+}
+
 
 void FEMMesh::saveObj(const std::string& filename, const std::string& mtlfilename)
 {
@@ -0,0 +1,272 @@
+#ifndef FEMSnapshot_h__
+#define FEMSnapshot_h__
+
+#include "common.h"
+#include "GPU.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Binary copy of the dynamic state of a FEMMesh: positions, velocities,
+// element rotations, kinematic targets and the last solution of the CG solver.
+// Buffers are reused when a snapshot is captured again with the same sizes, so
+// capturing is a few memcpy.
+struct FEMSnapshot
+{
+	double time;
+	std::vector<TCoord> positions;
+	std::vector<TDeriv> velocity;
+	std::vector<GPUElementRotation<TReal> > rotations;
+	std::vector<TCoord> fixedTargets;
+	std::vector<TDeriv> solution;
+
+	FEMSnapshot() : time(0) {}
+
+	bool empty() const { return positions.empty(); }
+
+	bool write(const std::string& filename) const;
+	bool read(const std::string& filename);
+};
+
+// Raw copy between a vector and a buffer, the buffer is only reallocated when it grows
+template<class T>
+void FEMSnapshot_copy(std::vector<T>& dest, const T* src, unsigned int size)
+{
+	dest.resize(size);
+	if (size) memcpy(&dest[0], src, size*sizeof(T));
+}
+
+static const char FEMSnapshot_magic[4] = { 'F', 'E', 'M', 'S' };
+static const int FEMSnapshot_version = 1;
+
+template<class T>
+static void FEMSnapshot_writeArray(std::ofstream& out, const std::vector<T>& v)
+{
+	unsigned int size = v.size();
+	out.write((const char*)&size, sizeof(size));
+	if (size) out.write((const char*)&v[0], size*sizeof(T));
+}
+
+template<class T>
+static bool FEMSnapshot_readArray(std::ifstream& in, std::vector<T>& v)
+{
+	unsigned int size = 0;
+	if (!in.read((char*)&size, sizeof(size))) return false;
+	v.resize(size);
+	if (size && !in.read((char*)&v[0], size*sizeof(T))) return false;
+	return true;
+}
+
+bool FEMSnapshot::write(const std::string& filename) const
+{
+	std::ofstream out(filename.c_str(), std::ios::binary);
+	if (!out)
+	{
+		std::cerr << "Cannot write to file " << filename << std::endl;
+		return false;
+	}
+	// header: magic, version, size of the scalar type and of a rotation block
+	const int sizes[2] = { (int)sizeof(TReal), (int)sizeof(GPUElementRotation<TReal>) };
+	out.write(FEMSnapshot_magic, 4);
+	out.write((const char*)&FEMSnapshot_version, sizeof(int));
+	out.write((const char*)sizes, sizeof(sizes));
+	out.write((const char*)&time, sizeof(time));
+	FEMSnapshot_writeArray(out, positions);
+	FEMSnapshot_writeArray(out, velocity);
+	FEMSnapshot_writeArray(out, rotations);
+	FEMSnapshot_writeArray(out, fixedTargets);
+	FEMSnapshot_writeArray(out, solution);
+	return !out.fail();
+}
+
+bool FEMSnapshot::read(const std::string& filename)
+{
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "Cannot open file " << filename << std::endl;
+		return false;
+	}
+	char magic[4];
+	int version = 0;
+	int sizes[2] = { 0, 0 };
+	in.read(magic, 4);
+	in.read((char*)&version, sizeof(int));
+	in.read((char*)sizes, sizeof(sizes));
+	if (!in || memcmp(magic, FEMSnapshot_magic, 4) || version != FEMSnapshot_version
+		|| sizes[0] != (int)sizeof(TReal) || sizes[1] != (int)sizeof(GPUElementRotation<TReal>))
+	{
+		std::cerr << "ERROR: file " << filename << " is not a compatible snapshot" << std::endl;
+		return false;
+	}
+	in.read((char*)&time, sizeof(time));
+	if (!FEMSnapshot_readArray(in, positions) || !FEMSnapshot_readArray(in, velocity)
+		|| !FEMSnapshot_readArray(in, rotations) || !FEMSnapshot_readArray(in, fixedTargets)
+		|| !FEMSnapshot_readArray(in, solution))
+	{
+		std::cerr << "ERROR: file " << filename << " is truncated" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Ring of the last captured snapshots, used to rewind the simulation.
+// The slots are kept allocated so that capturing a frame does not allocate
+// once the ring is full.
+class SnapshotRing
+{
+public:
+	SnapshotRing() : d_head(0), d_count(0) {}
+
+	void setCapacity(int capacity)
+	{
+		d_slots.resize(capacity > 0 ? capacity : 0);
+		clear();
+	}
+	int capacity() const { return d_slots.size(); }
+	int size() const { return d_count; }
+	void clear() { d_head = 0; d_count = 0; }
+	// Size the buffers of all the slots like s, the ring stays empty
+	void reserve(const FEMSnapshot& s)
+	{
+		for (unsigned int i = 0; i < d_slots.size(); ++i)
+			d_slots[i] = s;
+		clear();
+	}
+
+	// Slot for a new snapshot, overwriting the oldest one if the ring is full
+	FEMSnapshot& push()
+	{
+		FEMSnapshot& s = d_slots[d_head];
+		d_head = (d_head + 1) % d_slots.size();
+		if (d_count < (int)d_slots.size()) ++d_count;
+		return s;
+	}
+
+	// Snapshot captured back frames before the last one (0 for the last), NULL if not kept
+	const FEMSnapshot* get(int back) const
+	{
+		if (back < 0 || back >= d_count) return NULL;
+		int n = d_slots.size();
+		return &d_slots[(d_head - 1 - back + n) % n];
+	}
+
+	// Drop the n last snapshots
+	void pop(int n)
+	{
+		if (n > d_count) n = d_count;
+		d_head = (d_head - n + d_slots.size()) % d_slots.size();
+		d_count -= n;
+	}
+
+private:
+	std::vector<FEMSnapshot> d_slots;
+	int d_head;  // next slot to write
+	int d_count;
+};
+
+// Writes snapshots to disk from a background thread.
+// write() copies the snapshot in a recycled buffer and returns immediately.
+class SnapshotWriter
+{
+public:
+	SnapshotWriter() : d_started(false), d_quit(false), d_busy(false) {}
+	~SnapshotWriter();
+
+	void write(const FEMSnapshot& s, const std::string& filename);
+	// Wait until all queued snapshots are written
+	void flush();
+
+private:
+	struct Job
+	{
+		FEMSnapshot snapshot;
+		std::string filename;
+	};
+
+	void run();
+
+	std::thread d_thread;
+	std::mutex d_mutex;
+	std::condition_variable d_wake, d_idle;
+	std::deque<Job*> d_queue;
+	std::vector<Job*> d_free;
+	bool d_started, d_quit, d_busy;
+};
+
+SnapshotWriter::~SnapshotWriter()
+{
+	if (d_started)
+	{
+		{
+			std::lock_guard<std::mutex> lock(d_mutex);
+			d_quit = true;
+		}
+		d_wake.notify_one();
+		d_thread.join();
+	}
+	for (unsigned int i = 0; i < d_queue.size(); ++i) delete d_queue[i];
+	for (unsigned int i = 0; i < d_free.size(); ++i) delete d_free[i];
+}
+
+void SnapshotWriter::write(const FEMSnapshot& s, const std::string& filename)
+{
+	Job* job = NULL;
+	{
+		std::lock_guard<std::mutex> lock(d_mutex);
+		if (!d_free.empty())
+		{
+			job = d_free.back();
+			d_free.pop_back();
+		}
+	}
+	if (!job) job = new Job;
+	job->snapshot = s;
+	job->filename = filename;
+	{
+		std::lock_guard<std::mutex> lock(d_mutex);
+		d_queue.push_back(job);
+		if (!d_started)
+		{
+			d_started = true;
+			d_thread = std::thread(&SnapshotWriter::run, this);
+		}
+	}
+	d_wake.notify_one();
+}
+
+void SnapshotWriter::flush()
+{
+	std::unique_lock<std::mutex> lock(d_mutex);
+	while (!d_queue.empty() || d_busy)
+		d_idle.wait(lock);
+}
+
+void SnapshotWriter::run()
+{
+	std::unique_lock<std::mutex> lock(d_mutex);
+	for (;;)
+	{
+		while (d_queue.empty() && !d_quit)
+			d_wake.wait(lock);
+		// pending snapshots are still written when quitting
+		if (d_queue.empty()) break;
+		Job* job = d_queue.front();
+		d_queue.pop_front();
+		d_busy = true;
+		lock.unlock();
+		job->snapshot.write(job->filename);
+		lock.lock();
+		d_busy = false;
+		d_free.push_back(job);
+		if (d_queue.empty())
+			d_idle.notify_all();
+	}
+}
+
+#endif // FEMSnapshot_h__
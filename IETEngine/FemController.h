@@ -23,6 +23,8 @@ namespace Controller
 		~FemController();
 	private:
 		int MeshLoad();
+		// Height of the simulated body on screen, as a fraction of the viewport (0 if off-screen)
+		float screen_size(const glm::mat4& mvp) const;
 		void text_to_screen(); 
 		void tweak_bar_setup();
 		void setup_current_instance();
@@ -56,7 +58,7 @@ namespace Controller
 	{
 
 		std::cout << "Load meshes" << std::endl;
-		if (!d_simulation->simulation_load_fem_mesh(RAPTOR_NETGEN_MESH))
+		if (!d_simulation->simulation_load_fem_mesh(RAPTOR_NETGEN_MESH_FULL))
 		{
 			//return 1;
 		}
@@ -68,9 +70,34 @@ namespace Controller
 		std::cout << "Init simulation" << std::endl;
 		if (!d_simulation->simulation_init())
 			return 1;
+		// coarse level used when the body is small on screen or off-screen
+		d_simulation->simulation_add_lod(RAPTOR_NETGEN_MESH);
 		return 0;
 	}
 
+	float FemController::screen_size(const glm::mat4& mvp) const
+	{
+		const TCoord* bbox = d_simulation->simulation_params.simulation_bbox;
+		float ymin = 1, ymax = -1;
+		int outside[6] = { 0, 0, 0, 0, 0, 0 };
+		for (int c = 0; c < 8; ++c)
+		{
+			glm::vec4 p = mvp * glm::vec4(bbox[c&1][0], bbox[(c>>1)&1][1], bbox[(c>>2)&1][2], 1.0f);
+			for (int k = 0; k < 3; ++k)
+			{
+				if (p[k] < -p.w) ++outside[2*k];
+				if (p[k] >  p.w) ++outside[2*k+1];
+			}
+			if (p.w <= 0) continue;
+			ymin = std::min(ymin, p.y / p.w);
+			ymax = std::max(ymax, p.y / p.w);
+		}
+		// all corners on the outer side of a clipping plane
+		for (int k = 0; k < 6; ++k)
+			if (outside[k] == 8) return 0;
+		return std::max(0.0f, std::min(ymax, 1.0f) - std::max(ymin, -1.0f)) * 0.5f;
+	}
+
 	void FemController::Init(int argc, char* argv[])
 	{
 		AbstractController::Init(argc,argv);  
@@ -103,6 +130,35 @@ namespace Controller
 			cerr << "Error starting the simulation..." << endl;
 		}	
 
+		if (argc > 1 && strcmp(argv[1], "--benchmark-integrators") == 0)
+		{
+			if (!MeshLoad())
+				d_simulation->simulation_benchmark_integrators(100);
+		}
+
+		if (argc > 1 && strcmp(argv[1], "--benchmark-colliders") == 0)
+		{
+			if (!MeshLoad())
+				d_simulation->simulation_benchmark_colliders(100);
+		}
+
+		if (argc > 1 && strcmp(argv[1], "--check-allocations") == 0)
+		{
+			// the steps and mappings after the first frame must not allocate:
+			// exits with a non-zero status if any of them did
+			d_simulation->simulation_params.auditAllocations = true;
+			if (MeshLoad())
+				exit(2);
+			for (int i = 0; i < 100; ++i)
+			{
+				d_simulation->simulation_animate();
+				d_simulation->simulation_mapping();
+			}
+			const size_t allocations = d_simulation->simulation_steady_allocations();
+			cout << allocations << " allocations in steady state" << endl;
+			exit(allocations == 0 ? 0 : 1);
+		}
+
 	//	if (MeshLoad())
 		{
 			cerr << "Error initializing the meshes..." << endl;
@@ -150,6 +206,9 @@ namespace Controller
 
 		projection_view = d_projection_matrix * d_view_matrix;  
 
+		// the next steps run on the level matching the size of the body on screen
+		d_simulation->simulation_update_lod(screen_size(projection_view * d_model->GetModelMatrix()));
+
 		d_shader->Use();
 		d_shader->SetUniform("mvp", d_projection_matrix * d_view_matrix * d_model->GetModelMatrix());
 		d_shader->SetUniform("mv",   d_view_matrix * d_model->GetModelMatrix());
@@ -166,18 +225,23 @@ namespace Controller
 		 	d_simulation->fem_mesh->setPushRandomForce(TDeriv(x,y,z));
 			//cout << "FPS: " << d_fps << endl;
 		}
-		if (d_simulation->fem_mesh->externalForce.index != -1)
+		const FEMMesh* fem_mesh = d_simulation->fem_mesh;
+		const GPUExternalForce<TReal>* forces = fem_mesh->externalForces.hostRead();
+		const TCoord* positions = fem_mesh->positions.hostRead();
+		glLineWidth(3);
+		for (unsigned int i = 0; i < fem_mesh->externalForces.size(); ++i)
 		{
-			TCoord p1 = d_simulation->fem_mesh->positions[d_simulation->fem_mesh->externalForce.index];
-			TCoord p2 = p1 + d_simulation->fem_mesh->externalForce.value * 0.001;
+			TCoord p1;
+			for (int j = 0; j < 3; ++j)
+				p1 += positions[forces[i].index[j]] * forces[i].bary[j];
+			TCoord p2 = p1 + TDeriv(forces[i].value) * 0.001;
 			auto v1 = Vertex(glm::vec3(p1.x(),p1.y(),p1.z()), glm::vec4(1,0,0,0));
 			auto v2 = Vertex(glm::vec3(p2.x(),p2.y(),p2.z()), glm::vec4(1,0,0,0));
 
 			Line l(v1,v2);
-			glLineWidth(3);
 			l.Draw();
-			glLineWidth(1);
 		}
+		glLineWidth(1);
 		d_shader->Use();
 		d_shader->SetUniform("mvp", d_projection_matrix * d_view_matrix * d_floor->GetModelMatrix());
 		d_shader->SetUniform("mv",   d_view_matrix * d_floor->GetModelMatrix());
@@ -59,4 +59,59 @@ struct GPUSphere
 	real stiffness;
 	real damping;
 };
+
+enum ColliderType
+{
+	COLLIDER_PLANE,
+	COLLIDER_SPHERE,
+	COLLIDER_CAPSULE,
+	COLLIDER_BOX
+};
+
+template<class real>
+struct GPUCollider
+{
+	int type;
+	/// plane normal, sphere or box center, capsule first end point
+	real p0[3];
+	/// capsule second end point, box half extents
+	real p1[3];
+	/// box orientation (the third axis is the cross product of these two)
+	real axis[2][3];
+	/// plane offset, sphere or capsule radius
+	real radius;
+	real stiffness;
+	real damping;
+};
+
+template<class real>
+struct GPUColliderGrid
+{
+	real origin_x, origin_y, origin_z;
+	real invCellSize;
+	int nx, ny, nz;
+	/// number of unbounded (planes) and moving colliders, tested against every particle
+	int nbGlobal;
+};
+
+template<class real>
+struct GPUContact
+{
+	real normal_x, normal_y, normal_z;
+	/// penetration depth (negative when in contact)
+	real d;
+	real stiffness;
+	real damping;
+};
+
+/// External force applied at a point interpolated from up to three particles
+/// (a single particle has bary = {1,0,0} and index[1] = index[2] = index[0])
+template<class real>
+struct GPUExternalForce
+{
+	int index[3];
+	real bary[3];
+	real value[3];
+};
+
 #endif // GPU_h__
\ No newline at end of file
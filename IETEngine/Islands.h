@@ -0,0 +1,150 @@
+#ifndef Islands_h__
+#define Islands_h__
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cfloat>
+
+namespace Physics
+{
+	using namespace std;
+
+	/*
+	* Islands of bodies in contact, and their sleeping.
+	* The islands are found again at each update, by union-find over the pairs
+	* in contact (union by size and path halving, close to O(n)). A body is
+	* still while its linear and angular speeds stay under the thresholds. An
+	* island goes to sleep when all its bodies have been still for
+	* m_time_to_sleep, and wakes up as a whole as soon as one of them is not:
+	* a body woken by Wake_Up, or a moving body touching one of its bodies and
+	* joining it. The planes and other fixed bodies are not in the pairs, so
+	* that they do not link all the islands resting on them.
+	*/
+	class Islands
+	{
+	public:
+		float		m_linear_threshold;
+		float		m_angular_threshold;
+		float		m_time_to_sleep;		// seconds
+
+		Islands();
+
+		// Number of bodies, the new ones are awake
+		void		Resize(int count);
+		// Islands of the pairs, speeds of the bodies during the last delta_time
+		void		Update(const vector<pair<int,int>>& pairs, const vector<float>& linear_speeds,
+						const vector<float>& angular_speeds, float delta_time);
+		// Awake until its island is still again for m_time_to_sleep, the island wakes up at the next Update
+		void		Wake_Up(int body);
+		void		Wake_Up_All();
+
+		bool		Is_Sleeping(int body) const { return body < (int)d_sleeping.size() && d_sleeping[body] != 0; }
+		// Body representing the island of the body, from the last Update
+		int			Island(int body) const { return d_parent[body]; }
+		int			Nb_Bodies() const { return d_parent.size(); }
+		int			Nb_Islands() const { return d_nb_islands; }
+		int			Nb_Sleeping() const { return d_nb_sleeping; }
+
+	private:
+		vector<int>			d_parent;
+		vector<int>			d_size;
+		vector<float>		d_still_time;
+		vector<float>		d_island_still_time;
+		vector<char>		d_sleeping;
+		int					d_nb_islands;
+		int					d_nb_sleeping;
+
+		int			find(int body);
+		void		unite(int a, int b);
+	};
+
+	inline Islands::Islands()
+		: m_linear_threshold(0.05f),
+		m_angular_threshold(0.05f),
+		m_time_to_sleep(0.5f),
+		d_nb_islands(0),
+		d_nb_sleeping(0)
+	{
+	}
+
+	inline void Islands::Resize(int count)
+	{
+		d_parent.resize(count);
+		d_size.resize(count);
+		d_still_time.resize(count, 0.0f);
+		d_sleeping.resize(count, 0);
+		for (int i = 0; i < count; i++)
+			d_parent[i] = i;
+	}
+
+	inline int Islands::find(int body)
+	{
+		while (d_parent[body] != body)
+		{
+			d_parent[body] = d_parent[d_parent[body]];
+			body = d_parent[body];
+		}
+		return body;
+	}
+
+	inline void Islands::unite(int a, int b)
+	{
+		a = find(a);
+		b = find(b);
+		if (a == b) return;
+		if (d_size[a] < d_size[b]) swap(a, b);
+		d_parent[b] = a;
+		d_size[a] += d_size[b];
+	}
+
+	inline void Islands::Wake_Up(int body)
+	{
+		d_sleeping[body] = 0;
+		d_still_time[body] = 0.0f;
+	}
+
+	inline void Islands::Wake_Up_All()
+	{
+		fill(d_sleeping.begin(), d_sleeping.end(), 0);
+		fill(d_still_time.begin(), d_still_time.end(), 0.0f);
+		d_nb_sleeping = 0;
+	}
+
+	inline void Islands::Update(const vector<pair<int,int>>& pairs, const vector<float>& linear_speeds,
+		const vector<float>& angular_speeds, float delta_time)
+	{
+		const int n = d_parent.size();
+		for (int i = 0; i < n; i++)
+		{
+			d_parent[i] = i;
+			d_size[i] = 1;
+			const bool still = linear_speeds[i] < m_linear_threshold && angular_speeds[i] < m_angular_threshold;
+			d_still_time[i] = still ? d_still_time[i] + delta_time : 0.0f;
+		}
+		for (auto& p : pairs)
+			unite(p.first, p.second);
+
+		// the least still body of an island decides for all of it
+		d_island_still_time.assign(n, FLT_MAX);
+		for (int i = 0; i < n; i++)
+		{
+			d_parent[i] = find(i);
+			d_island_still_time[d_parent[i]] = min(d_island_still_time[d_parent[i]], d_still_time[i]);
+		}
+
+		d_nb_islands = 0;
+		d_nb_sleeping = 0;
+		for (int i = 0; i < n; i++)
+		{
+			if (d_parent[i] == i) d_nb_islands++;
+			const bool sleeping = d_island_still_time[d_parent[i]] >= m_time_to_sleep;
+			// woken by its island, it waits as long as the others before sleeping again
+			if (!sleeping && d_sleeping[i]) d_still_time[i] = 0.0f;
+			d_sleeping[i] = sleeping;
+			d_nb_sleeping += sleeping;
+		}
+	}
+}
+
+#endif // Islands_h__
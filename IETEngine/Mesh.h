@@ -26,7 +26,7 @@
 
 #include <glm/detail/type_vec3.hpp>
 #include "FEMMesh.h"
-#include "octree.h" 
+#include "TetraMapping.h"
 
 
 
@@ -73,8 +73,9 @@ namespace Rendering
 		map<string, Bone>			d_bone_mapping;
 		Material					d_material;
 #endif
-		MyVector(TTetra)			d_map_i;
-		MyVector(TCoord4)			d_map_f;
+		std::vector<TetraMapping>	d_mappings; // one per level of detail of the simulation mesh
+		int							d_level;
+		std::vector< std::pair<int,int> > d_uploadRanges; // vertices changed by the last mapping, all if empty
 		float						d_area;
 		
 	public:
@@ -90,8 +91,26 @@ namespace Rendering
 #endif // !NO_OPENGL
 		 
 		void updatePositions(FEMMesh* inputMesh);
+		// updatePositions in two parts: the mapping, which can run on any thread,
+		// and the upload to the vertex buffer, on the thread of the GL context.
+		// With epsilon >= 0, only the vertices around particles that moved by
+		// more than epsilon are mapped and uploaded; returns false if none did.
+		bool mapPositions(FEMMesh* inputMesh, TReal epsilon = -1);
+		void uploadPositions();
+		// Replace the positions without mapping, e.g. from a DeformationCacheReader
+		void setPositions(const TCoord* positions);
 		void updateNormals(FEMMesh*);
-		void init(FEMMesh* inputMesh);
+		// Map the vertices on the simulation mesh used for the given level of detail
+		void init(FEMMesh* inputMesh, int level = 0);
+		// Follow the simulation mesh of another level of detail (mapped by init)
+		void setLevel(int level)
+		{
+			if (level < 0 || level >= (int)d_mappings.size() || level == d_level) return;
+			d_level = level;
+			d_mappings[level].invalidate();
+		}
+		// Follow the tetrahedra renumbered or modified by the last topology change of the input mesh
+		void updateTopology(FEMMesh* inputMesh);
 		// Render the mesh
 		
 
@@ -133,6 +152,7 @@ bool hasBones() const{
 		//d_bounding_box(BoundingBox(nullptr)),
 		//d_bounding_sphere(BoundingSphere(NULL)),
 		d_material(material),
+		d_level(0),
 		d_area(0.0f)
 	{ 
 		this->m_vertices = vertices;
@@ -148,125 +168,50 @@ bool hasBones() const{
 
 	}
 #else
-	inline Mesh::Mesh(TVecCoord vertices, vector<unsigned int> indices){
+	inline Mesh::Mesh(TVecCoord vertices, vector<unsigned int> indices) : d_level(0) {
 		this->m_vertices = vertices;
 		this->m_indices = indices;
 	}
 #endif
 
-	void Mesh::init(FEMMesh* inputMesh)
+	void Mesh::init(FEMMesh* inputMesh, int level)
 	{ 
 		if (inputMesh)
 		{
 			std::cout << "Creating mapping between simulation mesh \"" << inputMesh->filename << "\" and surface mesh \" "  << std::endl;
-			static std::string input_filename;
-			static sofa::helper::vector<Mat3x3d> bases;
-			static sofa::helper::vector<Vec3d> centers;
-			static Octree<Vec3d> octree;
-			const TVecTetra& tetras = inputMesh->tetrahedra;
-			const TVecCoord& in = inputMesh->positions;
-			const TVecCoord& out = m_vertices;
-			d_map_i.resize(out.size());
-			d_map_f.resize(out.size());
-			if (input_filename != inputMesh->filename || bases.size() != tetras.size()) // we have to recompute the octree and bases
-			{
-				input_filename = inputMesh->filename;
-				sofa::helper::vector< BBox<Vec3d> > bbox;
-				bases.resize(tetras.size());
-				centers.resize(tetras.size());
-				bbox.resize(tetras.size());
-				std::cout << "  Preparing tetrahedra" << std::endl;
-				for (unsigned int t=0; t<tetras.size(); ++t)
-				{
-					Mat3x3d m, mt;
-					m[0] = in[tetras[t][1]]-in[tetras[t][0]];
-					m[1] = in[tetras[t][2]]-in[tetras[t][0]];
-					m[2] = in[tetras[t][3]]-in[tetras[t][0]];
-					mt.transpose(m);
-					bases[t].invert(mt);
-					centers[t] = (in[tetras[t][0]]+in[tetras[t][1]]+in[tetras[t][2]]+in[tetras[t][3]])*0.25;
-					bbox[t].add(tetras[t].begin(), tetras[t].end(), in);
-				}
-				std::cout << "  Building octree" << std::endl;
-				octree.init(bbox,8,8);
-			}
-			std::cout << "  Processing vertices" << std::endl;
-			int outside = 0;
-			sofa::helper::vector<Octree<Vec3d>*> cells;
-			for (unsigned int i=0;i<out.size();i++)
-			{
-				Vec3d pos = out[i];
-				Vec3d coefs;
-				int index = -1;
-				double distance = 1e10;
-				Octree<Vec3d>* cell = octree.findNear(pos);
-				if (cell)
-				{
-					const sofa::helper::vector<int>& elems = cell->elems();
-					for (unsigned int e = 0; e < elems.size(); e++)
-					{
-						unsigned int t = elems[e];
-						Vec3d v = bases[t] * (pos - in[tetras[t][0]]);
-						double d = std::max(std::max(-v[0],-v[1]),std::max(-v[2],v[0]+v[1]+v[2]-1));
-						if (d>0) d = (pos-centers[t]).norm2();
-						if (d<distance) { coefs = v; distance = d; index = t; }
-					}
-				}
-				if (distance > 0)
-				{ // pos is outside of the fem mesh, find the nearest tetra
-
-					// first let's find at least one tetra that is close, if not already found
-					if (index >= 0) // we already have a close tetra, we need to look only for closer ones
-					{
-						cells.clear();
-						octree.findAllAround(cells, pos, sqrt(distance)*1.5);
-						for (unsigned int ci = 0; ci < cells.size(); ++ci)
-						{
-							if (cells[ci] == cell) continue; // already processed this cell
-							const sofa::helper::vector<int>& elems = cells[ci]->elems();
-							for (unsigned int e = 0; e < elems.size(); e++)
-							{
-								unsigned int t = elems[e];
-								double d = (pos-centers[t]).norm2();
-								if (d<distance)
-								{
-									coefs = bases[t] * (pos - in[tetras[t][0]]);
-									distance = d; index = t;
-								}
-							}
-						}
-					}
-					else
-					{
-						// failsafe case (should not happen...), to be sure we do a brute-force search
-						for (unsigned int t = 0; t < tetras.size(); t++)
-						{
-							double d = (pos-centers[t]).norm2();
-							if (d<distance)
-							{
-								coefs = bases[t] * (pos - in[tetras[t][0]]);
-								distance = d; index = t;
-							}
-						}
-					}
-					if (index >= 0)
-					{
-						//if (verbose >= 1) std::cout << "Surface vertex " << i << " mapped outside of tetra " << index << " with coefs " << coefs << std::endl;
-						++outside;
-					}
-				}
-				if (index >= 0)
-				{
-					//std::cout << "Surface vertex " << i << " mapped from tetra " << index << " with coefs " << coefs << std::endl;
-					d_map_i[i][0] = tetras[index][0]; d_map_f[i][0] = (float)(1-coefs[0]-coefs[1]-coefs[2]);
-					d_map_i[i][1] = tetras[index][1]; d_map_f[i][1] = (float)(coefs[0]);
-					d_map_i[i][2] = tetras[index][2]; d_map_f[i][2] = (float)(coefs[1]);
-					d_map_i[i][3] = tetras[index][3]; d_map_f[i][3] = (float)(coefs[2]);
-				}
-			}
-			std::cout << "Mapping done: " << outside << " / " << out.size() << " vertices outside of simulation mesh" << std::endl;
+			if ((int)d_mappings.size() <= level)
+				d_mappings.resize(level+1);
+			int outside = d_mappings[level].init(inputMesh->filename, inputMesh->tetrahedra, inputMesh->positions, m_vertices);
+			d_mappings[level].invalidate();
+			// at most one range per gap of the incremental mapping
+			d_uploadRanges.reserve(m_vertices.size()/32 + 1);
+			std::cout << "Mapping done: " << outside << " / " << m_vertices.size() << " vertices outside of simulation mesh" << std::endl;
+		}
+	}
+	void Mesh::updateTopology(FEMMesh* inputMesh)
+	{
+		if (d_mappings.empty()) return;
+		TetraMapping& mapping = d_mappings[d_level];
+		mapping.invalidate();
+		const std::vector<int>& renumber = inputMesh->tetrahedronRenumber;
+		const TTetra* tetras = inputMesh->tetrahedra.hostRead();
+		const TTetra* current = mapping.map_i.hostRead();
+		TTetra* map_i = NULL; // only marked as modified if a vertex changes
+		for (unsigned int i = 0; i < mapping.map_tetra.size(); ++i)
+		{
+			int t = mapping.map_tetra[i];
+			if (t < 0 || t >= (int)renumber.size()) continue;
+			// vertices mapped from a removed tetrahedron keep following its particles
+			t = renumber[t];
+			mapping.map_tetra[i] = t;
+			if (t < 0) continue;
+			const TTetra& tetra = tetras[t];
+			if (current[i][0] == tetra[0] && current[i][1] == tetra[1] && current[i][2] == tetra[2] && current[i][3] == tetra[3]) continue;
+			if (!map_i) map_i = mapping.map_i.hostWrite();
+			map_i[i] = tetra;
 		}
 	}
+
 #ifndef NO_OPENGL
 	inline void Mesh::Draw(Shader& shader, bool withAdjecencies)
 	{
@@ -391,22 +336,8 @@ bool hasBones() const{
 
 	void Mesh::updatePositions(FEMMesh* inputMesh)
 	{
-		const TVecCoord& in = inputMesh->positions;
-		TVecCoord& out = m_vertices;
-		if (d_map_f.size() != out.size() || d_map_i.size() != out.size()) return;
-
-		DEVICE_METHOD(TetraMapper3f_apply)( out.size(), d_map_i.deviceRead(), d_map_f.deviceRead(), out.deviceWrite(), in.deviceRead() );
-
-		const void * pointer = NULL;
-
-		pointer = this->m_vertices.hostRead();
-#ifndef NO_OPENGL
-
-
-		glBindBuffer(GL_ARRAY_BUFFER, d_VBO);
-		glBufferData(GL_ARRAY_BUFFER, this->m_vertices.size() * sizeof(TCoord), NULL, GL_STREAM_DRAW); // Buffer orphaning, a common way to improve streaming perf. See above link for details.
-		glBufferSubData(GL_ARRAY_BUFFER, 0, this->m_vertices.size() * sizeof(TCoord), pointer );
-#endif
+		if (mapPositions(inputMesh))
+			uploadPositions();
 
 		/*for (unsigned int i=0;i<out.size();++i)
 		{
@@ -417,6 +348,53 @@ bool hasBones() const{
 		in[map_i[i][3]] * map_f[i][3];
 		}*/
 	}
+
+	bool Mesh::mapPositions(FEMMesh* inputMesh, TReal epsilon)
+	{
+		d_uploadRanges.clear();
+		if (d_mappings.empty() || d_mappings[d_level].size() != m_vertices.size()) return false;
+
+		if (epsilon < 0)
+		{
+			d_mappings[d_level].apply(m_vertices, inputMesh->positions);
+			d_mappings[d_level].invalidate();
+			return true;
+		}
+		d_mappings[d_level].applyChanged(m_vertices, inputMesh->positions, epsilon, d_uploadRanges);
+		return !d_uploadRanges.empty();
+	}
+
+	void Mesh::setPositions(const TCoord* positions)
+	{
+		if (m_vertices.empty()) return;
+		memcpy(m_vertices.hostWrite(), positions, m_vertices.size() * sizeof(TCoord));
+		if (!d_mappings.empty()) d_mappings[d_level].invalidate();
+		d_uploadRanges.clear();
+		uploadPositions();
+	}
+
+	void Mesh::uploadPositions()
+	{
+#ifndef NO_OPENGL
+		const TCoord* pointer = this->m_vertices.hostRead();
+		int changed = 0;
+		for (unsigned int r = 0; r < d_uploadRanges.size(); ++r)
+			changed += d_uploadRanges[r].second - d_uploadRanges[r].first;
+		glBindBuffer(GL_ARRAY_BUFFER, d_VBO);
+		if (d_uploadRanges.empty() || changed*4 > (int)this->m_vertices.size()*3)
+		{
+			glBufferData(GL_ARRAY_BUFFER, this->m_vertices.size() * sizeof(TCoord), NULL, GL_STREAM_DRAW); // Buffer orphaning, a common way to improve streaming perf. See above link for details.
+			glBufferSubData(GL_ARRAY_BUFFER, 0, this->m_vertices.size() * sizeof(TCoord), pointer );
+		}
+		else
+		{
+			// the other vertices of the buffer are still valid, only the changed ranges are sent
+			for (unsigned int r = 0; r < d_uploadRanges.size(); ++r)
+				glBufferSubData(GL_ARRAY_BUFFER, d_uploadRanges[r].first * sizeof(TCoord), (d_uploadRanges[r].second - d_uploadRanges[r].first) * sizeof(TCoord), pointer + d_uploadRanges[r].first );
+		}
+#endif
+		d_uploadRanges.clear();
+	}
 	 
 	//
 	void Mesh::updateNormals(FEMMesh* inputMesh)
@@ -0,0 +1,713 @@
+#ifndef ParallelNarrowPhase_h__
+#define ParallelNarrowPhase_h__
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <cfloat>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "Vertex.h"
+#include "ConvexHull.h"
+#include "SupportPoint.h"
+#include "ClosestPoint.h"
+
+namespace Physics
+{
+	using namespace std;
+	using namespace NarrowPhase;
+
+	/*
+	* GJK and EPA on the pairs found by the broad phase, without rendering.
+	* The simplex and the polytope are stored in fixed size arrays of a
+	* workspace per thread, so that a test does not allocate, and the pairs are
+	* processed in an OpenMP loop.
+	* The polytope is limited to MAX_EPA_VERTICES vertices and MAX_EPA_FACES
+	* faces: when full, the closest face found so far gives the contact, as
+	* when the iterations run out. Its faces know their neighbors, and past
+	* EPA_SCAN_FACES faces they wait in a binary heap by distance to the
+	* origin: the closest face is the top of the heap, and the faces seen from
+	* a new vertex are found from it across the edges, rather than by testing
+	* every face. Removed faces stay in the heap and are skipped when they
+	* reach the top.
+	* The search directions are turned to model space, rather than the
+	* vertices to world space. Shapes with a convex hull find their support
+	* vertices by climbing the hull, from the vertex found last for the same
+	* pair, or from the hint of the shape for the first query. The vertices
+	* of the other shapes are turned to world space once per Run instead.
+	* The pairs given to Run are cached from one call to the next: a pair
+	* separated last time starts from its separating axis, which usually
+	* still separates the shapes after one support query, and a colliding pair
+	* starts from its last tetrahedron, which usually still contains the
+	* origin and goes to EPA without any GJK iteration. The entries of the
+	* pairs missing from a call are dropped.
+	*/
+	class ParallelNarrowPhase
+	{
+	public:
+		enum { MAX_GJK_ITERATIONS = 64 };
+		enum { MAX_EPA_ITERATIONS = 64 };
+		enum { MAX_EPA_VERTICES = MAX_EPA_ITERATIONS + 4 };
+		// faces are not reused, each vertex adds a few more than it removes
+		enum { MAX_EPA_FACES = 8 * MAX_EPA_VERTICES };
+		// the closest face is found by a scan until the polytope has this many faces, then by the heap
+		enum { EPA_SCAN_FACES = 48 };
+		enum { MAX_EPA_EDGES = 2 * MAX_EPA_VERTICES };
+
+		// Convex hull of model space vertices, or a precomputed hull, and its model matrix
+		struct Shape
+		{
+			const Vertex*		vertices;
+			int					count;
+			glm::vec3			center;
+			const ConvexHull*	hull;		// used instead of the vertices if not null
+			glm::mat4			transform;
+			int					start;		// hull vertex to climb from, the support vertex of the last frame
+		};
+
+		struct Contact
+		{
+			bool			colliding;
+			glm::vec3		normal;		// from the first body to the second one
+			float			depth;		// distance to move the second body along the normal to separate them
+			glm::vec3		point_a;	// deepest points of the two bodies
+			glm::vec3		point_b;
+			int				vertex_a;	// last support vertices on the hulls, to start the next frame from
+			int				vertex_b;
+		};
+
+		// Result of the last test of a pair, to start the next one from
+		struct Cache
+		{
+			bool			valid;
+			glm::vec3		axis;		// separating axis, or the normal of a colliding pair
+			int				simplex_size;	// 4 if the pair was colliding
+			int				index_a[4];	// vertices of the tetrahedron on the two shapes
+			int				index_b[4];
+		};
+
+		// Storage of the tests of one thread
+		struct Workspace
+		{
+			// support point, and the vertices of the two shapes it comes from
+			struct Point : SupportPoint
+			{
+				int			index_a, index_b;
+			};
+			struct Face
+			{
+				int			v[3];		// counter clockwise seen from outside
+				int			adjacent[3];	// face across the edge v[k] v[k+1]
+				glm::vec3	normal;
+				float		distance;	// to the origin
+				bool		alive;
+			};
+			// edge k of a removed face, on the border of the hole
+			struct Edge
+			{
+				int			face, k;
+			};
+			struct QueuedFace
+			{
+				float		distance;
+				int			face;
+
+				// reversed, so that the heap keeps the closest face on top
+				bool operator<(const QueuedFace& other) const { return distance > other.distance; }
+			};
+
+			int				start_a, start_b;
+			const glm::vec3* points_a;	// world space vertices of the shapes without hull, or null to turn the model space ones
+			const glm::vec3* points_b;
+			Point			simplex[4];
+			glm::vec3		direction;	// last search direction of GJK
+			long long		nb_gjk_iterations;
+			int				simplex_size;
+			SupportPoint	vertices[MAX_EPA_VERTICES];
+			Face			faces[MAX_EPA_FACES];
+			QueuedFace		queue[MAX_EPA_FACES];
+			int				stack[MAX_EPA_FACES];
+			Edge			edges[MAX_EPA_EDGES];
+			int				starting[MAX_EPA_VERTICES];	// new face starting and ending at each vertex of the border
+			int				ending[MAX_EPA_VERTICES];
+			int				nb_vertices, nb_faces, nb_edges, queue_size;
+		};
+
+		ParallelNarrowPhase() : d_gjk_iterations(0.0f) {}
+
+		// Test the pairs of shapes, contacts[k] is the result for pairs[k]
+		void		Run(const vector<Shape>& shapes, const vector<pair<int,int>>& pairs, vector<Contact>& contacts);
+		void		Clear_Cache() { d_keys.clear(); d_caches.clear(); }
+		// Mean number of GJK support queries per pair in the last Run
+		float		Gjk_Iterations() const { return d_gjk_iterations; }
+
+		// Test one pair with the given workspace, starting from the cache and updating it if given
+		// points_a and points_b are the world space vertices of shapes without hull, if known
+		static bool	Collide(const Shape& a, const Shape& b, Workspace& workspace, Contact& contact, Cache* cache = NULL,
+						const glm::vec3* points_a = NULL, const glm::vec3* points_b = NULL);
+
+	private:
+		vector<Workspace>	d_workspaces;
+		// cache of each pair of the last Run, at the index of the pair, and the keys of the pairs
+		vector<Cache>		d_caches;
+		vector<unsigned long long>
+							d_keys;
+		vector<Cache>		d_next_caches;
+		vector<unsigned long long>
+							d_next_keys;
+		vector<pair<unsigned long long,int>>
+							d_sorted_keys;		// keys of the last Run and their index, sorted when the pairs changed
+		vector<glm::vec3>	d_points;			// world space vertices of the shapes without hull
+		vector<int>			d_points_start;		// first of them for each shape, -1 for the shapes with a hull
+		float				d_gjk_iterations;
+
+		static glm::vec3 support(const Shape& shape, const glm::vec3* points, glm::vec3 const& direction, int& start);
+		static Workspace::Point support(const Shape& a, const Shape& b, glm::vec3 const& direction, Workspace& w);
+		static glm::vec3 vertexAt(const Shape& shape, const glm::vec3* points, int index);
+		static glm::vec3 toWorld(const Shape& shape, glm::vec3 const& point);
+		static bool	containsOrigin(const Workspace& w);
+		static bool	gjk(const Shape& a, const Shape& b, Workspace& w, const Cache* cache);
+		static bool	doSimplex(Workspace& w, glm::vec3& direction);
+		static bool	doTriangle(Workspace& w, glm::vec3& direction);
+		static void	epa(const Shape& a, const Shape& b, Workspace& w, Contact& contact);
+		static int	addFace(Workspace& w, int a, int b, int c);
+		static int	popClosest(Workspace& w);
+		static bool	removeSeen(Workspace& w, int closest, glm::vec3 const& point);
+	};
+
+	// M p for an affine model matrix, without the last row
+	inline glm::vec3 ParallelNarrowPhase::toWorld(const Shape& shape, glm::vec3 const& point)
+	{
+		const glm::mat4& m = shape.transform;
+		return glm::vec3(m[0]) * point.x + glm::vec3(m[1]) * point.y + glm::vec3(m[2]) * point.z + glm::vec3(m[3]);
+	}
+
+	// Farthest world space point of the shape along direction, start is the hull vertex to climb from and is updated
+	inline glm::vec3 ParallelNarrowPhase::support(const Shape& shape, const glm::vec3* points, glm::vec3 const& direction, int& start)
+	{
+		if (points)
+		{
+			int best = 0;
+			float max_dot = glm::dot(points[0], direction);
+			for (int i = 1; i < shape.count; i++)
+			{
+				const float d = glm::dot(points[i], direction);
+				if (d > max_dot) { max_dot = d; best = i; }
+			}
+			start = best;
+			return points[best];
+		}
+		// the support of M x along d is the support of x along transpose(M) d
+		const glm::mat4& m = shape.transform;
+		const glm::vec3 local(glm::dot(glm::vec3(m[0]), direction), glm::dot(glm::vec3(m[1]), direction), glm::dot(glm::vec3(m[2]), direction));
+		if (shape.hull && !shape.hull->Empty())
+		{
+			start = shape.hull->Support(local, start);
+			return toWorld(shape, shape.hull->Vertex_At(start));
+		}
+		int best = 0;
+		float max_dot = glm::dot(shape.vertices[0].Position, local);
+		for (int i = 1; i < shape.count; i++)
+		{
+			const float d = glm::dot(shape.vertices[i].Position, local);
+			if (d > max_dot) { max_dot = d; best = i; }
+		}
+		start = best;
+		return toWorld(shape, shape.vertices[best].Position);
+	}
+
+	inline ParallelNarrowPhase::Workspace::Point ParallelNarrowPhase::support(const Shape& a, const Shape& b, glm::vec3 const& direction, Workspace& w)
+	{
+		Workspace::Point p;
+		p.support_a = support(a, w.points_a, direction, w.start_a);
+		p.support_b = support(b, w.points_b, -direction, w.start_b);
+		p.minkowski_point = p.support_a - p.support_b;
+		p.index_a = w.start_a;
+		p.index_b = w.start_b;
+		return p;
+	}
+
+	// World space position of a vertex found by support
+	inline glm::vec3 ParallelNarrowPhase::vertexAt(const Shape& shape, const glm::vec3* points, int index)
+	{
+		if (points)
+			return points[index];
+		if (shape.hull && !shape.hull->Empty())
+			return toWorld(shape, shape.hull->Vertex_At(index));
+		return toWorld(shape, shape.vertices[index].Position);
+	}
+
+	// Keep the feature of the triangle (A last added, then B, C) closest to the origin
+	inline bool ParallelNarrowPhase::doTriangle(Workspace& w, glm::vec3& direction)
+	{
+		const Workspace::Point A = w.simplex[2], B = w.simplex[1], C = w.simplex[0];
+		const glm::vec3 AO = -A.minkowski_point;
+		const glm::vec3 AB = B.minkowski_point - A.minkowski_point;
+		const glm::vec3 AC = C.minkowski_point - A.minkowski_point;
+		const glm::vec3 ABC = glm::cross(AB,AC);
+
+		if (glm::dot(glm::cross(ABC,AC), AO) > 0.0f)
+		{
+			if (glm::dot(AC,AO) > 0.0f)
+			{
+				w.simplex[0] = C; w.simplex[1] = A; w.simplex_size = 2;
+				direction = glm::cross(glm::cross(AC,AO),AC);
+				return false;
+			}
+		}
+		else if (glm::dot(glm::cross(AB,ABC), AO) <= 0.0f)
+		{
+			// inside the prism of the triangle, above or below it
+			if (glm::dot(ABC,AO) > 0.0f)
+				direction = ABC;
+			else
+			{
+				w.simplex[0] = B; w.simplex[1] = C;
+				direction = -ABC;
+			}
+			return false;
+		}
+		if (glm::dot(AB,AO) > 0.0f)
+		{
+			w.simplex[0] = B; w.simplex[1] = A; w.simplex_size = 2;
+			direction = glm::cross(glm::cross(AB,AO),AB);
+		}
+		else
+		{
+			w.simplex[0] = A; w.simplex_size = 1;
+			direction = AO;
+		}
+		return false;
+	}
+
+	// Reduce the simplex to the feature closest to the origin, and the next direction; true if it contains the origin
+	inline bool ParallelNarrowPhase::doSimplex(Workspace& w, glm::vec3& direction)
+	{
+		switch (w.simplex_size)
+		{
+		case 2:
+			{
+				const Workspace::Point A = w.simplex[1];
+				const glm::vec3 AO = -A.minkowski_point;
+				const glm::vec3 AB = w.simplex[0].minkowski_point - A.minkowski_point;
+				if (glm::dot(AB,AO) > 0.0f)
+					direction = glm::cross(glm::cross(AB,AO),AB);
+				else
+				{
+					w.simplex[0] = A; w.simplex_size = 1;
+					direction = AO;
+				}
+				return false;
+			}
+		case 3:
+			return doTriangle(w, direction);
+		case 4:
+			{
+				const Workspace::Point A = w.simplex[3], B = w.simplex[2], C = w.simplex[1], D = w.simplex[0];
+				const glm::vec3 AO = -A.minkowski_point;
+				const glm::vec3 AB = B.minkowski_point - A.minkowski_point;
+				const glm::vec3 AC = C.minkowski_point - A.minkowski_point;
+				const glm::vec3 AD = D.minkowski_point - A.minkowski_point;
+				w.simplex_size = 3;
+				if (glm::dot(glm::cross(AB,AC), AO) > 0.0f)
+				{
+					w.simplex[0] = C; w.simplex[1] = B; w.simplex[2] = A;
+					return doTriangle(w, direction);
+				}
+				if (glm::dot(glm::cross(AD,AB), AO) > 0.0f)
+				{
+					w.simplex[0] = B; w.simplex[1] = D; w.simplex[2] = A;
+					return doTriangle(w, direction);
+				}
+				if (glm::dot(glm::cross(AC,AD), AO) > 0.0f)
+				{
+					w.simplex[0] = D; w.simplex[1] = C; w.simplex[2] = A;
+					return doTriangle(w, direction);
+				}
+				w.simplex_size = 4;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// The origin is strictly inside the tetrahedron of the simplex
+	inline bool ParallelNarrowPhase::containsOrigin(const Workspace& w)
+	{
+		const int faces[4][4] = { {0,1,2,3}, {0,3,1,2}, {0,2,3,1}, {1,3,2,0} };
+		for (int f = 0; f < 4; f++)
+		{
+			const glm::vec3 p0 = w.simplex[faces[f][0]].minkowski_point;
+			const glm::vec3 n = glm::cross(w.simplex[faces[f][1]].minkowski_point - p0, w.simplex[faces[f][2]].minkowski_point - p0);
+			const float opposite = glm::dot(n, w.simplex[faces[f][3]].minkowski_point - p0);
+			const float origin = -glm::dot(n, p0);
+			if (opposite == 0.0f || (opposite > 0.0f) != (origin > 0.0f) || origin == 0.0f) return false;
+		}
+		return true;
+	}
+
+	inline bool ParallelNarrowPhase::gjk(const Shape& a, const Shape& b, Workspace& w, const Cache* cache)
+	{
+		glm::vec3 direction = b.center - a.center;
+		if (cache && cache->valid)
+		{
+			const int count_a = (a.hull && !a.hull->Empty()) ? a.hull->Size() : a.count;
+			const int count_b = (b.hull && !b.hull->Empty()) ? b.hull->Size() : b.count;
+			bool in_shapes = cache->simplex_size == 4;
+			for (int i = 0; i < cache->simplex_size; i++)
+				in_shapes = in_shapes && cache->index_a[i] < count_a && cache->index_b[i] < count_b;
+			if (in_shapes)
+			{
+				// the last tetrahedron, moved with the shapes
+				for (int i = 0; i < 4; i++)
+				{
+					Workspace::Point& p = w.simplex[i];
+					p.index_a = cache->index_a[i];
+					p.index_b = cache->index_b[i];
+					p.support_a = vertexAt(a, w.points_a, p.index_a);
+					p.support_b = vertexAt(b, w.points_b, p.index_b);
+					p.minkowski_point = p.support_a - p.support_b;
+				}
+				w.simplex_size = 4;
+				if (containsOrigin(w))
+				{
+					w.direction = cache->axis;
+					return true;
+				}
+			}
+			direction = cache->axis;
+		}
+		if (glm::dot(direction,direction) < FLT_EPSILON) direction = glm::vec3(1.0f,0.0f,0.0f);
+
+		w.simplex[0] = support(a, b, direction, w);
+		w.simplex_size = 1;
+		++w.nb_gjk_iterations;
+		w.direction = direction;
+		// still on the same side of the separating axis
+		if (glm::dot(w.simplex[0].minkowski_point, direction) < 0.0f) return false;
+		direction = -w.simplex[0].minkowski_point;
+
+		for (int counter = 0; counter < MAX_GJK_ITERATIONS; counter++)
+		{
+			// the origin is on the simplex: touching, not penetrating
+			if (glm::dot(direction,direction) < FLT_EPSILON * FLT_EPSILON) return false;
+
+			const Workspace::Point p = support(a, b, direction, w);
+			++w.nb_gjk_iterations;
+			w.direction = direction;
+			if (glm::dot(p.minkowski_point, direction) < 0.0f) return false;
+
+			w.simplex[w.simplex_size++] = p;
+			if (doSimplex(w, direction)) return true;
+		}
+		return false;
+	}
+
+	inline int ParallelNarrowPhase::addFace(Workspace& w, int a, int b, int c)
+	{
+		if (w.nb_faces == MAX_EPA_FACES) return -1;
+		Workspace::Face& face = w.faces[w.nb_faces];
+		face.v[0] = a; face.v[1] = b; face.v[2] = c;
+		face.adjacent[0] = face.adjacent[1] = face.adjacent[2] = -1;
+		face.alive = true;
+		const glm::vec3 pa = w.vertices[a].minkowski_point;
+		const glm::vec3 n = glm::cross(w.vertices[b].minkowski_point - pa, w.vertices[c].minkowski_point - pa);
+		const float length = glm::length(n);
+		// a flat face is never the closest one
+		face.normal = (length > FLT_EPSILON) ? n / length : glm::vec3(0.0f);
+		face.distance = (length > FLT_EPSILON) ? glm::dot(face.normal, pa) : FLT_MAX;
+		if (w.nb_faces == EPA_SCAN_FACES)
+		{
+			// all the faces go to the heap
+			for (int f = 0; f <= EPA_SCAN_FACES; f++)
+			{
+				if (!w.faces[f].alive || w.faces[f].distance == FLT_MAX) continue;
+				w.queue[w.queue_size].distance = w.faces[f].distance;
+				w.queue[w.queue_size].face = f;
+				++w.queue_size;
+			}
+			make_heap(w.queue, w.queue + w.queue_size);
+		}
+		else if (w.nb_faces > EPA_SCAN_FACES && face.distance != FLT_MAX)
+		{
+			w.queue[w.queue_size].distance = face.distance;
+			w.queue[w.queue_size].face = w.nb_faces;
+			push_heap(w.queue, w.queue + ++w.queue_size);
+		}
+		return w.nb_faces++;
+	}
+
+	// Closest face still in the polytope, -1 if none
+	inline int ParallelNarrowPhase::popClosest(Workspace& w)
+	{
+		if (w.nb_faces <= EPA_SCAN_FACES)
+		{
+			// a few faces: the heap costs more than it saves
+			int closest = -1;
+			for (int f = 0; f < w.nb_faces; f++)
+				if (w.faces[f].alive && w.faces[f].distance != FLT_MAX && (closest < 0 || w.faces[f].distance < w.faces[closest].distance))
+					closest = f;
+			return closest;
+		}
+		while (w.queue_size > 0)
+		{
+			const int face = w.queue[0].face;
+			pop_heap(w.queue, w.queue + w.queue_size--);
+			if (w.faces[face].alive) return face;
+		}
+		return -1;
+	}
+
+	/*
+	* Remove the faces seen from the point, from the closest one across the
+	* edges, and keep the edges to the faces not seen. Going across the edges
+	* keeps the hole in one piece with points in the plane of a face, as for
+	* boxes. False, with the polytope unchanged, if the new faces do not fit.
+	*/
+	inline bool ParallelNarrowPhase::removeSeen(Workspace& w, int closest, glm::vec3 const& point)
+	{
+		int nb_removed = 0;
+		w.nb_edges = 0;
+		w.faces[closest].alive = false;
+		w.stack[nb_removed++] = closest;
+		bool full = false;
+		for (int s = 0; s < nb_removed && !full; s++)
+		{
+			const int g = w.stack[s];
+			for (int k = 0; k < 3; k++)
+			{
+				Workspace::Face& h = w.faces[w.faces[g].adjacent[k]];
+				if (!h.alive) continue;
+				if (glm::dot(h.normal, point - w.vertices[h.v[0]].minkowski_point) > 0.0f)
+				{
+					h.alive = false;
+					w.stack[nb_removed++] = w.faces[g].adjacent[k];
+				}
+				else if (w.nb_edges == MAX_EPA_EDGES)
+					full = true;
+				else
+				{
+					w.edges[w.nb_edges].face = g;
+					w.edges[w.nb_edges].k = k;
+					++w.nb_edges;
+				}
+			}
+		}
+		if (full || w.nb_faces + w.nb_edges > MAX_EPA_FACES)
+		{
+			for (int s = 0; s < nb_removed; s++)
+				w.faces[w.stack[s]].alive = true;
+			return false;
+		}
+		return true;
+	}
+
+	inline void ParallelNarrowPhase::epa(const Shape& a, const Shape& b, Workspace& w, Contact& contact)
+	{
+		for (int i = 0; i < 4; i++)
+			w.vertices[i] = w.simplex[i];
+		w.nb_vertices = 4;
+		w.nb_faces = 0;
+		w.queue_size = 0;
+		// faces of the tetrahedron, with the fourth vertex behind the first face, and the face across each of their edges
+		const glm::vec3 p0 = w.vertices[0].minkowski_point;
+		if (glm::dot(glm::cross(w.vertices[1].minkowski_point - p0, w.vertices[2].minkowski_point - p0), w.vertices[3].minkowski_point - p0) > 0.0f)
+			swap(w.vertices[1], w.vertices[2]);
+		addFace(w, 0, 1, 2);
+		addFace(w, 0, 3, 1);
+		addFace(w, 1, 3, 2);
+		addFace(w, 2, 3, 0);
+		const int adjacent[4][3] = { {1,2,3}, {3,2,0}, {1,3,0}, {2,1,0} };
+		for (int f = 0; f < 4; f++)
+			for (int k = 0; k < 3; k++)
+				w.faces[f].adjacent[k] = adjacent[f][k];
+
+		int closest = -1;
+		for (int counter = 0; counter < MAX_EPA_ITERATIONS; counter++)
+		{
+			closest = popClosest(w);
+			if (closest < 0) break;
+			const Workspace::Face& face = w.faces[closest];
+
+			const SupportPoint p = support(a, b, face.normal, w);
+			if (glm::dot(face.normal, p.minkowski_point) - face.distance < 0.0001f) break;
+			if (w.nb_vertices == MAX_EPA_VERTICES) break;
+			if (!removeSeen(w, closest, p.minkowski_point)) break;
+			const int v = w.nb_vertices++;
+			w.vertices[v] = p;
+
+			// a cone of faces from the border of the hole to the new vertex
+			for (int e = 0; e < w.nb_edges; e++)
+			{
+				const Workspace::Face& g = w.faces[w.edges[e].face];
+				const int k = w.edges[e].k;
+				const int va = g.v[k], vb = g.v[(k + 1) % 3];
+				const int outer = g.adjacent[k];
+				const int f = addFace(w, va, vb, v);
+				w.faces[f].adjacent[0] = outer;
+				for (int j = 0; j < 3; j++)
+					if (w.faces[outer].v[j] == vb && w.faces[outer].v[(j + 1) % 3] == va)
+						w.faces[outer].adjacent[j] = f;
+				w.starting[va] = f;
+				w.ending[vb] = f;
+			}
+			for (int f = w.nb_faces - w.nb_edges; f < w.nb_faces; f++)
+			{
+				w.faces[f].adjacent[1] = w.starting[w.faces[f].v[1]];	// across vb v
+				w.faces[f].adjacent[2] = w.ending[w.faces[f].v[0]];		// across v va
+			}
+			closest = -1;
+		}
+
+		// the iterations ran out after removing the closest face
+		if (closest < 0)
+		{
+			for (int f = 0; f < w.nb_faces; f++)
+				if (w.faces[f].alive && (closest < 0 || w.faces[f].distance < w.faces[closest].distance))
+					closest = f;
+		}
+		const Workspace::Face& face = w.faces[closest];
+		const SupportPoint& pa = w.vertices[face.v[0]];
+		const SupportPoint& pb = w.vertices[face.v[1]];
+		const SupportPoint& pc = w.vertices[face.v[2]];
+		contact.normal = face.normal;
+		contact.depth = (face.distance == FLT_MAX) ? 0.0f : face.distance;
+		glm::vec3 barycentric = ClosestPoint::ToTriangle(face.normal * contact.depth, pa.minkowski_point, pb.minkowski_point, pc.minkowski_point);
+		if (barycentric != barycentric) barycentric = glm::vec3(1.0f, 0.0f, 0.0f);
+		contact.point_a = barycentric.x * pa.support_a + barycentric.y * pb.support_a + barycentric.z * pc.support_a;
+		contact.point_b = barycentric.x * pa.support_b + barycentric.y * pb.support_b + barycentric.z * pc.support_b;
+	}
+
+	inline bool ParallelNarrowPhase::Collide(const Shape& a, const Shape& b, Workspace& workspace, Contact& contact, Cache* cache,
+		const glm::vec3* points_a, const glm::vec3* points_b)
+	{
+		workspace.start_a = a.start;
+		workspace.start_b = b.start;
+		workspace.points_a = points_a;
+		workspace.points_b = points_b;
+		contact.colliding = gjk(a, b, workspace, cache);
+		contact.depth = 0.0f;
+		contact.normal = glm::vec3(0.0f);
+		if (cache)
+		{
+			// the tetrahedron before EPA, which reorders the simplex
+			cache->valid = true;
+			cache->axis = workspace.direction;
+			cache->simplex_size = contact.colliding ? 4 : 0;
+			for (int i = 0; i < cache->simplex_size; i++)
+			{
+				cache->index_a[i] = workspace.simplex[i].index_a;
+				cache->index_b[i] = workspace.simplex[i].index_b;
+			}
+		}
+		if (contact.colliding)
+		{
+			epa(a, b, workspace, contact);
+			// a colliding pair separates along its normal
+			if (cache && contact.depth > 0.0f) cache->axis = contact.normal;
+		}
+		contact.vertex_a = workspace.start_a;
+		contact.vertex_b = workspace.start_b;
+		return contact.colliding;
+	}
+
+	inline void ParallelNarrowPhase::Run(const vector<Shape>& shapes, const vector<pair<int,int>>& pairs, vector<Contact>& contacts)
+	{
+		const int nbPairs = pairs.size();
+		contacts.resize(nbPairs);
+		int nbThreads = 1;
+#ifdef _OPENMP
+		nbThreads = omp_get_max_threads();
+#endif
+		if ((int)d_workspaces.size() < nbThreads) d_workspaces.resize(nbThreads);
+		for (auto& w : d_workspaces)
+			w.nb_gjk_iterations = 0;
+
+		// the caches are at the index of their pair. The broad phase gives mostly the same pairs
+		// in the same order from one frame to the next, so they are found at the same index,
+		// or shifted as much as the last one found after pairs were added or removed,
+		// and the others in the keys of the last Run, sorted only if needed
+		d_next_keys.resize(nbPairs);
+		bool same = (nbPairs == (int)d_keys.size());
+		for (int k = 0; k < nbPairs; k++)
+		{
+			d_next_keys[k] = ((unsigned long long)pairs[k].first << 32) | (unsigned int)pairs[k].second;
+			same = same && d_next_keys[k] == d_keys[k];
+		}
+		if (!same)
+		{
+			const int nbLast = d_keys.size();
+			bool sorted = false;
+			int shift = 0;
+			d_next_caches.resize(nbPairs);
+			for (int k = 0; k < nbPairs; k++)
+			{
+				const unsigned long long key = d_next_keys[k];
+				int last = -1;
+				if (k + shift >= 0 && k + shift < nbLast && d_keys[k + shift] == key)
+					last = k + shift;
+				else if (nbLast > 0)
+				{
+					if (!sorted)
+					{
+						d_sorted_keys.resize(nbLast);
+						for (int i = 0; i < nbLast; i++)
+							d_sorted_keys[i] = make_pair(d_keys[i], i);
+						std::sort(d_sorted_keys.begin(), d_sorted_keys.end());
+						sorted = true;
+					}
+					auto it = std::lower_bound(d_sorted_keys.begin(), d_sorted_keys.end(), make_pair(key, -1));
+					if (it != d_sorted_keys.end() && it->first == key)
+					{
+						last = it->second;
+						shift = last - k;
+					}
+				}
+				if (last >= 0) d_next_caches[k] = d_caches[last];
+				else d_next_caches[k].valid = false;
+			}
+			d_caches.swap(d_next_caches);
+		}
+		d_keys.swap(d_next_keys);
+
+		// the vertices of the shapes without hull are turned to world space here once,
+		// rather than by each of their support queries
+		const int nbShapes = shapes.size();
+		d_points_start.resize(nbShapes);
+		int nbPoints = 0;
+		for (int s = 0; s < nbShapes; s++)
+		{
+			const bool hull = shapes[s].hull && !shapes[s].hull->Empty();
+			d_points_start[s] = hull ? -1 : nbPoints;
+			if (!hull) nbPoints += shapes[s].count;
+		}
+		d_points.resize(nbPoints);
+		for (int s = 0; s < nbShapes; s++)
+			for (int i = 0; d_points_start[s] >= 0 && i < shapes[s].count; i++)
+				d_points[d_points_start[s] + i] = toWorld(shapes[s], shapes[s].vertices[i].Position);
+
+		#pragma omp parallel for schedule(dynamic,16)
+		for (int k = 0; k < nbPairs; k++)
+		{
+			int thread = 0;
+#ifdef _OPENMP
+			thread = omp_get_thread_num();
+#endif
+			const int first = pairs[k].first, second = pairs[k].second;
+			Collide(shapes[first], shapes[second], d_workspaces[thread], contacts[k], &d_caches[k],
+				(d_points_start[first] >= 0) ? d_points.data() + d_points_start[first] : NULL,
+				(d_points_start[second] >= 0) ? d_points.data() + d_points_start[second] : NULL);
+		}
+
+		long long iterations = 0;
+		for (auto& w : d_workspaces)
+			iterations += w.nb_gjk_iterations;
+		d_gjk_iterations = nbPairs ? (float)iterations / nbPairs : 0.0f;
+	}
+}
+
+#endif // ParallelNarrowPhase_h__
@@ -38,6 +38,7 @@
 #include "CollidingPair.h"
 #include "Light.h"
 #include "Plane.h"
+#include "CollisionBenchmark.h"
 
 #include <glm/gtx/rotate_vector.hpp>
 class btShapeHull;
@@ -397,6 +398,8 @@ namespace Controller
 
 		AbstractController::Init(argc,argv);
 
+		Run_Collision_Benchmark(argc, argv);
+
 		d_camera->Position = glm::vec3(0,20,20);
 		d_camera->CameraType = FREE_FLY;
 		d_camera->MovementSpeed = 2.0f; 
@@ -691,70 +694,18 @@ namespace Controller
 
 		//	d_shader_boundings->SetUniform("shape_color",d_collision_color);
 #ifdef NARROW_PHASE
-		auto colliding_pairs = d_rigid_body_manager->CollidingPairs();
-		if (colliding_pairs->size())
-		{
-			d_shader_boundings->Use();
-			d_shader_boundings->SetUniform("mvp",projection_view * glm::mat4());
-
-			d_shader_boundings->SetUniform("model_matrix",glm::mat4()); 
-			for (auto pair : *colliding_pairs)
-			{
-				GJK *gjk = new GJK(
-					pair.m_left_element->Bounding_box()->m_model_space_vertices,
-					pair.m_right_element->Bounding_box()->m_model_space_vertices,
-					pair.m_left_element->Bounding_box()->m_center,
-					pair.m_right_element->Bounding_box()->m_center);  
-
-				d_is_narrow_phase_collision = gjk->Intersect(*d_shader_boundings); 
-				if (d_is_narrow_phase_collision )
-				{
-					d_collision_color = glm::vec4(1.0f,0.0f,0.0f,0.3f);
-					auto p1 =  gjk->m_intersection_point_a;
-					auto p2 =  gjk->m_intersection_point_b;
-
-					/*	Point p(p1);
-					Point origin(glm::vec3(0.0f));
-					Point p4(p2);
-					Line l(p1,p2);
-					d_shader_boundings->SetUniform("shape_color",glm::vec4(0.0f,1.0f,1.0f,1.0f));
-
-					p.Draw();
-					p4.Draw();
-					origin.Draw();
-
-					d_shader_boundings->SetUniform("shape_color",glm::vec4(0.0f,1.0f,0.0f,1.0f));
-
-					l.Draw();*/
-
-					auto force = pair.m_right_element->Calculate_Collision_Response(*pair.m_left_element,p1,p2,gjk->m_normal,false);
-
-					auto force1_dir = force * gjk->m_normal;
-					auto force2_dir = -force * gjk->m_normal; 
-					/*	
-					pair.m_right_element->Apply_Impulse(force1_dir,p1 - pair.m_right_element->Center_of_mass());
-					pair.m_left_element->Apply_Impulse(force2_dir,p2 - pair.m_left_element->Center_of_mass());
-					*/
-					pair.m_right_element->m_linear_momentum += force1_dir;
-
-					pair.m_right_element->m_angular_momentum += glm::cross(p1 - pair.m_right_element->Center_of_mass() , force1_dir);
-
-					pair.m_left_element->m_linear_momentum -= force1_dir;
-					pair.m_left_element->m_angular_momentum -= glm::cross(p2 - pair.m_left_element->Center_of_mass(), force1_dir);  
-
-					//glDisable(GL_CULL_FACE);
-					//glDisable(GL_DEPTH_TEST); 
-
-				} 
-
-				delete gjk;
-			}
-		}
-		else
+		d_rigid_body_manager->ComputeContacts();
+		auto& contacts = d_rigid_body_manager->Contacts();
+		d_collision_color = glm::vec4(.0f,.0f,.0f,1.0f);
+		d_is_narrow_phase_collision = false; 
+		for (int k = 0; k < contacts.size(); k++)
 		{
-			d_collision_color = glm::vec4(.0f,.0f,.0f,1.0f);
-			d_is_narrow_phase_collision = false; 
+			if (!contacts[k].colliding) continue;
+			d_is_narrow_phase_collision = true;
+			d_collision_color = glm::vec4(1.0f,0.0f,0.0f,0.3f);
 		}
+		// contact manifolds and impulses for all the pairs and planes at once, instead of one impulse per pair
+		d_rigid_body_manager->Solve_Contacts();
 #endif
 
 
@@ -11,6 +11,9 @@
 
 using namespace Controller;
 
+// counted in the allocation audit of the simulation (--check-allocations)
+SOFA_COUNT_HEAP_ALLOCATIONS()
+
 float rot_speed = 50.0f; // 50 radians per second 
  
 int main(int argc, char* argv[])
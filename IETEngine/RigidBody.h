@@ -3,6 +3,7 @@
 
 #include "Model.h"
 #include "Friction.h"
+#include "ConvexHull.h"
 #include <glm/gtx/orthonormalize.hpp>
 
 #define REST_FACTOR		1.0f
@@ -30,6 +31,7 @@ namespace Physics
 
 		float					m_damping_factor;
 		bool					m_use_damping;
+		bool					m_use_hull_bounds;	// exact box of the convex hull rather than the box of the model space box
 
 		RigidBody(Model&);
 		~RigidBody();
@@ -54,6 +56,11 @@ namespace Physics
 
 		BoundingBox*			d_bounding_box;
 		BoundingSphere*			d_bounding_sphere;
+		ConvexHull				d_convex_hull;		// of the vertices of all the meshes, in model space
+
+		// not copyable, the bounding volumes are owned (declared only, v110 has no = delete)
+		RigidBody(const RigidBody&);
+		RigidBody&				operator=(const RigidBody&);
 
 	public:
 		void					Update(float delta_time, bool use_polyhedral);
@@ -70,6 +77,7 @@ namespace Physics
 		float					Polyhedral_Mass() const;
 		BoundingSphere*			Bounding_sphere();
 		BoundingBox*			Bounding_box() ;
+		ConvexHull				const& Convex_hull() const;
 		float Calculate_Collision_Response(const RigidBody& other, glm::vec3 contact_point_a, 
 			glm::vec3 contact_point_b, glm::vec3 normal, bool use_polyhedral);
 
@@ -91,6 +99,7 @@ namespace Physics
 	glm::vec3				RigidBody::Center_of_mass()  const	 { return d_center_of_mass; } 
 	BoundingSphere*			RigidBody::Bounding_sphere()		 { return d_bounding_sphere; } 
 	BoundingBox*			RigidBody::Bounding_box()			 { return d_bounding_box ; } 
+	ConvexHull				const& RigidBody::Convex_hull() const { return d_convex_hull; }
 
 #pragma endregion 
 
@@ -105,19 +114,25 @@ namespace Physics
 		m_acceleration(0.0f),
 		m_linear_momentum(0.0f),
 		m_angular_momentum(0.0f),
+		m_force(0.0f),
+		m_force_application_point(0.0f),
 		m_damping_factor(0.2f),
-		m_use_damping(true)
+		m_use_damping(true),
+		m_use_hull_bounds(false),
+		d_bounding_box(nullptr),
+		d_bounding_sphere(nullptr)
 	{
 
 		calculate_mesh_stats();
 		d_center_of_mass += model.Position();
 		d_bounding_sphere->center += model.Position();
-		d_bounding_box->m_center += model.Position();
+		d_bounding_box->Recalculate_Bounding_Box(m_model.GetModelMatrix());
 	}
 
 	RigidBody::~RigidBody()
 	{
 		delete d_bounding_sphere;
+		delete d_bounding_box;
 	}
 
 	void RigidBody::Update(float delta_time, bool use_polyhedral)
@@ -161,14 +176,15 @@ namespace Physics
 		orientation = glm::normalize(orientation);
 		m_position =  m_linear_momentum * delta_time / mass;
 
-		d_bounding_sphere->center += m_position;
-		d_bounding_box->m_center += m_position;
-
-		d_bounding_box->Recalculate_Bounding_Box(&position,&orientation);
-		d_bounding_box->Recalculate_Vertices(&m_model.GetModelMatrix());
 		m_model.Rotate(orientation);
 		m_model.Translate(m_position);
 
+		// from the model space box or hull and the new model matrix, no vertex is transformed
+		if (m_use_hull_bounds)
+			d_bounding_box->Recalculate_Bounding_Box(m_model.GetModelMatrix(), d_convex_hull);
+		else
+			d_bounding_box->Recalculate_Bounding_Box(m_model.GetModelMatrix());
+
 		d_center_of_mass  = m_model.GetPositionVec();
 		d_bounding_sphere->center = d_center_of_mass;
 		m_force = glm::vec3(0.0f);
@@ -206,27 +222,34 @@ namespace Physics
 	void  RigidBody::calculate_mesh_stats()
 	{
 		auto meshes = *this->m_model.Meshes();
+		vector<glm::vec3> hull_points;
 
 		for (auto mesh : meshes)
 		{
 			d_area += mesh.Area();
+			for (auto& v : mesh.m_vertices)
+				hull_points.push_back(glm::vec3(v[0], v[1], v[2]));
 
-		//	d_bounding_box = new BoundingBox(mesh.Bounding_box());
-//			d_bounding_sphere = new BoundingSphere(mesh.Bounding_sphere()); 
 			d_center_of_mass += mesh.m_center_of_mass;
 			d_polyhedral_center_of_mass += mesh.m_polyhedral_center_of_mass;
 
-			Inertia::Compute_Tensor_With_AABB(*d_bounding_box,d_mass,d_inertial_tensor);
 			Inertia::Compute_Polyhedral_Tensor(mesh,d_polyhedral_mass,d_polyhedral_tensor);
 		}
 
 		d_center_of_mass /= meshes.size();
 		d_polyhedral_center_of_mass /= meshes.size();
 
+		// the bounding volumes only keep the model space box and the hull, not copies of the vertices
+		d_convex_hull.Build(hull_points);
+		d_bounding_box = new BoundingBox(hull_points);
+		vector<Vertex> hull_vertices;
+		for (int i = 0; i < d_convex_hull.Size(); i++)
+			hull_vertices.push_back(Vertex(d_convex_hull.Vertex_At(i)));
+		d_bounding_sphere = new BoundingSphere(hull_vertices);
+		Inertia::Compute_Tensor_With_AABB(*d_bounding_box,d_mass,d_inertial_tensor);
+
 		d_inverse_inertial_tensor	= glm::inverse(d_inertial_tensor);
 		d_inverse_polyhedral_tensor = glm::inverse(d_polyhedral_tensor);
-
-		d_bounding_box->Recalculate_Vertices(&m_model.GetModelMatrix());
 	} 
 
 	float RigidBody::Calculate_Collision_Response(const RigidBody& other, glm::vec3 contact_point_a, glm::vec3 contact_point_b, glm::vec3 normal, bool use_polyhedral)
@@ -10,15 +10,31 @@
 #include "Cube.h"
 #include "CollidingPair.h"
 #include "Plane.h"
+#include "SpatialHash.h"
+#include "SweepAndPrune.h"
+#include "DynamicAABBTree.h"
+#include "ParallelNarrowPhase.h"
+#include "ContactSolver.h"
+#include "Islands.h"
 
 namespace Physics
 {
+	enum BroadPhaseType
+	{
+		SWEEP_AND_PRUNE,
+		AABB_TREE
+	};
+
 	class RigidBodyManager
 	{ 
 	public:
 		bool								m_use_polyhedral;
 		float								m_damping_factor;
 		bool								m_use_damping;
+		BroadPhaseType						m_broad_phase;
+		glm::vec3							m_gravity;		// added to the velocities by Solve_Contacts
+		bool								m_use_sleeping;
+		bool								m_use_hull_bounds;
 
 
 	private:
@@ -32,7 +48,35 @@ namespace Physics
 		glm::vec4							d_colliding_color;
 		glm::vec4							d_non_colliding_color;
 
-		size_t								d_sort_axis;
+		SweepAndPrune						d_box_broad_phase;
+		vector<glm::vec3>					d_box_mins;
+		vector<glm::vec3>					d_box_maxs;
+		DynamicAABBTree						d_box_tree;
+		vector<glm::vec3>					d_box_displacements;
+		bool								d_box_tree_valid;
+		vector<pair<int,int>>				d_box_pairs;
+		vector<int>							d_query_bodies;
+		vector<pair<float,int>>				d_query_hits;
+		double								d_delta_time;
+
+		vector<pair<int,int>>				d_colliding_indices;
+		vector<pair<int,int>>				d_sleeping_indices;	// overlapping boxes of two sleeping bodies, not tested
+		ParallelNarrowPhase					d_narrow_phase;
+		vector<ParallelNarrowPhase::Shape>	d_shapes;
+		vector<ParallelNarrowPhase::Contact> d_contacts;
+		vector<int>							d_support_hints;	// hull vertex of each body to start the next support queries from
+		ContactSolver						d_contact_solver;
+		vector<ContactSolver::Body>			d_solver_bodies;
+		bool								d_solve_contacts;	// the planes are contacts of the solver rather than bounces
+		Islands								d_islands;
+		vector<float>						d_linear_speeds;
+		vector<float>						d_angular_speeds;
+		vector<pair<int,int>>				d_island_pairs;
+
+		SpatialHash							d_sphere_broad_phase;
+		vector<glm::vec3>					d_sphere_centers;
+		vector<float>						d_sphere_radii;
+		vector<pair<int,int>>				d_sphere_pairs;
 
 	public:
 		RigidBodyManager();
@@ -45,15 +89,45 @@ namespace Physics
 		void		Update(double delta_time); 
 		void		CheckSphereCollisions();
 		void		CheckAABBCollisions();
+		// GJK and EPA on the colliding pairs of the last CheckAABBCollisions, in parallel
+		void		ComputeContacts();
+		// Persistent contact manifolds of the colliding pairs of the last ComputeContacts and of the planes,
+		// and the momenta of the bodies changed by the sequential impulse solver
+		void		Solve_Contacts();
+		void		SetSolverIterations(int iterations);
 		void		Draw_Bounding_Box(Shader& shader, glm::mat4 projection_view);
 		void		Draw_Bounding_Sphere(Shader& shader, glm::mat4 projection_view);
 		void		Draw_Boundings(Shader& shader, glm::mat4 projection_view);
 		void		ApplyImpulseToAll();
 		void		SetDampingFactor(float damping);
 		void		Damping(bool enable);
+		// Exact boxes of the convex hulls, instead of the larger boxes of the model space boxes
+		void		Hull_Bounds(bool enable);
+		// A sleeping body is not moved, nor bounded again, nor tested against the other sleeping ones,
+		// until a body in contact, an impulse or Wake_Up wakes its island
+		void		Sleeping(bool enable);
+		void		Wake_Up(int body);
+		void		Wake_Up_All();
+		bool		Is_Sleeping(int body) const { return d_islands.Is_Sleeping(body); }
+		int			Nb_Sleeping() const { return d_islands.Nb_Sleeping(); }
 
 		vector<CollidingPair<RigidBody>> 
 					const& CollidingPairs() const;
+		// Result of ComputeContacts for each of the CollidingPairs, the normal goes from the left element to the right one
+		vector<ParallelNarrowPhase::Contact>
+					const& Contacts() const { return d_contacts; }
+		// Pairs of bodies whose boxes started or stopped overlapping in the last CheckAABBCollisions, with SWEEP_AND_PRUNE
+		vector<pair<int,int>>
+					const& StartedBoxOverlaps() const { return d_box_broad_phase.Added(); }
+		vector<pair<int,int>>
+					const& EndedBoxOverlaps() const { return d_box_broad_phase.Removed(); }
+		// Bodies whose box overlaps the given one, and the first body hit by a ray (nullptr if none),
+		// from the boxes of the last CheckAABBCollisions
+		void		Query_Box(glm::vec3 const& min, glm::vec3 const& max, vector<RigidBody*>& bodies);
+		RigidBody*	Ray_Cast(glm::vec3 const& origin, glm::vec3 const& direction, float max_distance, float* distance = nullptr);
+		// Indices of the bodies whose bounding spheres overlapped in the last CheckSphereCollisions, i < j
+		vector<pair<int,int>>
+					const& SpherePairs() const { return d_sphere_pairs; }
 
 
 
@@ -61,6 +135,8 @@ namespace Physics
 		void		drawBoundingSphere(RigidBody& rigid_body);
 		void		drawCenterOfMass(RigidBody& rigid_body);
 		void		checkPlaneCollision(RigidBody& rigid_body, float delta_time);
+		void		updateBoxTree();
+		void		updateIslands(float delta_time);
 	};
 
 
@@ -68,9 +144,15 @@ namespace Physics
 		: m_use_polyhedral(false),
 		m_damping_factor(0.2f),
 		m_use_damping(true),
+		m_broad_phase(SWEEP_AND_PRUNE),
+		m_gravity(0.0f),
+		m_use_sleeping(false),
+		m_use_hull_bounds(false),
 		d_colliding_color(glm::vec4(1.0f,0.0f,0.0f,0.3f)),
 		d_non_colliding_color(glm::vec4(0.0f,0.0f,1.0f,1.0f)),
-		d_sort_axis(0)
+		d_box_tree_valid(false),
+		d_delta_time(0.0),
+		d_solve_contacts(false)
 	{
 
 	}
@@ -79,6 +161,7 @@ namespace Physics
 	inline void RigidBodyManager::Add(Model* model)
 	{
 		auto rigid_body = new RigidBody(*model);
+		rigid_body->m_use_hull_bounds = m_use_hull_bounds;
 		this->d_rigid_bodies.push_back(rigid_body);
 
 		auto sphere = new Sphere(rigid_body->Bounding_sphere()->radius,50,glm::vec3(0.0f));
@@ -95,108 +178,268 @@ namespace Physics
 
 	inline void RigidBodyManager::Update(double delta_time)
 	{
-		for (auto rigid_body : d_rigid_bodies)
+		d_delta_time = delta_time;
+		updateIslands((float)delta_time);
+		for (int i = 0; i < d_rigid_bodies.size(); i++)
 		{
+			auto rigid_body = d_rigid_bodies[i];
 			rigid_body->Bounding_sphere()->ChangeColor(d_non_colliding_color);
 			rigid_body->Bounding_box()->m_is_colliding = glm::vec3(0.0f);
+			if (d_islands.Is_Sleeping(i)) continue;
 			rigid_body->Update(delta_time,m_use_polyhedral);
-			checkPlaneCollision(*rigid_body, delta_time);
+			if (!d_solve_contacts) checkPlaneCollision(*rigid_body, delta_time);
+		}
+	}
+
+	inline void RigidBodyManager::updateIslands(float delta_time)
+	{
+		const int n = d_rigid_bodies.size();
+		d_islands.Resize(n);
+		if (!m_use_sleeping)
+		{
+			if (d_islands.Nb_Sleeping() > 0) d_islands.Wake_Up_All();
+			return;
+		}
+
+		d_linear_speeds.resize(n);
+		d_angular_speeds.resize(n);
+		for (int i = 0; i < n; i++)
+		{
+			auto rigid_body = d_rigid_bodies[i];
+			// an impulse is waiting for the next Update of the body
+			if (rigid_body->m_force != glm::vec3(0.0f)) d_islands.Wake_Up(i);
+			float mass = m_use_polyhedral ? rigid_body->Polyhedral_Mass() : rigid_body->Mass();
+			d_linear_speeds[i] = glm::length(rigid_body->m_linear_momentum) / mass;
+			d_angular_speeds[i] = glm::length(rigid_body->Inertial_Tensor(m_use_polyhedral) * rigid_body->m_angular_momentum);
+		}
+
+		//The islands come from the bodies in contact in the last frame: the manifolds of the solver,
+		//which are kept between sleeping bodies, or else the colliding pairs
+		if (d_solve_contacts)
+			d_contact_solver.Body_Pairs(d_island_pairs);
+		else
+		{
+			//The pairs of sleeping bodies are not tested, but still link their islands
+			d_island_pairs = d_colliding_indices;
+			d_island_pairs.insert(d_island_pairs.end(), d_sleeping_indices.begin(), d_sleeping_indices.end());
 		}
+		d_islands.Update(d_island_pairs, d_linear_speeds, d_angular_speeds, delta_time);
+
+		for (int i = 0; i < n; i++)
+		{
+			if (!d_islands.Is_Sleeping(i)) continue;
+			d_rigid_bodies[i]->m_linear_momentum = glm::vec3(0.0f);
+			d_rigid_bodies[i]->m_angular_momentum = glm::vec3(0.0f);
+		}
+	}
+
+	inline void RigidBodyManager::Sleeping(bool enable)
+	{
+		m_use_sleeping = enable;
+		if (!enable) d_islands.Wake_Up_All();
+	}
+
+	inline void RigidBodyManager::Wake_Up(int body)
+	{
+		if (body < d_islands.Nb_Bodies()) d_islands.Wake_Up(body);
+	}
+
+	inline void RigidBodyManager::Wake_Up_All()
+	{
+		d_islands.Wake_Up_All();
 	}
 
 	inline void RigidBodyManager::CheckSphereCollisions()
 	{
+		//The grid is rebuilt from the current spheres, so it follows the bodies without any update.
+		//O(n) for bodies of similar sizes, instead of testing every pair
+		d_sphere_centers.resize(d_rigid_bodies.size());
+		d_sphere_radii.resize(d_rigid_bodies.size());
 		for (int i = 0; i < d_rigid_bodies.size(); i++)
 		{
-			for (int j = i+1; j < d_rigid_bodies.size() ; j++)
-			{
-				if (i==j) continue;
-
-				auto sphere1 = d_rigid_bodies[i]->Bounding_sphere();
-				auto sphere2 = d_rigid_bodies[j]->Bounding_sphere();
+			auto sphere = d_rigid_bodies[i]->Bounding_sphere();
+			d_sphere_centers[i] = sphere->center;
+			d_sphere_radii[i] = sphere->radius;
+		}
 
-				bool overlap = sphere1->Overlaps(sphere2);
+		d_sphere_broad_phase.Find_Pairs(d_sphere_centers, d_sphere_radii, d_sphere_pairs);
 
-				if (overlap) 
-				{
-					sphere2->ChangeColor(d_colliding_color);
-					sphere1->ChangeColor(d_colliding_color);
-				}
-			}
+		for (auto pair : d_sphere_pairs)
+		{
+			d_rigid_bodies[pair.first]->Bounding_sphere()->ChangeColor(d_colliding_color);
+			d_rigid_bodies[pair.second]->Bounding_sphere()->ChangeColor(d_colliding_color);
 		}
 	}
 
 	inline void RigidBodyManager::CheckAABBCollisions()
 	{
-		vector<EndPoint> x_axis,y_axis,z_axis;
-		bool x_overlap,y_overlap,z_overlap;
-		BoundingBox *x_current,*y_current,*z_current;
-		BoundingBox *x_next,*y_next,*z_next;
 		d_colliding_pairs.clear();
-		//First sweep and prune step algorithm. I use an ordered data structure to create the three axis lists.
-		//O(n)
-		for (auto rigid_body : d_rigid_bodies)
+		d_colliding_indices.clear();
+		d_sleeping_indices.clear();
+		d_box_mins.resize(d_rigid_bodies.size());
+		d_box_maxs.resize(d_rigid_bodies.size());
+		for (int i = 0; i < d_rigid_bodies.size(); i++)
 		{
-			x_axis.push_back(rigid_body->Bounding_box()->Get_EndPoint_X());
-			y_axis.push_back(rigid_body->Bounding_box()->Get_EndPoint_Y());
-			z_axis.push_back(rigid_body->Bounding_box()->Get_EndPoint_Z());
+			auto bounding_box = d_rigid_bodies[i]->Bounding_box();
+			EndPoint x = bounding_box->Get_EndPoint_X(), y = bounding_box->Get_EndPoint_Y(), z = bounding_box->Get_EndPoint_Z();
+			d_box_mins[i] = glm::vec3(x.m_min_point, y.m_min_point, z.m_min_point);
+			d_box_maxs[i] = glm::vec3(x.m_max_point, y.m_max_point, z.m_max_point);
 		}
 
-		//Sorting O(n log (n) )
-		std::sort(x_axis.begin(),x_axis.end());
-		std::sort(y_axis.begin(),y_axis.end());
-		std::sort(z_axis.begin(),z_axis.end());
-
+		//Sweep and prune: the end point lists stay sorted between the frames, so they only need an
+		//insertion sort, close to O(n) when the bodies move a little.
+		//AABB tree: the leaves hold fattened boxes, extended along the displacement of the last frame,
+		//so that most of the bodies stay in their leaf, whatever their sizes and speeds.
+		//The tree also answers the queries, it is only updated for them with the sweep and prune.
+		d_box_tree_valid = false;
+		if (m_broad_phase == AABB_TREE)
+		{
+			updateBoxTree();
+			d_box_tree.Find_Pairs(d_box_pairs);
+		}
+		else
+		{
+			d_box_broad_phase.Update(d_box_mins, d_box_maxs);
+			d_box_pairs.clear();
+			for (auto key : d_box_broad_phase.Pairs())
+				d_box_pairs.push_back(SweepAndPrune::Pair_From_Key(key));
+		}
 
 		//I determine which pairs collide
-		//O(n)
-		glm::vec3 s(0.0f);
-		glm::vec3 s2(0.0f);
-		glm::vec3 v;
+		//O(number of overlapping boxes)
+		for (auto pair : d_box_pairs)
+		{
+			auto box1 = d_rigid_bodies[pair.first]->Bounding_box();
+			auto box2 = d_rigid_bodies[pair.second]->Bounding_box();
 
+			if (!box2->Overlaps(*box1)) continue;
+			// nothing moved between two sleeping bodies, their manifold is kept by the solver
+			if (d_islands.Is_Sleeping(pair.first) && d_islands.Is_Sleeping(pair.second))
+			{
+				d_sleeping_indices.push_back(make_pair(pair.second, pair.first));
+				continue;
+			}
+
+			d_colliding_pairs.push_back(CollidingPair<RigidBody>(d_rigid_bodies[pair.second] ,d_rigid_bodies[pair.first]));
+			d_colliding_indices.push_back(make_pair(pair.second, pair.first));
+
+			box2->m_is_colliding = glm::vec3(1.0f);
+			box1->m_is_colliding = glm::vec3(1.0f);
+		}
+	}
+
+
+	inline void RigidBodyManager::ComputeContacts()
+	{
+		d_shapes.resize(d_rigid_bodies.size());
+		d_support_hints.resize(d_rigid_bodies.size(), 0);
 		for (int i = 0; i < d_rigid_bodies.size(); i++)
 		{
+			auto bounding_box = d_rigid_bodies[i]->Bounding_box();
+			// the hull is in model space, the support queries turn their directions with the model matrix
+			d_shapes[i].vertices = nullptr;
+			d_shapes[i].count = 0;
+			d_shapes[i].center = bounding_box->m_center;
+			d_shapes[i].hull = &d_rigid_bodies[i]->Convex_hull();
+			d_shapes[i].transform = d_rigid_bodies[i]->m_model.GetModelMatrix();
+			d_shapes[i].start = d_support_hints[i];
+		}
+		// the narrow phase keeps the separating axis or the tetrahedron of each pair from the last frame
+		d_narrow_phase.Run(d_shapes, d_colliding_indices, d_contacts);
 
-			s   += d_rigid_bodies[i]->Center_of_mass();
-			s2  += d_rigid_bodies[i]->Center_of_mass() * d_rigid_bodies[i]->Center_of_mass();
+		// the bodies turn a little each frame, their support vertices are close to the last ones
+		for (int k = 0; k < d_contacts.size(); k++)
+		{
+			d_support_hints[d_colliding_indices[k].first] = d_contacts[k].vertex_a;
+			d_support_hints[d_colliding_indices[k].second] = d_contacts[k].vertex_b;
+		}
+	}
 
-			for (int j = i+1; j < d_rigid_bodies.size(); j++)
+	inline void RigidBodyManager::Solve_Contacts()
+	{
+		const float delta_time = (float)d_delta_time;
+		if (delta_time <= 0.0f || d_shapes.size() != d_rigid_bodies.size()) return;
+		d_solve_contacts = true;
+
+		d_solver_bodies.resize(d_rigid_bodies.size());
+		for (int i = 0; i < d_rigid_bodies.size(); i++)
+		{
+			auto rigid_body = d_rigid_bodies[i];
+			auto& body = d_solver_bodies[i];
+			float mass = m_use_polyhedral ? rigid_body->Polyhedral_Mass() : rigid_body->Mass();
+			body.transform = d_shapes[i].transform;
+			body.center = rigid_body->Center_of_mass();
+			if (d_islands.Is_Sleeping(i))
 			{
-				vector<EndPoint>* current_axis = nullptr;
-				switch (d_sort_axis)
-				{
-				case 0:
-					current_axis = &x_axis;
-					break;
-				case 1:
-					current_axis = &y_axis;
-					break;
-				case 2:
-					current_axis = &z_axis;
-					break;
-				}
-
-				// Stop when tested AABBs are beyond the end of current AABB
-				if ((*current_axis)[j].m_min_point > (*current_axis)[i].m_max_point)
-				{
-					break;
-				}
-
-				if (!(*current_axis)[j].m_bounding_box->Overlaps(*(*current_axis)[i].m_bounding_box)) continue;
-
-				d_colliding_pairs.push_back(CollidingPair<RigidBody>(d_rigid_bodies[j] ,d_rigid_bodies[i]));
-
-				(*current_axis)[j].m_bounding_box->m_is_colliding = glm::vec3(1.0f);
-				(*current_axis)[i].m_bounding_box->m_is_colliding = glm::vec3(1.0f);
+				// fixed for the others until its island wakes up
+				body.inverse_mass = 0.0f;
+				body.inverse_inertia = glm::mat3(0.0f);
+				body.velocity = body.angular_velocity = glm::vec3(0.0f);
+				continue;
 			}
+			body.inverse_mass = 1.0f / mass;
+			body.inverse_inertia = rigid_body->Inertial_Tensor(m_use_polyhedral);
+			body.velocity = rigid_body->m_linear_momentum / mass + m_gravity * delta_time;
+			body.angular_velocity = body.inverse_inertia * rigid_body->m_angular_momentum;
+		}
+
+		//The manifolds keep their points and impulses from the last frames, so a resting body
+		//gets its support back at once rather than sinking a little each frame
+		d_contact_solver.Begin_Frame();
+		for (int k = 0; k < d_contacts.size(); k++)
+		{
+			auto pair = d_colliding_indices[k];
+			d_contact_solver.Add_Contact(d_solver_bodies, pair.first, pair.second, d_shapes[pair.first], d_shapes[pair.second], d_contacts[k]);
+		}
+		for (int i = 0; i < d_rigid_bodies.size(); i++)
+			for (int p = 0; p < d_planes.size() && !d_islands.Is_Sleeping(i); p++)
+				d_contact_solver.Add_Plane_Contact(d_solver_bodies, i, p, d_shapes[i], d_planes[p].x, d_planes[p].n_normal);
+		d_contact_solver.Solve(d_solver_bodies, delta_time);
+
+		for (int i = 0; i < d_rigid_bodies.size(); i++)
+		{
+			if (d_islands.Is_Sleeping(i)) continue;
+			auto rigid_body = d_rigid_bodies[i];
+			auto& body = d_solver_bodies[i];
+			float mass = m_use_polyhedral ? rigid_body->Polyhedral_Mass() : rigid_body->Mass();
+			rigid_body->m_linear_momentum = body.velocity * mass;
+			rigid_body->m_angular_momentum = glm::inverse(body.inverse_inertia) * body.angular_velocity;
 		}
+	}
 
-		v  = s2 - s * s / (float)d_rigid_bodies.size();
-		d_sort_axis = 0;
-		if (v[1] > v[0]) d_sort_axis = 1;
-		if (v[2] > v[d_sort_axis]) d_sort_axis = 2;
+	inline void RigidBodyManager::SetSolverIterations(int iterations)
+	{
+		d_contact_solver.m_iterations = iterations;
 	}
 
+	inline void RigidBodyManager::updateBoxTree()
+	{
+		if (d_box_tree_valid) return;
+		d_box_displacements.resize(d_rigid_bodies.size());
+		for (int i = 0; i < d_rigid_bodies.size(); i++)
+			d_box_displacements[i] = d_rigid_bodies[i]->m_velocity * (float)d_delta_time;
+		d_box_tree.Update(d_box_mins, d_box_maxs, &d_box_displacements);
+		d_box_tree_valid = true;
+	}
+
+	inline void RigidBodyManager::Query_Box(glm::vec3 const& min, glm::vec3 const& max, vector<RigidBody*>& bodies)
+	{
+		updateBoxTree();
+		d_box_tree.Query_Box(min, max, d_query_bodies);
+		bodies.clear();
+		for (auto i : d_query_bodies)
+			bodies.push_back(d_rigid_bodies[i]);
+	}
+
+	inline RigidBody* RigidBodyManager::Ray_Cast(glm::vec3 const& origin, glm::vec3 const& direction, float max_distance, float* distance)
+	{
+		updateBoxTree();
+		glm::vec3 unit_direction = glm::normalize(direction);
+		d_box_tree.Ray_Cast(origin, unit_direction, max_distance, d_query_hits);
+		if (d_query_hits.empty()) return nullptr;
+		if (distance) *distance = d_query_hits[0].first;
+		return d_rigid_bodies[d_query_hits[0].second];
+	}
 
 	inline void RigidBodyManager::drawCenterOfMass(RigidBody& rigid_body)
 	{
@@ -216,8 +459,10 @@ namespace Physics
 		for (int i = 0; i < d_rigid_bodies.size(); i++)
 		{ 
 			auto bounding_box = d_rigid_bodies[i]->Bounding_box();
-			glm::mat4 scale = glm::scale(glm::mat4(1),d_rigid_bodies[i]->Bounding_box()->m_scale_factor);
-			shader.SetUniform("mvp",projection_view * d_rigid_bodies[i]->m_model.GetPosition() * scale);
+			// the cube is centered on the origin, the box on m_center in world space
+			glm::mat4 translate = glm::translate(glm::mat4(1),bounding_box->m_center);
+			glm::mat4 scale = glm::scale(glm::mat4(1),bounding_box->m_scale_factor);
+			shader.SetUniform("mvp",projection_view * translate * scale);
 
 			shader.SetUniform("shape_color",d_rigid_bodies[i]->Bounding_box()->Color());
 
@@ -327,6 +572,15 @@ namespace Physics
 		}
 	}
 
+	inline void RigidBodyManager::Hull_Bounds(bool enable)
+	{
+		m_use_hull_bounds = enable;
+		for (auto rigid_body : d_rigid_bodies)
+		{
+			rigid_body->m_use_hull_bounds = enable;
+		}
+	}
+
 
 
 }
@@ -9,8 +9,13 @@ struct SimulationParameters
 	double timeStep;
 	double rayleighMass;
 	double rayleighStiffness;
+	// Symplectic Euler: fraction of the CFL stable step used for each substep
+	double courantFactor;
 	// CG Solver
 	double tolerance;
+	// Mixed precision: tolerance of each inner CG solve, and maximum number of refinements
+	double innerTolerance;
+	int maxRefinements;
 	// Material properties
 	double youngModulusTop,youngModulusBottom;
 	double poissonRatio;
@@ -19,8 +24,34 @@ struct SimulationParameters
 
 	double planeRepulsion;
 	double sphereRepulsion;
+	// Surface collisions
+	bool selfCollision;
+	double collisionThickness;
+	double collisionStiffness;
 	// Constraints
 	double fixedHeight;
+	// Tearing: tetrahedra with an edge stretched beyond this ratio are removed (0 to disable)
+	double tearStretch;
+	// Rewind: number of frames kept in memory (0 to disable)
+	int rewindFrames;
+	// Time the kernel variants on the loaded mesh at init, the best one is cached per device and mesh size
+	bool autotune;
+	// Worker threads running the independent tasks of a step besides the calling
+	// thread (-1 for one per hardware thread, 0 to run them in sequence). The
+	// tasks run OpenMP kernels too, so workers oversubscribe the processors
+	// unless the kernel threads (KernelVariants::nbThreads) are reduced.
+	int taskThreads;
+	// CPU: back the large vectors allocated at init by huge pages
+	bool hugePages;
+	// CPU: report the allocations made by the steps and mappings in steady state
+	bool auditAllocations;
+	// Levels of detail: screen height fraction below which the next coarser
+	// level is used (halved for each level), and step time budget in ms (0 to disable)
+	double lodScreenSize;
+	double lodStepBudget;
+	// Render vertices are mapped again only around particles that moved by more
+	// than this distance since their last mapping (0: moved at all, -1: map all)
+	double mappingTolerance;
 
 	double simulation_time;
 
@@ -30,6 +61,7 @@ struct SimulationParameters
 	double plane_size;
 
 	int maxIter;
+	int maxSubsteps;
 
 	TCoord sphere_position0;
 	TCoord sphere_position;
@@ -42,6 +74,7 @@ struct SimulationParameters
 	TDeriv pushForce;
 
 	TimeIntegration odeSolver;
+	SolverPrecision solverPrecision;
 	bool simulation_mapping_needed;
 
 	SimulationParameters();
@@ -53,22 +86,43 @@ struct SimulationParameters
 
 SimulationParameters::SimulationParameters()
 	: timeStep(0.04), 
-	//  odeSolver(ODE_EulerExplicit),
-	odeSolver(ODE_EulerImplicit),
 	rayleighMass(0.01), 
 	rayleighStiffness(0.01),
-	maxIter(25), 
+	courantFactor(0.5),
 	tolerance(1e-3),
+	innerTolerance(1e-2),
+	maxRefinements(10),
 	youngModulusTop(100000), 
 	youngModulusBottom(1000000), 
 	poissonRatio(0.4), 
 	massDensity(0.01),
-	gravity(0,-10,0), 
-	pushForce(75, 20, -15), 
 	planeRepulsion(10000),
 	sphereRepulsion(0),
+	selfCollision(false),
+	collisionThickness(0),
+	collisionStiffness(10000),
 	fixedHeight(0.05),
-	simulation_time(0)
+	tearStretch(0),
+	rewindFrames(0),
+	autotune(false),
+	taskThreads(0),
+	hugePages(false),
+#ifdef NDEBUG
+	auditAllocations(false),
+#else
+	auditAllocations(true),
+#endif
+	lodScreenSize(0.25),
+	lodStepBudget(0),
+	mappingTolerance(0),
+	simulation_time(0),
+	maxIter(25), 
+	maxSubsteps(1000),
+	gravity(0,-10,0), 
+	pushForce(75, 20, -15), 
+	//  odeSolver(ODE_EulerExplicit),
+	odeSolver(ODE_EulerImplicit),
+	solverPrecision(SOLVER_Float)
 {
 }
 
@@ -93,6 +147,7 @@ void SimulationParameters::Init(TCoord boundingBox[2])
 	sphere_position = sphere_position0;
 	sphere_velocity[0] = -simulation_size*0.1f;
 	sphere_radius = simulation_size*0.05f;
+	collisionThickness = simulation_size*0.005f;
 }
 
 void SimulationParameters::Reset()
@@ -0,0 +1,76 @@
+#ifndef SolverWorkspace_h__
+#define SolverWorkspace_h__
+
+#include "common.h"
+#include "kernels.h"
+#include "FEMMesh.h"
+
+// Temporary vectors of a time step. They are owned by the Simulation and
+// shared by all the levels of detail, and reserve() sizes them for a mesh
+// before its first step, so that the steps do not allocate.
+struct SolverWorkspace
+{
+	TVecDeriv f; // force vector when using Euler explicit
+	TVecDeriv b; // right-hand term when calling CG solver
+	TVecDeriv r,d,q; // temporary vectors used by CG solver
+#ifdef DOUBLE_KERNELS
+	MyVector(double) aAccumulator; // solution accumulated in double by the mixed precision solver
+	TVecDeriv refineResidual, refineCorrection; // residual and correction of each refinement
+	MyVector(double) bDouble, rDouble, dDouble, qDouble; // vectors of the double CG, qDouble also for the double residual
+	MyVector(double) xDouble; // float solution converted for its double residual
+#endif
+#ifdef PARALLEL_REDUCTION
+	TVecReal dottmp; // temporary buffer for dot product reductions
+#endif
+#ifdef PARALLEL_GATHER
+	MyVector(GPUElementForce<TReal>) femElemForce; // force of each element, gathered on the particles
+#endif
+#ifdef USE_VEC4
+	MyVector(TCoord4) x4,dx4;
+#endif
+
+	// Grow the vectors to the sizes needed by the mesh, they are never shrunk
+	void reserve(const FEMMesh* mesh);
+};
+
+// Resize v to at least size values, keeping its size if already larger
+template<class T>
+static void SolverWorkspace_grow(T& v, unsigned int size)
+{
+	if (v.size() < size) v.recreate(size);
+}
+
+void SolverWorkspace::reserve(const FEMMesh* mesh)
+{
+	const unsigned int size = mesh->positions.size();
+	SolverWorkspace_grow(f, size);
+	SolverWorkspace_grow(b, size);
+	SolverWorkspace_grow(r, size);
+	SolverWorkspace_grow(d, size);
+	SolverWorkspace_grow(q, size);
+#ifdef DOUBLE_KERNELS
+	SolverWorkspace_grow(aAccumulator, 3*size);
+	SolverWorkspace_grow(refineResidual, size);
+	SolverWorkspace_grow(refineCorrection, size);
+	SolverWorkspace_grow(bDouble, 3*size);
+	SolverWorkspace_grow(rDouble, 3*size);
+	SolverWorkspace_grow(dDouble, 3*size);
+	SolverWorkspace_grow(qDouble, 3*size);
+	SolverWorkspace_grow(xDouble, 3*size);
+#endif
+#ifdef PARALLEL_REDUCTION
+	int tmpsize = DEVICE_METHOD(MechanicalObject3f_vDotTmpSize)( size );
+	tmpsize = std::max(tmpsize, DEVICE_METHOD(MergedKernels3f_cgDot3TmpSize)( size ));
+	tmpsize = std::max(tmpsize, DEVICE_METHOD(MergedKernels3f_cgDeltaTmpSize)( size ));
+	SolverWorkspace_grow(dottmp, tmpsize);
+#endif
+#ifdef PARALLEL_GATHER
+	SolverWorkspace_grow(femElemForce, mesh->tetrahedra.size());
+#endif
+#ifdef USE_VEC4
+	SolverWorkspace_grow(x4, size);
+	SolverWorkspace_grow(dx4, size);
+#endif
+}
+
+#endif // SolverWorkspace_h__
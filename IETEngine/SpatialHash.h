@@ -0,0 +1,216 @@
+#ifndef SpatialHash_h__
+#define SpatialHash_h__
+
+#include <glm/glm.hpp>
+#include <glm/gtx/norm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace Physics
+{
+	using namespace std;
+
+	/*
+	* Broad phase for bounding spheres on a uniform grid.
+	* Each sphere is inserted in the cells overlapped by its bounding box, and
+	* only the spheres sharing a cell are tested. A pair sharing several cells is
+	* reported by the cell holding the lowest corner of the intersection of their
+	* boxes, so each pair is found once without a set.
+	* The cells are identified by their packed coordinates, sorted rather than
+	* hashed in buckets. Coordinates wrapping around the packing give equal keys
+	* for different cells, which the pair test rejects, so the result is exact.
+	*/
+	class SpatialHash
+	{
+	public:
+		SpatialHash();
+
+		// Pairs (i < j) of overlapping spheres, sorted, the same set as testing
+		// every pair with BoundingSphere::Overlaps
+		void		Find_Pairs(const vector<glm::vec3>& centers, const vector<float>& radii, vector<pair<int,int>>& pairs);
+
+		float		Cell_size() const { return d_cell_size; }
+
+	private:
+		// Spheres covering more cells are tested against all the others
+		enum { MAX_CELLS_PER_SPHERE = 512 };
+
+		struct Entry
+		{
+			unsigned long long	key;
+			int					cell[3];
+			int					sphere;
+
+			bool operator<(const Entry& other) const { return key < other.key || (key == other.key && sphere < other.sphere); }
+		};
+
+		float								d_cell_size;
+		float								d_inv_cell_size;
+		vector<float>						d_radii_sorted;
+		vector<int>							d_offsets;	// first entry of each sphere
+		vector<Entry>						d_entries;
+		vector<int>							d_runs;		// first entry of each cell, and the end
+		vector<int>							d_large;
+		vector<vector<pair<int,int>>>		d_thread_pairs;
+
+		void		chooseCellSize(const vector<float>& radii);
+		int			cellCoord(float x) const { return (int)floor(x * d_inv_cell_size); }
+		static unsigned long long packKey(const int* cell);
+		static bool	overlaps(const glm::vec3& c1, float r1, const glm::vec3& c2, float r2);
+	};
+
+	inline SpatialHash::SpatialHash()
+		: d_cell_size(1.0f),
+		d_inv_cell_size(1.0f)
+	{
+	}
+
+	// Same expression as BoundingSphere::Overlaps
+	inline bool SpatialHash::overlaps(const glm::vec3& c1, float r1, const glm::vec3& c2, float r2)
+	{
+		float distanceSquared = glm::distance2(c1,c2);
+		return distanceSquared < (r1+r2)*(r1+r2);
+	}
+
+	inline unsigned long long SpatialHash::packKey(const int* cell)
+	{
+		const unsigned long long mask = 0x1FFFFF;
+		return (((unsigned long long)cell[0] & mask) << 42) | (((unsigned long long)cell[1] & mask) << 21) | ((unsigned long long)cell[2] & mask);
+	}
+
+	/*
+	* The cell size is twice the radius at the 90th percentile, so that most
+	* spheres overlap at most 2 cells along each axis, while the few larger ones
+	* do not make the cells too big for the others.
+	*/
+	inline void SpatialHash::chooseCellSize(const vector<float>& radii)
+	{
+		d_radii_sorted.assign(radii.begin(), radii.end());
+		const size_t k = (d_radii_sorted.size() * 9) / 10;
+		nth_element(d_radii_sorted.begin(), d_radii_sorted.begin() + k, d_radii_sorted.end());
+		float radius = d_radii_sorted[k];
+		if (!(radius > 0.0f))
+			radius = *max_element(d_radii_sorted.begin(), d_radii_sorted.end());
+		d_cell_size = (radius > 0.0f) ? 2.0f * radius : 1.0f;
+		d_inv_cell_size = 1.0f / d_cell_size;
+	}
+
+	inline void SpatialHash::Find_Pairs(const vector<glm::vec3>& centers, const vector<float>& radii, vector<pair<int,int>>& pairs)
+	{
+		pairs.clear();
+		const int n = centers.size();
+		if (n < 2) return;
+		chooseCellSize(radii);
+
+		// number of cells of each sphere, the large ones are kept aside
+		d_offsets.resize(n+1);
+		d_offsets[0] = 0;
+		#pragma omp parallel for
+		for (int i = 0; i < n; ++i)
+		{
+			long long count = 1;
+			for (int a = 0; a < 3; ++a)
+				count *= cellCoord(centers[i][a] + radii[i]) - cellCoord(centers[i][a] - radii[i]) + 1;
+			d_offsets[i+1] = (count > MAX_CELLS_PER_SPHERE) ? -1 : (int)count;
+		}
+		d_large.clear();
+		for (int i = 0; i < n; ++i)
+		{
+			if (d_offsets[i+1] < 0)
+			{
+				d_large.push_back(i);
+				d_offsets[i+1] = 0;
+			}
+			d_offsets[i+1] += d_offsets[i];
+		}
+
+		d_entries.resize(d_offsets[n]);
+		#pragma omp parallel for
+		for (int i = 0; i < n; ++i)
+		{
+			if (d_offsets[i+1] == d_offsets[i]) continue;
+			int lo[3], hi[3];
+			for (int a = 0; a < 3; ++a)
+			{
+				lo[a] = cellCoord(centers[i][a] - radii[i]);
+				hi[a] = cellCoord(centers[i][a] + radii[i]);
+			}
+			Entry* e = &d_entries[d_offsets[i]];
+			for (int x = lo[0]; x <= hi[0]; ++x)
+				for (int y = lo[1]; y <= hi[1]; ++y)
+					for (int z = lo[2]; z <= hi[2]; ++z, ++e)
+					{
+						e->cell[0] = x; e->cell[1] = y; e->cell[2] = z;
+						e->key = packKey(e->cell);
+						e->sphere = i;
+					}
+		}
+		sort(d_entries.begin(), d_entries.end());
+
+		d_runs.clear();
+		for (int e = 0; e < (int)d_entries.size(); ++e)
+			if (e == 0 || d_entries[e].key != d_entries[e-1].key)
+				d_runs.push_back(e);
+		d_runs.push_back(d_entries.size());
+		const int nbRuns = d_runs.size() - 1;
+
+		int nbThreads = 1;
+#ifdef _OPENMP
+		nbThreads = omp_get_max_threads();
+#endif
+		d_thread_pairs.resize(nbThreads);
+		#pragma omp parallel
+		{
+			int thread = 0;
+#ifdef _OPENMP
+			thread = omp_get_thread_num();
+#endif
+			vector<pair<int,int>>& local = d_thread_pairs[thread];
+			local.clear();
+			#pragma omp for schedule(dynamic,64)
+			for (int r = 0; r < nbRuns; ++r)
+			{
+				for (int ea = d_runs[r]; ea < d_runs[r+1]; ++ea)
+				{
+					const Entry& a = d_entries[ea];
+					for (int eb = ea+1; eb < d_runs[r+1]; ++eb)
+					{
+						const Entry& b = d_entries[eb];
+						if (a.cell[0] != b.cell[0] || a.cell[1] != b.cell[1] || a.cell[2] != b.cell[2]) continue;
+						const int i = a.sphere, j = b.sphere; // i < j, entries are sorted by sphere in a cell
+						// only in the cell of the lowest corner of the intersection of the boxes
+						bool owner = true;
+						for (int k = 0; k < 3 && owner; ++k)
+							owner = cellCoord(max(centers[i][k] - radii[i], centers[j][k] - radii[j])) == a.cell[k];
+						if (owner && overlaps(centers[i], radii[i], centers[j], radii[j]))
+							local.push_back(make_pair(i,j));
+					}
+				}
+			}
+			// large spheres against all the others, each pair once
+			#pragma omp for schedule(dynamic,1)
+			for (int l = 0; l < (int)d_large.size(); ++l)
+			{
+				const int i = d_large[l];
+				for (int j = 0; j < n; ++j)
+				{
+					if (j == i) continue;
+					if (d_offsets[j+1] == d_offsets[j] && j < i) continue; // also large, tested from j
+					if (overlaps(centers[min(i,j)], radii[min(i,j)], centers[max(i,j)], radii[max(i,j)]))
+						local.push_back(make_pair(min(i,j), max(i,j)));
+				}
+			}
+		}
+		for (int t = 0; t < nbThreads; ++t)
+			pairs.insert(pairs.end(), d_thread_pairs[t].begin(), d_thread_pairs[t].end());
+		sort(pairs.begin(), pairs.end());
+	}
+}
+
+#endif // SpatialHash_h__
@@ -0,0 +1,495 @@
+#ifndef SurfaceCollision_h__
+#define SurfaceCollision_h__
+
+#include "common.h"
+#include "GPU.h"
+#include <algorithm>
+#include <vector>
+
+// Closest point to p on triangle (a,b,c) (Ericson, Real-Time Collision Detection 5.1.5)
+TCoord closestPointOnTriangle(const TCoord& p, const TCoord& a, const TCoord& b, const TCoord& c)
+{
+	const TDeriv ab = b - a, ac = c - a, ap = p - a;
+	TReal d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if (d1 <= 0 && d2 <= 0) return a;
+	const TDeriv bp = p - b;
+	TReal d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if (d3 >= 0 && d4 <= d3) return b;
+	TReal vc = d1*d4 - d3*d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab * (d1 / (d1 - d3));
+	const TDeriv cp = p - c;
+	TReal d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if (d6 >= 0 && d5 <= d6) return c;
+	TReal vb = d5*d2 - d1*d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac * (d2 / (d2 - d6));
+	TReal va = d3*d6 - d5*d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	TReal denom = 1 / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// Bounding volume hierarchy over a triangle surface.
+// The tree topology is built once from the rest positions, then only the
+// bounding boxes are refitted when the vertices move.
+class SurfaceBVH
+{
+public:
+	struct Node
+	{
+		TCoord bmin, bmax;
+		int left, right;  // children, -1 for a leaf
+		int start, count; // range in the triangle order, for leaves
+	};
+
+	std::vector<Node> nodes;
+	std::vector<int> order; // triangle indices, grouped by leaf
+
+	void build(const TCoord* x, const TTriangle* triangles, int nbTriangles);
+
+	// Refit all boxes bottom-up, each level in parallel
+	void refit(const TCoord* x, const TTriangle* triangles, TReal margin);
+
+	// Call visitor(triangle) for every triangle whose box is closer than radius to p
+	template<class Visitor>
+	void query(const TCoord& p, TReal radius, Visitor& visitor) const;
+
+	// Call visitor.leaf(start, count) for every leaf whose box is closer than radius
+	// to p, its triangles are order[start] to order[start+count-1]
+	template<class Visitor>
+	void queryLeaves(const TCoord& p, TReal radius, Visitor& visitor) const;
+
+	bool empty() const { return nodes.empty(); }
+
+private:
+	static const int LEAF_SIZE = 4;
+	std::vector< std::vector<int> > d_levels; // node indices per depth
+
+	int build(const TCoord* x, const TTriangle* triangles, const std::vector<TCoord>& centers, int start, int count, int depth);
+};
+
+void SurfaceBVH::build(const TCoord* x, const TTriangle* triangles, int nbTriangles)
+{
+	nodes.clear();
+	d_levels.clear();
+	order.resize(nbTriangles);
+	std::vector<TCoord> centers(nbTriangles);
+	for (int i = 0; i < nbTriangles; ++i)
+	{
+		order[i] = i;
+		centers[i] = (x[triangles[i][0]] + x[triangles[i][1]] + x[triangles[i][2]]) / 3;
+	}
+	if (nbTriangles > 0)
+	{
+		nodes.reserve(2 * nbTriangles / LEAF_SIZE + 1);
+		build(x, triangles, centers, 0, nbTriangles, 0);
+	}
+}
+
+int SurfaceBVH::build(const TCoord* x, const TTriangle* triangles, const std::vector<TCoord>& centers, int start, int count, int depth)
+{
+	const int index = nodes.size();
+	nodes.push_back(Node());
+	if ((int)d_levels.size() <= depth) d_levels.resize(depth + 1);
+	d_levels[depth].push_back(index);
+
+	TCoord cmin = centers[order[start]], cmax = cmin;
+	for (int i = start + 1; i < start + count; ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			cmin[k] = std::min(cmin[k], centers[order[i]][k]);
+			cmax[k] = std::max(cmax[k], centers[order[i]][k]);
+		}
+
+	if (count <= LEAF_SIZE)
+	{
+		nodes[index].left = nodes[index].right = -1;
+		nodes[index].start = start;
+		nodes[index].count = count;
+		return index;
+	}
+
+	// median split along the largest axis of the centers
+	const TDeriv extent = cmax - cmin;
+	const int axis = (extent[0] > extent[1]) ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+	const int half = count / 2;
+	std::nth_element(order.begin() + start, order.begin() + start + half, order.begin() + start + count,
+		[&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+
+	nodes[index].start = start;
+	nodes[index].count = 0;
+	int left = build(x, triangles, centers, start, half, depth + 1);
+	int right = build(x, triangles, centers, start + half, count - half, depth + 1);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	return index;
+}
+
+void SurfaceBVH::refit(const TCoord* x, const TTriangle* triangles, TReal margin)
+{
+	for (int level = (int)d_levels.size() - 1; level >= 0; --level)
+	{
+		const std::vector<int>& levelNodes = d_levels[level];
+		#pragma omp parallel for
+		for (int i = 0; i < (int)levelNodes.size(); ++i)
+		{
+			Node& node = nodes[levelNodes[i]];
+			if (node.left < 0)
+			{
+				const TTriangle& t0 = triangles[order[node.start]];
+				node.bmin = node.bmax = x[t0[0]];
+				for (int j = node.start; j < node.start + node.count; ++j)
+				{
+					const TTriangle& t = triangles[order[j]];
+					for (int v = 0; v < 3; ++v)
+						for (int k = 0; k < 3; ++k)
+						{
+							node.bmin[k] = std::min(node.bmin[k], x[t[v]][k]);
+							node.bmax[k] = std::max(node.bmax[k], x[t[v]][k]);
+						}
+				}
+				for (int k = 0; k < 3; ++k)
+				{
+					node.bmin[k] -= margin;
+					node.bmax[k] += margin;
+				}
+			}
+			else
+			{
+				const Node& l = nodes[node.left];
+				const Node& r = nodes[node.right];
+				for (int k = 0; k < 3; ++k)
+				{
+					node.bmin[k] = std::min(l.bmin[k], r.bmin[k]);
+					node.bmax[k] = std::max(l.bmax[k], r.bmax[k]);
+				}
+			}
+		}
+	}
+}
+
+template<class Visitor>
+struct SurfaceBVHTriangles
+{
+	const int* order;
+	Visitor* visitor;
+
+	void leaf(int start, int count)
+	{
+		for (int j = start; j < start + count; ++j)
+			(*visitor)(order[j]);
+	}
+};
+
+template<class Visitor>
+void SurfaceBVH::query(const TCoord& p, TReal radius, Visitor& visitor) const
+{
+	if (nodes.empty()) return;
+	SurfaceBVHTriangles<Visitor> triangles;
+	triangles.order = &order[0];
+	triangles.visitor = &visitor;
+	queryLeaves(p, radius, triangles);
+}
+
+template<class Visitor>
+void SurfaceBVH::queryLeaves(const TCoord& p, TReal radius, Visitor& visitor) const
+{
+	if (nodes.empty()) return;
+	const TCoord pmin = p - TDeriv(radius, radius, radius), pmax = p + TDeriv(radius, radius, radius);
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& node = nodes[stack[--top]];
+		if (pmax[0] < node.bmin[0] || pmin[0] > node.bmax[0] ||
+			pmax[1] < node.bmin[1] || pmin[1] > node.bmax[1] ||
+			pmax[2] < node.bmin[2] || pmin[2] > node.bmax[2])
+			continue;
+		if (node.left < 0)
+			visitor.leaf(node.start, node.count);
+		else
+		{
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+		}
+	}
+}
+
+// Rigid triangle mesh colliding with the FEM surface.
+// Triangles must be oriented with outward normals.
+struct TriangleMeshCollider
+{
+	std::vector<TCoord> positions0; // vertices in the mesh frame
+	std::vector<TCoord> positions;  // vertices in world space
+	std::vector<TTriangle> triangles;
+	SurfaceBVH bvh;
+	TReal stiffness;
+	TReal depth; // penetration depth below which contacts are still resolved
+
+	TriangleMeshCollider()
+		: stiffness(0), depth(0)
+	{
+	}
+
+	void init(const std::vector<TCoord>& vertices, const std::vector<TTriangle>& tris, TReal meshStiffness, TReal meshDepth);
+
+	// Move the mesh, the hierarchy is refitted instead of rebuilt
+	void setTransform(const Mat3x3f& rotation, const TDeriv& translation);
+};
+
+void TriangleMeshCollider::init(const std::vector<TCoord>& vertices, const std::vector<TTriangle>& tris, TReal meshStiffness, TReal meshDepth)
+{
+	positions0 = vertices;
+	positions = vertices;
+	triangles = tris;
+	stiffness = meshStiffness;
+	depth = meshDepth;
+	if (triangles.empty())
+	{
+		// nothing to collide with, the empty hierarchy is never queried
+		bvh.build(NULL, NULL, 0);
+		return;
+	}
+	bvh.build(&positions[0], &triangles[0], triangles.size());
+	bvh.refit(&positions[0], &triangles[0], 0);
+}
+
+void TriangleMeshCollider::setTransform(const Mat3x3f& rotation, const TDeriv& translation)
+{
+	for (unsigned int i = 0; i < positions0.size(); ++i)
+		positions[i] = rotation * positions0[i] + translation;
+	if (!bvh.empty())
+		bvh.refit(&positions[0], &triangles[0], 0);
+}
+
+// Vertex-triangle proximity between the FEM surface and itself or rigid
+// triangle meshes, producing one penalty contact per surface particle.
+class SurfaceCollision
+{
+public:
+	bool selfCollision;
+	TReal thickness;
+	TReal stiffness;
+	std::vector<TriangleMeshCollider> meshes;
+
+	SurfaceCollision()
+		: selfCollision(false), thickness(0), stiffness(0), d_nbContacts(0)
+	{
+	}
+
+	bool enabled() const { return selfCollision || !meshes.empty(); }
+
+	void init(const TCoord* x0, int nbPoints, const TTriangle* triangles, int nbTriangles);
+
+	// Refit the surface hierarchy to the current positions, then find the deepest
+	// contact of each surface particle. Returns the number of particles in contact.
+	int detect(const TCoord* x, const TCoord* x0, const TTriangle* triangles, const int* surfacePoints, int nbSurfacePoints, GPUContact<TReal>* contacts);
+
+	int nbContacts() const { return d_nbContacts; }
+
+private:
+	SurfaceBVH d_bvh;
+	std::vector<TDeriv> d_normals; // current unit normal of each surface triangle
+	// triangles ignored by each point, by sorted position in the hierarchy order,
+	// so that a leaf of ignored triangles is skipped without reading them
+	std::vector<int> d_excludeStart, d_exclude;
+	int d_nbContacts;
+};
+
+// Collects the triangles incident to a point or closer than a distance in the rest configuration
+struct RestNeighborVisitor
+{
+	const TCoord* x0;
+	const TTriangle* triangles;
+	int point;
+	TReal distance;
+	std::vector<int>* neighbors;
+
+	void operator()(int t)
+	{
+		const TTriangle& tri = triangles[t];
+		if ((int)tri[0] == point || (int)tri[1] == point || (int)tri[2] == point ||
+			(x0[point] - closestPointOnTriangle(x0[point], x0[tri[0]], x0[tri[1]], x0[tri[2]])).norm2() < distance*distance)
+			neighbors->push_back(t);
+	}
+};
+
+void SurfaceCollision::init(const TCoord* x0, int nbPoints, const TTriangle* triangles, int nbTriangles)
+{
+	d_bvh.build(x0, triangles, nbTriangles);
+	d_bvh.refit(x0, triangles, 0);
+	d_normals.resize(nbTriangles);
+
+	// pairs already close at rest never generate contacts, find them once
+	d_excludeStart.resize(nbPoints+1);
+	d_exclude.clear();
+	std::vector<int> position(nbTriangles);
+	for (int j = 0; j < nbTriangles; ++j)
+		position[d_bvh.order[j]] = j;
+	std::vector<int> neighbors;
+	for (int i = 0; i < nbPoints; ++i)
+	{
+		d_excludeStart[i] = d_exclude.size();
+		neighbors.clear();
+		RestNeighborVisitor visitor;
+		visitor.x0 = x0;
+		visitor.triangles = triangles;
+		visitor.point = i;
+		visitor.distance = 2*thickness;
+		visitor.neighbors = &neighbors;
+		d_bvh.query(x0[i], visitor.distance, visitor);
+		for (unsigned int n = 0; n < neighbors.size(); ++n)
+			neighbors[n] = position[neighbors[n]];
+		std::sort(neighbors.begin(), neighbors.end());
+		d_exclude.insert(d_exclude.end(), neighbors.begin(), neighbors.end());
+	}
+	d_excludeStart[nbPoints] = d_exclude.size();
+}
+
+// Collects the deepest contact of a point against the surface triangles
+struct SelfContactVisitor
+{
+	const TCoord* x;
+	const TCoord* x0;
+	const TTriangle* triangles;
+	const TDeriv* normals;
+	const int* order;
+	const int* excludeBegin; // positions in order
+	const int* excludeEnd;
+	int point;
+	TReal thickness;
+	GPUContact<TReal>* contact;
+
+	void leaf(int start, int count)
+	{
+		const int end = start + count;
+		const int* e = std::lower_bound(excludeBegin, excludeEnd, start);
+		const int* eEnd = e;
+		while (eEnd != excludeEnd && *eEnd < end) ++eEnd;
+		// most leaves near the point only hold its neighbors at rest
+		if (eEnd - e == count) return;
+		for (int j = start; j < end; ++j)
+		{
+			if (e != eEnd && *e == j) { ++e; continue; }
+			(*this)(order[j]);
+		}
+	}
+
+	void operator()(int t)
+	{
+		const TTriangle& tri = triangles[t];
+		const TCoord& p = x[point];
+		TDeriv n = normals[t];
+		const TReal s = dot(p - x[tri[0]], n);
+		if (s >= thickness || s <= -thickness) return;
+		const TCoord q = closestPointOnTriangle(p, x[tri[0]], x[tri[1]], x[tri[2]]);
+		if ((p - q).norm2() >= thickness*thickness) return;
+		// push the point back to the side of the triangle it was on at rest
+		const TDeriv n0 = cross(x0[tri[1]] - x0[tri[0]], x0[tri[2]] - x0[tri[0]]);
+		if (dot(x0[point] - x0[tri[0]], n0) < 0) n = -n;
+		const TReal d = dot(p - q, n) - thickness;
+		if (d < contact->d)
+		{
+			contact->normal_x = n[0]; contact->normal_y = n[1]; contact->normal_z = n[2];
+			contact->d = d;
+		}
+	}
+};
+
+// Collects the deepest contact of a point against a rigid triangle mesh
+struct MeshContactVisitor
+{
+	const TriangleMeshCollider* mesh;
+	TCoord p;
+	TReal thickness;
+	TReal bestDist2;
+	TCoord bestPoint;
+	int best;
+
+	void operator()(int t)
+	{
+		const TTriangle& tri = mesh->triangles[t];
+		const TCoord q = closestPointOnTriangle(p, mesh->positions[tri[0]], mesh->positions[tri[1]], mesh->positions[tri[2]]);
+		const TReal dist2 = (p - q).norm2();
+		if (dist2 < bestDist2)
+		{
+			bestDist2 = dist2;
+			bestPoint = q;
+			best = t;
+		}
+	}
+};
+
+int SurfaceCollision::detect(const TCoord* x, const TCoord* x0, const TTriangle* triangles, const int* surfacePoints, int nbSurfacePoints, GPUContact<TReal>* contacts)
+{
+	if (selfCollision)
+	{
+		d_bvh.refit(x, triangles, 0);
+		const int nbTriangles = d_normals.size();
+		#pragma omp parallel for
+		for (int i = 0; i < nbTriangles; ++i)
+		{
+			const TTriangle& t = triangles[i];
+			TDeriv n = cross(x[t[1]] - x[t[0]], x[t[2]] - x[t[0]]);
+			const TReal len = n.norm();
+			d_normals[i] = (len > 0) ? n / len : TDeriv();
+		}
+	}
+
+	int nbContacts = 0;
+	#pragma omp parallel for reduction(+:nbContacts)
+	for (int i = 0; i < nbSurfacePoints; ++i)
+	{
+		const int point = surfacePoints[i];
+		GPUContact<TReal>& contact = contacts[i];
+		contact.d = 0;
+		contact.stiffness = stiffness;
+		contact.damping = 0;
+
+		if (selfCollision)
+		{
+			SelfContactVisitor visitor;
+			visitor.x = x;
+			visitor.x0 = x0;
+			visitor.triangles = triangles;
+			visitor.normals = &d_normals[0];
+			visitor.order = &d_bvh.order[0];
+			visitor.excludeBegin = &d_exclude[0] + d_excludeStart[point];
+			visitor.excludeEnd = &d_exclude[0] + d_excludeStart[point+1];
+			visitor.point = point;
+			visitor.thickness = thickness;
+			visitor.contact = &contact;
+			d_bvh.queryLeaves(x[point], thickness, visitor);
+		}
+
+		for (unsigned int m = 0; m < meshes.size(); ++m)
+		{
+			const TriangleMeshCollider& mesh = meshes[m];
+			const TReal radius = thickness + mesh.depth;
+			MeshContactVisitor visitor;
+			visitor.mesh = &mesh;
+			visitor.p = x[point];
+			visitor.bestDist2 = radius*radius;
+			visitor.best = -1;
+			mesh.bvh.query(visitor.p, radius, visitor);
+			if (visitor.best < 0) continue;
+			const TTriangle& tri = mesh.triangles[visitor.best];
+			TDeriv n = cross(mesh.positions[tri[1]] - mesh.positions[tri[0]], mesh.positions[tri[2]] - mesh.positions[tri[0]]);
+			const TReal len = n.norm();
+			if (len <= 0) continue;
+			n *= 1/len;
+			const TReal d = dot(visitor.p - visitor.bestPoint, n) - thickness;
+			if (d < contact.d)
+			{
+				contact.normal_x = n[0]; contact.normal_y = n[1]; contact.normal_z = n[2];
+				contact.d = d;
+				contact.stiffness = mesh.stiffness;
+			}
+		}
+		if (contact.d < 0) ++nbContacts;
+	}
+	d_nbContacts = nbContacts;
+	return nbContacts;
+}
+
+#endif // SurfaceCollision_h__
@@ -0,0 +1,183 @@
+#ifndef SweepAndPrune_h__
+#define SweepAndPrune_h__
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <unordered_set>
+
+namespace Physics
+{
+	using namespace std;
+
+	/*
+	* Incremental sweep and prune on the three axes.
+	* The sorted lists of interval end points are kept between the updates and
+	* sorted again by insertion, which is close to O(n) when the bodies move a
+	* little each frame. Insertion sort only swaps the end points whose order
+	* changed: a minimum passing before a maximum starts an overlap on this axis,
+	* a maximum passing before a minimum ends it. The pair set is only changed by
+	* these swaps, and gives the boxes overlapping on the three axes (closed
+	* intervals).
+	*/
+	class SweepAndPrune
+	{
+	public:
+		typedef unordered_set<unsigned long long> PairSet;
+
+		SweepAndPrune() {}
+
+		// Boxes of the bodies 0..n-1, a different count sorts the lists again from scratch
+		void		Update(const vector<glm::vec3>& mins, const vector<glm::vec3>& maxs);
+		// Sort the lists and find the pairs from scratch
+		void		Rebuild(const vector<glm::vec3>& mins, const vector<glm::vec3>& maxs);
+
+		// Overlapping pairs, see Pair_Key
+		PairSet		const& Pairs() const { return d_pairs; }
+		// Pairs which started or stopped overlapping in the last update
+		vector<pair<int,int>>
+					const& Added() const { return d_added; }
+		vector<pair<int,int>>
+					const& Removed() const { return d_removed; }
+
+		static unsigned long long Pair_Key(int i, int j);
+		static pair<int,int> Pair_From_Key(unsigned long long key) { return make_pair((int)(key >> 32), (int)(key & 0xFFFFFFFF)); }
+
+	private:
+		// box index, and 1 for its maximum
+		struct EndPoint
+		{
+			int		box;
+			int		is_max;
+		};
+
+		vector<glm::vec3>			d_min;
+		vector<glm::vec3>			d_max;
+		vector<EndPoint>			d_axis[3];
+		PairSet						d_pairs;
+		vector<pair<int,int>>		d_added;
+		vector<pair<int,int>>		d_removed;
+
+		float		value(const EndPoint& e, int axis) const { return e.is_max ? d_max[e.box][axis] : d_min[e.box][axis]; }
+		// a minimum goes before a maximum of the same value, so touching intervals overlap
+		bool		before(const EndPoint& a, const EndPoint& b, int axis) const;
+		bool		overlaps(int i, int j, int axis) const { return d_min[i][axis] <= d_max[j][axis] && d_min[j][axis] <= d_max[i][axis]; }
+		bool		overlaps(int i, int j) const { return overlaps(i,j,0) && overlaps(i,j,1) && overlaps(i,j,2); }
+		void		sortAxis(int axis);
+		void		addPair(int i, int j);
+		void		removePair(int i, int j);
+	};
+
+	inline unsigned long long SweepAndPrune::Pair_Key(int i, int j)
+	{
+		if (i > j) swap(i,j);
+		return ((unsigned long long)i << 32) | (unsigned int)j;
+	}
+
+	inline bool SweepAndPrune::before(const EndPoint& a, const EndPoint& b, int axis) const
+	{
+		const float va = value(a,axis), vb = value(b,axis);
+		return va < vb || (va == vb && !a.is_max && b.is_max);
+	}
+
+	inline void SweepAndPrune::addPair(int i, int j)
+	{
+		// a pair starting on two axes in the same update is only added once
+		if (d_pairs.insert(Pair_Key(i,j)).second)
+			d_added.push_back(Pair_From_Key(Pair_Key(i,j)));
+	}
+
+	inline void SweepAndPrune::removePair(int i, int j)
+	{
+		if (d_pairs.erase(Pair_Key(i,j)))
+			d_removed.push_back(Pair_From_Key(Pair_Key(i,j)));
+	}
+
+	inline void SweepAndPrune::sortAxis(int axis)
+	{
+		vector<EndPoint>& points = d_axis[axis];
+		for (int k = 1; k < (int)points.size(); ++k)
+		{
+			const EndPoint e = points[k];
+			int l = k;
+			for (; l > 0 && before(e, points[l-1], axis); --l)
+			{
+				const EndPoint& passed = points[l-1];
+				if (!e.is_max && passed.is_max)
+				{
+					// the values of all the boxes are already updated, so the other axes are final
+					if (overlaps(e.box, passed.box)) addPair(e.box, passed.box);
+				}
+				else if (e.is_max && !passed.is_max)
+					removePair(e.box, passed.box);
+				points[l] = passed;
+			}
+			points[l] = e;
+		}
+	}
+
+	inline void SweepAndPrune::Update(const vector<glm::vec3>& mins, const vector<glm::vec3>& maxs)
+	{
+		if (mins.size() != d_min.size())
+		{
+			Rebuild(mins, maxs);
+			return;
+		}
+		d_added.clear();
+		d_removed.clear();
+		d_min.assign(mins.begin(), mins.end());
+		d_max.assign(maxs.begin(), maxs.end());
+		for (int axis = 0; axis < 3; ++axis)
+			sortAxis(axis);
+	}
+
+	inline void SweepAndPrune::Rebuild(const vector<glm::vec3>& mins, const vector<glm::vec3>& maxs)
+	{
+		const int n = mins.size();
+		d_min.assign(mins.begin(), mins.end());
+		d_max.assign(maxs.begin(), maxs.end());
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			vector<EndPoint>& points = d_axis[axis];
+			points.resize(2*n);
+			for (int i = 0; i < n; ++i)
+			{
+				points[2*i].box = i;
+				points[2*i].is_max = 0;
+				points[2*i+1].box = i;
+				points[2*i+1].is_max = 1;
+			}
+			sort(points.begin(), points.end(), [this, axis](const EndPoint& a, const EndPoint& b) { return before(a, b, axis); });
+		}
+
+		// sweep the first axis, the open boxes are the candidates
+		PairSet old_pairs;
+		old_pairs.swap(d_pairs);
+		d_added.clear();
+		d_removed.clear();
+		vector<int> open;
+		for (auto& e : d_axis[0])
+		{
+			if (e.is_max)
+			{
+				open.erase(find(open.begin(), open.end(), e.box));
+				continue;
+			}
+			for (auto other : open)
+				if (overlaps(e.box, other, 1) && overlaps(e.box, other, 2))
+				{
+					d_pairs.insert(Pair_Key(e.box, other));
+					if (!old_pairs.count(Pair_Key(e.box, other)))
+						d_added.push_back(Pair_From_Key(Pair_Key(e.box, other)));
+				}
+			open.push_back(e.box);
+		}
+		for (auto key : old_pairs)
+			if (!d_pairs.count(key))
+				d_removed.push_back(Pair_From_Key(key));
+	}
+}
+
+#endif // SweepAndPrune_h__
@@ -0,0 +1,239 @@
+#ifndef TaskGraph_h__
+#define TaskGraph_h__
+
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Tasks of one frame and their dependencies. The graph is built once and run
+// every frame by a TaskScheduler; a task decides itself if it has work to do.
+// A task can only depend on tasks added before it, so the order of addition
+// is always a valid sequential order.
+class TaskGraph
+{
+public:
+	TaskGraph(const std::string& name = std::string()) : d_name(name), d_frame(0) {}
+
+	const std::string& name() const { return d_name; }
+	bool empty() const { return d_tasks.empty(); }
+	int size() const { return d_tasks.size(); }
+	void clear() { d_tasks.clear(); }
+
+	// Add a task running after the given ones (-1 for none), returns its index
+	int add(const std::string& name, const std::function<void()>& run, int after0 = -1, int after1 = -1, int after2 = -1, int after3 = -1);
+	// task runs after the task after
+	void depend(int task, int after);
+
+	// Last run: start time since the start of the run, duration (ms) and thread (0 for the calling thread)
+	double taskStart(int task) const { return d_tasks[task].start; }
+	double taskTime(int task) const { return d_tasks[task].time; }
+	int taskThread(int task) const { return d_tasks[task].thread; }
+	const std::string& taskName(int task) const { return d_tasks[task].name; }
+	int frame() const { return d_frame; }
+
+	// CSV rows of the last run: graph,frame,task,thread,start,duration
+	static void writeTimingsHeader(std::ostream& out);
+	void writeTimings(std::ostream& out) const;
+
+private:
+	friend class TaskScheduler;
+	struct Task
+	{
+		std::string name;
+		std::function<void()> run;
+		std::vector<int> next; // tasks depending on this one
+		int nbDeps;
+		int pending; // dependencies not done yet in the current run
+		double start, time;
+		int thread;
+	};
+	std::string d_name;
+	std::vector<Task> d_tasks;
+	int d_frame;
+};
+
+int TaskGraph::add(const std::string& name, const std::function<void()>& run, int after0, int after1, int after2, int after3)
+{
+	Task t;
+	t.name = name;
+	t.run = run;
+	t.nbDeps = 0;
+	t.pending = 0;
+	t.start = t.time = 0;
+	t.thread = 0;
+	d_tasks.push_back(t);
+	const int task = d_tasks.size()-1;
+	const int after[4] = { after0, after1, after2, after3 };
+	for (int i = 0; i < 4; ++i)
+		if (after[i] >= 0) depend(task, after[i]);
+	return task;
+}
+
+void TaskGraph::depend(int task, int after)
+{
+	if (after < 0 || after >= task) return; // only earlier tasks, the graph stays acyclic
+	d_tasks[after].next.push_back(task);
+	++d_tasks[task].nbDeps;
+}
+
+void TaskGraph::writeTimingsHeader(std::ostream& out)
+{
+	out << "graph,frame,task,thread,start,duration" << std::endl;
+}
+
+void TaskGraph::writeTimings(std::ostream& out) const
+{
+	for (unsigned int i = 0; i < d_tasks.size(); ++i)
+		out << d_name << "," << d_frame << "," << d_tasks[i].name << "," << d_tasks[i].thread << ","
+			<< d_tasks[i].start << "," << d_tasks[i].time << std::endl;
+}
+
+// Pool of worker threads running task graphs. The calling thread of run()
+// takes part, so with no worker the tasks run in sequence on it, in the order
+// they were added. The workers use the OpenMP team size of the calling thread.
+class TaskScheduler
+{
+public:
+	TaskScheduler() : d_graph(NULL), d_remaining(0), d_quit(false), d_ompThreads(0) {}
+	~TaskScheduler() { setWorkers(0); }
+
+	// Number of threads besides the calling thread (-1 for one per hardware thread)
+	void setWorkers(int nbWorkers);
+	int workers() const { return d_threads.size(); }
+
+	void run(TaskGraph& graph);
+
+private:
+	void work(int thread);
+	// Run ready tasks until the graph is done, the lock is held between tasks
+	void execute(std::unique_lock<std::mutex>& lock, int thread);
+	void runTask(TaskGraph::Task& t, int thread);
+
+	std::vector<std::thread> d_threads;
+	std::mutex d_mutex;
+	std::condition_variable d_wake;
+	TaskGraph* d_graph;
+	std::deque<int> d_ready;
+	int d_remaining;
+	bool d_quit;
+	int d_ompThreads; // of the calling thread of the current run
+	std::chrono::high_resolution_clock::time_point d_start; // of the current run
+};
+
+void TaskScheduler::setWorkers(int nbWorkers)
+{
+	if (nbWorkers < 0)
+	{
+		const int n = std::thread::hardware_concurrency();
+		nbWorkers = (n > 1) ? n-1 : 0;
+	}
+	if (nbWorkers == (int)d_threads.size()) return;
+	if (!d_threads.empty())
+	{
+		{
+			std::lock_guard<std::mutex> lock(d_mutex);
+			d_quit = true;
+		}
+		d_wake.notify_all();
+		for (unsigned int i = 0; i < d_threads.size(); ++i)
+			d_threads[i].join();
+		d_threads.clear();
+		d_quit = false;
+	}
+	for (int i = 0; i < nbWorkers; ++i)
+		d_threads.push_back(std::thread(&TaskScheduler::work, this, i+1));
+}
+
+void TaskScheduler::runTask(TaskGraph::Task& t, int thread)
+{
+	typedef std::chrono::duration<double, std::milli> ms;
+	const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+#ifdef _OPENMP
+	// omp_set_num_threads only applies to the thread calling it
+	if (thread != 0 && omp_get_max_threads() != d_ompThreads)
+		omp_set_num_threads(d_ompThreads);
+#endif
+	t.run();
+	const std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+	t.start = std::chrono::duration_cast<ms>(start - d_start).count();
+	t.time = std::chrono::duration_cast<ms>(end - start).count();
+	t.thread = thread;
+}
+
+void TaskScheduler::run(TaskGraph& graph)
+{
+	std::vector<TaskGraph::Task>& tasks = graph.d_tasks;
+	++graph.d_frame;
+	d_start = std::chrono::high_resolution_clock::now();
+	if (d_threads.empty())
+	{
+		for (unsigned int i = 0; i < tasks.size(); ++i)
+			runTask(tasks[i], 0);
+		return;
+	}
+	std::unique_lock<std::mutex> lock(d_mutex);
+#ifdef _OPENMP
+	d_ompThreads = omp_get_max_threads();
+#endif
+	d_graph = &graph;
+	d_ready.clear();
+	for (unsigned int i = 0; i < tasks.size(); ++i)
+	{
+		tasks[i].pending = tasks[i].nbDeps;
+		if (tasks[i].pending == 0) d_ready.push_back(i);
+	}
+	d_remaining = tasks.size();
+	d_wake.notify_all();
+	for (;;)
+	{
+		execute(lock, 0);
+		if (d_remaining == 0) break;
+		d_wake.wait(lock);
+	}
+	d_graph = NULL;
+}
+
+void TaskScheduler::execute(std::unique_lock<std::mutex>& lock, int thread)
+{
+	while (!d_ready.empty())
+	{
+		const int i = d_ready.front();
+		d_ready.pop_front();
+		TaskGraph::Task& t = d_graph->d_tasks[i];
+		lock.unlock();
+		runTask(t, thread);
+		lock.lock();
+		for (unsigned int n = 0; n < t.next.size(); ++n)
+		{
+			TaskGraph::Task& next = d_graph->d_tasks[t.next[n]];
+			if (--next.pending == 0)
+				d_ready.push_back(t.next[n]);
+		}
+		--d_remaining;
+		// new ready tasks for the workers, or the end of the run for the calling thread
+		d_wake.notify_all();
+	}
+}
+
+void TaskScheduler::work(int thread)
+{
+	std::unique_lock<std::mutex> lock(d_mutex);
+	for (;;)
+	{
+		while (!d_quit && (d_graph == NULL || d_ready.empty()))
+			d_wake.wait(lock);
+		if (d_quit) break;
+		execute(lock, thread);
+	}
+}
+
+#endif // TaskGraph_h__
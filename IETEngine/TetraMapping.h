@@ -0,0 +1,234 @@
+#ifndef TetraMapping_h__
+#define TetraMapping_h__
+
+#include "common.h"
+#include "kernels.h"
+#include "octree.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+
+// Barycentric mapping of a set of points on the tetrahedra of a FEM mesh.
+// Points outside of the mesh are mapped on the nearest tetrahedron with
+// extrapolated coefficients.
+struct TetraMapping
+{
+	MyVector(TTetra) map_i;
+	MyVector(TCoord4) map_f;
+	std::vector<int> map_tetra; // tetrahedron each point is mapped from, -1 if none
+
+	// Incremental mapping
+	std::vector<int> particle_begin, particle_points; // points mapped from each particle
+	std::vector<TCoord> reference; // particle positions when their points were last mapped
+	std::vector<unsigned char> dirty;
+
+	unsigned int size() const { return map_tetra.size(); }
+
+	// Map points given in the same configuration as the particles in, returns
+	// the number of points outside of the mesh. The octree is kept between
+	// calls with the same key and number of tetrahedra.
+	int init(const std::string& key, const TVecTetra& tetras, const TVecCoord& in, const TVecCoord& points);
+
+	// out = in interpolated at the mapped points
+	void apply(TVecDeriv& out, const TVecDeriv& in) const
+	{
+		if (map_i.size() != out.size()) return;
+		DEVICE_METHOD(TetraMapper3f_apply)( out.size(), map_i.deviceRead(), map_f.deviceRead(), out.deviceWrite(), in.deviceRead() );
+	}
+
+	// Map again only the points depending on a particle that moved by more
+	// than epsilon since the points were last mapped (with epsilon 0, that
+	// changed at all, so the result is the same as apply). The mapped points
+	// are given as ranges [first,second), merged when less than gap points apart.
+	// The first call after init or invalidate maps all the points.
+	void applyChanged(TVecCoord& out, const TVecCoord& in, TReal epsilon, std::vector< std::pair<int,int> >& ranges, int gap = 32);
+	// The particles were moved or renumbered without this mapping
+	void invalidate() { reference.clear(); }
+
+private:
+	void buildInverse(int nbParticles);
+};
+
+void TetraMapping::buildInverse(int nbParticles)
+{
+	const int size = map_i.size();
+	const TTetra* mi = map_i.hostRead();
+	// the indices are unsigned, as the particles count here
+	const unsigned int nbp = nbParticles;
+	particle_begin.assign(nbp+1, 0);
+	for (int i = 0; i < size; ++i)
+		for (int j = 0; j < 4; ++j)
+			if (mi[i][j] < nbp) ++particle_begin[mi[i][j]+1];
+	for (unsigned int p = 0; p < nbp; ++p)
+		particle_begin[p+1] += particle_begin[p];
+	particle_points.resize(particle_begin[nbp]);
+	std::vector<int> next(particle_begin.begin(), particle_begin.end()-1);
+	for (int i = 0; i < size; ++i)
+		for (int j = 0; j < 4; ++j)
+			if (mi[i][j] < nbp) particle_points[next[mi[i][j]]++] = i;
+	dirty.assign(size, 0);
+}
+
+void TetraMapping::applyChanged(TVecCoord& out, const TVecCoord& in, TReal epsilon, std::vector< std::pair<int,int> >& ranges, int gap)
+{
+	ranges.clear();
+	const int size = map_i.size();
+	const int nbp = in.size();
+	if (size == 0 || size != (int)out.size()) return;
+	const TCoord* x = in.hostRead();
+	if ((int)reference.size() != nbp)
+	{
+		apply(out, in);
+		reference.assign(x, x+nbp);
+		buildInverse(nbp);
+		ranges.push_back(std::make_pair(0, size));
+		return;
+	}
+
+	const TReal eps2 = epsilon*epsilon;
+	bool moved = false;
+	for (int p = 0; p < nbp; ++p)
+	{
+		const TCoord& r = reference[p];
+		if (epsilon > 0 ? (x[p]-r).norm2() <= eps2 : (x[p][0] == r[0] && x[p][1] == r[1] && x[p][2] == r[2]))
+			continue;
+		reference[p] = x[p];
+		for (int k = particle_begin[p]; k < particle_begin[p+1]; ++k)
+			dirty[particle_points[k]] = 1;
+		moved = true;
+	}
+	if (!moved) return;
+
+	int first = -1, last = -1;
+	for (int i = 0; i < size; ++i)
+	{
+		if (!dirty[i]) continue;
+		dirty[i] = 0;
+		if (first >= 0 && i - last > gap)
+		{
+			ranges.push_back(std::make_pair(first, last+1));
+			first = -1;
+		}
+		if (first < 0) first = i;
+		last = i;
+	}
+	ranges.push_back(std::make_pair(first, last+1));
+	// the points in the gaps are mapped again too, they are unchanged
+	for (unsigned int r = 0; r < ranges.size(); ++r)
+	{
+		const int begin = ranges[r].first;
+		DEVICE_METHOD(TetraMapper3f_apply)( ranges[r].second - begin, map_i.deviceReadAt(begin), map_f.deviceReadAt(begin), out.deviceWriteAt(begin), in.deviceRead() );
+	}
+}
+
+int TetraMapping::init(const std::string& key, const TVecTetra& tetras, const TVecCoord& in, const TVecCoord& out)
+{
+	static std::string input_key;
+	static sofa::helper::vector<Mat3x3d> bases;
+	static sofa::helper::vector<Vec3d> centers;
+	static Octree<Vec3d> octree;
+	map_i.resize(out.size());
+	map_f.resize(out.size());
+	map_tetra.assign(out.size(), -1);
+	if (input_key != key || bases.size() != tetras.size()) // we have to recompute the octree and bases
+	{
+		input_key = key;
+		sofa::helper::vector< BBox<Vec3d> > bbox;
+		bases.resize(tetras.size());
+		centers.resize(tetras.size());
+		bbox.resize(tetras.size());
+		std::cout << "  Preparing tetrahedra" << std::endl;
+		for (unsigned int t=0; t<tetras.size(); ++t)
+		{
+			Mat3x3d m, mt;
+			m[0] = in[tetras[t][1]]-in[tetras[t][0]];
+			m[1] = in[tetras[t][2]]-in[tetras[t][0]];
+			m[2] = in[tetras[t][3]]-in[tetras[t][0]];
+			mt.transpose(m);
+			bases[t].invert(mt);
+			centers[t] = (in[tetras[t][0]]+in[tetras[t][1]]+in[tetras[t][2]]+in[tetras[t][3]])*0.25;
+			bbox[t].add(tetras[t].begin(), tetras[t].end(), in);
+		}
+		std::cout << "  Building octree" << std::endl;
+		octree.init(bbox,8,8);
+	}
+	std::cout << "  Processing vertices" << std::endl;
+	int outside = 0;
+	sofa::helper::vector<Octree<Vec3d>*> cells;
+	for (unsigned int i=0;i<out.size();i++)
+	{
+		Vec3d pos = out[i];
+		Vec3d coefs;
+		int index = -1;
+		double distance = 1e10;
+		Octree<Vec3d>* cell = octree.findNear(pos);
+		if (cell)
+		{
+			const sofa::helper::vector<int>& elems = cell->elems();
+			for (unsigned int e = 0; e < elems.size(); e++)
+			{
+				unsigned int t = elems[e];
+				Vec3d v = bases[t] * (pos - in[tetras[t][0]]);
+				double d = std::max(std::max(-v[0],-v[1]),std::max(-v[2],v[0]+v[1]+v[2]-1));
+				if (d>0) d = (pos-centers[t]).norm2();
+				if (d<distance) { coefs = v; distance = d; index = t; }
+			}
+		}
+		if (distance > 0)
+		{ // pos is outside of the fem mesh, find the nearest tetra
+
+			// first let's find at least one tetra that is close, if not already found
+			if (index >= 0) // we already have a close tetra, we need to look only for closer ones
+			{
+				cells.clear();
+				octree.findAllAround(cells, pos, sqrt(distance)*1.5);
+				for (unsigned int ci = 0; ci < cells.size(); ++ci)
+				{
+					if (cells[ci] == cell) continue; // already processed this cell
+					const sofa::helper::vector<int>& elems = cells[ci]->elems();
+					for (unsigned int e = 0; e < elems.size(); e++)
+					{
+						unsigned int t = elems[e];
+						double d = (pos-centers[t]).norm2();
+						if (d<distance)
+						{
+							coefs = bases[t] * (pos - in[tetras[t][0]]);
+							distance = d; index = t;
+						}
+					}
+				}
+			}
+			else
+			{
+				// failsafe case (should not happen...), to be sure we do a brute-force search
+				for (unsigned int t = 0; t < tetras.size(); t++)
+				{
+					double d = (pos-centers[t]).norm2();
+					if (d<distance)
+					{
+						coefs = bases[t] * (pos - in[tetras[t][0]]);
+						distance = d; index = t;
+					}
+				}
+			}
+			if (index >= 0)
+			{
+				//if (verbose >= 1) std::cout << "Surface vertex " << i << " mapped outside of tetra " << index << " with coefs " << coefs << std::endl;
+				++outside;
+			}
+		}
+		if (index >= 0)
+		{
+			//std::cout << "Surface vertex " << i << " mapped from tetra " << index << " with coefs " << coefs << std::endl;
+			map_i[i][0] = tetras[index][0]; map_f[i][0] = (float)(1-coefs[0]-coefs[1]-coefs[2]);
+			map_i[i][1] = tetras[index][1]; map_f[i][1] = (float)(coefs[0]);
+			map_i[i][2] = tetras[index][2]; map_f[i][2] = (float)(coefs[1]);
+			map_i[i][3] = tetras[index][3]; map_f[i][3] = (float)(coefs[2]);
+			map_tetra[i] = index;
+		}
+	}
+	return outside;
+}
+
+#endif // TetraMapping_h__
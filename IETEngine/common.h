@@ -84,7 +84,7 @@ GLfloat lastX = VIEWPORT_WIDTH/2, lastY = VIEWPORT_HEIGHT/2;
 #ifdef ANDROID
 #define RAPTOR_MODEL "raptor.dae"
 #define RAPTOR_NETGEN_MESH "raptor-8418.mesh"
-#define RAPTOR_NETGEN_MESH_HIGH "raptor-12580.mesh"
+#define RAPTOR_NETGEN_MESH_FULL "raptor-12580.mesh"
 #else
 #define RAPTOR_MODEL "models\\raptor.dae"
 #define RAPTOR_NETGEN_MESH "models\\raptor-8418.mesh"
@@ -113,6 +113,16 @@ enum TimeIntegration
 {
 	ODE_EulerExplicit = 0,
 	ODE_EulerImplicit,
+	ODE_SymplecticEuler,
+};
+
+// Precision of the linear solve of the implicit integrator
+enum SolverPrecision
+{
+	SOLVER_Float = 0,  // float CG
+	SOLVER_Mixed,      // float CG corrections, residual and solution refined in double
+	SOLVER_Double,     // double CG, reference of the other two
+	// without the double kernels (CUDA) both fall back to the float CG
 };
 
 enum GameState
@@ -160,6 +170,12 @@ enum { BSIZE=1 };
 #define USE_VEC4
 #endif
 
+// Flag for the double precision matrix product and vector kernels (3d), used by the
+// residual of the mixed precision solver and by the double reference solver
+#if defined(SOFA_DEVICE_CPU)
+#define DOUBLE_KERNELS
+#endif
+
 typedef float TReal;
 typedef sofa::defaulttype::Vec<3,TReal> TCoord;
 typedef sofa::defaulttype::Vec<3,TReal> TDeriv;
@@ -0,0 +1,152 @@
+#include "../kernels.h"
+
+// Keep the deepest penetration of point x into collider c
+static inline void CPUColliderForceField3f_collide( const GPUCollider<float>& c, const TCoord& x, GPUContact<float>& contact )
+{
+    TDeriv n;
+    TReal d;
+    switch (c.type)
+    {
+    case COLLIDER_PLANE:
+    {
+        n = TDeriv(c.p0[0], c.p0[1], c.p0[2]);
+        d = dot(x, n) - c.radius;
+        break;
+    }
+    case COLLIDER_SPHERE:
+    case COLLIDER_CAPSULE:
+    {
+        TCoord center(c.p0[0], c.p0[1], c.p0[2]);
+        if (c.type == COLLIDER_CAPSULE)
+        {
+            TDeriv ab = TCoord(c.p1[0], c.p1[1], c.p1[2]) - center;
+            TReal t = dot(x - center, ab) / dot(ab, ab);
+            if (t < 0) t = 0; else if (t > 1) t = 1;
+            center += ab*t;
+        }
+        n = x - center;
+        TReal len = n.norm();
+        d = len - c.radius;
+        if (d >= contact.d) return;
+        if (len > 0) n *= 1/len; else n = TDeriv(0,1,0);
+        break;
+    }
+    case COLLIDER_BOX:
+    {
+        const TDeriv rel = x - TCoord(c.p0[0], c.p0[1], c.p0[2]);
+        TDeriv axis[3];
+        axis[0] = TDeriv(c.axis[0][0], c.axis[0][1], c.axis[0][2]);
+        axis[1] = TDeriv(c.axis[1][0], c.axis[1][1], c.axis[1][2]);
+        axis[2] = cross(axis[0], axis[1]);
+        // inside the box: push out through the closest face
+        d = -std::numeric_limits<TReal>::max();
+        for (int k=0;k<3;++k)
+        {
+            TReal l = dot(rel, axis[k]);
+            TReal dk = fabs(l) - c.p1[k];
+            if (dk >= 0) return;
+            if (dk > d)
+            {
+                d = dk;
+                n = (l < 0) ? -axis[k] : axis[k];
+            }
+        }
+        break;
+    }
+    default:
+        return;
+    }
+    if (d < contact.d)
+    {
+        contact.normal_x = n[0]; contact.normal_y = n[1]; contact.normal_z = n[2];
+        contact.d = d;
+        contact.stiffness = c.stiffness;
+        contact.damping = c.damping;
+    }
+}
+
+void CPUColliderForceField3f_addForce( unsigned int nbPoints, const int* points, const GPUColliderGrid<float>* grid
+                                     , const GPUCollider<float>* colliders, const int* cellStart, const int* cellColliders
+                                     , GPUContact<float>* contacts, TDeriv* f, const TCoord* x, const TDeriv* v )
+{
+    const TCoord origin ( grid->origin_x, grid->origin_y, grid->origin_z );
+
+    #pragma omp parallel for
+    for (int i=0;i<(int)nbPoints;++i)
+    {
+        const int index = points[i];
+        const TCoord xi = x[index];
+        GPUContact<float> contact;
+        contact.d = 0;
+
+        // unbounded colliders are listed first
+        for (int j=0;j<grid->nbGlobal;++j)
+            CPUColliderForceField3f_collide(colliders[cellColliders[j]], xi, contact);
+
+        // then only the colliders overlapping the cell of the particle
+        const TDeriv g = (xi - origin) * grid->invCellSize;
+        const int cx = (int)floor(g[0]), cy = (int)floor(g[1]), cz = (int)floor(g[2]);
+        if (cx >= 0 && cx < grid->nx && cy >= 0 && cy < grid->ny && cz >= 0 && cz < grid->nz)
+        {
+            const int cell = (cz * grid->ny + cy) * grid->nx + cx;
+            for (int j=cellStart[cell];j<cellStart[cell+1];++j)
+                CPUColliderForceField3f_collide(colliders[cellColliders[j]], xi, contact);
+        }
+
+        contacts[i] = contact;
+        if (f && contact.d < 0)
+        {
+            const TDeriv n ( contact.normal_x, contact.normal_y, contact.normal_z );
+            TReal forceIntensity = -contact.stiffness*contact.d;
+            TReal dampingIntensity = -contact.damping*contact.d;
+            f[index] += n*forceIntensity - v[index]*dampingIntensity;
+        }
+    }
+}
+
+// Apply precomputed contacts (one per point)
+void CPUColliderForceField3f_addContactForce( unsigned int nbPoints, const int* points, const GPUContact<float>* contacts, TDeriv* f, const TDeriv* v )
+{
+    #pragma omp parallel for
+    for (int i=0;i<(int)nbPoints;++i)
+    {
+        const GPUContact<float>& contact = contacts[i];
+        if (contact.d < 0)
+        {
+            const int index = points[i];
+            const TDeriv n ( contact.normal_x, contact.normal_y, contact.normal_z );
+            TReal forceIntensity = -contact.stiffness*contact.d;
+            TReal dampingIntensity = -contact.damping*contact.d;
+            f[index] += n*forceIntensity - v[index]*dampingIntensity;
+        }
+    }
+}
+
+template<class Deriv>
+void CPUColliderForceField3t_addDForce( unsigned int nbPoints, const int* points, const GPUContact<float>* contacts, typename Deriv::value_type factor, Deriv* f, const Deriv* dx )
+{
+    #pragma omp parallel for
+    for (int i=0;i<(int)nbPoints;++i)
+    {
+        const GPUContact<float>& contact = contacts[i];
+        if (contact.d < 0)
+        {
+            const int index = points[i];
+            const Deriv n ( contact.normal_x, contact.normal_y, contact.normal_z );
+            f[index] += n * (-contact.stiffness*factor*dot(n,dx[index]));
+        }
+    }
+}
+
+void CPUColliderForceField3f_addDForce( unsigned int nbPoints, const int* points, const GPUContact<float>* contacts, float factor, TDeriv* f, const TDeriv* dx )
+{
+    CPUColliderForceField3t_addDForce( nbPoints, points, contacts, factor, f, dx );
+}
+
+#ifdef DOUBLE_KERNELS
+void CPUColliderForceField3d_addDForce( unsigned int nbPoints, const int* points, const GPUContact<float>* contacts, double factor, double* f, const double* dx )
+{
+    typedef sofa::defaulttype::Vec<3,double> Deriv;
+    CPUColliderForceField3t_addDForce( nbPoints, points, contacts, factor, (Deriv*)f, (const Deriv*)dx );
+}
+#endif
@@ -0,0 +1,22 @@
+#include "../kernels.h"
+
+void CPUExternalForceField3f_addForce( unsigned int nbForces, const GPUExternalForce<float>* forces, TDeriv* f )
+{
+    // several forces may share a particle: accumulate atomically, and only
+    // split the work between threads for large batches
+    #pragma omp parallel for if (nbForces > 1024)
+    for (int i=0;i<(int)nbForces;++i)
+    {
+        const GPUExternalForce<float>& e = forces[i];
+        for (int j=0;j<3;++j)
+        {
+            if (e.bary[j] == 0) continue;
+            float* fj = f[e.index[j]].ptr();
+            for (int k=0;k<3;++k)
+            {
+                #pragma omp atomic
+                fj[k] += e.value[k] * e.bary[j];
+            }
+        }
+    }
+}
@@ -1,7 +1,20 @@
 #include "../kernels.h"
 
-void CPUFixedConstraint3f_projectResponseIndexed( unsigned int size, const int* indices, TDeriv* dx )
+template<class Deriv>
+void CPUFixedConstraint3t_projectResponseIndexed( unsigned int size, const int* indices, Deriv* dx )
 {
     for (unsigned int i=0;i<size;++i)
         dx[indices[i]].clear();
 }
+
+void CPUFixedConstraint3f_projectResponseIndexed( unsigned int size, const int* indices, TDeriv* dx )
+{
+    CPUFixedConstraint3t_projectResponseIndexed( size, indices, dx );
+}
+
+#ifdef DOUBLE_KERNELS
+void CPUFixedConstraint3d_projectResponseIndexed( unsigned int size, const int* indices, double* dx )
+{
+    CPUFixedConstraint3t_projectResponseIndexed( size, indices, (sofa::defaulttype::Vec<3,double>*)dx );
+}
+#endif
@@ -1,45 +1,172 @@
 #include "../kernels.h"
 #include <string.h>
 
-void CPUMechanicalObject3f_vClear( unsigned int size, TDeriv* res )
+template<class Deriv>
+void CPUMechanicalObject3t_vClear( unsigned int size, Deriv* res )
 {
-    //memset(res, 0, size*sizeof(TDeriv));
+    //memset(res, 0, size*sizeof(Deriv));
     for (unsigned int i=0;i<size;++i)
         res[i].clear();
 }
 
-void CPUMechanicalObject3f_vEqBF( unsigned int size, TDeriv* res, const TDeriv* b, float f )
+template<class Deriv>
+void CPUMechanicalObject3t_vEqBF( unsigned int size, Deriv* res, const Deriv* b, typename Deriv::value_type f )
 {
     for (unsigned int i=0;i<size;++i)
         res[i] = b[i]*f;
 }
 
-void CPUMechanicalObject3f_vPEqBF( unsigned int size, TDeriv* res, const TDeriv* b, float f )
+template<class Deriv>
+void CPUMechanicalObject3t_vPEqBF( unsigned int size, Deriv* res, const Deriv* b, typename Deriv::value_type f )
 {
     for (unsigned int i=0;i<size;++i)
         res[i] += b[i]*f;
 }
 
-void CPUMechanicalObject3f_vOp( unsigned int size, TDeriv* res, const TDeriv* a, const TDeriv* b, float f )
+template<class Deriv>
+void CPUMechanicalObject3t_vOp( unsigned int size, Deriv* res, const Deriv* a, const Deriv* b, typename Deriv::value_type f )
 {
     for (unsigned int i=0;i<size;++i)
         res[i] = a[i] + b[i]*f;
 }
 
-void CPUMechanicalObject3f_vIntegrate( unsigned int size, const TDeriv* a, TDeriv* v, TCoord* x, float h )
+void CPUMechanicalObject3f_vClear( unsigned int size, TDeriv* res )
+{
+    CPUMechanicalObject3t_vClear( size, res );
+}
+
+void CPUMechanicalObject3f_vEqBF( unsigned int size, TDeriv* res, const TDeriv* b, float f )
+{
+    CPUMechanicalObject3t_vEqBF( size, res, b, f );
+}
+
+void CPUMechanicalObject3f_vPEqBF( unsigned int size, TDeriv* res, const TDeriv* b, float f )
+{
+    CPUMechanicalObject3t_vPEqBF( size, res, b, f );
+}
+
+void CPUMechanicalObject3f_vOp( unsigned int size, TDeriv* res, const TDeriv* a, const TDeriv* b, float f )
+{
+    CPUMechanicalObject3t_vOp( size, res, a, b, f );
+}
+
+#ifdef DOUBLE_KERNELS
+typedef sofa::defaulttype::Vec<3,double> CPUDeriv3d;
+
+void CPUMechanicalObject3d_vClear( unsigned int size, double* res )
+{
+    CPUMechanicalObject3t_vClear( size, (CPUDeriv3d*)res );
+}
+
+void CPUMechanicalObject3d_vEqBF( unsigned int size, double* res, const double* b, double f )
 {
+    CPUMechanicalObject3t_vEqBF( size, (CPUDeriv3d*)res, (const CPUDeriv3d*)b, f );
+}
+
+void CPUMechanicalObject3d_vPEqBF( unsigned int size, double* res, const double* b, double f )
+{
+    CPUMechanicalObject3t_vPEqBF( size, (CPUDeriv3d*)res, (const CPUDeriv3d*)b, f );
+}
+
+void CPUMechanicalObject3d_vOp( unsigned int size, double* res, const double* a, const double* b, double f )
+{
+    CPUMechanicalObject3t_vOp( size, (CPUDeriv3d*)res, (const CPUDeriv3d*)a, (const CPUDeriv3d*)b, f );
+}
+
+void CPUMechanicalObject3d_vDot( unsigned int size, double* res, const double* a, const double* b )
+{
+    double sum = 0.0;
+    for (unsigned int i=0;i<3*size;++i)
+        sum += a[i]*b[i];
+    *res = sum;
+}
+
+void CPUMechanicalObject3d_vFromFloat( unsigned int size, double* res, const TDeriv* a )
+{
+    const float* af = a[0].ptr();
+    for (unsigned int i=0;i<3*size;++i)
+        res[i] = af[i];
+}
+
+void CPUMechanicalObject3f_vFromDouble( unsigned int size, TDeriv* res, const double* a )
+{
+    float* resf = res[0].ptr();
+    for (unsigned int i=0;i<3*size;++i)
+        resf[i] = (float)a[i];
+}
+
+void CPUMechanicalObject3f_vResidual( unsigned int size, double* r2, TDeriv* res, const TDeriv* b, const double* q )
+{
+    const float* bf = b[0].ptr();
+    float* resf = res[0].ptr();
+    double sum = 0.0;
+    for (unsigned int i=0;i<3*size;++i)
+    {
+        const double r = bf[i] - q[i];
+        resf[i] = (float)r;
+        sum += r*r;
+    }
+    *r2 = sum;
+}
+#endif
+
+void CPUMechanicalObject3f_vIntegrate( unsigned int size, const TDeriv* a, TDeriv* v, TCoord* x, float h, const unsigned int* fixedMask, const TCoord* fixedTargets )
+{
+    const float invH = 1.0f / h;
     for (unsigned int i=0;i<size;++i)
     {
+        if (fixedMask && (fixedMask[i>>5] & (1u << (i&31))))
+        {
+            // fixed particles move to their target
+            v[i] = (fixedTargets[i] - x[i]) * invH;
+            x[i] = fixedTargets[i];
+            continue;
+        }
         v[i] += a[i]*h;
         x[i] += v[i]*h;
     }
 }
 
+void CPUMechanicalObject3f_vIntegrateSymplectic( unsigned int size, const TDeriv* f, TDeriv* v, TCoord* x, float invMassH, float vFactor, float h, const unsigned int* fixedMask, const TCoord* fixedTargets )
+{
+    const float invH = 1.0f / h;
+    #pragma omp parallel for
+    for (int i=0;i<(int)size;++i)
+    {
+        if (fixedMask && (fixedMask[i>>5] & (1u << (i&31))))
+        {
+            v[i] = (fixedTargets[i] - x[i]) * invH;
+            x[i] = fixedTargets[i];
+            continue;
+        }
+        TDeriv vi = v[i]*vFactor + f[i]*invMassH;
+        v[i] = vi;
+        x[i] += vi*h;
+    }
+}
+
 void CPUMechanicalObject3f_vPEq1( unsigned int size, TDeriv* res, int index, const float* val )
 {
     res[index] += TDeriv(val);
 }
 
+template<class Acc>
+void CPUMechanicalObject3t_vAccumulate( unsigned int size, bool first, Acc* acc, float* res, const float* d )
+{
+    #pragma omp parallel for
+    for (int i=0;i<(int)(3*size);++i)
+    {
+        Acc a = (first) ? (Acc)d[i] : acc[i] + (Acc)d[i];
+        acc[i] = a;
+        res[i] = (float)a;
+    }
+}
+
+void CPUMechanicalObject3f_vAccumulate( unsigned int size, bool first, double* acc, TDeriv* res, const TDeriv* d )
+{
+    CPUMechanicalObject3t_vAccumulate<double>( size, first, acc, res[0].ptr(), d[0].ptr() );
+}
+
 #ifdef PARALLEL_REDUCTION
 int CPUMechanicalObject3f_vDotTmpSize( unsigned int size )
 {
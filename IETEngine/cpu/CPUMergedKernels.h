@@ -1,6 +1,14 @@
 #include "../kernels.h"
 
-#if defined(MERGE_REDUCTION_KERNELS)
+// CG_MergedReduction
+// q is read as 0 on fixed particles, which projects the matrix product
+// without a separate pass over the fixed particles
+static inline TDeriv CPUMergedKernels3f_readFree( const TDeriv* q, const unsigned int* fixedMask, unsigned int i )
+{
+    if (fixedMask && (fixedMask[i>>5] & (1u << (i&31)))) return TDeriv();
+    return q[i];
+}
+
 #ifdef PARALLEL_REDUCTION
 int CPUMergedKernels3f_cgDot3TmpSize( unsigned int size )
 {
@@ -9,7 +17,7 @@ int CPUMergedKernels3f_cgDot3TmpSize( unsigned int size )
 #endif
 // d.q, r.q, q.q
 void CPUMergedKernels3f_cgDot3( unsigned int size, float* dot3
-    , const TDeriv* r, const TDeriv* q, const TDeriv* d
+    , const TDeriv* r, const TDeriv* q, const TDeriv* d, const unsigned int* fixedMask
 #ifdef PARALLEL_REDUCTION
     , TReal* tmp, float* cputmp
 #endif
@@ -21,7 +29,7 @@ void CPUMergedKernels3f_cgDot3( unsigned int size, float* dot3
     for (unsigned int i=0; i<size; ++i)
     {
         TDeriv di = d[i];
-        TDeriv qi = q[i];
+        TDeriv qi = CPUMergedKernels3f_readFree(q, fixedMask, i);
         TDeriv ri = r[i];
         dot_dq += di * qi;
         dot_rq += ri * qi;
@@ -33,7 +41,7 @@ void CPUMergedKernels3f_cgDot3( unsigned int size, float* dot3
 }
 // b.q, b.q, q.q
 void CPUMergedKernels3f_cgDot3First( unsigned int size, float* dot3
-    , const TDeriv* b, const TDeriv* q
+    , const TDeriv* b, const TDeriv* q, const unsigned int* fixedMask
 #ifdef PARALLEL_REDUCTION
     , TReal* tmp, float* cputmp
 #endif
@@ -44,7 +52,7 @@ void CPUMergedKernels3f_cgDot3First( unsigned int size, float* dot3
     for (unsigned int i=0; i<size; ++i)
     {
         TDeriv bi = b[i];
-        TDeriv qi = q[i];
+        TDeriv qi = CPUMergedKernels3f_readFree(q, fixedMask, i);
         dot_bq += bi * qi;
         dot_qq += qi * qi;
     }
@@ -55,13 +63,13 @@ void CPUMergedKernels3f_cgDot3First( unsigned int size, float* dot3
 
 // a = a + alpha d, r = r - alpha q, d = r + beta d
 void CPUMergedKernels3f_cgOp3( unsigned int size, float alpha, float beta
-    , TDeriv* r, TDeriv* a, TDeriv* d, const TDeriv* q
+    , TDeriv* r, TDeriv* a, TDeriv* d, const TDeriv* q, const unsigned int* fixedMask
 )
 {
     for (unsigned int i=0; i<size; ++i)
     {
         TDeriv di = d[i];
-        TDeriv qi = q[i];
+        TDeriv qi = CPUMergedKernels3f_readFree(q, fixedMask, i);
         TDeriv ai = a[i];
         TDeriv ri = r[i];
         ai += di * alpha;
@@ -76,13 +84,13 @@ void CPUMergedKernels3f_cgOp3( unsigned int size, float alpha, float beta
 // a = alpha b, r = b - alpha q, d = r + beta b
 void CPUMergedKernels3f_cgOp3First( unsigned int size, float alpha, float beta
     , TDeriv* r, TDeriv* a, TDeriv* d, const TDeriv* q
-    , const TDeriv* b
+    , const TDeriv* b, const unsigned int* fixedMask
 )
 {
     for (unsigned int i=0; i<size; ++i)
     {
         TDeriv bi = b[i];
-        TDeriv qi = q[i];
+        TDeriv qi = CPUMergedKernels3f_readFree(q, fixedMask, i);
         TDeriv ai = bi * alpha;
         a[i] = ai;
         TDeriv ri = bi - qi * alpha;
@@ -92,7 +100,7 @@ void CPUMergedKernels3f_cgOp3First( unsigned int size, float alpha, float beta
     }
 }
 
-#elif defined(MERGE_CG_KERNELS)
+// CG_Merged
 #ifdef PARALLEL_REDUCTION
 int CPUMergedKernels3f_cgDeltaTmpSize( unsigned int size )
 {
@@ -122,4 +130,3 @@ void CPUMergedKernels3f_cgDelta( bool first, unsigned int size, float* delta, fl
     }
     *delta = sum;
 }
-#endif
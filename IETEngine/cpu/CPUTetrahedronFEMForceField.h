@@ -161,15 +161,15 @@ void CPUTetrahedronFEMForceField3f_addForce( unsigned int nbElem, unsigned int n
     }
 }
 
-void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int nbVertex, bool add, double factor
+// The element data is float, df and dx may be in double for the residual of the mixed precision solver
+template<class Real>
+void CPUTetrahedronFEMForceField3t_addDForce( unsigned int nbElem, unsigned int nbVertex, bool add, double factor
                                             , const GPUElement<TReal>* elems, const GPUElementRotation<TReal>* state
-                                            , TDeriv* df, const TDeriv* dx
-#ifdef PARALLEL_GATHER
-                                            , unsigned int nbElemPerVertex, int addForce_PT, int addForce_BSIZE
-                                            , GPUElementForce<TReal>* eforce, const int* velems
-#endif
-)
+                                            , sofa::defaulttype::Vec<3,Real>* df, const sofa::defaulttype::Vec<3,Real>* dx )
 {
+    typedef sofa::defaulttype::Vec<3,Real> Deriv;
+    typedef sofa::defaulttype::Mat<3,3,Real> Mat3;
+
     if (!add)
         for (unsigned int i=0;i<nbVertex;++i)
             df[i].clear();
@@ -179,7 +179,7 @@ void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int
     {
         const GPUElement<TReal>* e = elems + i;
 #ifdef USE_ROT6
-        sofa::defaulttype::Mat<3,3,TReal> Rt;
+        Mat3 Rt;
         Rt.x().x() = state[i].rx[0][0];
         Rt.x().y() = state[i].rx[0][1];
         Rt.x().z() = state[i].rx[0][2];
@@ -188,16 +188,16 @@ void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int
         Rt.y().z() = state[i].ry[0][2];
         Rt.z() = cross(Rt.x(), Rt.y());
 #else
-        sofa::defaulttype::Mat<3,3,TReal> Rt = *(sofa::defaulttype::Mat<3,3,TReal>*)&state[i];
+        Mat3 Rt(*(sofa::defaulttype::Mat<3,3,TReal>*)&state[i]);
 #endif
-        TDeriv fB,fC,fD;
+        Deriv fB,fC,fD;
 
         // Compute JtRtX = JbtRtB + JctRtC + JdtRtD
 
-        TDeriv A = dx[e->ia[index1]];
-        TDeriv JtRtX0,JtRtX1;
+        Deriv A = dx[e->ia[index1]];
+        Deriv JtRtX0,JtRtX1;
 
-        TDeriv B = dx[e->ib[index1]];
+        Deriv B = dx[e->ib[index1]];
         B = Rt * (B-A);
 
         // Jtb = (Jbx  0   0 )
@@ -216,7 +216,7 @@ void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int
         JtRtX1.y() =                  e_Jbz_bx * B.y() + e_Jby_bx * B.z();
         JtRtX1.z() = e_Jbz_bx * B.x()                  + e_Jbx_bx * B.z();
 
-        TDeriv C = dx[e->ic[index1]];
+        Deriv C = dx[e->ic[index1]];
         C = Rt * (C-A);
 
         // Jtc = ( 0   0   0 )
@@ -240,7 +240,7 @@ void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int
         //       ( 0   0   0 )
         //       ( 0   cy  0 )
         //       ( cy  0   0 )
-        TDeriv D = dx[e->id[index1]];
+        Deriv D = dx[e->id[index1]];
         D = Rt * (D-A);
 
         TReal e_cy = e->cy[index1];
@@ -263,10 +263,10 @@ void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int
         // S1 = JtRtX1*mu2/2
 
         TReal e_mu2_bx2 = e->mu2_bx2[index1];
-        TDeriv S0 = JtRtX0*e_mu2_bx2;
-        TReal s0 = (JtRtX0.x()+JtRtX0.y()+JtRtX0.z())*e->gamma_bx2[index1];
+        Deriv S0 = JtRtX0*e_mu2_bx2;
+        Real s0 = (JtRtX0.x()+JtRtX0.y()+JtRtX0.z())*e->gamma_bx2[index1];
         S0.x() += s0;  S0.y() += s0;  S0.z() += s0;
-        TDeriv S1  = JtRtX1*(e_mu2_bx2*0.5f);
+        Deriv S1  = JtRtX1*(e_mu2_bx2*0.5f);
 
         S0 *= factor;
         S1 *= factor;
@@ -274,21 +274,21 @@ void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int
         // Jd = ( 0   0   0   0   0  cy )
         //      ( 0   0   0   0  cy   0 )
         //      ( 0   0   cy  0   0   0 )
-        fD = (Rt.multTranspose(TDeriv(
+        fD = (Rt.multTranspose(Deriv(
             e_cy * S1.z(),
             e_cy * S1.y(),
             e_cy * S0.z())));
         // Jc = ( 0   0   0  dz   0 -dy )
         //      ( 0   dz  0   0 -dy   0 )
         //      ( 0   0  -dy  0  dz   0 )
-        fC = (Rt.multTranspose(TDeriv(
+        fC = (Rt.multTranspose(Deriv(
             e_dz * S1.x() - e_dy * S1.z(),
             e_dz * S0.y() - e_dy * S1.y(),
             e_dz * S1.y() - e_dy * S0.z())));
         // Jb = (Jbx  0   0  Jby  0  Jbz)
         //      ( 0  Jby  0  Jbx Jbz  0 )
         //      ( 0   0  Jbz  0  Jby Jbx)
-        fB = (Rt.multTranspose(TDeriv(
+        fB = (Rt.multTranspose(Deriv(
             e_Jbx_bx * S0.x()                                     + e_Jby_bx * S1.x()                   + e_Jbz_bx * S1.z(),
                               e_Jby_bx * S0.y()                   + e_Jbx_bx * S1.x() + e_Jbz_bx * S1.y(),
                                                 e_Jbz_bx * S0.z()                   + e_Jby_bx * S1.y() + e_Jbx_bx * S1.z())));
@@ -301,3 +301,25 @@ void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int
         df[e->id[index1]] -= fD;
     }
 }
+
+void CPUTetrahedronFEMForceField3f_addDForce( unsigned int nbElem, unsigned int nbVertex, bool add, double factor
+                                            , const GPUElement<TReal>* elems, const GPUElementRotation<TReal>* state
+                                            , TDeriv* df, const TDeriv* dx
+#ifdef PARALLEL_GATHER
+                                            , unsigned int nbElemPerVertex, int addForce_PT, int addForce_BSIZE
+                                            , GPUElementForce<TReal>* eforce, const int* velems
+#endif
+)
+{
+    CPUTetrahedronFEMForceField3t_addDForce<TReal>( nbElem, nbVertex, add, factor, elems, state, df, dx );
+}
+
+#ifdef DOUBLE_KERNELS
+void CPUTetrahedronFEMForceField3d_addDForce( unsigned int nbElem, unsigned int nbVertex, bool add, double factor
+                                            , const GPUElement<TReal>* elems, const GPUElementRotation<TReal>* state
+                                            , double* df, const double* dx )
+{
+    typedef sofa::defaulttype::Vec<3,double> Deriv;
+    CPUTetrahedronFEMForceField3t_addDForce<double>( nbElem, nbVertex, add, factor, elems, state, (Deriv*)df, (const Deriv*)dx );
+}
+#endif
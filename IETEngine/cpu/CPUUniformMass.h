@@ -1,11 +1,25 @@
 #include "../kernels.h"
 
-void CPUUniformMass3f_addMDx( unsigned int size, float mass, TDeriv* res, const TDeriv* dx )
+template<class Deriv>
+void CPUUniformMass3t_addMDx( unsigned int size, typename Deriv::value_type mass, Deriv* res, const Deriv* dx )
 {
     for (unsigned int i=0;i<size;++i)
         res[i] += dx[i] * mass;
 }
 
+void CPUUniformMass3f_addMDx( unsigned int size, float mass, TDeriv* res, const TDeriv* dx )
+{
+    CPUUniformMass3t_addMDx( size, mass, res, dx );
+}
+
+#ifdef DOUBLE_KERNELS
+void CPUUniformMass3d_addMDx( unsigned int size, double mass, double* res, const double* dx )
+{
+    typedef sofa::defaulttype::Vec<3,double> Deriv;
+    CPUUniformMass3t_addMDx( size, mass, (Deriv*)res, (const Deriv*)dx );
+}
+#endif
+
 void CPUUniformMass3f_accFromF( unsigned int size, float mass, TDeriv* a, const TDeriv* f )
 {
     TReal inv_mass = 1.0f / mass;
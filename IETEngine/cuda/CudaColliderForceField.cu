@@ -0,0 +1,207 @@
+#include <cuda/CudaCommon.h>
+#include <cuda/CudaMath.h>
+#include "cuda.h"
+
+enum ColliderType
+{
+    COLLIDER_PLANE,
+    COLLIDER_SPHERE,
+    COLLIDER_CAPSULE,
+    COLLIDER_BOX
+};
+
+template<class real>
+class GPUCollider
+{
+public:
+    int type;
+    real p0[3];
+    real p1[3];
+    real axis[2][3];
+    real radius;
+    real stiffness;
+    real damping;
+};
+
+template<class real>
+class GPUColliderGrid
+{
+public:
+    real origin_x, origin_y, origin_z;
+    real invCellSize;
+    int nx, ny, nz;
+    int nbGlobal;
+};
+
+template<class real>
+class GPUContact
+{
+public:
+    real normal_x, normal_y, normal_z;
+    real d;
+    real stiffness;
+    real damping;
+};
+
+typedef GPUCollider<float> GPUCollider3f;
+typedef GPUColliderGrid<float> GPUColliderGrid3f;
+
+extern "C"
+{
+void CudaColliderForceField3f_addForce(unsigned int nbPoints, const void* points, const GPUColliderGrid3f* grid, const void* colliders, const void* cellStart, const void* cellColliders, void* contacts, void* f, const void* x, const void* v);
+void CudaColliderForceField3f_addContactForce(unsigned int nbPoints, const void* points, const void* contacts, void* f, const void* v);
+void CudaColliderForceField3f_addDForce(unsigned int nbPoints, const void* points, const void* contacts, float factor, void* df, const void* dx);
+}
+
+//////////////////////
+// GPU-side methods //
+//////////////////////
+
+template<class real>
+__device__ void CudaColliderForceField3t_collide(const GPUCollider<real>& c, CudaVec3<real> x, GPUContact<real>& contact)
+{
+    CudaVec3<real> n;
+    real d;
+    if (c.type == COLLIDER_PLANE)
+    {
+        n = CudaVec3<real>::make(c.p0[0], c.p0[1], c.p0[2]);
+        d = dot(x, n) - c.radius;
+    }
+    else if (c.type == COLLIDER_SPHERE || c.type == COLLIDER_CAPSULE)
+    {
+        CudaVec3<real> center = CudaVec3<real>::make(c.p0[0], c.p0[1], c.p0[2]);
+        if (c.type == COLLIDER_CAPSULE)
+        {
+            CudaVec3<real> ab = CudaVec3<real>::make(c.p1[0], c.p1[1], c.p1[2]) - center;
+            real t = dot(x - center, ab) / dot(ab, ab);
+            t = (t < 0) ? 0 : ((t > 1) ? 1 : t);
+            center += ab*t;
+        }
+        n = x - center;
+        real len = norm(n);
+        d = len - c.radius;
+        if (d >= contact.d) return;
+        n = (len > 0) ? n*(1/len) : CudaVec3<real>::make(0,1,0);
+    }
+    else if (c.type == COLLIDER_BOX)
+    {
+        CudaVec3<real> rel = x - CudaVec3<real>::make(c.p0[0], c.p0[1], c.p0[2]);
+        CudaVec3<real> axis[3];
+        axis[0] = CudaVec3<real>::make(c.axis[0][0], c.axis[0][1], c.axis[0][2]);
+        axis[1] = CudaVec3<real>::make(c.axis[1][0], c.axis[1][1], c.axis[1][2]);
+        axis[2] = cross(axis[0], axis[1]);
+        d = -1e30f;
+        for (int k=0;k<3;++k)
+        {
+            real l = dot(rel, axis[k]);
+            real dk = fabs(l) - c.p1[k];
+            if (dk >= 0) return;
+            if (dk > d)
+            {
+                d = dk;
+                n = (l < 0) ? axis[k]*(real)-1 : axis[k];
+            }
+        }
+    }
+    else return;
+    if (d < contact.d)
+    {
+        contact.normal_x = n.x; contact.normal_y = n.y; contact.normal_z = n.z;
+        contact.d = d;
+        contact.stiffness = c.stiffness;
+        contact.damping = c.damping;
+    }
+}
+
+template<class real>
+__global__ void CudaColliderForceField3t_addForce_kernel(int nbPoints, const int* points, GPUColliderGrid<real> grid, const GPUCollider<real>* colliders, const int* cellStart, const int* cellColliders, GPUContact<real>* contacts, CudaVec3<real>* f, const CudaVec3<real>* x, const CudaVec3<real>* v)
+{
+    int i = fastmul(blockIdx.x,BSIZE)+threadIdx.x;
+    if (i >= nbPoints) return;
+
+    const int index = points[i];
+    CudaVec3<real> xi = x[index];
+    GPUContact<real> contact;
+    contact.d = 0;
+
+    // unbounded colliders are listed first
+    for (int j=0;j<grid.nbGlobal;++j)
+        CudaColliderForceField3t_collide(colliders[cellColliders[j]], xi, contact);
+
+    // then only the colliders overlapping the cell of the particle
+    int cx = (int)floorf((xi.x - grid.origin_x) * grid.invCellSize);
+    int cy = (int)floorf((xi.y - grid.origin_y) * grid.invCellSize);
+    int cz = (int)floorf((xi.z - grid.origin_z) * grid.invCellSize);
+    if (cx >= 0 && cx < grid.nx && cy >= 0 && cy < grid.ny && cz >= 0 && cz < grid.nz)
+    {
+        int cell = (cz * grid.ny + cy) * grid.nx + cx;
+        for (int j=cellStart[cell];j<cellStart[cell+1];++j)
+            CudaColliderForceField3t_collide(colliders[cellColliders[j]], xi, contact);
+    }
+
+    contacts[i] = contact;
+    if (f && contact.d < 0)
+    {
+        CudaVec3<real> n = CudaVec3<real>::make(contact.normal_x, contact.normal_y, contact.normal_z);
+        real forceIntensity = -contact.stiffness*contact.d;
+        real dampingIntensity = -contact.damping*contact.d;
+        f[index] = f[index] + n*forceIntensity - v[index]*dampingIntensity;
+    }
+}
+
+template<class real>
+__global__ void CudaColliderForceField3t_addContactForce_kernel(int nbPoints, const int* points, const GPUContact<real>* contacts, CudaVec3<real>* f, const CudaVec3<real>* v)
+{
+    int i = fastmul(blockIdx.x,BSIZE)+threadIdx.x;
+    if (i >= nbPoints) return;
+
+    GPUContact<real> contact = contacts[i];
+    if (contact.d < 0)
+    {
+        const int index = points[i];
+        CudaVec3<real> n = CudaVec3<real>::make(contact.normal_x, contact.normal_y, contact.normal_z);
+        real forceIntensity = -contact.stiffness*contact.d;
+        real dampingIntensity = -contact.damping*contact.d;
+        f[index] = f[index] + n*forceIntensity - v[index]*dampingIntensity;
+    }
+}
+
+template<class real>
+__global__ void CudaColliderForceField3t_addDForce_kernel(int nbPoints, const int* points, const GPUContact<real>* contacts, real factor, CudaVec3<real>* df, const CudaVec3<real>* dx)
+{
+    int i = fastmul(blockIdx.x,BSIZE)+threadIdx.x;
+    if (i >= nbPoints) return;
+
+    GPUContact<real> contact = contacts[i];
+    if (contact.d < 0)
+    {
+        const int index = points[i];
+        CudaVec3<real> n = CudaVec3<real>::make(contact.normal_x, contact.normal_y, contact.normal_z);
+        df[index] = df[index] + n * (-contact.stiffness*factor*dot(n, dx[index]));
+    }
+}
+
+//////////////////////
+// CPU-side methods //
+//////////////////////
+
+void CudaColliderForceField3f_addForce(unsigned int nbPoints, const void* points, const GPUColliderGrid3f* grid, const void* colliders, const void* cellStart, const void* cellColliders, void* contacts, void* f, const void* x, const void* v)
+{
+	dim3 threads(BSIZE,1);
+	dim3 grid_((nbPoints+BSIZE-1)/BSIZE,1);
+	CudaColliderForceField3t_addForce_kernel<float><<< grid_, threads >>>(nbPoints, (const int*)points, *grid, (const GPUCollider3f*)colliders, (const int*)cellStart, (const int*)cellColliders, (GPUContact<float>*)contacts, (CudaVec3<float>*)f, (const CudaVec3<float>*)x, (const CudaVec3<float>*)v);
+}
+
+void CudaColliderForceField3f_addContactForce(unsigned int nbPoints, const void* points, const void* contacts, void* f, const void* v)
+{
+	dim3 threads(BSIZE,1);
+	dim3 grid((nbPoints+BSIZE-1)/BSIZE,1);
+	CudaColliderForceField3t_addContactForce_kernel<float><<< grid, threads >>>(nbPoints, (const int*)points, (const GPUContact<float>*)contacts, (CudaVec3<float>*)f, (const CudaVec3<float>*)v);
+}
+
+void CudaColliderForceField3f_addDForce(unsigned int nbPoints, const void* points, const void* contacts, float factor, void* df, const void* dx)
+{
+	dim3 threads(BSIZE,1);
+	dim3 grid((nbPoints+BSIZE-1)/BSIZE,1);
+	CudaColliderForceField3t_addDForce_kernel<float><<< grid, threads >>>(nbPoints, (const int*)points, (const GPUContact<float>*)contacts, factor, (CudaVec3<float>*)df, (const CudaVec3<float>*)dx);
+}
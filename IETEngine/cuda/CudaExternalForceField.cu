@@ -0,0 +1,50 @@
+#include <cuda/CudaCommon.h>
+#include <cuda/CudaMath.h>
+#include "cuda.h"
+
+template<class real>
+class GPUExternalForce
+{
+public:
+    int index[3];
+    real bary[3];
+    real value[3];
+};
+
+extern "C"
+{
+void CudaExternalForceField3f_addForce(unsigned int nbForces, const void* forces, void* f);
+}
+
+//////////////////////
+// GPU-side methods //
+//////////////////////
+
+// one thread per force, several forces may share a particle
+template<class real>
+__global__ void CudaExternalForceField3t_addForce_kernel(int nbForces, const GPUExternalForce<real>* forces, real* f)
+{
+    int i = fastmul(blockIdx.x,BSIZE)+threadIdx.x;
+    if (i >= nbForces) return;
+
+    GPUExternalForce<real> e = forces[i];
+    for (int j=0;j<3;++j)
+    {
+        if (e.bary[j] == 0) continue;
+        int index3 = fastmul(e.index[j],3);
+        atomicAdd(f+index3+0, e.value[0]*e.bary[j]);
+        atomicAdd(f+index3+1, e.value[1]*e.bary[j]);
+        atomicAdd(f+index3+2, e.value[2]*e.bary[j]);
+    }
+}
+
+//////////////////////
+// CPU-side methods //
+//////////////////////
+
+void CudaExternalForceField3f_addForce(unsigned int nbForces, const void* forces, void* f)
+{
+	dim3 threads(BSIZE,1);
+	dim3 grid((nbForces+BSIZE-1)/BSIZE,1);
+	CudaExternalForceField3t_addForce_kernel<float><<< grid, threads >>>(nbForces, (const GPUExternalForce<float>*)forces, (float*)f);
+}
@@ -33,8 +33,10 @@ void CudaMechanicalObject3f_vClear(unsigned int size, void* res);
 void CudaMechanicalObject3f_vEqBF(unsigned int size, void* res, const void* b, float f);
 void CudaMechanicalObject3f_vPEqBF(unsigned int size, void* res, const void* b, float f);
 void CudaMechanicalObject3f_vOp(unsigned int size, void* res, const void* a, const void* b, float f);
-void CudaMechanicalObject3f_vIntegrate(unsigned int size, const void* a, void* v, void* x, float h);
+void CudaMechanicalObject3f_vIntegrate(unsigned int size, const void* a, void* v, void* x, float h, const void* fixedMask, const void* fixedTargets);
 void CudaMechanicalObject3f_vPEq1(unsigned int size, void* res, int index, const float* val);
+void CudaMechanicalObject3f_vAccumulate(unsigned int size, bool first, void* acc, void* res, const void* d);
+void CudaMechanicalObject3f_vIntegrateSymplectic(unsigned int size, const void* f, void* v, void* x, float invMassH, float vFactor, float h, const void* fixedMask, const void* fixedTargets);
 int CudaMechanicalObject3f_vDotTmpSize(unsigned int size);
 void CudaMechanicalObject3f_vDot(unsigned int size, float* res, const void* a, const void* b, void* tmp, float* cputmp);
 
@@ -92,6 +94,19 @@ __global__ void CudaMechanicalObject1t_vPEqBF_kernel(int size, real* res, const
 	}
 }
 
+// the correction is accumulated in the precision of acc, res gets the rounded sum
+template<class acc_real, class real>
+__global__ void CudaMechanicalObject1t_vAccumulate_kernel(int size, bool first, acc_real* acc, real* res, const real* d)
+{
+	int index = fastmul(blockIdx.x,BSIZE)+threadIdx.x;
+	if (index < size)
+	{
+		acc_real a = (first) ? (acc_real)d[index] : acc[index] + (acc_real)d[index];
+		acc[index] = a;
+		res[index] = (real)a;
+	}
+}
+
 template<class real>
 __global__ void CudaMechanicalObject3t_vPEqBF_kernel(int size, real* res, const real* b, real f)
 {
@@ -184,6 +199,45 @@ __global__ void CudaMechanicalObject3t_vIntegrate_kernel(int size, const real* a
     }
 }
 
+// fixed particles move to their target
+template<class real>
+__global__ void CudaMechanicalObject3t_vIntegrateFixed_kernel(int size, const CudaVec3<real>* a, CudaVec3<real>* v, CudaVec3<real>* x, real h, const unsigned int* fixedMask, const CudaVec3<real>* fixedTargets)
+{
+    int index = fastmul(blockIdx.x,BSIZE)+threadIdx.x;
+    if (index < size)
+    {
+        if (fixedMask[index>>5] & (1u << (index&31)))
+        {
+            CudaVec3<real> t = fixedTargets[index];
+            v[index] = (t - x[index]) * (1/h);
+            x[index] = t;
+            return;
+        }
+        CudaVec3<real> vi = v[index] + a[index]*h;
+        v[index] = vi;
+        x[index] = x[index] + vi*h;
+    }
+}
+
+template<class real>
+__global__ void CudaMechanicalObject3t_vIntegrateSymplectic_kernel(int size, const CudaVec3<real>* f, CudaVec3<real>* v, CudaVec3<real>* x, real invMassH, real vFactor, real h, const unsigned int* fixedMask, const CudaVec3<real>* fixedTargets)
+{
+    int index = fastmul(blockIdx.x,BSIZE)+threadIdx.x;
+    if (index < size)
+    {
+        if (fixedMask && (fixedMask[index>>5] & (1u << (index&31))))
+        {
+            CudaVec3<real> t = fixedTargets[index];
+            v[index] = (t - x[index]) * (1/h);
+            x[index] = t;
+            return;
+        }
+        CudaVec3<real> vi = v[index]*vFactor + f[index]*invMassH;
+        v[index] = vi;
+        x[index] = x[index] + vi*h;
+    }
+}
+
 
 #define RED_BSIZE 128
 #define blockSize RED_BSIZE
@@ -325,6 +379,13 @@ void CudaMechanicalObject3f_vEqBF(unsigned int size, void* res, const void* b, f
 	//CudaMechanicalObject1t_vEqBF_kernel<float><<< grid, threads >>>(3*size, (float*)res, (const float*)b, f);
 }
 
+void CudaMechanicalObject3f_vAccumulate(unsigned int size, bool first, void* acc, void* res, const void* d)
+{
+	dim3 threads(BSIZE,1);
+	dim3 grid((3*size+BSIZE-1)/BSIZE,1);
+	CudaMechanicalObject1t_vAccumulate_kernel<double,float><<< grid, threads >>>(3*size, first, (double*)acc, (float*)res, (const float*)d);
+}
+
 void CudaMechanicalObject3f_vPEqBF(unsigned int size, void* res, const void* b, float f)
 {
 	dim3 threads(BSIZE,1);
@@ -343,10 +404,15 @@ void CudaMechanicalObject3f_vOp(unsigned int size, void* res, const void* a, con
 	//CudaMechanicalObject1t_vOp_kernel<float><<< grid, threads >>>(3*size, (float*)res, (const float*)a, (const float*)b, f);
 }
 
-void CudaMechanicalObject3f_vIntegrate(unsigned int size, const void* a, void* v, void* x, float h)
+void CudaMechanicalObject3f_vIntegrate(unsigned int size, const void* a, void* v, void* x, float h, const void* fixedMask, const void* fixedTargets)
 {
 	dim3 threads(BSIZE,1);
 	dim3 grid((size+BSIZE-1)/BSIZE,1);
+	if (fixedMask)
+	{
+		CudaMechanicalObject3t_vIntegrateFixed_kernel<float><<< grid, threads >>>(size, (const CudaVec3<float>*)a, (CudaVec3<float>*)v, (CudaVec3<float>*)x, h, (const unsigned int*)fixedMask, (const CudaVec3<float>*)fixedTargets);
+		return;
+	}
 	CudaMechanicalObject3t_vIntegrate_kernel<float><<< grid, threads >>>(size, (const float*)a, (float*)v, (float*)x, h);
 	//dim3 grid((3*size+BSIZE-1)/BSIZE,1);
 	//CudaMechanicalObject1t_vIntegrate_kernel<float><<< grid, threads >>>(3*size, (const float*)a, (float*)v, (float*)x, h);
@@ -364,6 +430,13 @@ void CudaMechanicalObject3f_vPEq1(unsigned int size, void* res, int index, const
 	CudaMechanicalObject3t_vPEq1_kernel<float><<< grid, threads >>>(((float*)res)+(3*index), v);
 }
 
+void CudaMechanicalObject3f_vIntegrateSymplectic(unsigned int size, const void* f, void* v, void* x, float invMassH, float vFactor, float h, const void* fixedMask, const void* fixedTargets)
+{
+	dim3 threads(BSIZE,1);
+	dim3 grid((size+BSIZE-1)/BSIZE,1);
+	CudaMechanicalObject3t_vIntegrateSymplectic_kernel<float><<< grid, threads >>>(size, (const CudaVec3<float>*)f, (CudaVec3<float>*)v, (CudaVec3<float>*)x, invMassH, vFactor, h, (const unsigned int*)fixedMask, (const CudaVec3<float>*)fixedTargets);
+}
+
 int CudaMechanicalObject3f_vDotTmpSize(unsigned int size)
 {
     size *= 3;
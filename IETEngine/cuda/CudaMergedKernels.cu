@@ -23,15 +23,15 @@ void CudaMergedKernels3f_cgDelta(bool first, unsigned int size, float* delta, fl
                                  void* tmp, float* cputmp);
 int CudaMergedKernels3f_cgDot3TmpSize(unsigned int size);
 void CudaMergedKernels3f_cgDot3(unsigned int size, float* dot3,
-                                const void* r, const void* q, const void* d,
+                                const void* r, const void* q, const void* d, const void* fixedMask,
                                 void* tmp, float* cputmp);
 void CudaMergedKernels3f_cgDot3First(unsigned int size, float* dot3,
-                                     const void* b, const void* q,
+                                     const void* b, const void* q, const void* fixedMask,
                                      void* tmp, float* cputmp);
 void CudaMergedKernels3f_cgOp3(unsigned int size, float alpha, float beta,
-                               void* r, void* a, void* d, const void* q);
+                               void* r, void* a, void* d, const void* q, const void* fixedMask);
 void CudaMergedKernels3f_cgOp3First(unsigned int size, float alpha, float beta,
-                                    void* r, void* a, void* d, const void* q, const void* b);
+                                    void* r, void* a, void* d, const void* q, const void* b, const void* fixedMask);
 
 }
 
@@ -94,8 +94,20 @@ __global__ void MergedKernels_cgDelta_kernel(unsigned int n, real alpha, real* r
 #undef SYNC
 }
 
+// q is read as 0 on fixed particles (i is a scalar index, the particle is i/3)
+template<class real>
+__device__ real MergedKernels_readFree(const real* q, const unsigned int* fixedMask, unsigned int i)
+{
+    if (fixedMask)
+    {
+        unsigned int p = i/3;
+        if (fixedMask[p>>5] & (1u << (p&31))) return 0;
+    }
+    return q[i];
+}
+
 template<class real, bool first, int blockSize>
-__global__ void MergedKernels_cgDot3_kernel(unsigned int n, const real* r, const real* q, const real* d, real* tmp)
+__global__ void MergedKernels_cgDot3_kernel(unsigned int n, const real* r, const real* q, const real* d, const unsigned int* fixedMask, real* tmp)
 {
     unsigned int tid = threadIdx.x;
     unsigned int gridSize = gridDim.x*(blockSize);
@@ -105,7 +117,7 @@ __global__ void MergedKernels_cgDot3_kernel(unsigned int n, const real* r, const
 	#pragma unroll
     for (unsigned int i = blockIdx.x*(blockSize) + tid; i < n; i += gridSize)
     {
-        real qi = q[i];
+        real qi = MergedKernels_readFree(q, fixedMask, i);
         real di = d[i];
         real ri = (first) ? d[i] : r[i];
         dot_qq += qi*qi;
@@ -183,14 +195,14 @@ __global__ void MergedKernels_cgDot3_kernel(unsigned int n, const real* r, const
 
 template<class real, int blockSize>
 __global__ void MergedKernels_cgOp3_kernel(unsigned int n, float alpha, float beta,
-                                           float* r, float* a, float* d, const float* q)
+                                           float* r, float* a, float* d, const float* q, const unsigned int* fixedMask)
 {
     unsigned int tid = threadIdx.x;
     unsigned int gridSize = gridDim.x*(blockSize);
 	#pragma unroll
     for (unsigned int i = blockIdx.x*(blockSize) + tid; i < n; i += gridSize)
     {
-        real qi = q[i];
+        real qi = MergedKernels_readFree(q, fixedMask, i);
         real di = /* (first) ? b[i] : */ d[i];
         real ai = /* (first) ? 0 : */ a[i];
         real ri = /* (first) ? di : */ r[i];
@@ -205,14 +217,14 @@ __global__ void MergedKernels_cgOp3_kernel(unsigned int n, float alpha, float be
 
 template<class real, int blockSize>
 __global__ void MergedKernels_cgOp3First_kernel(unsigned int n, float alpha, float beta,
-                                           float* r, float* a, float* d, const float* q, const float* b)
+                                           float* r, float* a, float* d, const float* q, const float* b, const unsigned int* fixedMask)
 {
     unsigned int tid = threadIdx.x;
     unsigned int gridSize = gridDim.x*(blockSize);
 	#pragma unroll
     for (unsigned int i = blockIdx.x*(blockSize) + tid; i < n; i += gridSize)
     {
-        real qi = q[i];
+        real qi = MergedKernels_readFree(q, fixedMask, i);
         real di = b[i];
         real ai = di * alpha;
         a[i] = ai;
@@ -277,7 +289,7 @@ int CudaMergedKernels3f_cgDot3TmpSize(unsigned int size)
 }
 
 void CudaMergedKernels3f_cgDot3(unsigned int size, float* dot3,
-                                const void* r, const void* q, const void* d,
+                                const void* r, const void* q, const void* d, const void* fixedMask,
                                 void* tmp, float* cputmp)
 {
     size *= 3;
@@ -293,7 +305,7 @@ void CudaMergedKernels3f_cgDot3(unsigned int size, float* dot3,
 
     dim3 threads(DOT3_BSIZE,1);
     dim3 grid(nblocs,1);
-    MergedKernels_cgDot3_kernel<float, false, DOT3_BSIZE> <<< grid, threads >>>(size, (const float*)r, (const float*)q, (const float*)d, (float*)tmp);
+    MergedKernels_cgDot3_kernel<float, false, DOT3_BSIZE> <<< grid, threads >>>(size, (const float*)r, (const float*)q, (const float*)d, (const unsigned int*)fixedMask, (float*)tmp);
     
     cudaMemcpy(cputmp,tmp,nblocs*3*sizeof(float),cudaMemcpyDeviceToHost);
     float sum[3] = {0.0f,0.0f,0.0f};
@@ -309,7 +321,7 @@ void CudaMergedKernels3f_cgDot3(unsigned int size, float* dot3,
     dot3[2] = sum[2];
 }
 void CudaMergedKernels3f_cgDot3First(unsigned int size, float* dot3,
-                                     const void* b, const void* q,
+                                     const void* b, const void* q, const void* fixedMask,
                                      void* tmp, float* cputmp)
 {
     size *= 3;
@@ -325,7 +337,7 @@ void CudaMergedKernels3f_cgDot3First(unsigned int size, float* dot3,
 
     dim3 threads(DOT3_BSIZE,1);
     dim3 grid(nblocs,1);
-    MergedKernels_cgDot3_kernel<float, true, DOT3_BSIZE> <<< grid, threads >>>(size, (const float*)b, (const float*)q, (const float*)b, (float*)tmp);
+    MergedKernels_cgDot3_kernel<float, true, DOT3_BSIZE> <<< grid, threads >>>(size, (const float*)b, (const float*)q, (const float*)b, (const unsigned int*)fixedMask, (float*)tmp);
     
     cudaMemcpy(cputmp,tmp,nblocs*3*sizeof(float),cudaMemcpyDeviceToHost);
     float sum[3] = {0.0f,0.0f,0.0f};
@@ -345,7 +357,7 @@ enum { OP3_BSIZE = 64 };
 enum { OP3_GRIDSIZE = 256 };
 
 void CudaMergedKernels3f_cgOp3(unsigned int size, float alpha, float beta,
-                               void* r, void* a, void* d, const void* q)
+                               void* r, void* a, void* d, const void* q, const void* fixedMask)
 {
     size *= 3;
     int nblocs = (size+OP3_BSIZE-1)/OP3_BSIZE;
@@ -353,11 +365,11 @@ void CudaMergedKernels3f_cgOp3(unsigned int size, float alpha, float beta,
 
     dim3 threads(OP3_BSIZE,1);
     dim3 grid(nblocs,1);
-    MergedKernels_cgOp3_kernel<float, OP3_BSIZE> <<< grid, threads >>>(size, alpha, beta, (float*)r, (float*)a, (float*)d, (const float*)q);
+    MergedKernels_cgOp3_kernel<float, OP3_BSIZE> <<< grid, threads >>>(size, alpha, beta, (float*)r, (float*)a, (float*)d, (const float*)q, (const unsigned int*)fixedMask);
 }
 
 void CudaMergedKernels3f_cgOp3First(unsigned int size, float alpha, float beta,
-                                    void* r, void* a, void* d, const void* q, const void* b)
+                                    void* r, void* a, void* d, const void* q, const void* b, const void* fixedMask)
 {
     size *= 3;
     int nblocs = (size+OP3_BSIZE-1)/OP3_BSIZE;
@@ -365,5 +377,5 @@ void CudaMergedKernels3f_cgOp3First(unsigned int size, float alpha, float beta,
 
     dim3 threads(OP3_BSIZE,1);
     dim3 grid(nblocs,1);
-    MergedKernels_cgOp3First_kernel<float, OP3_BSIZE> <<< grid, threads >>>(size, alpha, beta, (float*)r, (float*)a, (float*)d, (const float*)q, (const float*)b);
+    MergedKernels_cgOp3First_kernel<float, OP3_BSIZE> <<< grid, threads >>>(size, alpha, beta, (float*)r, (float*)a, (float*)d, (const float*)q, (const float*)b, (const unsigned int*)fixedMask);
 }
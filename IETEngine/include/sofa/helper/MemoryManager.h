@@ -29,6 +29,21 @@
 
 #include <sofa/helper/helper.h>
 #include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <ostream>
+#if defined(WIN32)
+#include <malloc.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 #ifndef NO_OPENGL
 
@@ -42,6 +57,20 @@ namespace sofa
 namespace helper
 {
 
+// Replace the global operator new and delete by ones counting the allocations
+// in CPUMemory::heapAllocs(); to be used once, in the source file of main
+#define SOFA_COUNT_HEAP_ALLOCATIONS() \
+    void* operator new(size_t size) \
+    { \
+        ++sofa::helper::CPUMemory::heapAllocs(); \
+        void* p = std::malloc(size ? size : 1); \
+        if (!p) throw std::bad_alloc(); \
+        return p; \
+    } \
+    void* operator new[](size_t size) { return operator new(size); } \
+    void operator delete(void* p) throw() { std::free(p); } \
+    void operator delete[](void* p) throw() { std::free(p); }
+
 #ifndef MAX_NUMBER_OF_DEVICES
 #define MAX_NUMBER_OF_DEVICES 8
 #endif
@@ -94,6 +123,168 @@ public:
     //static bool isNull(device_pointer p){return p==NULL;}
 };
 
+/* Settings and statistics of the CPU allocations.
+ * Blocks are 64-byte aligned (a cache line, and the widest SIMD load), and
+ * large blocks are first touched by the OpenMP threads with a static schedule,
+ * so that on NUMA machines each page is placed on the node of the thread that
+ * processes this part of the vector in the kernels.
+ */
+struct CPUMemory
+{
+    enum { ALIGNMENT = 64 };
+    enum { HUGE_PAGE = 2*1024*1024 };
+
+    struct Stats
+    {
+        size_t nbAllocs, nbFrees;
+        size_t bytes, peakBytes, totalBytes;
+        size_t hugeBytes; // currently in blocks backed by huge pages
+        Stats() : nbAllocs(0), nbFrees(0), bytes(0), peakBytes(0), totalBytes(0), hugeBytes(0) {}
+    };
+
+    // Use huge pages for blocks of at least HUGE_PAGE bytes (Linux: transparent
+    // huge pages; Windows: large pages, which need the "Lock pages in memory" privilege)
+    static bool& hugePages() { static bool b = false; return b; }
+    // Blocks from this size are first touched in parallel (0 to disable)
+    static size_t& firstTouchSize() { static size_t s = 256*1024; return s; }
+
+    static Stats stats() { std::lock_guard<std::mutex> lock(mutex()); return statsRef(); }
+    // Allocations with the global operator new (std containers...), counted only
+    // if the program installs the counting operators with SOFA_COUNT_HEAP_ALLOCATIONS()
+    static std::atomic<size_t>& heapAllocs() { static std::atomic<size_t> n(0); return n; }
+    static void print(std::ostream& out)
+    {
+        Stats s = stats();
+        out << "CPU memory: " << s.bytes/1024 << " KB in " << (s.nbAllocs-s.nbFrees) << " blocks (peak " << s.peakBytes/1024
+            << " KB, " << s.hugeBytes/1024 << " KB on huge pages), " << s.nbAllocs << " allocations of " << s.totalBytes/1024 << " KB in total" << std::endl;
+    }
+
+    // Blocks of at least HUGE_PAGE bytes are preceded by a header telling how to free them
+    struct Header
+    {
+        void* base;
+        int kind; // 0: aligned heap block, 1: huge pages (Linux: aligned on HUGE_PAGE, Windows: VirtualAlloc)
+    };
+
+    static void* alloc(size_t size)
+    {
+        const bool large = (size >= HUGE_PAGE);
+        const size_t total = large ? size + ALIGNMENT : size;
+        void* base = NULL;
+        int kind = 0;
+        if (large && hugePages())
+        {
+#if defined(WIN32)
+            const size_t page = GetLargePageMinimum();
+            if (page)
+            {
+                base = VirtualAlloc(NULL, (total + page-1) & ~(page-1), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+                if (base) kind = 1;
+            }
+#elif defined(__linux__)
+            if (posix_memalign(&base, HUGE_PAGE, total) == 0)
+            {
+                kind = 1;
+#ifdef MADV_HUGEPAGE
+                madvise(base, total, MADV_HUGEPAGE);
+#endif
+            }
+            else base = NULL;
+#endif
+        }
+        if (!base)
+        {
+#if defined(WIN32)
+            base = _aligned_malloc(total, ALIGNMENT);
+#else
+            if (posix_memalign(&base, ALIGNMENT, total) != 0) base = NULL;
+#endif
+        }
+        if (!base) throw std::bad_alloc();
+        char* p = (char*)base;
+        if (large)
+        {
+            Header* h = (Header*)base;
+            h->base = base;
+            h->kind = kind;
+            p += ALIGNMENT;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex());
+            Stats& s = statsRef();
+            ++s.nbAllocs;
+            s.bytes += size;
+            s.totalBytes += size;
+            if (kind) s.hugeBytes += size;
+            if (s.bytes > s.peakBytes) s.peakBytes = s.bytes;
+        }
+        if (firstTouchSize() && size >= firstTouchSize())
+        {
+            // first touch: each page is placed by the thread that processes it
+            // in the OpenMP loops with the default static schedule
+            const int nbPages = (int)((size + 4095) / 4096);
+            #pragma omp parallel for schedule(static)
+            for (int i=0;i<nbPages;++i)
+            {
+                const size_t begin = (size_t)i*4096;
+                memset(p + begin, 0, (begin + 4096 <= size) ? 4096 : size - begin);
+            }
+        }
+        return p;
+    }
+
+    // size must be the one given to alloc
+    static void free(void* p, size_t size)
+    {
+        void* base = p;
+        int kind = 0;
+        if (size >= HUGE_PAGE)
+        {
+            Header* h = (Header*)((char*)p - ALIGNMENT);
+            base = h->base;
+            kind = h->kind;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex());
+            Stats& s = statsRef();
+            ++s.nbFrees;
+            s.bytes -= size;
+            if (kind) s.hugeBytes -= size;
+        }
+#if defined(WIN32)
+        if (kind) VirtualFree(base, 0, MEM_RELEASE);
+        else _aligned_free(base);
+#else
+        ::free(base);
+#endif
+    }
+
+private:
+    static std::mutex& mutex() { static std::mutex m; return m; }
+    static Stats& statsRef() { static Stats s; return s; }
+};
+
+/* Allocator of the std::vector behind sofa::helper::vector on CPU, see CPUMemory
+ */
+template <class T>
+class CPUAllocator : public std::allocator<T>
+{
+public:
+    typedef typename std::allocator<T>::pointer pointer;
+    typedef typename std::allocator<T>::size_type size_type;
+    template <class U> struct rebind { typedef CPUAllocator<U> other; };
+
+    CPUAllocator() {}
+    CPUAllocator(const CPUAllocator& a) : std::allocator<T>(a) {}
+    template <class U> CPUAllocator(const CPUAllocator<U>& a) : std::allocator<T>(a) {}
+
+    pointer allocate(size_type n, const void* = 0) { return n ? (pointer)CPUMemory::alloc(n*sizeof(T)) : NULL; }
+    void deallocate(pointer p, size_type n) { if (p) CPUMemory::free(p, n*sizeof(T)); }
+};
+
+template <class T, class U> bool operator==(const CPUAllocator<T>&, const CPUAllocator<U>&) { return true; }
+template <class T, class U> bool operator!=(const CPUAllocator<T>&, const CPUAllocator<U>&) { return false; }
+
 //CPU MemoryManager
 template <class T >
 class CPUMemoryManager : public MemoryManager<T>
@@ -523,10 +523,10 @@ namespace sofa
 
 		//classic vector (using CPUMemoryManager, same behavior as std::helper)
 		template <class T>
-		class vector<T, CPUMemoryManager<T> > : public std::vector<T, std::allocator<T> >
+		class vector<T, CPUMemoryManager<T> > : public std::vector<T, CPUAllocator<T> >
 		{
 		public:
-			typedef std::allocator<T> Alloc;
+			typedef CPUAllocator<T> Alloc;
 			/// size_type
 			typedef typename std::vector<T,Alloc>::size_type size_type;
 			/// reference to a value (read-write)
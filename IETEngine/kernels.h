@@ -7,34 +7,172 @@
 #ifdef _MSC_VER
 #include <intrin.h>
 #endif
+#ifdef _OPENMP
+#include <omp.h>
 #endif
+#endif
+#include <fstream>
+#include <sstream>
 
 //// DATA ////
 int cuda_device = -1;
 std::string device_name;
 
-#if !defined(VERSION) || VERSION >= 5
-// FLAG to activate linear algebra kernels merging optimization
-#define MERGE_CG_KERNELS
-#endif
-#if !defined(VERSION) || VERSION >= 6
-// FLAG to reduction kernels merging optimization
-#define MERGE_REDUCTION_KERNELS
+// Linear algebra kernels used by the CG solver
+enum CGKernels
+{
+	CG_Separate = 0,    // one kernel per vector operation
+	CG_Merged,          // vector updates merged with the residual reduction
+	CG_MergedReduction, // the dot products of an iteration merged in one reduction, fixed constraints fused
+};
+
+// Kernel variants, all compiled in and selected at runtime.
+// VERSION only sets the default variant. PARALLEL_GATHER stays a build flag:
+// it changes the data layout (element forces gathered per vertex) of the CUDA
+// kernels, while the shape of the gather is a variant.
+struct KernelVariants
+{
+	CGKernels cg;
+	int nbThreads;   // OpenMP threads of the CPU kernels, 0 for all processors
+	int gatherPT;    // FEM add force: number of threads per point (1, 4 or 8)
+	int gatherBSize; // FEM add force: number of threads per bloc (32, 64, 128 or 256)
+
+	KernelVariants()
+#if defined(VERSION) && VERSION < 5
+		: cg(CG_Separate),
+#elif defined(VERSION) && VERSION < 6
+		: cg(CG_Merged),
+#else
+		: cg(CG_MergedReduction),
 #endif
+		nbThreads(0), gatherPT(4), gatherBSize(64)
+	{
+	}
 
+	bool operator==(const KernelVariants& v) const
+	{
+		return cg == v.cg && nbThreads == v.nbThreads && gatherPT == v.gatherPT && gatherBSize == v.gatherBSize;
+	}
+
+	std::string name() const
+	{
+		static const char* cgNames[3] = { "separate", "merged", "merged-reduction" };
+		std::ostringstream o;
+		o << "cg=" << cgNames[cg];
+#if defined(SOFA_DEVICE_CPU)
+		o << " threads=" << nbThreads;
+#endif
 #ifdef PARALLEL_GATHER
+		o << " gather=" << gatherPT << "x" << gatherBSize;
+#endif
+		return o.str();
+	}
+};
 
-// FEM add force: number of threads per point
-#define GATHER_PT 4
-//#define GATHER_PT 1
+KernelVariants kernel_variants;
 
-// FEM add force: number of threads per bloc
-//#define GATHER_BSIZE 32
-#define GATHER_BSIZE 64
-//#define GATHER_BSIZE 128
-//#define GATHER_BSIZE 256
+// The OpenMP team size is set for the calling thread, the TaskScheduler
+// workers take it from the thread running the graph
+void kernels_set_variants(const KernelVariants& v)
+{
+	kernel_variants = v;
+#if defined(SOFA_DEVICE_CPU) && defined(_OPENMP)
+	omp_set_num_threads((v.nbThreads > 0) ? v.nbThreads : omp_get_num_procs());
+#endif
+}
 
+// Variants worth timing on this device
+void kernels_candidates(std::vector<KernelVariants>& candidates)
+{
+	candidates.clear();
+	std::vector<int> threads(1, 0);
+#if defined(SOFA_DEVICE_CPU) && defined(_OPENMP)
+	// hyper-threads and little cores do not always help the memory bound kernels
+	for (int n = omp_get_num_procs()/2; n >= 1; n /= 2)
+		threads.push_back(n);
+#endif
+	std::vector<std::pair<int,int> > gathers(1, std::make_pair(4, 64));
+#ifdef PARALLEL_GATHER
+	const int pts[3] = { 1, 4, 8 };
+	const int bsizes[4] = { 32, 64, 128, 256 };
+	gathers.clear();
+	for (int p = 0; p < 3; ++p)
+		for (int b = 0; b < 4; ++b)
+			gathers.push_back(std::make_pair(pts[p], bsizes[b]));
 #endif
+	for (int cg = CG_Separate; cg <= CG_MergedReduction; ++cg)
+		for (unsigned int t = 0; t < threads.size(); ++t)
+			for (unsigned int g = 0; g < gathers.size(); ++g)
+			{
+				KernelVariants v;
+				v.cg = (CGKernels)cg;
+				v.nbThreads = threads[t];
+				v.gatherPT = gathers[g].first;
+				v.gatherBSize = gathers[g].second;
+				candidates.push_back(v);
+			}
+}
+
+// Cache of the best variant per device and mesh size, one line per entry:
+// cg nbThreads gatherPT gatherBSize sizeClass deviceName
+static const char* kernels_cache_filename = "./KernelVariants.cache";
+
+// Meshes within a factor 2 of elements share their variant
+int kernels_size_class(unsigned int nbElems)
+{
+	int c = 0;
+	while (nbElems > 1) { nbElems >>= 1; ++c; }
+	return c;
+}
+
+bool kernels_cache_read(unsigned int nbElems, KernelVariants& result)
+{
+	std::ifstream in(kernels_cache_filename);
+	const int sizeClass = kernels_size_class(nbElems);
+	std::string line;
+	while (std::getline(in, line))
+	{
+		std::istringstream l(line);
+		KernelVariants v;
+		int cg, c;
+		std::string device;
+		if (!(l >> cg >> v.nbThreads >> v.gatherPT >> v.gatherBSize >> c)) continue;
+		l >> std::ws;
+		std::getline(l, device);
+		if (c != sizeClass || device != device_name || cg < CG_Separate || cg > CG_MergedReduction) continue;
+		v.cg = (CGKernels)cg;
+		result = v;
+		return true;
+	}
+	return false;
+}
+
+void kernels_cache_write(unsigned int nbElems, const KernelVariants& v)
+{
+	const int sizeClass = kernels_size_class(nbElems);
+	std::vector<std::string> lines;
+	{
+		std::ifstream in(kernels_cache_filename);
+		std::string line;
+		while (std::getline(in, line))
+		{
+			std::istringstream l(line);
+			int cg, t, pt, bs, c;
+			std::string device;
+			if (!(l >> cg >> t >> pt >> bs >> c)) continue;
+			l >> std::ws;
+			std::getline(l, device);
+			if (c == sizeClass && device == device_name) continue; // replaced
+			lines.push_back(line);
+		}
+	}
+	std::ostringstream o;
+	o << (int)v.cg << " " << v.nbThreads << " " << v.gatherPT << " " << v.gatherBSize << " " << sizeClass << " " << device_name;
+	lines.push_back(o.str());
+	std::ofstream out(kernels_cache_filename);
+	for (unsigned int i = 0; i < lines.size(); ++i)
+		out << lines[i] << std::endl;
+}
 
 #if defined( SOFA_DEVICE_CUDA )
 #define DEVICE_METHOD(name) sofa_concat(Cuda,name)
@@ -106,6 +244,7 @@ bool kernels_init()
 	std::cout << "V" << VERSION << " ";
 #endif
 	std::cout << device_name << " (" << sizeof(void*)*8 << " bits)" << std::endl;
+	kernels_set_variants(kernel_variants);
 	return true;
 }
 
@@ -135,38 +274,46 @@ void DEVICE_METHOD(TetrahedronFEMForceField3f_addDForce)( unsigned int nbElem, u
     , DEVICE_PTR(GPUElementForce<TReal>) eforce, const DEVICE_PTR(int) velems
 #endif
 );
+#ifdef DOUBLE_KERNELS
+// df and dx are 3*nbVertex doubles
+void DEVICE_METHOD(TetrahedronFEMForceField3d_addDForce)( unsigned int nbElem, unsigned int nbVertex, bool add, double factor
+    , const DEVICE_PTR(GPUElement<TReal>) elems, const DEVICE_PTR(GPUElementRotation<TReal>) state
+    , DEVICE_PTR(double) df, const DEVICE_PTR(double) dx
+);
+#endif
 }
 
 extern "C" // MergedKernels
 {
-#if defined(MERGE_REDUCTION_KERNELS)
+// CG_MergedReduction
 #ifdef PARALLEL_REDUCTION
 int DEVICE_METHOD(MergedKernels3f_cgDot3TmpSize)( unsigned int size );
 #endif
+// q is taken as 0 on the particles set in fixedMask (if not NULL)
 // d.q, r.q, q.q
 void DEVICE_METHOD(MergedKernels3f_cgDot3)( unsigned int size, float* dot3
-    , const DEVICE_PTR(TDeriv) r, const DEVICE_PTR(TDeriv) q, const DEVICE_PTR(TDeriv) d
+    , const DEVICE_PTR(TDeriv) r, const DEVICE_PTR(TDeriv) q, const DEVICE_PTR(TDeriv) d, const DEVICE_PTR(unsigned int) fixedMask
 #ifdef PARALLEL_REDUCTION
     , DEVICE_PTR(TReal) tmp, float* cputmp
 #endif
 );
 // b.q, b.q, q.q
 void DEVICE_METHOD(MergedKernels3f_cgDot3First)( unsigned int size, float* dot3
-    , const DEVICE_PTR(TDeriv) b, const DEVICE_PTR(TDeriv) q
+    , const DEVICE_PTR(TDeriv) b, const DEVICE_PTR(TDeriv) q, const DEVICE_PTR(unsigned int) fixedMask
 #ifdef PARALLEL_REDUCTION
     , DEVICE_PTR(TReal) tmp, float* cputmp
 #endif
 );
 // a = a + alpha d, r = r - alpha q, d = r + beta d
 void DEVICE_METHOD(MergedKernels3f_cgOp3)( unsigned int size, float alpha, float beta
-    , DEVICE_PTR(TDeriv) r, DEVICE_PTR(TDeriv) a, DEVICE_PTR(TDeriv) d, const DEVICE_PTR(TDeriv) q
+    , DEVICE_PTR(TDeriv) r, DEVICE_PTR(TDeriv) a, DEVICE_PTR(TDeriv) d, const DEVICE_PTR(TDeriv) q, const DEVICE_PTR(unsigned int) fixedMask
 );
 // a = alpha b, r = b - alpha q, d = r + beta b
 void DEVICE_METHOD(MergedKernels3f_cgOp3First)( unsigned int size, float alpha, float beta
     , DEVICE_PTR(TDeriv) r, DEVICE_PTR(TDeriv) a, DEVICE_PTR(TDeriv) d, const DEVICE_PTR(TDeriv) q
-    , const DEVICE_PTR(TDeriv) b
+    , const DEVICE_PTR(TDeriv) b, const DEVICE_PTR(unsigned int) fixedMask
 );
-#elif defined(MERGE_CG_KERNELS)
+// CG_Merged
 #ifdef PARALLEL_REDUCTION
 int DEVICE_METHOD(MergedKernels3f_cgDeltaTmpSize)( unsigned int size );
 #endif
@@ -176,7 +323,6 @@ void DEVICE_METHOD(MergedKernels3f_cgDelta)( bool first, unsigned int size, floa
     , DEVICE_PTR(TReal) tmp, float* cputmp
 #endif
 );
-#endif
 }
 
 extern "C" // MechanicalObject
@@ -185,8 +331,13 @@ void DEVICE_METHOD(MechanicalObject3f_vClear)( unsigned int size, DEVICE_PTR(TDe
 void DEVICE_METHOD(MechanicalObject3f_vEqBF)( unsigned int size, DEVICE_PTR(TDeriv) res, const DEVICE_PTR(TDeriv) b, float f );
 void DEVICE_METHOD(MechanicalObject3f_vPEqBF)( unsigned int size, DEVICE_PTR(TDeriv) res, const DEVICE_PTR(TDeriv) b, float f );
 void DEVICE_METHOD(MechanicalObject3f_vOp)( unsigned int size, DEVICE_PTR(TDeriv) res, const DEVICE_PTR(TDeriv) a, const DEVICE_PTR(TDeriv) b, float f );
-void DEVICE_METHOD(MechanicalObject3f_vIntegrate)( unsigned int size, const DEVICE_PTR(TDeriv) a, DEVICE_PTR(TDeriv) v, DEVICE_PTR(TCoord) x, float h );
+// v = v + h a, x = x + h v, fixed particles (if fixedMask is not NULL) move to their target
+void DEVICE_METHOD(MechanicalObject3f_vIntegrate)( unsigned int size, const DEVICE_PTR(TDeriv) a, DEVICE_PTR(TDeriv) v, DEVICE_PTR(TCoord) x, float h, const DEVICE_PTR(unsigned int) fixedMask, const DEVICE_PTR(TCoord) fixedTargets );
 void DEVICE_METHOD(MechanicalObject3f_vPEq1)( unsigned int size, DEVICE_PTR(TDeriv) res, int index, const float* val );
+// Mixed precision accumulation (3*size values in acc): acc = d if first, acc += d otherwise, then res = acc rounded to float
+void DEVICE_METHOD(MechanicalObject3f_vAccumulate)( unsigned int size, bool first, DEVICE_PTR(double) acc, DEVICE_PTR(TDeriv) res, const DEVICE_PTR(TDeriv) d );
+// v = vFactor v + invMassH f, x = x + h v, fixed particles move to their target
+void DEVICE_METHOD(MechanicalObject3f_vIntegrateSymplectic)( unsigned int size, const DEVICE_PTR(TDeriv) f, DEVICE_PTR(TDeriv) v, DEVICE_PTR(TCoord) x, float invMassH, float vFactor, float h, const DEVICE_PTR(unsigned int) fixedMask, const DEVICE_PTR(TCoord) fixedTargets );
 #ifdef PARALLEL_REDUCTION
 int DEVICE_METHOD(MechanicalObject3f_vDotTmpSize)( unsigned int size );
 #endif
@@ -196,6 +347,18 @@ void DEVICE_METHOD(MechanicalObject3f_vDot)( unsigned int size, float* res
     , DEVICE_PTR(TReal) tmp, float* cputmp
 #endif
 );
+#ifdef DOUBLE_KERNELS
+// double vectors of 3*size values
+void DEVICE_METHOD(MechanicalObject3d_vClear)( unsigned int size, DEVICE_PTR(double) res );
+void DEVICE_METHOD(MechanicalObject3d_vEqBF)( unsigned int size, DEVICE_PTR(double) res, const DEVICE_PTR(double) b, double f );
+void DEVICE_METHOD(MechanicalObject3d_vPEqBF)( unsigned int size, DEVICE_PTR(double) res, const DEVICE_PTR(double) b, double f );
+void DEVICE_METHOD(MechanicalObject3d_vOp)( unsigned int size, DEVICE_PTR(double) res, const DEVICE_PTR(double) a, const DEVICE_PTR(double) b, double f );
+void DEVICE_METHOD(MechanicalObject3d_vDot)( unsigned int size, double* res, const DEVICE_PTR(double) a, const DEVICE_PTR(double) b );
+void DEVICE_METHOD(MechanicalObject3d_vFromFloat)( unsigned int size, DEVICE_PTR(double) res, const DEVICE_PTR(TDeriv) a );
+void DEVICE_METHOD(MechanicalObject3f_vFromDouble)( unsigned int size, DEVICE_PTR(TDeriv) res, const DEVICE_PTR(double) a );
+// res = b - q rounded to float, r2 = squared norm of b - q in double
+void DEVICE_METHOD(MechanicalObject3f_vResidual)( unsigned int size, double* r2, DEVICE_PTR(TDeriv) res, const DEVICE_PTR(TDeriv) b, const DEVICE_PTR(double) q );
+#endif
 }
 
 extern "C" // UniformMass
@@ -203,11 +366,17 @@ extern "C" // UniformMass
 void DEVICE_METHOD(UniformMass3f_addMDx)( unsigned int size, float mass, DEVICE_PTR(TDeriv) res, const DEVICE_PTR(TDeriv) dx );
 void DEVICE_METHOD(UniformMass3f_accFromF)( unsigned int size, float mass, DEVICE_PTR(TDeriv) a, const DEVICE_PTR(TDeriv) f );
 void DEVICE_METHOD(UniformMass3f_addForce)( unsigned int size, const float *mg, DEVICE_PTR(TDeriv) f );
+#ifdef DOUBLE_KERNELS
+void DEVICE_METHOD(UniformMass3d_addMDx)( unsigned int size, double mass, DEVICE_PTR(double) res, const DEVICE_PTR(double) dx );
+#endif
 }
 
 extern "C" // FixedConstraint
 {
 void DEVICE_METHOD(FixedConstraint3f_projectResponseIndexed)( unsigned int size, const DEVICE_PTR(int) indices, DEVICE_PTR(TDeriv) dx );
+#ifdef DOUBLE_KERNELS
+void DEVICE_METHOD(FixedConstraint3d_projectResponseIndexed)( unsigned int size, const DEVICE_PTR(int) indices, DEVICE_PTR(double) dx );
+#endif
 }
 
 extern "C" // PlaneForceField
@@ -222,6 +391,25 @@ void DEVICE_METHOD(SphereForceField3f_addForce)( unsigned int size, GPUSphere<fl
 void DEVICE_METHOD(SphereForceField3f_addDForce)( unsigned int size, GPUSphere<float>* sphere, const DEVICE_PTR(TReal) penetration, DEVICE_PTR(TDeriv) f, const DEVICE_PTR(TDeriv) dx );
 }
 
+extern "C" // ColliderForceField
+{
+// with f NULL only the contacts are computed
+void DEVICE_METHOD(ColliderForceField3f_addForce)( unsigned int nbPoints, const DEVICE_PTR(int) points, const GPUColliderGrid<float>* grid
+    , const DEVICE_PTR(GPUCollider<float>) colliders, const DEVICE_PTR(int) cellStart, const DEVICE_PTR(int) cellColliders
+    , DEVICE_PTR(GPUContact<float>) contacts, DEVICE_PTR(TDeriv) f, const DEVICE_PTR(TCoord) x, const DEVICE_PTR(TDeriv) v );
+void DEVICE_METHOD(ColliderForceField3f_addContactForce)( unsigned int nbPoints, const DEVICE_PTR(int) points, const DEVICE_PTR(GPUContact<float>) contacts, DEVICE_PTR(TDeriv) f, const DEVICE_PTR(TDeriv) v );
+void DEVICE_METHOD(ColliderForceField3f_addDForce)( unsigned int nbPoints, const DEVICE_PTR(int) points, const DEVICE_PTR(GPUContact<float>) contacts, float factor, DEVICE_PTR(TDeriv) f, const DEVICE_PTR(TDeriv) dx );
+#ifdef DOUBLE_KERNELS
+void DEVICE_METHOD(ColliderForceField3d_addDForce)( unsigned int nbPoints, const DEVICE_PTR(int) points, const DEVICE_PTR(GPUContact<float>) contacts, double factor, DEVICE_PTR(double) f, const DEVICE_PTR(double) dx );
+#endif
+}
+
+extern "C" // ExternalForceField
+{
+// scatter a batch of point forces, each spread over up to three particles
+void DEVICE_METHOD(ExternalForceField3f_addForce)( unsigned int nbForces, const DEVICE_PTR(GPUExternalForce<float>) forces, DEVICE_PTR(TDeriv) f );
+}
+
 extern "C" // TetraMapper
 {
 void DEVICE_METHOD(TetraMapper3f_apply)( unsigned int size, const DEVICE_PTR(TTetra) map_i, const DEVICE_PTR(TCoord4) map_f, DEVICE_PTR(TDeriv) out, const DEVICE_PTR(TDeriv) in );
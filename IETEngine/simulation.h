@@ -4,6 +4,9 @@
 #include "common.h"
 
 #include "FEMMesh.h"
+#include "SolverWorkspace.h"
+#include "DeformationCache.h"
+#include "TaskGraph.h"
 #include "SimulationParameters.h"  
 #include "SurfaceMesh.h"
 #include "MecanicalMatrix.h"
@@ -15,8 +18,8 @@
 #include "cpu/CPUFixedConstraint.h"
 #include "cpu/CPUMechanicalObject.h"
 #include "cpu/CPUMergedKernels.h"
-#include "cpu/CPUPlaneForceField.h"
-#include "cpu/CPUSphereForceField.h"
+#include "cpu/CPUColliderForceField.h"
+#include "cpu/CPUExternalForceField.h"
 #include "cpu/CPUTetrahedronFEMForceField.h"
 #include "cpu/CPUUniformMass.h"
 #include "cpu/CPUVisualModel.h"
@@ -34,24 +37,74 @@ public:
 	void simulation_reorder_fem_mesh();
 	bool simulation_load_render_mesh(const char* filename);
 	bool simulation_init();
+	// Select the fastest kernel variants for the current mesh, from the cache
+	// or by timing nbFrames steps with each candidate (force to ignore the cache)
+	void simulation_autotune(int nbFrames = 5, bool force = false);
 
 	void simulation_animate();
+	void timeIntegrator(const SimulationParameters* params, FEMMesh* mesh);
 	void timeIntegrator_EulerImplicit(const SimulationParameters* params, FEMMesh* mesh);
 	void timeIntegrator_EulerExplicit(const SimulationParameters* params, FEMMesh* mesh);
+	void timeIntegrator_SymplecticEuler(const SimulationParameters* params, FEMMesh* mesh);
 	void computeForce(const SimulationParameters* params, FEMMesh* mesh, TVecDeriv& result);
+	// Parts of computeForce, run as tasks of d_forceGraph
+	void addInternalForce(const SimulationParameters* params, FEMMesh* mesh, TVecDeriv& result);
+	void detectColliders(FEMMesh* mesh);
+	void detectSurfaceCollisions(FEMMesh* mesh);
+	void addContactForces(const SimulationParameters* params, FEMMesh* mesh, TVecDeriv& result);
 	void applyConstraints(const SimulationParameters* /*params*/, FEMMesh* mesh, TVecDeriv& result);
 	void accFromF(const SimulationParameters* params, FEMMesh* mesh, const TVecDeriv& f);
 	void addKv(const SimulationParameters* params, FEMMesh* mesh, double kFactor);
 	void mulMatrixVector(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix, TVecDeriv& result, const TVecDeriv& input);
-	void linearSolver_ConjugateGradient(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix);
+	void linearSolver_ConjugateGradient(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix, const TVecDeriv& b, TVecDeriv& a, double tolerance, int maxIter);
+#ifdef DOUBLE_KERNELS
+	void linearSolver_MixedRefinement(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix);
+	void mulMatrixVectorDouble(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix, MyVector(double)& result, const MyVector(double)& input);
+	void linearSolver_Double(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix);
+#endif
+	double vDot(FEMMesh* mesh, const TVecDeriv& a, const TVecDeriv& b);
+	double residualNorm2(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix, TVecDeriv& residual, bool accumulated);
 	template<class TVec> void showDebug(const TVec& v, const char* name);
 	void simulation_mapping();
 	void simulation_reset();
 	void simulation_save();
 	void simulation_load();
+	// Binary snapshots, written from a background thread
+	void simulation_save_snapshot(const std::string& filename);
+	bool simulation_load_snapshot(const std::string& filename);
+	// Rewind to the state frames steps back (0 restores the last captured frame)
+	void simulation_capture_frame();
+	bool simulation_rewind(int frames);
+	// Record the mapped render meshes of each frame in a deformation cache
+	// (precision 0 uses 1e-4 of the size of the simulation)
+	bool simulation_record_start(const std::string& filename, TReal precision = 0, int keyInterval = 30);
+	void simulation_record_stop();
 	void setRandomForce(TVecCoord coord);
+	void simulation_benchmark_integrators(int nbFrames);
+	void simulation_benchmark_solvers(int nbFrames);
+	void simulation_benchmark_colliders(int nbFrames);
+	// Append the timings of each task to a CSV file (empty filename to stop)
+	void simulation_task_log(const std::string& filename);
+	// Topology changes, applied to the FEM mesh and the mapped render meshes
+	int simulation_cut(const TCoord& center, const TDeriv& normal, TReal radius);
+	int simulation_tear(TReal maxStretch);
+	void simulation_topology_changed();
+	// Levels of detail, added after simulation_init from the finest to the coarsest.
+	// The state is transferred between levels by barycentric mapping of the particles.
+	bool simulation_add_lod(const char* filename);
+	bool simulation_set_lod(int level);
+	// Choose the level from the projected height of the body (fraction of the
+	// screen height, 0 if off-screen) and the step time budget; returns the level
+	int simulation_update_lod(TReal screenSize);
+	// Allocations of CPU vectors counted in steady state, that is in the steps
+	// and mappings after the first one since init or the last topology or level
+	// change (only counted when simulation_params.auditAllocations is set), with
+	// the std containers growth if the program uses SOFA_COUNT_HEAP_ALLOCATIONS()
+	size_t simulation_steady_allocations() const { return d_steadyAllocations; }
 
 	FEMMesh* fem_mesh;
+	std::vector<FEMMesh*> simulation_lods; // fem_mesh is simulation_lods[simulation_lod]
+	int simulation_lod;
 	Timer *timer;
 	SimulationParameters simulation_params;
 	//std::vector<SurfaceMesh*> render_meshes;
@@ -60,6 +113,40 @@ public:
 	bool d_profile;
 
 	int simulation_cg_iter;
+	int simulation_substeps;
+
+	SolverWorkspace d_workspace;
+	bool d_steady; // a full frame was run since the last change of sizes
+	size_t d_steadyAllocations;
+	size_t allocationCount() const;
+	void auditAllocations(size_t before, const char* step);
+
+	SnapshotRing simulation_history; // last rewindFrames states
+	FEMSnapshot d_snapshot;
+	SnapshotWriter d_snapshotWriter;
+	DeformationCacheWriter d_recorder;
+	std::vector<const TCoord*> d_recorded;
+
+	// particles of level b mapped on the tetrahedra of level a, at a*nbLevels+b
+	std::vector<TetraMapping> d_lodTransfers;
+	std::vector<double> d_lodStepTime; // last step time of each level (ms), 0 if never run
+	Timer d_lodTimer;
+	bool d_lodLocked; // the topology of the current level was changed, the transfers are no longer valid
+	FEMMesh* load_fem_mesh(const char* filename);
+	void transferExternalForces(int from, int to);
+
+	// Independent parts of the step and of the mapping, run by d_scheduler
+	TaskScheduler d_scheduler;
+	TaskGraph d_forceGraph;
+	TaskGraph d_mappingGraph;
+	std::vector<int> d_mapped; // render meshes mapped by the last run of d_mappingGraph
+	// arguments of the current computeForce, read by the tasks of d_forceGraph
+	const SimulationParameters* d_taskParams;
+	FEMMesh* d_taskMesh;
+	TVecDeriv* d_taskResult;
+	ofstream d_task_time_o;
+	void buildForceGraph();
+	void buildMappingGraph();
 
 	Simulation(int verbose = 0, bool profile = false);
 	~Simulation();
@@ -80,7 +167,7 @@ public:
 #define SET_TIME_ELAPSED(isProfiling, profiler)	if (isProfiling) \
 								profiler << std::fixed << std::setprecision(8) << timer->ElapsedTime() << ",";
 
-Simulation::Simulation(int verbose, bool profile) : d_verbose(verbose), d_profile(profile), simulation_cg_iter(0)
+Simulation::Simulation(int verbose, bool profile) : fem_mesh(NULL), simulation_lod(0), d_verbose(verbose), d_profile(profile), simulation_cg_iter(0), simulation_substeps(0), d_steady(false), d_steadyAllocations(0), d_lodLocked(false), d_forceGraph("force"), d_mappingGraph("mapping"), d_taskParams(NULL), d_taskMesh(NULL), d_taskResult(NULL)
 {
 	if (profile)
 	{
@@ -135,12 +222,22 @@ bool Simulation::simulation_preload()
 }
 
 bool Simulation::simulation_load_fem_mesh(const char* filename)
+{
+	FEMMesh* mesh = load_fem_mesh(filename);
+	if (!mesh) return false;
+	fem_mesh = mesh;
+	simulation_lods.assign(1, mesh);
+	simulation_lod = 0;
+	return true;
+}
+
+FEMMesh* Simulation::load_fem_mesh(const char* filename)
 {
 	FEMMesh* mesh = new FEMMesh;
 	if (!read_mesh_netgen(filename, mesh->positions, mesh->tetrahedra, mesh->triangles))
 	{
 		delete mesh;
-		return false;
+		return NULL;
 	}
 	mesh->filename = filename;
 
@@ -157,8 +254,7 @@ bool Simulation::simulation_load_fem_mesh(const char* filename)
 		}
 	}
 
-	fem_mesh = mesh;
-	return true;
+	return mesh;
 }
 
 void Simulation::simulation_reorder_fem_mesh()
@@ -172,20 +268,98 @@ bool Simulation::simulation_init()
 	FEMMesh* mesh = fem_mesh;
 
 	simulation_params.Init(mesh->bbox);
+#ifdef SOFA_DEVICE_CPU
+	sofa::helper::CPUMemory::hugePages() = simulation_params.hugePages;
+#endif
 
 	if (mesh)
 	{
 		mesh->init(&simulation_params);
+		d_workspace.reserve(mesh);
 
 		for (unsigned int i = 0; i < d_meshes->size(); ++i)
 		{
 			(*d_meshes)[i].init(mesh);
 		}
+#ifdef SOFA_DEVICE_CPU
+		if (d_verbose >= 1) sofa::helper::CPUMemory::print(std::cout);
+#endif
+
+		if (simulation_params.autotune)
+			simulation_autotune();
 	}
+	d_steady = false;
 
 	return true;
 }
 
+void Simulation::simulation_autotune(int nbFrames, bool force)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return;
+	const unsigned int nbElems = mesh->tetrahedra.size();
+	KernelVariants best;
+	if (!force && kernels_cache_read(nbElems, best))
+	{
+		std::cout << "Kernel variants (cached): " << best.name() << std::endl;
+	}
+	else
+	{
+		std::vector<KernelVariants> candidates;
+		kernels_candidates(candidates);
+		const KernelVariants saved_variants = kernel_variants;
+		const bool saved_profile = d_profile;
+		d_profile = false;
+		mesh->captureSnapshot(d_snapshot, simulation_params.simulation_time);
+		Timer bench;
+		double bestTime = 0;
+		bool restored = true;
+		for (unsigned int c = 0; c < candidates.size() && restored; ++c)
+		{
+			kernels_set_variants(candidates[c]);
+#ifdef PARALLEL_GATHER
+			mesh->initGather();
+#endif
+			// only the integrator is timed: simulation_animate would also tear the mesh,
+			// capture the rewind history, time the level of detail and advance the time,
+			// which the snapshot does not undo.
+			// The first frame allocates the solver vectors and is not timed;
+			// the best frame is kept as the others can be slowed by the system
+			timeIntegrator(&simulation_params, mesh);
+			double time = 0;
+			for (int i = 0; i < nbFrames; ++i)
+			{
+				bench.Start();
+				timeIntegrator(&simulation_params, mesh);
+				bench.Stop();
+				if (i == 0 || bench.ElapsedTime() < time) time = bench.ElapsedTime();
+			}
+			if (d_verbose >= 1) std::cout << "  " << candidates[c].name() << " : " << time << " ms" << std::endl;
+			if (c == 0 || time < bestTime) { best = candidates[c]; bestTime = time; }
+			restored = mesh->restoreSnapshot(d_snapshot);
+		}
+		d_profile = saved_profile;
+		if (!restored)
+		{
+			// the state can not be trusted anymore, nor the timings
+			std::cerr << "ERROR: the kernel variants autotune could not restore the mesh state, it is aborted" << std::endl;
+			kernels_set_variants(saved_variants);
+#ifdef PARALLEL_GATHER
+			mesh->initGather();
+#endif
+			return;
+		}
+		kernels_cache_write(nbElems, best);
+		std::cout << "Kernel variants (" << bestTime << " ms per step): " << best.name() << std::endl;
+	}
+	kernels_set_variants(best);
+#ifdef PARALLEL_GATHER
+	// the gather tables depend on the variant
+	for (unsigned int l = 0; l < simulation_lods.size(); ++l)
+		simulation_lods[l]->initGather();
+#endif
+}
+
 
 void Simulation::simulation_reset()
 {
@@ -200,7 +374,7 @@ void Simulation::simulation_save()
 {
 	FEMMesh* mesh = fem_mesh;
 	if (simulation_params.simulation_time)
-		mesh->save(mesh->filename + ".state");
+		simulation_save_snapshot(mesh->filename + ".snap");
 	simulation_mapping();
 	std::string suffix = (simulation_params.simulation_time ? "-deformed" : "-initial");
 	/*for (unsigned int i = 0; i < meshes.size(); ++i)
@@ -217,11 +391,88 @@ void Simulation::simulation_save()
 void Simulation::simulation_load()
 {
 	FEMMesh* mesh = fem_mesh;
+	if (simulation_load_snapshot(mesh->filename + ".snap")) return;
+	// text state from older versions
 	mesh->load(mesh->filename + ".state");
 	simulation_params.simulation_mapping_needed = true;
 	simulation_params.simulation_time = 1;
 }
 
+void Simulation::simulation_save_snapshot(const std::string& filename)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return;
+	mesh->captureSnapshot(d_snapshot, simulation_params.simulation_time);
+	d_snapshotWriter.write(d_snapshot, filename);
+}
+
+bool Simulation::simulation_load_snapshot(const std::string& filename)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return false;
+	// the file may still be queued for writing
+	d_snapshotWriter.flush();
+	std::ifstream test(filename.c_str());
+	if (!test) return false;
+	test.close();
+	if (!d_snapshot.read(filename) || !mesh->restoreSnapshot(d_snapshot)) return false;
+	simulation_params.simulation_time = d_snapshot.time;
+	simulation_params.sphere_position = simulation_params.sphere_position0 + simulation_params.sphere_velocity * d_snapshot.time;
+	mesh->update(&simulation_params);
+	simulation_history.clear();
+	simulation_params.simulation_mapping_needed = true;
+	return true;
+}
+
+bool Simulation::simulation_record_start(const std::string& filename, TReal precision, int keyInterval)
+{
+	if (precision <= 0)
+		precision = (TReal)(simulation_params.simulation_size * 1e-4);
+	std::vector<int> nbVertices;
+	for (unsigned int i = 0; i < d_meshes->size(); ++i)
+		nbVertices.push_back((*d_meshes)[i].m_vertices.size());
+	d_recorded.resize(d_meshes->size());
+	return d_recorder.open(filename, nbVertices, simulation_params.timeStep, precision, keyInterval);
+}
+
+void Simulation::simulation_record_stop()
+{
+	d_recorder.close();
+}
+
+void Simulation::simulation_capture_frame()
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return;
+	if (simulation_history.capacity() != simulation_params.rewindFrames)
+	{
+		simulation_history.setCapacity(simulation_params.rewindFrames);
+		// allocate all the slots now rather than in the next frames
+		if (simulation_history.capacity() > 0)
+		{
+			mesh->captureSnapshot(d_snapshot, simulation_params.simulation_time);
+			simulation_history.reserve(d_snapshot);
+		}
+	}
+	if (simulation_history.capacity() == 0) return;
+	mesh->captureSnapshot(simulation_history.push(), simulation_params.simulation_time);
+}
+
+bool Simulation::simulation_rewind(int frames)
+{
+	FEMMesh* mesh = fem_mesh;
+	const FEMSnapshot* s = simulation_history.get(frames);
+	if (!mesh || !s) return false;
+	if (!mesh->restoreSnapshot(*s)) return false;
+	simulation_params.simulation_time = s->time;
+	simulation_params.sphere_position = simulation_params.sphere_position0 + simulation_params.sphere_velocity * s->time;
+	mesh->update(&simulation_params);
+	// the restored frame stays the last one of the history
+	simulation_history.pop(frames);
+	simulation_params.simulation_mapping_needed = true;
+	return true;
+}
+
 
 void Simulation::simulation_mapping()
 {
@@ -231,41 +482,282 @@ void Simulation::simulation_mapping()
 	FEMMesh* mesh = fem_mesh;
 	if (!mesh) return;
 
+	const size_t allocations = allocationCount();
 	START_PROFILING(d_profile);
 
+	// the render meshes are mapped concurrently, then uploaded from this thread
+	if (d_mappingGraph.size() != (int)d_meshes->size())
+		buildMappingGraph();
+	mesh->positions.hostRead();
+	mesh->positions.deviceRead();
+	d_scheduler.run(d_mappingGraph);
+	if (d_task_time_o.is_open()) d_mappingGraph.writeTimings(d_task_time_o);
 	for (unsigned int i = 0; i < d_meshes->size(); ++i)
 	{
-		(*d_meshes)[i].updatePositions(mesh);
+		if (d_mapped[i]) (*d_meshes)[i].uploadPositions();
 		(*d_meshes)[i].updateNormals(mesh);	 
 	}
 
+	if (d_recorder.isOpen() && !d_recorded.empty())
+	{
+		for (unsigned int i = 0; i < d_recorded.size(); ++i)
+			d_recorded[i] = (*d_meshes)[i].m_vertices.hostRead();
+		d_recorder.addFrame(&d_recorded[0]);
+	}
+
 	STOP_PROFILING(d_profile);
 
 	SET_TIME_ELAPSED(d_profile, d_mapping_time_o);
+
+	auditAllocations(allocations, "mapping");
+	// the first frame after a change of sizes is done
+	d_steady = true;
 }
-//
-void Simulation::simulation_animate()
+
+size_t Simulation::allocationCount() const
 {
-	FEMMesh* mesh = fem_mesh;
-	if (!mesh) return;
-	switch (simulation_params.odeSolver)
+#ifdef SOFA_DEVICE_CPU
+	if (simulation_params.auditAllocations)
+		return sofa::helper::CPUMemory::stats().nbAllocs + sofa::helper::CPUMemory::heapAllocs();
+#endif
+	return 0;
+}
+
+void Simulation::auditAllocations(size_t before, const char* step)
+{
+	if (!simulation_params.auditAllocations || !d_steady) return;
+	const size_t n = allocationCount() - before;
+	if (n == 0) return;
+	d_steadyAllocations += n;
+	std::cerr << "ERROR: " << n << " allocations during the " << step << " at time " << simulation_params.simulation_time << std::endl;
+}
+// The time step of the FEM mesh alone, without the tearing, the moving objects and the history
+void Simulation::timeIntegrator(const SimulationParameters* params, FEMMesh* mesh)
+{
+	d_scheduler.setWorkers(params->taskThreads);
+	switch (params->odeSolver)
 	{
 	case ODE_EulerExplicit:
-		timeIntegrator_EulerExplicit(&simulation_params, mesh);
+		timeIntegrator_EulerExplicit(params, mesh);
 		break;
 	case ODE_EulerImplicit:
-		timeIntegrator_EulerImplicit(&simulation_params, mesh);
+		timeIntegrator_EulerImplicit(params, mesh);
 		break;
+	case ODE_SymplecticEuler:
+		timeIntegrator_SymplecticEuler(params, mesh);
+		break;
+	}
+}
+
+//
+void Simulation::simulation_animate()
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return;
+	const size_t allocations = allocationCount();
+	const bool timeLod = simulation_lods.size() > 1;
+	if (timeLod) d_lodTimer.Start();
+	timeIntegrator(&simulation_params, mesh);
+	if (timeLod)
+	{
+		d_lodTimer.Stop();
+		d_lodStepTime[simulation_lod] = d_lodTimer.ElapsedTime();
 	}
 
+	if (simulation_params.tearStretch > 0)
+		simulation_tear((TReal)simulation_params.tearStretch);
+
 	// non-simulated objects
 	simulation_params.sphere_position += simulation_params.sphere_velocity * simulation_params.timeStep;
 	mesh->update(&simulation_params);
 
 	simulation_params.simulation_time += simulation_params.timeStep;
 	simulation_params.simulation_mapping_needed = true;
+
+	if (simulation_params.rewindFrames > 0)
+		simulation_capture_frame();
+
+	auditAllocations(allocations, "step");
+}
+
+
+int Simulation::simulation_cut(const TCoord& center, const TDeriv& normal, TReal radius)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return 0;
+	int nbNew = mesh->cut(center, normal, radius);
+	if (nbNew > 0)
+		simulation_topology_changed();
+	return nbNew;
+}
+
+int Simulation::simulation_tear(TReal maxStretch)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return 0;
+	int nbRemoved = mesh->tear(maxStretch);
+	if (nbRemoved > 0)
+		simulation_topology_changed();
+	return nbRemoved;
+}
+
+void Simulation::simulation_topology_changed()
+{
+	for (unsigned int i = 0; i < d_meshes->size(); ++i)
+		(*d_meshes)[i].updateTopology(fem_mesh);
+	d_workspace.reserve(fem_mesh);
+	d_steady = false;
+	// the history was captured with the old particles and elements,
+	// its slots are allocated again with the new sizes
+	simulation_history.setCapacity(0);
+	// the other levels do not follow the cuts
+	d_lodLocked = true;
+	simulation_params.simulation_mapping_needed = true;
+}
+
+bool Simulation::simulation_add_lod(const char* filename)
+{
+	if (simulation_lods.empty() || d_lodLocked) return false;
+	FEMMesh* mesh = load_fem_mesh(filename);
+	if (!mesh) return false;
+	mesh->init(&simulation_params);
+	d_workspace.reserve(mesh);
+	const int level = simulation_lods.size();
+	simulation_lods.push_back(mesh);
+	for (unsigned int i = 0; i < d_meshes->size(); ++i)
+		(*d_meshes)[i].init(mesh, level);
+
+	// map the particles of each level on the tetrahedra of the others, at rest
+	// (starting with the new level, whose octree was just built by the render mappings)
+	const int n = simulation_lods.size();
+	std::vector<TetraMapping> transfers(n*n);
+	for (int a = n-1; a >= 0; --a)
+		for (int b = 0; b < n; ++b)
+		{
+			if (a == b) continue;
+			if (a < level && b < level)
+				transfers[a*n+b] = d_lodTransfers[a*level+b];
+			else
+				transfers[a*n+b].init(simulation_lods[a]->filename, simulation_lods[a]->tetrahedra, simulation_lods[a]->positions0, simulation_lods[b]->positions0);
+		}
+	d_lodTransfers.swap(transfers);
+	d_lodStepTime.resize(n, 0.0);
+	return true;
+}
+
+bool Simulation::simulation_set_lod(int level)
+{
+	const int n = simulation_lods.size();
+	if (level < 0 || level >= n) return false;
+	if (level == simulation_lod) return true;
+	if (d_lodLocked) return false;
+	FEMMesh* from = fem_mesh;
+	FEMMesh* to = simulation_lods[level];
+
+	// interpolate the state of the current level at the particles of the new one
+	const TetraMapping& transfer = d_lodTransfers[simulation_lod*n+level];
+	transfer.apply(to->positions, from->positions);
+	transfer.apply(to->velocity, from->velocity);
+	if (to->nbFixedParticles > 0)
+	{
+		// fixed particles stay on their own targets
+		TCoord* x = to->positions.hostWrite();
+		TDeriv* v = to->velocity.hostWrite();
+		const TCoord* targets = to->fixedTargets.hostRead();
+		const int* fixed = to->fixedParticles.hostRead();
+		for (int i = 0; i < to->nbFixedParticles; ++i)
+		{
+			x[fixed[i]] = targets[fixed[i]];
+			v[fixed[i]].clear();
+		}
+	}
+	to->colliders = from->colliders;
+	to->planeCollider = from->planeCollider;
+	to->sphereCollider = from->sphereCollider;
+	transferExternalForces(simulation_lod, level);
+	to->update(&simulation_params);
+
+	fem_mesh = to;
+	simulation_lod = level;
+	for (unsigned int i = 0; i < d_meshes->size(); ++i)
+		(*d_meshes)[i].setLevel(level);
+	d_steady = false;
+	// the history was captured on the other level
+	simulation_history.setCapacity(0);
+	simulation_params.simulation_mapping_needed = true;
+	return true;
+}
+
+// Level for a projected size, each halving of the size moves one level coarser
+static int simulation_lodFromScreenSize(TReal screenSize, TReal threshold, int nbLevels)
+{
+	int level = 0;
+	while (level < nbLevels-1 && screenSize < threshold)
+	{
+		++level;
+		threshold *= 0.5f;
+	}
+	return level;
+}
+
+int Simulation::simulation_update_lod(TReal screenSize)
+{
+	const int n = simulation_lods.size();
+	if (n < 2 || d_lodLocked) return simulation_lod;
+
+	const TReal threshold = (TReal)simulation_params.lodScreenSize;
+	int level = n-1; // off-screen
+	if (screenSize > 0)
+	{
+		level = simulation_lodFromScreenSize(screenSize, threshold, n);
+		// only move to a finer level when clearly above its threshold
+		if (level < simulation_lod)
+			level = std::min(simulation_lod, simulation_lodFromScreenSize(screenSize / 1.25f, threshold, n));
+	}
+
+	// then coarser levels until the estimated step time fits in the budget
+	if (simulation_params.lodStepBudget > 0 && d_lodStepTime[simulation_lod] > 0)
+	{
+		for (; level < n-1; ++level)
+		{
+			double t = d_lodStepTime[level];
+			if (t <= 0) // never run, scaled from the current level
+				t = d_lodStepTime[simulation_lod] * simulation_lods[level]->tetrahedra.size() / fem_mesh->tetrahedra.size();
+			if (t <= simulation_params.lodStepBudget) break;
+		}
+	}
+
+	simulation_set_lod(level);
+	return simulation_lod;
 }
 
+void Simulation::transferExternalForces(int from, int to)
+{
+	// particles of the current level mapped on the tetrahedra of the new one
+	const int n = simulation_lods.size();
+	const TetraMapping& m = d_lodTransfers[to*n+from];
+	const MyVector(GPUExternalForce<TReal>)& in = simulation_lods[from]->externalForces;
+	MyVector(GPUExternalForce<TReal>)& out = simulation_lods[to]->externalForces;
+	out.fastResize(in.size());
+	if (in.empty()) return;
+	const TTetra* map_i = m.map_i.hostRead();
+	const TCoord4* map_f = m.map_f.hostRead();
+	const GPUExternalForce<TReal>* fin = in.hostRead();
+	GPUExternalForce<TReal>* fout = out.hostWrite();
+	for (unsigned int i = 0; i < in.size(); ++i)
+	{
+		fout[i] = fin[i];
+		// each point of application moves to the closest particle of its tetrahedron
+		for (int j = 0; j < 3; ++j)
+		{
+			const int p = fin[i].index[j];
+			int best = 0;
+			for (int k = 1; k < 4; ++k)
+				if (map_f[p][k] > map_f[p][best]) best = k;
+			fout[i].index[j] = map_i[p][best];
+		}
+	}
+}
 
 void Simulation::timeIntegrator_EulerImplicit(const SimulationParameters* params, FEMMesh* mesh)
 {
@@ -276,7 +768,7 @@ void Simulation::timeIntegrator_EulerImplicit(const SimulationParameters* params
 	START_PROFILING(d_profile);
 
 	// Compute right-hand term b
-	TVecDeriv& b = mesh->b;
+	TVecDeriv& b = d_workspace.b;
 	computeForce(params, mesh, b);
 	// no need to apply constraints as it will be done in addKv()
 	addKv(params, mesh, h);
@@ -291,7 +783,23 @@ void Simulation::timeIntegrator_EulerImplicit(const SimulationParameters* params
 	systemMatrix.kFactor =   - h*rK - h*h;
 	START_PROFILING(d_profile);
 	// Solve system for a
-	linearSolver_ConjugateGradient(params, mesh, systemMatrix);
+#ifdef DOUBLE_KERNELS
+	if (params->solverPrecision == SOLVER_Double)
+		linearSolver_Double(params, mesh, systemMatrix);
+	else if (params->solverPrecision == SOLVER_Mixed)
+		linearSolver_MixedRefinement(params, mesh, systemMatrix);
+	else
+#else
+	// without the double kernels (CUDA) the refinement residual would be a float product,
+	// with the same floor as the float CG: the float CG is used for every precision
+	static bool warnedPrecision = false;
+	if (params->solverPrecision != SOLVER_Float && !warnedPrecision)
+	{
+		std::cerr << "WARNING: no double kernels on " SOFA_DEVICE ", the float CG is used" << std::endl;
+		warnedPrecision = true;
+	}
+#endif
+		linearSolver_ConjugateGradient(params, mesh, systemMatrix, d_workspace.b, mesh->a, params->tolerance, params->maxIter);
 	STOP_PROFILING(d_profile);
 
 	d_cgiteration_counts_o << simulation_cg_iter << ",";
@@ -304,12 +812,16 @@ void Simulation::timeIntegrator_EulerImplicit(const SimulationParameters* params
 	TVecCoord& x = mesh->positions;
 	TVecDeriv& v = mesh->velocity;
 	const TVecDeriv& a = mesh->a;
-#ifdef MERGE_CG_KERNELS
-	DEVICE_METHOD(MechanicalObject3f_vIntegrate)( x.size(), a.deviceRead(), v.deviceWrite(), x.deviceWrite(), (TReal)h );
-#else
-	DEVICE_METHOD(MechanicalObject3f_vPEqBF)( x.size(), v.deviceWrite(), a.deviceRead(), (TReal)h );
-	DEVICE_METHOD(MechanicalObject3f_vPEqBF)( x.size(), x.deviceWrite(), v.deviceRead(), (TReal)h );
-#endif
+	// fixed particles are moved to their target in the same pass
+	const DEVICE_PTR(unsigned int) fixedMask = (mesh->nbFixedParticles > 0) ? mesh->fixedMask.deviceRead() : NULL;
+	const DEVICE_PTR(TCoord) fixedTargets = (mesh->nbFixedParticles > 0) ? mesh->fixedTargets.deviceRead() : NULL;
+	if (kernel_variants.cg != CG_Separate || fixedMask)
+		DEVICE_METHOD(MechanicalObject3f_vIntegrate)( x.size(), a.deviceRead(), v.deviceWrite(), x.deviceWrite(), (TReal)h, fixedMask, fixedTargets );
+	else
+	{
+		DEVICE_METHOD(MechanicalObject3f_vPEqBF)( x.size(), v.deviceWrite(), a.deviceRead(), (TReal)h );
+		DEVICE_METHOD(MechanicalObject3f_vPEqBF)( x.size(), x.deviceWrite(), v.deviceRead(), (TReal)h );
+	}
  
 
 
@@ -321,7 +833,7 @@ void Simulation::timeIntegrator_EulerExplicit(const SimulationParameters* params
 	const double rM = params->rayleighMass;
 	TVecCoord& x = mesh->positions;
 	TVecDeriv& v = mesh->velocity;
-	TVecDeriv& f = mesh->f;
+	TVecDeriv& f = d_workspace.f;
 	TVecDeriv& a = mesh->a;
 
 	START_PROFILING(d_profile);
@@ -333,10 +845,6 @@ void Simulation::timeIntegrator_EulerExplicit(const SimulationParameters* params
 
 	SET_TIME_ELAPSED(d_profile, d_compute_force_time_o);
 
-	// Apply constraints
-	applyConstraints(params, mesh, f);
-
-	
 	// Compute acceleration
 	accFromF(params, mesh, f);
 
@@ -350,25 +858,321 @@ void Simulation::timeIntegrator_EulerExplicit(const SimulationParameters* params
 		DEVICE_METHOD(MechanicalObject3f_vEqBF)( v.size(), v.deviceWrite(), v.deviceRead(), 1-rM);
 
 	// Apply solution:  v = v + h a        x = x + h v
-	DEVICE_METHOD(MechanicalObject3f_vPEqBF)( x.size(), v.deviceWrite(), a.deviceRead(), (TReal)h );
-	DEVICE_METHOD(MechanicalObject3f_vPEqBF)( x.size(), x.deviceWrite(), v.deviceRead(), (TReal)h );
+	// (fixed particles are moved to their target instead)
+	const DEVICE_PTR(unsigned int) fixedMask = (mesh->nbFixedParticles > 0) ? mesh->fixedMask.deviceRead() : NULL;
+	const DEVICE_PTR(TCoord) fixedTargets = (mesh->nbFixedParticles > 0) ? mesh->fixedTargets.deviceRead() : NULL;
+	DEVICE_METHOD(MechanicalObject3f_vIntegrate)( x.size(), a.deviceRead(), v.deviceWrite(), x.deviceWrite(), (TReal)h, fixedMask, fixedTargets );
 
 	STOP_PROFILING(d_profile);
 
 	SET_TIME_ELAPSED(d_profile, d_conjugate_gradient_time_o);
 }
 
+void Simulation::timeIntegrator_SymplecticEuler(const SimulationParameters* params, FEMMesh* mesh)
+{
+	const double h  = params->timeStep;
+	const double rM = params->rayleighMass;
+	const double mass = params->massDensity;
+	TVecCoord& x = mesh->positions;
+	TVecDeriv& v = mesh->velocity;
+	TVecDeriv& f = d_workspace.f;
+
+	// Split the frame in as few substeps as the CFL bound of the mesh allows
+	int nbSteps = 1;
+	if (mesh->stableTimeStep > 0)
+		nbSteps = (int)ceil(h / (mesh->stableTimeStep * params->courantFactor));
+	if (nbSteps < 1) nbSteps = 1;
+	if (params->maxSubsteps > 0 && nbSteps > params->maxSubsteps)
+	{
+		// the capped substep is above the stable step, the explicit scheme may diverge
+		static bool warned = false;
+		if (!warned)
+			std::cerr << "WARNING: symplectic Euler needs " << nbSteps << " substeps, capped to " << params->maxSubsteps << std::endl;
+		warned = true;
+		nbSteps = params->maxSubsteps;
+	}
+	simulation_substeps = nbSteps;
+	const double hs = h / nbSteps;
+	// Rayleigh mass damping applied as a velocity scaling
+	const double vFactor = std::max(0.0, 1 - hs*rM);
+	const DEVICE_PTR(unsigned int) fixedMask = (mesh->nbFixedParticles > 0) ? mesh->fixedMask.deviceRead() : NULL;
+	const DEVICE_PTR(TCoord) fixedTargets = (mesh->nbFixedParticles > 0) ? mesh->fixedTargets.deviceRead() : NULL;
+
+	double forceTime = 0, integrateTime = 0;
+	for (int s = 0; s < nbSteps; ++s)
+	{
+		START_PROFILING(d_profile);
+		computeForce(params, mesh, f);
+		STOP_PROFILING(d_profile);
+		if (d_profile) forceTime += timer->ElapsedTime();
+
+		START_PROFILING(d_profile);
+		// Apply solution:  v = v + hs M^-1 f        x = x + hs v
+		// (constraints, damping and integration are merged in a single pass)
+		DEVICE_METHOD(MechanicalObject3f_vIntegrateSymplectic)( x.size(), f.deviceRead(), v.deviceWrite(), x.deviceWrite(), (TReal)(hs/mass), (TReal)vFactor, (TReal)hs, fixedMask, fixedTargets );
+		STOP_PROFILING(d_profile);
+		if (d_profile) integrateTime += timer->ElapsedTime();
+	}
+
+	if (d_profile)
+	{
+		d_compute_force_time_o << std::fixed << std::setprecision(8) << forceTime << ",";
+		d_conjugate_gradient_time_o << std::fixed << std::setprecision(8) << integrateTime << ",";
+	}
+}
+
+// Run nbFrames frames with the implicit and the symplectic integrators for increasing
+// stiffness values, to find where explicit substepping stops being cheaper than CG
+void Simulation::simulation_benchmark_integrators(int nbFrames)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return;
+
+	const SimulationParameters saved_params = simulation_params;
+	const bool saved_profile = d_profile;
+	d_profile = false;
+	// no substep cap, so that both integrators produce a stable animation
+	simulation_params.maxSubsteps = 0;
+
+	ofstream out("./IntegratorCrossover.csv");
+	out << "youngModulus,implicitTime,cgIterations,symplecticTime,substeps" << std::endl;
+	Timer bench;
+	for (double youngModulus = 10; youngModulus <= 1000000; youngModulus *= 4)
+	{
+		double frameTime[2];
+		int iterations[2];
+		const TimeIntegration solvers[2] = { ODE_EulerImplicit, ODE_SymplecticEuler };
+		for (int s = 0; s < 2; ++s)
+		{
+			simulation_params.odeSolver = solvers[s];
+			simulation_params.youngModulusTop = youngModulus;
+			simulation_params.youngModulusBottom = youngModulus;
+			mesh->init(&simulation_params);
+			simulation_reset();
+			// the point push force is too strong for an undamped explicit scheme
+			mesh->clearExternalForces();
+			iterations[s] = 0;
+			bench.Start();
+			for (int i = 0; i < nbFrames; ++i)
+			{
+				simulation_animate();
+				iterations[s] += (s == 0) ? simulation_cg_iter : simulation_substeps;
+			}
+			bench.Stop();
+			frameTime[s] = bench.ElapsedTime() / nbFrames;
+		}
+		out << std::fixed << std::setprecision(8) << youngModulus << "," << frameTime[0] << "," << iterations[0] / nbFrames << ","
+			<< frameTime[1] << "," << iterations[1] / nbFrames << std::endl;
+		std::cout << "E = " << youngModulus << " : implicit " << frameTime[0] << " ms (" << iterations[0] / nbFrames << " CG iterations), symplectic "
+			<< frameTime[1] << " ms (" << iterations[1] / nbFrames << " substeps)" << std::endl;
+	}
+	out.close();
+
+	simulation_params = saved_params;
+	d_profile = saved_profile;
+	mesh->init(&simulation_params);
+	simulation_reset();
+}
+
+
+// Run nbFrames frames with the float CG at the default and at a tight tolerance, and with
+// the mixed precision refinement and the double CG at the tight tolerance where there are
+// double kernels (not on CUDA, where both would be the float CG). The relative residual
+// is the true one of the last solve: the float CG stops on its recurrence, which drifts
+// from the true residual long before 1e-6.
+void Simulation::simulation_benchmark_solvers(int nbFrames)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return;
+
+	const SimulationParameters saved_params = simulation_params;
+	const bool saved_profile = d_profile;
+	d_profile = false;
+	simulation_params.odeSolver = ODE_EulerImplicit;
+	simulation_params.maxRefinements = 20;
+
+	const int nbModes = 4;
+	const char* names[nbModes] = { "float", "float", "mixed", "double" };
+	const SolverPrecision precisions[nbModes] = { SOLVER_Float, SOLVER_Float, SOLVER_Mixed, SOLVER_Double };
+	const double tolerances[nbModes] = { saved_params.tolerance, 1e-6, 1e-6, 1e-6 };
+	// the double CG needs several thousand iterations at 1e-6 on the stiff meshes
+	const int maxIters[nbModes] = { saved_params.maxIter, 1000, 1000, 10000 };
+
+	ofstream out("./SolverPrecision.csv");
+	out << "solver,tolerance,frameTime,cgIterations,residual" << std::endl;
+	Timer bench;
+#ifdef DOUBLE_KERNELS
+	const int nbRuns = nbModes;
+#else
+	const int nbRuns = 2; // the float CG only
+#endif
+	for (int s = 0; s < nbRuns; ++s)
+	{
+		simulation_params.solverPrecision = precisions[s];
+		simulation_params.tolerance = tolerances[s];
+		simulation_params.maxIter = maxIters[s];
+		mesh->init(&simulation_params);
+		simulation_reset();
+		int iterations = 0;
+		bench.Start();
+		for (int i = 0; i < nbFrames; ++i)
+		{
+			simulation_animate();
+			iterations += simulation_cg_iter;
+		}
+		bench.Stop();
+		const double frameTime = bench.ElapsedTime() / nbFrames;
+
+		const double h = simulation_params.timeStep;
+		MechanicalMatrix systemMatrix;
+		systemMatrix.mFactor = 1 - h*simulation_params.rayleighMass;
+		systemMatrix.kFactor =   - h*simulation_params.rayleighStiffness - h*h;
+		const double b2 = vDot(mesh, d_workspace.b, d_workspace.b);
+		// the residual of the double solution of the mixed and double solvers, before its rounding to float
+		const double r2 = residualNorm2(&simulation_params, mesh, systemMatrix, d_workspace.r, precisions[s] != SOLVER_Float);
+		const double residual = (b2 > 0) ? sqrt(r2 / b2) : 0;
+
+		out << names[s] << "," << std::scientific << std::setprecision(1) << tolerances[s] << "," << std::fixed << std::setprecision(8) << frameTime << ","
+			<< iterations / nbFrames << "," << std::scientific << std::setprecision(3) << residual << std::endl;
+		std::cout << names[s] << " (tolerance " << tolerances[s] << ") : " << frameTime << " ms, " << iterations / nbFrames
+			<< " CG iterations, residual " << residual << std::endl;
+	}
+	out.close();
+
+	simulation_params = saved_params;
+	d_profile = saved_profile;
+	mesh->init(&simulation_params);
+	simulation_reset();
+}
+
+// Run nbFrames frames with and without 200 static colliders around the mesh, and with and
+// without the moving sphere of the parameters, to check that the colliders away from the
+// surface cost nothing per frame and that moving a collider does not rebuild the grid.
+void Simulation::simulation_benchmark_colliders(int nbFrames)
+{
+	FEMMesh* mesh = fem_mesh;
+	if (!mesh) return;
+
+	const SimulationParameters saved_params = simulation_params;
+	const bool saved_profile = d_profile;
+	d_profile = false;
+	const double sphereRepulsion = (saved_params.sphereRepulsion != 0) ? saved_params.sphereRepulsion : saved_params.planeRepulsion;
+
+	ofstream out("./ColliderGrid.csv");
+	out << "staticColliders,movingSphere,frameTime,gridCells" << std::endl;
+	Timer bench;
+	for (int run = 0; run < 4; ++run)
+	{
+		const int nbStatic = (run & 1) ? 200 : 0;
+		const bool moving = (run & 2) != 0;
+		simulation_params.sphereRepulsion = moving ? sphereRepulsion : 0;
+		mesh->init(&simulation_params);
+		simulation_reset();
+
+		// spheres, capsules and boxes on a lattice three times as large as the mesh,
+		// the ones overlapping its bounding box are skipped
+		const TCoord bmin = simulation_params.simulation_bbox[0], bmax = simulation_params.simulation_bbox[1];
+		const TDeriv extent = bmax - bmin;
+		const TReal size = (TReal)simulation_params.simulation_size * 0.02f;
+		const int n = 8;
+		int added = 0;
+		for (int i = 0; i < n*n*n && added < nbStatic; ++i)
+		{
+			TCoord c;
+			for (int k = 0; k < 3; ++k)
+				c[k] = bmin[k] - extent[k] + 3 * extent[k] * (((i >> (3*k)) & 7) + 0.5f) / n;
+			if (c[0] > bmin[0] - 2*size && c[0] < bmax[0] + 2*size && c[1] > bmin[1] - 2*size && c[1] < bmax[1] + 2*size
+				&& c[2] > bmin[2] - 2*size && c[2] < bmax[2] + 2*size)
+				continue;
+			const TReal stiffness = (TReal)simulation_params.planeRepulsion;
+			if (added % 3 == 0)
+				mesh->colliders.addSphere(c, size, stiffness);
+			else if (added % 3 == 1)
+				mesh->colliders.addCapsule(c, c + TDeriv(size, 0, 0), size * 0.5f, stiffness);
+			else
+				mesh->colliders.addBox(c, TDeriv(size, size, size), TDeriv(1, 1, 0), TDeriv(0, 0, 1), stiffness);
+			++added;
+		}
+
+		bench.Start();
+		for (int i = 0; i < nbFrames; ++i)
+			simulation_animate();
+		bench.Stop();
+		const double frameTime = bench.ElapsedTime() / nbFrames;
+		const ColliderSet& colliders = mesh->colliders;
+		const int cells = colliders.grid.nx * colliders.grid.ny * colliders.grid.nz;
+
+		out << added << "," << (moving ? 1 : 0) << "," << std::fixed << std::setprecision(8) << frameTime << "," << cells << std::endl;
+		std::cout << added << " static colliders" << (moving ? ", moving sphere" : "") << " : " << frameTime << " ms, "
+			<< cells << " grid cells" << std::endl;
+	}
+	out.close();
+
+	simulation_params = saved_params;
+	d_profile = saved_profile;
+	mesh->init(&simulation_params);
+	simulation_reset();
+}
 
 // Compute b = f
 void Simulation::computeForce(const SimulationParameters* params, FEMMesh* mesh, TVecDeriv& result)
+{
+	result.recreate(mesh->positions.size());
+	if (d_forceGraph.empty())
+		buildForceGraph();
+	d_taskParams = params;
+	d_taskMesh = mesh;
+	d_taskResult = &result;
+	if (d_scheduler.workers() > 0)
+	{
+		// the vectors read by several tasks are made valid on the host and the
+		// device first, so that the concurrent reads do not copy them
+		mesh->positions.hostRead(); mesh->positions.deviceRead();
+		mesh->velocity.deviceRead();
+		mesh->surfacePoints.hostRead(); mesh->surfacePoints.deviceRead();
+	}
+	d_scheduler.run(d_forceGraph);
+	if (d_task_time_o.is_open()) d_forceGraph.writeTimings(d_task_time_o);
+}
+
+// The internal forces and the collision detections only read the positions,
+// they run concurrently. The detections write their contacts per surface
+// point, and the contact forces are added after the internal forces in the
+// same order as a sequential computation, so the result does not depend on
+// the number of threads.
+void Simulation::buildForceGraph()
+{
+	d_forceGraph.clear();
+	const int internal = d_forceGraph.add("internal", [this]() { addInternalForce(d_taskParams, d_taskMesh, *d_taskResult); });
+	const int colliders = d_forceGraph.add("colliders", [this]() { detectColliders(d_taskMesh); });
+	const int surface = d_forceGraph.add("surface collision", [this]() { detectSurfaceCollisions(d_taskMesh); });
+	d_forceGraph.add("contacts", [this]() { addContactForces(d_taskParams, d_taskMesh, *d_taskResult); }, internal, colliders, surface);
+}
+
+void Simulation::buildMappingGraph()
+{
+	d_mappingGraph.clear();
+	d_mapped.assign(d_meshes->size(), 0);
+	for (unsigned int i = 0; i < d_meshes->size(); ++i)
+	{
+		std::ostringstream name;
+		name << "mesh " << i;
+		d_mappingGraph.add(name.str(), [this, i]() { d_mapped[i] = (*d_meshes)[i].mapPositions(fem_mesh, (TReal)simulation_params.mappingTolerance); });
+	}
+}
+
+void Simulation::simulation_task_log(const std::string& filename)
+{
+	if (d_task_time_o.is_open()) d_task_time_o.close();
+	if (filename.empty()) return;
+	d_task_time_o.open(filename.c_str());
+	TaskGraph::writeTimingsHeader(d_task_time_o);
+}
+
+void Simulation::addInternalForce(const SimulationParameters* params, FEMMesh* mesh, TVecDeriv& result)
 {
 	const unsigned int size = mesh->positions.size();
-	const double mass = params->massDensity;
-	const TDeriv mg = params->gravity * mass;
 	const TVecCoord& x = mesh->positions;
-	const TVecDeriv& v = mesh->velocity;
-	TVecDeriv& f = result;
-	result.recreate(size);
 
 	// it is no longer necessary to clear the result vector as the addForce
 	// kernel from TetrahedronFEMForceField will do an assignement instead of
@@ -381,36 +1185,64 @@ void Simulation::computeForce(const SimulationParameters* params, FEMMesh* mesh,
 	if (params->youngModulusTop != 0 || params->youngModulusBottom != 0)
 	{
 #ifdef USE_VEC4
-		mesh->x4.fastResize(size);
-		DEVICE_METHOD(TetrahedronFEMForceField3f_prepareX)(size, mesh->x4.deviceWrite(), x.deviceRead());
+		d_workspace.x4.fastResize(size);
+		DEVICE_METHOD(TetrahedronFEMForceField3f_prepareX)(size, d_workspace.x4.deviceWrite(), x.deviceRead());
 #endif
 		DEVICE_METHOD(TetrahedronFEMForceField3f_addForce)( mesh->tetrahedra.size(), size, false
 			, mesh->femElem.deviceRead(), mesh->femElemRotation.deviceWrite()
 			, result.deviceWrite(), x.deviceRead()
 #ifdef PARALLEL_GATHER
-			, mesh->nbElemPerVertex, GATHER_PT, GATHER_BSIZE
-			, mesh->femElemForce.deviceWrite(), mesh->femVElems.deviceRead()
+			, mesh->nbElemPerVertex, kernel_variants.gatherPT, kernel_variants.gatherBSize
+			, d_workspace.femElemForce.deviceWrite(), mesh->femVElems.deviceRead()
 #endif
 			);
 	}
+}
+
+// Colliders (only surface particles are tested, each against the colliders of its grid cell)
+void Simulation::detectColliders(FEMMesh* mesh)
+{
+	if (mesh->colliders.empty()) return;
+	ColliderSet& colliders = mesh->colliders;
+	colliders.update();
+	mesh->contacts.recreate(mesh->surfacePoints.size());
+	DEVICE_METHOD(ColliderForceField3f_addForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), &colliders.grid
+		, colliders.colliders.deviceRead(), colliders.cellStart.deviceRead(), colliders.cellColliders.deviceRead()
+		, mesh->contacts.deviceWrite(), NULL, mesh->positions.deviceRead(), mesh->velocity.deviceRead() );
+}
+
+// Self-collision and triangle meshes: the surface hierarchy is refitted and
+// queried on the host
+void Simulation::detectSurfaceCollisions(FEMMesh* mesh)
+{
+	if (!mesh->surfaceCollision.enabled()) return;
+	mesh->surfaceContacts.recreate(mesh->surfacePoints.size());
+	mesh->surfaceCollision.detect(mesh->positions.hostRead(), mesh->positions0.hostRead(), mesh->triangles.hostRead()
+		, mesh->surfacePoints.hostRead(), mesh->surfacePoints.size(), mesh->surfaceContacts.hostWrite());
+}
+
+void Simulation::addContactForces(const SimulationParameters* params, FEMMesh* mesh, TVecDeriv& result)
+{
+	const unsigned int size = mesh->positions.size();
+	const double mass = params->massDensity;
+	const TDeriv mg = params->gravity * mass;
+	const TVecDeriv& v = mesh->velocity;
 
 	// External forces
-	if (mesh->externalForce.index >= 0)
+	// (scattered on the touched particles only, the cost does not depend on the mesh size)
+	if (!mesh->externalForces.empty())
 	{
-		//result[mesh->externalForce.index] += mesh->externalForce.value;
-		DEVICE_METHOD(MechanicalObject3f_vPEq1)( size, result.deviceWrite(), mesh->externalForce.index, mesh->externalForce.value.ptr() );
+		DEVICE_METHOD(ExternalForceField3f_addForce)( mesh->externalForces.size(), mesh->externalForces.deviceRead(), result.deviceWrite() );
 	}
 
-	if (mesh->plane.stiffness != 0)
+	if (!mesh->colliders.empty())
 	{
-		mesh->planePenetration.recreate(size);
-		DEVICE_METHOD(PlaneForceField3f_addForce)( size, &mesh->plane, mesh->planePenetration.deviceWrite(), result.deviceWrite(), x.deviceRead(), v.deviceRead() );
+		DEVICE_METHOD(ColliderForceField3f_addContactForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->contacts.deviceRead(), result.deviceWrite(), v.deviceRead() );
 	}
 
-	if (mesh->sphere.stiffness != 0)
+	if (mesh->surfaceCollision.enabled())
 	{
-		mesh->spherePenetration.recreate(size);
-		DEVICE_METHOD(SphereForceField3f_addForce)( size, &mesh->sphere, mesh->spherePenetration.deviceWrite(), result.deviceWrite(), x.deviceRead(), v.deviceRead() );
+		DEVICE_METHOD(ColliderForceField3f_addContactForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->surfaceContacts.deviceRead(), result.deviceWrite(), v.deviceRead() );
 	}
 
 	// Gravity
@@ -443,37 +1275,33 @@ void Simulation::addKv(const SimulationParameters* params, FEMMesh* mesh, double
 	const TDeriv mg = params->gravity * mass;
 	const TVecCoord& x = mesh->positions;
 	const TVecDeriv& v = mesh->velocity;
-	TVecDeriv& b = mesh->b;
+	TVecDeriv& b = d_workspace.b;
 
 	// b += kFactor * K * v
 	if (params->youngModulusTop != 0 || params->youngModulusBottom != 0)
 	{
 #ifdef USE_VEC4
-		mesh->dx4.fastResize(size);
-		DEVICE_METHOD(TetrahedronFEMForceField3f_prepareDx)(size, mesh->dx4.deviceWrite(), v.deviceRead());
+		d_workspace.dx4.fastResize(size);
+		DEVICE_METHOD(TetrahedronFEMForceField3f_prepareDx)(size, d_workspace.dx4.deviceWrite(), v.deviceRead());
 #endif
 		DEVICE_METHOD(TetrahedronFEMForceField3f_addDForce)( mesh->tetrahedra.size(), size, true, kFactor
 			, mesh->femElem.deviceRead(), mesh->femElemRotation.deviceRead()
 			, b.deviceWrite(), v.deviceRead()
 #ifdef PARALLEL_GATHER
-			, mesh->nbElemPerVertex, GATHER_PT, GATHER_BSIZE
-			, mesh->femElemForce.deviceWrite(), mesh->femVElems.deviceRead()
+			, mesh->nbElemPerVertex, kernel_variants.gatherPT, kernel_variants.gatherBSize
+			, d_workspace.femElemForce.deviceWrite(), mesh->femVElems.deviceRead()
 #endif
 			);
 	}
 
-	if (mesh->plane.stiffness != 0)
+	if (!mesh->colliders.empty())
 	{
-		GPUPlane<TReal> plane2 = mesh->plane;
-		plane2.stiffness *= (TReal)kFactor;
-		DEVICE_METHOD(PlaneForceField3f_addDForce)( size, &plane2, mesh->planePenetration.deviceRead(), b.deviceWrite(), v.deviceRead() );
+		DEVICE_METHOD(ColliderForceField3f_addDForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->contacts.deviceRead(), (TReal)kFactor, b.deviceWrite(), v.deviceRead() );
 	}
 
-	if (mesh->sphere.stiffness != 0)
+	if (mesh->surfaceCollision.enabled())
 	{
-		GPUSphere<TReal> sphere2 = mesh->sphere;
-		sphere2.stiffness *= (TReal)kFactor;
-		DEVICE_METHOD(SphereForceField3f_addDForce)( size, &sphere2, mesh->spherePenetration.deviceRead(), b.deviceWrite(), v.deviceRead() );
+		DEVICE_METHOD(ColliderForceField3f_addDForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->surfaceContacts.deviceRead(), (TReal)kFactor, b.deviceWrite(), v.deviceRead() );
 	}
 
 	if (mesh->nbFixedParticles > 0)
@@ -502,53 +1330,46 @@ void Simulation::mulMatrixVector(const SimulationParameters* params, FEMMesh* me
 	if (params->youngModulusTop != 0 || params->youngModulusBottom != 0)
 	{
 #ifdef USE_VEC4
-		mesh->dx4.fastResize(size);
-		DEVICE_METHOD(TetrahedronFEMForceField3f_prepareDx)(size, mesh->dx4.deviceWrite(), input.deviceRead());
+		d_workspace.dx4.fastResize(size);
+		DEVICE_METHOD(TetrahedronFEMForceField3f_prepareDx)(size, d_workspace.dx4.deviceWrite(), input.deviceRead());
 #endif
 		DEVICE_METHOD(TetrahedronFEMForceField3f_addDForce)( mesh->tetrahedra.size(), size, false, matrix.kFactor
 			, mesh->femElem.deviceRead(), mesh->femElemRotation.deviceRead()
 			, result.deviceWrite(), input.deviceRead()
 #ifdef PARALLEL_GATHER
-			, mesh->nbElemPerVertex, GATHER_PT, GATHER_BSIZE
-			, mesh->femElemForce.deviceWrite(), mesh->femVElems.deviceRead()
+			, mesh->nbElemPerVertex, kernel_variants.gatherPT, kernel_variants.gatherBSize
+			, d_workspace.femElemForce.deviceWrite(), mesh->femVElems.deviceRead()
 #endif
 			);
 	}
 
 	DEVICE_METHOD(UniformMass3f_addMDx)( size, matrix.mFactor * mass, result.deviceWrite(), input.deviceRead() );
 
-	if (mesh->plane.stiffness != 0)
+	if (!mesh->colliders.empty())
 	{
-		GPUPlane<TReal> plane2 = mesh->plane;
-		plane2.stiffness *= matrix.kFactor;
-		DEVICE_METHOD(PlaneForceField3f_addDForce)( size, &plane2, mesh->planePenetration.deviceRead(), result.deviceWrite(), input.deviceRead() );
+		DEVICE_METHOD(ColliderForceField3f_addDForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->contacts.deviceRead(), (TReal)matrix.kFactor, result.deviceWrite(), input.deviceRead() );
 	}
 
-	if (mesh->sphere.stiffness != 0)
+	if (mesh->surfaceCollision.enabled())
 	{
-		GPUSphere<TReal> sphere2 = mesh->sphere;
-		sphere2.stiffness *= matrix.kFactor;
-		DEVICE_METHOD(SphereForceField3f_addDForce)( size, &sphere2, mesh->spherePenetration.deviceRead(), result.deviceWrite(), input.deviceRead() );
+		DEVICE_METHOD(ColliderForceField3f_addDForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->surfaceContacts.deviceRead(), (TReal)matrix.kFactor, result.deviceWrite(), input.deviceRead() );
 	}
 
-	if (mesh->nbFixedParticles > 0)
+	// the merged reduction CG kernels read q through the fixed mask instead
+	if (mesh->nbFixedParticles > 0 && kernel_variants.cg != CG_MergedReduction)
 	{
 		DEVICE_METHOD(FixedConstraint3f_projectResponseIndexed)( mesh->fixedParticles.size(), mesh->fixedParticles.deviceRead(), result.deviceWrite() );
 	}
 }
 
 
-void Simulation::linearSolver_ConjugateGradient(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix)
+// Solve A a = b, b must be projected by the fixed constraints
+void Simulation::linearSolver_ConjugateGradient(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix, const TVecDeriv& b, TVecDeriv& a, double tolerance, int maxIter)
 {
 	const unsigned int size = mesh->positions.size();
-	const double mass = params->massDensity;
-	const int maxIter = params->maxIter;
-	const double tolerance = params->tolerance;
-	const TVecDeriv& b = mesh->b;
-	TVecDeriv& a = mesh->a;
-	TVecDeriv& q = mesh->q;
-	TVecDeriv& d = mesh->d;
-	TVecDeriv& r = mesh->r;
+	TVecDeriv& q = d_workspace.q;
+	TVecDeriv& d = d_workspace.d;
+	TVecDeriv& r = d_workspace.r;
 	a.recreate(size);
 	q.recreate(size);
 	d.recreate(size);
@@ -556,25 +1377,19 @@ void Simulation::linearSolver_ConjugateGradient(const SimulationParameters* para
 
 	// for parallel reductions (vDot)
 #ifdef PARALLEL_REDUCTION
-	TVecReal& tmp = mesh->dottmp;
+	TVecReal& tmp = d_workspace.dottmp;
 	int tmpsize = std::max(
 		DEVICE_METHOD(MechanicalObject3f_vDotTmpSize)( size ),
-#if defined(MERGE_REDUCTION_KERNELS)
-		DEVICE_METHOD(MergedKernels3f_cgDot3TmpSize)( size )
-#elif defined(MERGE_CG_KERNELS)
-		DEVICE_METHOD(MergedKernels3f_cgDeltaTmpSize)( size )
-#else
-		0
-#endif
+		(kernel_variants.cg == CG_MergedReduction) ? DEVICE_METHOD(MergedKernels3f_cgDot3TmpSize)( size ) :
+		(kernel_variants.cg == CG_Merged) ? DEVICE_METHOD(MergedKernels3f_cgDeltaTmpSize)( size ) : 0
 		);
 	tmp.recreate(tmpsize);
 	DEVICE_PTR(TReal) dottmp = tmp.deviceWrite();
 	TReal* cputmp = (TReal*)(&(tmp.getCached(0)));
 #endif
 	float dotresult = 0;
-#if defined(MERGE_REDUCTION_KERNELS)
 	float dot3result[3] = {0,0,0};
-#endif
+	const DEVICE_PTR(unsigned int) fixedMask = (mesh->nbFixedParticles > 0) ? mesh->fixedMask.deviceRead() : NULL;
 
 	int i = 0;
 
@@ -609,112 +1424,293 @@ void Simulation::linearSolver_ConjugateGradient(const SimulationParameters* para
 		// q = Ad;
 		mulMatrixVector(params, mesh, matrix, q, ((i==0)?b:d));
 		if (d_verbose >= 2) showDebug(q, "q");
-#if defined(MERGE_REDUCTION_KERNELS)
-		if (i==0)
-			DEVICE_METHOD(MergedKernels3f_cgDot3First)( size, dot3result
-			, b.deviceRead(), q.deviceRead()
+		if (kernel_variants.cg == CG_MergedReduction)
+		{
+			if (i==0)
+				DEVICE_METHOD(MergedKernels3f_cgDot3First)( size, dot3result
+				, b.deviceRead(), q.deviceRead(), fixedMask
 #ifdef PARALLEL_REDUCTION
-			, dottmp, cputmp
+				, dottmp, cputmp
 #endif
-			);
-		else
-			DEVICE_METHOD(MergedKernels3f_cgDot3)( size, dot3result
-			, r.deviceRead(), q.deviceWrite(), d.deviceRead()
+				);
+			else
+				DEVICE_METHOD(MergedKernels3f_cgDot3)( size, dot3result
+				, r.deviceRead(), q.deviceWrite(), d.deviceRead(), fixedMask
 #ifdef PARALLEL_REDUCTION
-			, dottmp, cputmp
+				, dottmp, cputmp
 #endif
-			);
-
-		double dot_dq = dot3result[0];
-		double dot_rq = dot3result[1];
-		double dot_qq = dot3result[2];
-		double den = dot_dq;
-		if (d_verbose >= 2) std::cout << "CG i="<<i<<" den = " << den << std::endl;
-		double alpha = delta_new / den;
-		if (d_verbose >= 2) std::cout << "CG i="<<i<<" alpha = " << alpha << std::endl;
-		double delta_old = delta_new;
-		// r_new = r - q * alpha
-		// delta_new = dot(r_new,r_new) = dot(r - q * alpha,r - q * alpha) = dot(r,r) -2*alpha*dot(r,q) + alpha^2*(dot(q,q)
-		delta_new = delta_old - 2*alpha*dot_rq + alpha*alpha*dot_qq;
-
-		if (d_verbose >= 2) std::cout << "CG i="<<i<<" delta = " << delta_new << std::endl;
-
-		double beta = delta_new / delta_old;
-		// a = a + d * alpha;
-		// r = r - q * alpha;
-		// d = r + d * beta;
-		if (i==0)
-			DEVICE_METHOD(MergedKernels3f_cgOp3First)( size, alpha, beta
-			, r.deviceWrite(), a.deviceWrite(), d.deviceWrite(), q.deviceRead(), b.deviceRead()
-			);
+				);
+
+			double dot_dq = dot3result[0];
+			double dot_rq = dot3result[1];
+			double dot_qq = dot3result[2];
+			double den = dot_dq;
+			if (d_verbose >= 2) std::cout << "CG i="<<i<<" den = " << den << std::endl;
+			double alpha = delta_new / den;
+			if (d_verbose >= 2) std::cout << "CG i="<<i<<" alpha = " << alpha << std::endl;
+			double delta_old = delta_new;
+			// r_new = r - q * alpha
+			// delta_new = dot(r_new,r_new) = dot(r - q * alpha,r - q * alpha) = dot(r,r) -2*alpha*dot(r,q) + alpha^2*(dot(q,q)
+			delta_new = delta_old - 2*alpha*dot_rq + alpha*alpha*dot_qq;
+
+			if (d_verbose >= 2) std::cout << "CG i="<<i<<" delta = " << delta_new << std::endl;
+
+			double beta = delta_new / delta_old;
+			// a = a + d * alpha;
+			// r = r - q * alpha;
+			// d = r + d * beta;
+			if (i==0)
+				DEVICE_METHOD(MergedKernels3f_cgOp3First)( size, alpha, beta
+				, r.deviceWrite(), a.deviceWrite(), d.deviceWrite(), q.deviceRead(), b.deviceRead(), fixedMask
+				);
+			else
+				DEVICE_METHOD(MergedKernels3f_cgOp3)( size, alpha, beta
+				, r.deviceWrite(), a.deviceWrite(), d.deviceWrite(), q.deviceRead(), fixedMask
+				);
+
+			if (d_verbose >= 2) showDebug(a, "a");
+			if (d_verbose >= 2) showDebug(r, "r");
+			if (d_verbose >= 2) showDebug(d, "d");
+		}
 		else
-			DEVICE_METHOD(MergedKernels3f_cgOp3)( size, alpha, beta
-			, r.deviceWrite(), a.deviceWrite(), d.deviceWrite(), q.deviceRead()
-			);
-
-		if (d_verbose >= 2) showDebug(a, "a");
-		if (d_verbose >= 2) showDebug(r, "r");
-		if (d_verbose >= 2) showDebug(d, "d");
-
-#else
-		// den = dot(d,q)
-		DEVICE_METHOD(MechanicalObject3f_vDot)( size, &dotresult, ((i==0)?b.deviceRead():d.deviceRead()), q.deviceRead()
+		{
+			// den = dot(d,q)
+			DEVICE_METHOD(MechanicalObject3f_vDot)( size, &dotresult, ((i==0)?b.deviceRead():d.deviceRead()), q.deviceRead()
 #ifdef PARALLEL_REDUCTION
-			, dottmp, cputmp
+				, dottmp, cputmp
 #endif
-			);
-		double den = dotresult;
-		if (verbose >= 2) std::cout << "CG i="<<i<<" den = " << den << std::endl;
-		double alpha = delta_new / den;
-		if (verbose >= 2) std::cout << "CG i="<<i<<" alpha = " << alpha << std::endl;
-		double delta_old = delta_new;
-		// a = a + d * alpha
-		// r = r - q * alpha
-		// delta_new = dot(r,r)
-#if defined(MERGE_CG_KERNELS)
-		DEVICE_METHOD(MergedKernels3f_cgDelta)( (i==0), size, &dotresult, (TReal)alpha
-			, r.deviceWrite(), a.deviceWrite(), q.deviceRead(), ((i==0)?b.deviceRead():d.deviceRead())
+				);
+			double den = dotresult;
+			if (d_verbose >= 2) std::cout << "CG i="<<i<<" den = " << den << std::endl;
+			double alpha = delta_new / den;
+			if (d_verbose >= 2) std::cout << "CG i="<<i<<" alpha = " << alpha << std::endl;
+			double delta_old = delta_new;
+			// a = a + d * alpha
+			// r = r - q * alpha
+			// delta_new = dot(r,r)
+			if (kernel_variants.cg == CG_Merged)
+			{
+				DEVICE_METHOD(MergedKernels3f_cgDelta)( (i==0), size, &dotresult, (TReal)alpha
+					, r.deviceWrite(), a.deviceWrite(), q.deviceRead(), ((i==0)?b.deviceRead():d.deviceRead())
 #ifdef PARALLEL_REDUCTION
-			, dottmp, cputmp
+					, dottmp, cputmp
 #endif
-			);
-		delta_new = dotresult;
-#else
-		if (i==0)
-		{
-			DEVICE_METHOD(MechanicalObject3f_vEqBF)( size, a.deviceWrite(), b.deviceRead(), alpha );
-			DEVICE_METHOD(MechanicalObject3f_vOp)( size, r.deviceWrite(), b.deviceRead(), q.deviceRead(), -alpha );
-		}
-		else
-		{
-			DEVICE_METHOD(MechanicalObject3f_vPEqBF)( size, a.deviceWrite(), d.deviceRead(), alpha );
-			DEVICE_METHOD(MechanicalObject3f_vPEqBF)( size, r.deviceWrite(), q.deviceRead(), -alpha );
+					);
+				delta_new = dotresult;
+			}
+			else
+			{
+				if (i==0)
+				{
+					DEVICE_METHOD(MechanicalObject3f_vEqBF)( size, a.deviceWrite(), b.deviceRead(), alpha );
+					DEVICE_METHOD(MechanicalObject3f_vOp)( size, r.deviceWrite(), b.deviceRead(), q.deviceRead(), -alpha );
+				}
+				else
+				{
+					DEVICE_METHOD(MechanicalObject3f_vPEqBF)( size, a.deviceWrite(), d.deviceRead(), alpha );
+					DEVICE_METHOD(MechanicalObject3f_vPEqBF)( size, r.deviceWrite(), q.deviceRead(), -alpha );
+				}
+				DEVICE_METHOD(MechanicalObject3f_vDot)( size, &dotresult, r.deviceRead(), r.deviceRead()
+#ifdef PARALLEL_REDUCTION
+					, dottmp, cputmp
+#endif
+					);
+				delta_new = dotresult;
+			}
+
+			if (d_verbose >= 2) showDebug(a, "a");
+			if (d_verbose >= 2) showDebug(r, "r");
+
+			if (d_verbose >= 2) std::cout << "CG i="<<i<<" delta = " << delta_new << std::endl;
+			double beta = delta_new / delta_old;
+			// d = r + d * beta;
+			if (i==0)
+				DEVICE_METHOD(MechanicalObject3f_vOp)( size, d.deviceWrite(), r.deviceRead(), b.deviceRead(), (TReal)beta );
+			else
+				DEVICE_METHOD(MechanicalObject3f_vOp)( size, d.deviceWrite(), r.deviceRead(), d.deviceRead(), (TReal)beta );
+			if (d_verbose >= 2) showDebug(d, "d");
 		}
-		DEVICE_METHOD(MechanicalObject3f_vDot)( size, &dotresult, r.deviceRead(), r.deviceRead()
+		++i;
+	}
+	simulation_cg_iter = i;
+	if (d_verbose >= 1) std::cout << "CG iterations = " << i << " residual error = " << sqrt(delta_new / delta_0) << std::endl;
+}
+
+double Simulation::vDot(FEMMesh* mesh, const TVecDeriv& a, const TVecDeriv& b)
+{
+	const unsigned int size = a.size();
+	float dotresult = 0;
 #ifdef PARALLEL_REDUCTION
-			, dottmp, cputmp
+	TVecReal& tmp = d_workspace.dottmp;
+	const int tmpsize = DEVICE_METHOD(MechanicalObject3f_vDotTmpSize)( size );
+	if ((int)tmp.size() < tmpsize) tmp.recreate(tmpsize);
+	TReal* cputmp = (TReal*)(&(tmp.getCached(0)));
 #endif
-			);
-		delta_new = dotresult;
+	DEVICE_METHOD(MechanicalObject3f_vDot)( size, &dotresult, a.deviceRead(), b.deviceRead()
+#ifdef PARALLEL_REDUCTION
+		, tmp.deviceWrite(), cputmp
 #endif
+		);
+	return dotresult;
+}
 
-		if (verbose >= 2) showDebug(a, "a");
-		if (verbose >= 2) showDebug(r, "r");
-
-		if (verbose >= 2) std::cout << "CG i="<<i<<" delta = " << delta_new << std::endl;
-		double beta = delta_new / delta_old;
-		// d = r + d * beta;
-		if (i==0)
-			DEVICE_METHOD(MechanicalObject3f_vOp)( size, d.deviceWrite(), r.deviceRead(), b.deviceRead(), (TReal)beta );
-		else
-			DEVICE_METHOD(MechanicalObject3f_vOp)( size, d.deviceWrite(), r.deviceRead(), d.deviceRead(), (TReal)beta );
-		if (verbose >= 2) showDebug(d, "d");
+// residual = b - A a, projected by the fixed constraints; returns its squared norm.
+// Unlike the delta of the CG recurrence, this is the true residual of the current solution:
+// the one accumulated in double by the mixed solver if accumulated is set, mesh->a otherwise.
+// With the double kernels the product and the difference are in double, and only the
+// returned residual is rounded to float. Without them they are in float, from mesh->a.
+double Simulation::residualNorm2(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix, TVecDeriv& residual, bool accumulated)
+{
+	const unsigned int size = mesh->positions.size();
+	residual.recreate(size);
+#ifdef DOUBLE_KERNELS
+	MyVector(double)& x = accumulated ? d_workspace.aAccumulator : d_workspace.xDouble;
+	MyVector(double)& qDouble = d_workspace.qDouble;
+	if (!accumulated)
+	{
+		x.recreate(3*size);
+		DEVICE_METHOD(MechanicalObject3d_vFromFloat)( size, x.deviceWrite(), mesh->a.deviceRead() );
+	}
+	qDouble.recreate(3*size);
+	// b is projected by addKv and A x by mulMatrixVectorDouble, so is their difference
+	mulMatrixVectorDouble(params, mesh, matrix, qDouble, x);
+	double r2 = 0;
+	DEVICE_METHOD(MechanicalObject3f_vResidual)( size, &r2, residual.deviceWrite(), d_workspace.b.deviceRead(), qDouble.deviceRead() );
+	return r2;
+#else
+	TVecDeriv& q = d_workspace.q;
+	q.recreate(size);
+	mulMatrixVector(params, mesh, matrix, q, mesh->a);
+	DEVICE_METHOD(MechanicalObject3f_vOp)( size, residual.deviceWrite(), d_workspace.b.deviceRead(), q.deviceRead(), -1.0f );
+	if (mesh->nbFixedParticles > 0)
+	{
+		DEVICE_METHOD(FixedConstraint3f_projectResponseIndexed)( mesh->fixedParticles.size(), mesh->fixedParticles.deviceRead(), residual.deviceWrite() );
+	}
+	return vDot(mesh, residual, residual);
 #endif
+}
+
+#ifdef DOUBLE_KERNELS
+// Iterative refinement: the matrix products of the CG corrections stay in float,
+// the solution is accumulated in double and the residual is recomputed from it
+// after each correction, in double too, so the tolerance is limited neither by the
+// drift of the float CG recurrence nor by the round-off of the float product.
+void Simulation::linearSolver_MixedRefinement(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix)
+{
+	const unsigned int size = mesh->positions.size();
+	const TVecDeriv& b = d_workspace.b;
+	TVecDeriv& a = mesh->a;
+	TVecDeriv& residual = d_workspace.refineResidual;
+	TVecDeriv& correction = d_workspace.refineCorrection;
+	MyVector(double)& acc = d_workspace.aAccumulator;
+	a.recreate(size);
+	acc.recreate(3*size);
+
+	const double b2 = vDot(mesh, b, b);
+	const double threshold = b2 * (params->tolerance * params->tolerance);
+	int iterations = 0;
+	int k = 0;
+	double r2 = b2;
+	while (k < params->maxRefinements && r2 > threshold)
+	{
+		// A c = r, with r = b for the first pass
+		linearSolver_ConjugateGradient(params, mesh, matrix, (k==0) ? b : residual, correction, params->innerTolerance, params->maxIter);
+		iterations += simulation_cg_iter;
+		if (simulation_cg_iter == 0) break;
+		// a = a + c
+		DEVICE_METHOD(MechanicalObject3f_vAccumulate)( size, (k==0), acc.deviceWrite(), a.deviceWrite(), correction.deviceRead() );
+		++k;
+		r2 = residualNorm2(params, mesh, matrix, residual, true);
+		if (d_verbose >= 2) std::cout << "Refinement " << k << " residual error = " << sqrt(r2 / b2) << std::endl;
+	}
+	if (k == 0)
+		DEVICE_METHOD(MechanicalObject3f_vClear)( size, a.deviceWrite() );
+	simulation_cg_iter = iterations;
+	if (d_verbose >= 1) std::cout << "Refinements = " << k << " CG iterations = " << iterations << " residual error = " << ((b2 > 0) ? sqrt(r2 / b2) : 0) << std::endl;
+}
+
+// Same products as mulMatrixVector on double vectors (3*size values), the element
+// data staying in float. The fixed constraints are always applied on the result.
+void Simulation::mulMatrixVectorDouble(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix, MyVector(double)& result, const MyVector(double)& input)
+{
+	const unsigned int size = mesh->positions.size();
+	const double mass = params->massDensity;
+
+	if (params->youngModulusTop == 0 && params->youngModulusBottom == 0)
+		DEVICE_METHOD(MechanicalObject3d_vClear)( size, result.deviceWrite() );
+	else
+		DEVICE_METHOD(TetrahedronFEMForceField3d_addDForce)( mesh->tetrahedra.size(), size, false, matrix.kFactor
+			, mesh->femElem.deviceRead(), mesh->femElemRotation.deviceRead()
+			, result.deviceWrite(), input.deviceRead() );
+
+	DEVICE_METHOD(UniformMass3d_addMDx)( size, matrix.mFactor * mass, result.deviceWrite(), input.deviceRead() );
+
+	if (!mesh->colliders.empty())
+	{
+		DEVICE_METHOD(ColliderForceField3d_addDForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->contacts.deviceRead(), matrix.kFactor, result.deviceWrite(), input.deviceRead() );
+	}
+
+	if (mesh->surfaceCollision.enabled())
+	{
+		DEVICE_METHOD(ColliderForceField3d_addDForce)( mesh->surfacePoints.size(), mesh->surfacePoints.deviceRead(), mesh->surfaceContacts.deviceRead(), matrix.kFactor, result.deviceWrite(), input.deviceRead() );
+	}
+
+	if (mesh->nbFixedParticles > 0)
+	{
+		DEVICE_METHOD(FixedConstraint3d_projectResponseIndexed)( mesh->fixedParticles.size(), mesh->fixedParticles.deviceRead(), result.deviceWrite() );
+	}
+}
+
+// Reference solve: CG with all the vectors and the products in double, from the float b.
+// The solution is kept in aAccumulator and rounded to float into mesh->a.
+void Simulation::linearSolver_Double(const SimulationParameters* params, FEMMesh* mesh, MechanicalMatrix matrix)
+{
+	const unsigned int size = mesh->positions.size();
+	TVecDeriv& a = mesh->a;
+	MyVector(double)& x = d_workspace.aAccumulator;
+	MyVector(double)& b = d_workspace.bDouble;
+	MyVector(double)& r = d_workspace.rDouble;
+	MyVector(double)& d = d_workspace.dDouble;
+	MyVector(double)& q = d_workspace.qDouble;
+	a.recreate(size);
+	x.recreate(3*size);
+	b.recreate(3*size);
+	r.recreate(3*size);
+	d.recreate(3*size);
+	q.recreate(3*size);
+
+	DEVICE_METHOD(MechanicalObject3d_vFromFloat)( size, b.deviceWrite(), d_workspace.b.deviceRead() );
+	double delta_0 = 0;
+	DEVICE_METHOD(MechanicalObject3d_vDot)( size, &delta_0, b.deviceRead(), b.deviceRead() );
+	const double delta_threshold = delta_0 * (params->tolerance * params->tolerance);
+	double delta_new = delta_0;
+
+	// x = 0, r = d = b
+	DEVICE_METHOD(MechanicalObject3d_vClear)( size, x.deviceWrite() );
+	DEVICE_METHOD(MechanicalObject3d_vEqBF)( size, r.deviceWrite(), b.deviceRead(), 1.0 );
+	DEVICE_METHOD(MechanicalObject3d_vEqBF)( size, d.deviceWrite(), b.deviceRead(), 1.0 );
+	int i = 0;
+	while (i < params->maxIter && delta_new > delta_threshold)
+	{
+		// q = Ad
+		mulMatrixVectorDouble(params, mesh, matrix, q, d);
+		double den = 0;
+		DEVICE_METHOD(MechanicalObject3d_vDot)( size, &den, d.deviceRead(), q.deviceRead() );
+		const double alpha = delta_new / den;
+		// x = x + d * alpha, r = r - q * alpha
+		DEVICE_METHOD(MechanicalObject3d_vPEqBF)( size, x.deviceWrite(), d.deviceRead(), alpha );
+		DEVICE_METHOD(MechanicalObject3d_vPEqBF)( size, r.deviceWrite(), q.deviceRead(), -alpha );
+		const double delta_old = delta_new;
+		DEVICE_METHOD(MechanicalObject3d_vDot)( size, &delta_new, r.deviceRead(), r.deviceRead() );
+		// d = r + d * beta
+		DEVICE_METHOD(MechanicalObject3d_vOp)( size, d.deviceWrite(), r.deviceRead(), d.deviceRead(), delta_new / delta_old );
 		++i;
 	}
+	DEVICE_METHOD(MechanicalObject3f_vFromDouble)( size, a.deviceWrite(), x.deviceRead() );
 	simulation_cg_iter = i;
-	if (d_verbose >= 1) std::cout << "CG iterations = " << i << " residual error = " << sqrt(delta_new / delta_0) << std::endl;
+	if (d_verbose >= 1) std::cout << "Double CG iterations = " << i << " residual error = " << ((delta_0 > 0) ? sqrt(delta_new / delta_0) : 0) << std::endl;
 }
+#endif
 
 
 template<class TVec>